@@ -0,0 +1,446 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file adapter.c
+ * @author Daniel Oliveira
+ * @brief Pool of Bluetooth adapters: placement of the bands by load and signal, failover and rebalancing.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "adapter.h"
+
+/**
+ * @brief Open the adapters of a pool.
+ */
+int adapter_pool_open(AdapterPool *pool, const char *names, int capacity)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    // Without names, the pool is the default adapter, connected through with a NULL handle.
+    if (names == NULL || names[0] == '\0')
+    {
+        snprintf(pool->adapters[0].name, sizeof(pool->adapters[0].name), "default");
+        pool->adapters[0].capacity = capacity;
+        pool->adapters[0].available = 1;
+        pool->count = 1;
+        return pool->count;
+    }
+
+    const char *name = names;
+    while (*name != '\0' && pool->count < ADAPTER_MAX)
+    {
+        size_t length = strcspn(name, ",");
+        Adapter *adapter = &pool->adapters[pool->count];
+
+        snprintf(adapter->name, sizeof(adapter->name), "%.*s", (int)length, name);
+        if (gattlib_adapter_open(adapter->name, &adapter->handle) == GATTLIB_SUCCESS)
+        {
+            adapter->capacity = capacity;
+            adapter->available = 1;
+            pool->count++;
+        }
+        else
+        {
+            fprintf(stderr, "Failed to open adapter %s\n", adapter->name);
+        }
+
+        name += length;
+        if (*name == ',')
+        {
+            name++;
+        }
+    }
+
+    return pool->count > 0 ? pool->count : -1;
+}
+
+/**
+ * @brief Close the adapters of a pool.
+ */
+void adapter_pool_close(AdapterPool *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->adapters[i].handle)
+        {
+            gattlib_adapter_close(pool->adapters[i].handle);
+        }
+    }
+    pool->count = 0;
+}
+
+/**
+ * @brief Whether an adapter can be used, giving a failed adapter another chance after ADAPTER_RETRY_S.
+ */
+static int adapter_usable(Adapter *adapter, time_t now)
+{
+    if (!adapter->available && now - adapter->failedAt >= ADAPTER_RETRY_S)
+    {
+        // One more failure disables it again.
+        adapter->available = 1;
+        adapter->failures = ADAPTER_MAX_FAILURES - 1;
+    }
+    return adapter->available;
+}
+
+/**
+ * @brief Account for an error of the adapter itself.
+ */
+static void adapter_failed(Adapter *adapter)
+{
+    adapter->failures++;
+    if (adapter->available && adapter->failures >= ADAPTER_MAX_FAILURES)
+    {
+        fprintf(stderr, "Adapter %s failed %d times, not used for %d s\n", adapter->name, adapter->failures, ADAPTER_RETRY_S);
+        adapter->available = 0;
+        adapter->failedAt = time(NULL);
+    }
+}
+
+/**
+ * @brief Account for a failed connection through an adapter.
+ *
+ * A band out of range or refusing the connection says nothing about the adapter, so
+ * the failure only counts against it if BlueZ can no longer open the adapter.
+ */
+static void connection_failed(Adapter *adapter)
+{
+    void *handle;
+    if (gattlib_adapter_open(adapter->handle ? adapter->name : NULL, &handle) != GATTLIB_SUCCESS)
+    {
+        adapter_failed(adapter);
+        return;
+    }
+    gattlib_adapter_close(handle);
+}
+
+/**
+ * @brief Signal of a band heard by an adapter, in dBm.
+ */
+static int adapter_rssi(const Adapter *adapter, const char *mac_address)
+{
+    int16_t rssi;
+    if (adapter->handle && gattlib_get_rssi_from_mac(adapter->handle, mac_address, &rssi) == GATTLIB_SUCCESS && rssi != 0)
+    {
+        return rssi;
+    }
+    return ADAPTER_RSSI_UNKNOWN;
+}
+
+/**
+ * @brief Best adapter with a free connection, among the ones not in a mask.
+ */
+static int select_adapter(AdapterPool *pool, const char *mac_address, unsigned int excluded)
+{
+    time_t now = time(NULL);
+    int best = -1;
+    int best_score = INT_MIN;
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        Adapter *adapter = &pool->adapters[i];
+        if ((excluded & (1u << i)) || !adapter_usable(adapter, now) || adapter->connections >= adapter->capacity)
+        {
+            continue;
+        }
+
+        int score = adapter_rssi(adapter, mac_address) - ADAPTER_LOAD_DB * adapter->connections;
+        if (score > best_score || (score == best_score && adapter->connections < pool->adapters[best].connections))
+        {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Choose the adapter for a band.
+ */
+int adapter_pool_select(AdapterPool *pool, const char *mac_address, int exclude)
+{
+    return select_adapter(pool, mac_address, exclude >= 0 ? 1u << exclude : 0);
+}
+
+/**
+ * @brief Connect a band through the best adapter, falling back to the next ones.
+ */
+BLEDevice *adapter_pool_connect(AdapterPool *pool, const char *mac_address, int band_type)
+{
+    unsigned int tried = 0;
+    int index;
+
+    while ((index = select_adapter(pool, mac_address, tried)) >= 0)
+    {
+        Adapter *adapter = &pool->adapters[index];
+        BLEDevice *device = ble_device_create_on_adapter(adapter->handle, mac_address, band_type);
+        if (device)
+        {
+            printf("Band %s connected through %s (%d/%d)\n", mac_address, adapter->name, adapter->connections + 1, adapter->capacity);
+            adapter->connections++;
+            adapter->failures = 0;
+            device->adapter = index;
+            return device;
+        }
+
+        connection_failed(adapter);
+        tried |= 1u << index;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Release the connection of a band, before it is destroyed.
+ */
+void adapter_pool_release(AdapterPool *pool, BLEDevice *device)
+{
+    if (device->adapter >= 0)
+    {
+        pool->adapters[device->adapter].connections--;
+        device->adapter = -1;
+    }
+}
+
+/**
+ * @brief A band being reconnected, and the adapters already tried.
+ */
+typedef struct
+{
+    AdapterPool *pool;
+    BLEDevice *device;
+    int source;
+    int target;
+    unsigned int excluded;
+    int cancelled;
+
+    // Called with the outcome, or NULL to authenticate the band once connected.
+    ConnectCallback callback;
+    void *userData;
+} AdapterMove;
+
+static int start_move(AdapterMove *move);
+
+/**
+ * @brief Connection callback of a move: authenticate the band again, or try the next adapter.
+ */
+static void move_connected(int status, void *user_data)
+{
+    AdapterMove *move = (AdapterMove *)user_data;
+    AdapterPool *pool = move->pool;
+    BLEDevice *device = move->device;
+    Adapter *adapter = &pool->adapters[move->target];
+
+    // Nobody waits for the band any more, give back its slots and destroy it.
+    if (move->cancelled)
+    {
+        if (move->target != move->source)
+        {
+            adapter->connections--;
+        }
+        adapter_pool_release(pool, device);
+        free(move);
+        ble_device_destroy(device);
+        return;
+    }
+
+    if (status != 0)
+    {
+        connection_failed(adapter);
+        if (move->target != move->source)
+        {
+            adapter->connections--;
+        }
+        move->excluded |= 1u << move->target;
+        if (start_move(move) != 0)
+        {
+            // The band keeps its previous slot, for the next attempt.
+            if (move->callback)
+            {
+                move->callback(-1, move->userData);
+            }
+            free(move);
+        }
+        return;
+    }
+
+    // The previous slot is given back only now that the band has a new one.
+    if (move->source >= 0 && move->source != move->target)
+    {
+        pool->adapters[move->source].connections--;
+    }
+    device->adapter = move->target;
+
+    printf("Band %s connected through %s (%d/%d)\n", device->macAddress, adapter->name, adapter->connections, adapter->capacity);
+    adapter->failures = 0;
+
+    ConnectCallback callback = move->callback;
+    void *callback_data = move->userData;
+    free(move);
+
+    if (callback)
+    {
+        callback(0, callback_data);
+    }
+    else
+    {
+        pool->moves++;
+        enable_notifications_chunked(device);
+    }
+}
+
+/**
+ * @brief Start the connection of a band through the best adapter not tried yet.
+ * @return 0 if a connection started, -1 if no adapter is left.
+ */
+static int start_move(AdapterMove *move)
+{
+    AdapterPool *pool = move->pool;
+    BLEDevice *device = move->device;
+
+    for (;;)
+    {
+        // The slot the band still holds is free for it on its own adapter.
+        if (move->source >= 0)
+        {
+            pool->adapters[move->source].connections--;
+        }
+        int target = select_adapter(pool, device->macAddress, move->excluded);
+        if (move->source >= 0)
+        {
+            pool->adapters[move->source].connections++;
+        }
+        if (target < 0)
+        {
+            return -1;
+        }
+
+        // The connection is taken on the target while it is pending, so it is not given twice.
+        Adapter *adapter = &pool->adapters[target];
+        if (target != move->source)
+        {
+            adapter->connections++;
+        }
+        move->target = target;
+
+        if (ble_device_reconnect(device, adapter->handle, move_connected, move) == 0)
+        {
+            return 0;
+        }
+
+        connection_failed(adapter);
+        if (target != move->source)
+        {
+            adapter->connections--;
+        }
+        move->excluded |= 1u << target;
+    }
+}
+
+/**
+ * @brief Create a band and connect it asynchronously through the best adapter, falling back to the next ones.
+ */
+BLEDevice *adapter_pool_connect_async(AdapterPool *pool, const char *mac_address, int band_type, ConnectCallback callback,
+                                      void *user_data)
+{
+    AdapterMove *move = malloc(sizeof(AdapterMove));
+    if (move == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+
+    BLEDevice *device = ble_device_new(mac_address, band_type);
+    if (device == NULL)
+    {
+        free(move);
+        return NULL;
+    }
+
+    move->pool = pool;
+    move->device = device;
+    move->source = -1;
+    move->target = -1;
+    move->excluded = 0;
+    move->cancelled = 0;
+    move->callback = callback;
+    move->userData = user_data;
+
+    if (start_move(move) != 0)
+    {
+        free(move);
+        ble_device_destroy(device);
+        return NULL;
+    }
+
+    return device;
+}
+
+/**
+ * @brief Give up a band being connected by adapter_pool_connect_async.
+ */
+void adapter_pool_cancel(AdapterPool *pool, BLEDevice *device)
+{
+    if (device->connecting && device->connectCallback == move_connected)
+    {
+        AdapterMove *move = (AdapterMove *)device->connectCallbackData;
+        move->cancelled = 1;
+        return;
+    }
+
+    // The connection already completed.
+    adapter_pool_release(pool, device);
+    ble_device_destroy(device);
+}
+
+/**
+ * @brief Reconnect the bands that lost their connection or whose adapter failed.
+ */
+int adapter_pool_rebalance(AdapterPool *pool, BLEDevice **devices, int count)
+{
+    int started = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        BLEDevice *device = devices[i];
+        int failed = device->adapter >= 0 && !pool->adapters[device->adapter].available;
+        if (device->connecting || (device->connected && !failed))
+        {
+            continue;
+        }
+
+        AdapterMove *move = malloc(sizeof(AdapterMove));
+        if (move == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            break;
+        }
+        move->pool = pool;
+        move->device = device;
+        move->source = device->adapter;
+        move->target = -1;
+        move->excluded = failed ? 1u << device->adapter : 0;
+        move->cancelled = 0;
+        move->callback = NULL;
+        move->userData = NULL;
+
+        // The band keeps its previous slot until it is connected elsewhere.
+        if (start_move(move) == 0)
+        {
+            started++;
+        }
+        else
+        {
+            free(move);
+        }
+    }
+
+    return started;
+}
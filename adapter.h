@@ -0,0 +1,154 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile adapter.h
+ * @author Daniel Oliveira
+ * @brief Pool of Bluetooth adapters: placement of the bands by load and signal, failover and rebalancing.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef ADAPTER_H
+#define ADAPTER_H
+
+#include <stdint.h>
+#include <time.h>
+#include "band.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Maximum number of adapters in a pool.
+#define ADAPTER_MAX 8
+
+// Concurrent LE connections per controller, most of them accept 7 to 10.
+#define ADAPTER_DEFAULT_CAPACITY 7
+
+// An adapter failing ADAPTER_MAX_FAILURES times in a row is not used for ADAPTER_RETRY_S seconds.
+// Only the errors of the adapter itself count, not the bands that fail to connect through it.
+#define ADAPTER_MAX_FAILURES 3
+#define ADAPTER_RETRY_S 60
+
+// Signal assumed when the RSSI of a band is unknown, in dBm.
+#define ADAPTER_RSSI_UNKNOWN -100
+
+// Each connection already on an adapter counts as this many dB less signal.
+#define ADAPTER_LOAD_DB 6
+
+/**
+ * @brief An adapter of the pool and its load.
+ */
+typedef struct
+{
+    char name[16];
+    void *handle;
+    int connections;
+    int capacity;
+    int failures;
+    int available;
+    time_t failedAt;
+} Adapter;
+
+/**
+ * @brief Adapters the bands are spread over.
+ */
+typedef struct
+{
+    Adapter adapters[ADAPTER_MAX];
+    int count;
+    int64_t moves;
+} AdapterPool;
+
+/**
+ * @brief Open the adapters of a pool.
+ * @param pool The AdapterPool instance.
+ * @param names Comma-separated adapter names (e.g. "hci0,hci1"), or NULL or "" for the default adapter.
+ * @param capacity The number of connections each adapter accepts.
+ * @return The number of adapters opened, or -1 if none could be opened.
+ */
+int adapter_pool_open(AdapterPool *pool, const char *names, int capacity);
+
+/**
+ * @brief Close the adapters of a pool.
+ * @param pool The AdapterPool instance.
+ */
+void adapter_pool_close(AdapterPool *pool);
+
+/**
+ * @brief Choose the adapter for a band.
+ * @param pool The AdapterPool instance.
+ * @param mac_address The MAC address of the band.
+ * @param exclude An adapter not to choose, or -1.
+ * @return The index of the adapter, or -1 if every adapter is full or failed.
+ *
+ * Each available adapter with a free connection is scored with the RSSI of the band
+ * it reports minus ADAPTER_LOAD_DB per connection, so the load is spread unless an
+ * adapter hears the band much better.
+ */
+int adapter_pool_select(AdapterPool *pool, const char *mac_address, int exclude);
+
+/**
+ * @brief Connect a band through the best adapter, falling back to the next ones.
+ * @param pool The AdapterPool instance.
+ * @param mac_address The MAC address of the band.
+ * @param band_type The type of the Mi Band.
+ * @return The connected BLEDevice, or NULL if no adapter could connect it.
+ */
+BLEDevice *adapter_pool_connect(AdapterPool *pool, const char *mac_address, int band_type);
+
+/**
+ * @brief Create a band and connect it asynchronously through the best adapter, falling back to the next ones.
+ * @param pool The AdapterPool instance.
+ * @param mac_address The MAC address of the band.
+ * @param band_type The type of the Mi Band.
+ * @param callback The function called from the main loop once connected, or once every adapter failed.
+ * @param user_data The user data passed to the callback.
+ * @return The BLEDevice being connected, or NULL if no adapter has a free connection.
+ *
+ * The main loop keeps running while the band connects. The BLEDevice must not be destroyed
+ * before the callback ran, use adapter_pool_cancel to give it up. After a failure, destroy it.
+ */
+BLEDevice *adapter_pool_connect_async(AdapterPool *pool, const char *mac_address, int band_type, ConnectCallback callback,
+                                      void *user_data);
+
+/**
+ * @brief Give up a band being connected by adapter_pool_connect_async.
+ * @param pool The AdapterPool instance.
+ * @param device The BLEDevice being connected.
+ *
+ * The callback will not be called. The connection cannot be aborted, so the band is
+ * released and destroyed once it completes, or at once if it already did.
+ */
+void adapter_pool_cancel(AdapterPool *pool, BLEDevice *device);
+
+/**
+ * @brief Release the connection of a band, before it is destroyed.
+ * @param pool The AdapterPool instance.
+ * @param device The BLEDevice instance.
+ */
+void adapter_pool_release(AdapterPool *pool, BLEDevice *device);
+
+/**
+ * @brief Reconnect the bands that lost their connection or whose adapter failed.
+ * @param pool The AdapterPool instance.
+ * @param devices The bands.
+ * @param count The number of bands.
+ * @return The number of reconnections started.
+ *
+ * Each such band is connected asynchronously through the best adapter, falling back to
+ * the next ones, and authenticated again once connected. A band keeps the slot of its
+ * previous adapter until it is connected elsewhere, and keeps it if every adapter fails,
+ * so a failed move never lets another band take its place. Healthy bands are never moved,
+ * the load is spread when bands (re)connect. Calling this periodically from the main
+ * loop never blocks it.
+ */
+int adapter_pool_rebalance(AdapterPool *pool, BLEDevice **devices, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
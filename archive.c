@@ -0,0 +1,140 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file archive.c
+ * @author Daniel Oliveira
+ * @brief Archive files of compressed heart rate blocks.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+/**
+ * @brief Write the header of a new archive file.
+ */
+int archive_write_header(FILE *file, const char *mac_address, int64_t start_time)
+{
+    SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    header.startTime = start_time;
+    snprintf(header.macAddress, sizeof(header.macAddress), "%s", mac_address);
+
+    return fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Check whether a file is an archive file.
+ */
+int archive_is_archive(const char *path)
+{
+    char magic[4];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    int is_archive = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+
+    return is_archive;
+}
+
+/**
+ * @brief Memory-map an archive file for reading.
+ */
+int archive_file_open(const char *path, ArchiveFile *archive)
+{
+    memset(archive, 0, sizeof(*archive));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not open archive file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionHeader))
+    {
+        fprintf(stderr, "Error: %s is not an archive file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: could not map archive file %s\n", path);
+        return -1;
+    }
+
+    const SessionHeader *header = (const SessionHeader *)map;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 || header->version != ARCHIVE_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not an archive file\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    archive->map = map;
+    archive->mapSize = st.st_size;
+    archive->header = header;
+    archive->data = (const uint8_t *)map + sizeof(SessionHeader);
+    archive->dataSize = archive->mapSize - sizeof(SessionHeader);
+
+    return 0;
+}
+
+/**
+ * @brief Unmap an archive file.
+ */
+void archive_file_close(ArchiveFile *archive)
+{
+    if (archive->map != NULL)
+    {
+        munmap(archive->map, archive->mapSize);
+    }
+    memset(archive, 0, sizeof(*archive));
+}
+
+/**
+ * @brief Iterate over the blocks of an archive without decoding them.
+ */
+int archive_file_next_block(const ArchiveFile *archive, size_t *offset, CodecBlockHeader *header, const uint8_t **block, size_t *size)
+{
+    if (*offset >= archive->dataSize)
+    {
+        return 0;
+    }
+
+    // Blocks are not aligned, copy the header out of the mapping.
+    if (archive->dataSize - *offset < sizeof(CodecBlockHeader))
+    {
+        return -1;
+    }
+    memcpy(header, archive->data + *offset, sizeof(CodecBlockHeader));
+
+    size_t block_size = sizeof(CodecBlockHeader) + header->payloadSize;
+    if (archive->dataSize - *offset < block_size)
+    {
+        return -1;
+    }
+
+    *block = archive->data + *offset;
+    *size = block_size;
+    *offset += block_size;
+
+    return 1;
+}
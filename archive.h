@@ -0,0 +1,84 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile archive.h
+ * @author Daniel Oliveira
+ * @brief Archive files of compressed heart rate blocks.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "session.h"
+#include "codec.h"
+
+#define ARCHIVE_MAGIC "MBHA"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_EXTENSION ".hra"
+
+// Number of samples per encoded block.
+#define ARCHIVE_BLOCK_SAMPLES 512
+
+/**
+ * @brief Read-only, memory-mapped view of an archive file.
+ *
+ * An archive starts with the same header as a session file, with its own magic,
+ * followed by encoded blocks (see codec.h) stored back to back in time order.
+ */
+typedef struct
+{
+    const SessionHeader *header;
+    const uint8_t *data;
+    size_t dataSize;
+    void *map;
+    size_t mapSize;
+} ArchiveFile;
+
+/**
+ * @brief Write the header of a new archive file.
+ * @param file The file to write to, positioned at its beginning.
+ * @param mac_address The MAC address of the recorded device.
+ * @param start_time The absolute time (epoch seconds) sample times are relative to.
+ * @return 0 on success, -1 on write error.
+ */
+int archive_write_header(FILE *file, const char *mac_address, int64_t start_time);
+
+/**
+ * @brief Check whether a file is an archive file.
+ * @param path The path of the file.
+ * @return 1 if the file starts with the archive magic, 0 otherwise.
+ */
+int archive_is_archive(const char *path);
+
+/**
+ * @brief Memory-map an archive file for reading.
+ * @param path The path of the archive file.
+ * @param archive The ArchiveFile structure to fill.
+ * @return 0 on success, -1 if the file could not be opened or is not a valid archive.
+ */
+int archive_file_open(const char *path, ArchiveFile *archive);
+
+/**
+ * @brief Unmap an archive file.
+ * @param archive The ArchiveFile instance.
+ */
+void archive_file_close(ArchiveFile *archive);
+
+/**
+ * @brief Iterate over the blocks of an archive without decoding them.
+ * @param archive The ArchiveFile instance.
+ * @param offset The offset of the block to read, set to 0 for the first block. Advanced to the next block.
+ * @param header The header of the block.
+ * @param block The start of the encoded block, header included, to pass to codec_decode_block.
+ * @param size The size of the encoded block, header included.
+ * @return 1 if a block was read, 0 at the end of the archive, -1 if the archive is truncated.
+ */
+int archive_file_next_block(const ArchiveFile *archive, size_t *offset, CodecBlockHeader *header, const uint8_t **block, size_t *size);
+
+#endif
@@ -17,30 +17,86 @@
 #include <openssl/rand.h>
 #include <openssl/aes.h>
 #include "band.h"
+#include "plot.h"
 #include "ecdh.h"
 #include "uuid.h"
 
-// Global time valu to store heart rate notification timestamps in seconds
-time_t initial_timestamp;
+/**
+ * @brief Spectral analysis of a copy of the RR window, run on the spectral thread pool.
+ */
+typedef struct
+{
+    BLEDevice *device;
+    int count;
+    double *time;
+    double *rr;
+    void *scratch;
+    SpectralMetrics metrics;
+    int status;
+} SpectralJob;
+
+static void spectral_job_run(gpointer data, gpointer user_data);
+static void log_band_event(const BandEvent *event, void *user_data);
+static void handle_nonwear_event(const BandEvent *event, void *user_data);
+static void acknowledge_alert(const BandEvent *event, void *user_data);
+static void finish_authentication(BLEDevice *device, int status);
+static void finish_fetch(BLEDevice *device, int status);
+static void discover_characteristics(BLEDevice *device);
+static void connection_lost(void *user_data);
 
 /**
  * @brief Create a Mi Band instance (BLEDevice) and connect to the device with the given MAC address.
  */
 BLEDevice *ble_device_create(const char *mac_address, const int band_type)
 {
-    // Allocate memory for the BLEDevice structure and initialize it.
-    BLEDevice *device = malloc(sizeof(BLEDevice));
+    return ble_device_create_on_adapter(NULL, mac_address, band_type);
+}
 
+/**
+ * @brief Create a Mi Band instance (BLEDevice) connected through a given adapter.
+ */
+BLEDevice *ble_device_create_on_adapter(void *adapter, const char *mac_address, const int band_type)
+{
     // Establish a connection to the device with the provided MAC address.
-    device->connection = gattlib_connect(NULL, mac_address, GATTLIB_CONNECTION_OPTIONS_LEGACY_DEFAULT);
-    if (device->connection == NULL)
+    gatt_connection_t *connection = gattlib_connect(adapter, mac_address, GATTLIB_CONNECTION_OPTIONS_LEGACY_DEFAULT);
+    if (connection == NULL)
     {
         printf("Failed to connect to the device.\n");
-        free(device);
         return NULL;
     }
 
+    BLEDevice *device = ble_device_new(mac_address, band_type);
+    device->connection = connection;
+    device->connected = 1;
+
+    discover_characteristics(device);
+    gattlib_register_on_disconnect(device->connection, connection_lost, device);
+
+    return device;
+}
+
+/**
+ * @brief Create a Mi Band instance (BLEDevice) without connecting it.
+ */
+BLEDevice *ble_device_new(const char *mac_address, const int band_type)
+{
+    // Allocate memory for the BLEDevice structure and initialize it.
+    BLEDevice *device = malloc(sizeof(BLEDevice));
+
     // Initialize the properties of the BLEDevice structure.
+    snprintf(device->macAddress, sizeof(device->macAddress), "%s", mac_address);
+    device->connection = NULL;
+    device->connected = 0;
+    device->connecting = 0;
+    device->authenticated = 0;
+    device->connectCallback = NULL;
+    device->connectCallbackData = NULL;
+    device->adapter = -1;
+    device->startTime = 0;
+    device->services = NULL;
+    device->characteristics = NULL;
+    device->session = NULL;
+    device->columns = NULL;
     device->handle = 0;
     device->lastSequenceNumber = 0;
     device->pointer = 0;
@@ -53,13 +109,50 @@ BLEDevice *ble_device_create(const char *mac_address, const int band_type)
     // Initialize heart rate array and allocate memory for it.
     device->hrCount = 0;
     device->histSize = 1000;
-    device->hrHist = malloc(device->histSize * sizeof(int32_t *));
-    for (int i = 0; i < device->histSize; ++i)
-    {
-        device->hrHist[i] = malloc(2 * sizeof(int32_t));
-    }
+    device->hrHist = malloc(device->histSize * sizeof(*device->hrHist));
+    device->hrRaw = malloc(device->histSize * sizeof(RawSample));
+    hampel_init(&device->hrFilter);
+    wear_init(&device->wear);
+    interval_init(&device->interval);
+    device->dutyCycled = 0;
+
+    // Handlers of the device events.
+    device->alertSentAt = 0;
+    device->sampleCallback = NULL;
+    device->sampleCallbackData = NULL;
+    device->authCallback = NULL;
+    device->authCallbackData = NULL;
+    device->activityCallback = NULL;
+    device->activityCallbackData = NULL;
+    device->activityTime = 0;
+    device->fetchNotifying = 0;
+    event_bus_init(&device->events);
+    event_bus_subscribe(&device->events, EVENT_ANY, log_band_event, device);
+    event_bus_subscribe(&device->events, EVENT_START_NONWEAR, handle_nonwear_event, device);
+    event_bus_subscribe(&device->events, EVENT_BUTTON_PRESSED, acknowledge_alert, device);
+    event_bus_subscribe(&device->events, EVENT_CALL_REJECT, acknowledge_alert, device);
+    event_bus_subscribe(&device->events, EVENT_CALL_IGNORE, acknowledge_alert, device);
+    history_index_init(&device->hrIndex);
+    lod_init(&device->hrPyramid);
+    gap_list_init(&device->hrGaps);
+    hrv_init(&device->hrv);
+    memset(&device->hrvMetrics, 0, sizeof(device->hrvMetrics));
+    memset(&device->spectralMetrics, 0, sizeof(device->spectralMetrics));
+    device->spectralClock = 0;
+    device->spectralJob = NULL;
+    device->spectralPool = g_thread_pool_new(spectral_job_run, NULL, 1, FALSE, NULL);
+
+    return device;
+}
 
+/**
+ * @brief Discover the services and characteristics, and keep the ones used.
+ */
+static void discover_characteristics(BLEDevice *device)
+{
     // Discover the primary services and characteristics of the connected device.
+    free(device->services);
+    free(device->characteristics);
     gattlib_discover_primary(device->connection, &device->services, &device->serviceCount);
     gattlib_discover_char(device->connection, &device->characteristics, &device->characteristicCount);
 
@@ -101,9 +194,102 @@ BLEDevice *ble_device_create(const char *mac_address, const int band_type)
         {
             device->characteristicAlert = device->characteristics[i];
         }
+        else if (strcmp(uuid_str, CHARACTERISTIC_DEVICEEVENT) == 0)
+        {
+            device->characteristicDeviceEvent = device->characteristics[i];
+        }
     }
+}
 
-    return device;
+/**
+ * @brief Disconnection handler: the band or the adapter dropped the connection.
+ */
+static void connection_lost(void *user_data)
+{
+    BLEDevice *device = (BLEDevice *)user_data;
+
+    printf("Connection to %s lost\n", device->macAddress);
+    device->connected = 0;
+    device->authenticated = 0;
+}
+
+/**
+ * @brief gattlib callback: the connection of ble_device_reconnect completed.
+ */
+static void reconnected(gatt_connection_t *connection, void *user_data)
+{
+    BLEDevice *device = (BLEDevice *)user_data;
+    ConnectCallback callback = device->connectCallback;
+    void *callback_data = device->connectCallbackData;
+
+    device->connecting = 0;
+    device->connectCallback = NULL;
+    device->connectCallbackData = NULL;
+
+    if (connection == NULL)
+    {
+        printf("Failed to reconnect to %s\n", device->macAddress);
+        if (callback)
+        {
+            callback(-1, callback_data);
+        }
+        return;
+    }
+
+    device->connection = connection;
+    device->connected = 1;
+    discover_characteristics(device);
+    gattlib_register_on_disconnect(device->connection, connection_lost, device);
+
+    if (callback)
+    {
+        callback(0, callback_data);
+    }
+}
+
+/**
+ * @brief Connect the band again, possibly through another adapter.
+ */
+int ble_device_reconnect(BLEDevice *device, void *adapter, ConnectCallback callback, void *user_data)
+{
+    if (device->connecting)
+    {
+        return -1;
+    }
+
+    // Release the previous connection, also when it was lost.
+    if (device->connection != NULL)
+    {
+        gattlib_disconnect(device->connection);
+        device->connection = NULL;
+    }
+    device->connected = 0;
+
+    // The authentication and the notifications start over on the new connection.
+    device->authenticated = 0;
+    device->handle = 0;
+    device->lastSequenceNumber = 0;
+    device->pointer = 0;
+    device->expectedBytes = 0;
+    device->fetchNotifying = 0;
+    finish_fetch(device, FETCH_FAILED);
+
+    device->connecting = 1;
+    device->connectCallback = callback;
+    device->connectCallbackData = user_data;
+
+    // The callback may already have run, with a failure, when NULL is returned.
+    if (gattlib_connect_async(adapter, device->macAddress, GATTLIB_CONNECTION_OPTIONS_LEGACY_DEFAULT, reconnected, device) == NULL &&
+        device->connecting)
+    {
+        printf("Failed to reconnect to %s\n", device->macAddress);
+        device->connecting = 0;
+        device->connectCallback = NULL;
+        device->connectCallbackData = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
@@ -112,10 +298,32 @@ BLEDevice *ble_device_create(const char *mac_address, const int band_type)
 void ble_device_destroy(BLEDevice *device)
 {
     // Disconnect the BLE device.
-    gattlib_disconnect(device->connection);
+    if (device->connection != NULL)
+    {
+        gattlib_disconnect(device->connection);
+    }
+
+    // Let the queued or running spectral analysis finish, then drop its result before it reaches the device.
+    if (device->spectralPool)
+    {
+        g_thread_pool_free(device->spectralPool, FALSE, TRUE);
+    }
+    if (device->spectralJob)
+    {
+        g_source_remove_by_user_data(device->spectralJob);
+        free(device->spectralJob);
+    }
+
+    // Close the recorded session files.
+    session_writer_close(device->session);
+    columnar_writer_close(device->columns);
 
     // Free the allocated memory for the device's properties.
     free(device->hrHist);
+    free(device->hrRaw);
+    history_index_free(&device->hrIndex);
+    lod_free(&device->hrPyramid);
+    gap_list_free(&device->hrGaps);
     free(device->services);
     free(device->characteristics);
 
@@ -126,59 +334,28 @@ void ble_device_destroy(BLEDevice *device)
 /**
  * @brief Split value in differente packets to write in the chunked transfer characteristic
  */
-void write_chunked_value(gatt_connection_t *connection, uuid_t *char_uuid, uint8_t type, uint8_t handle, uint8_t *data, size_t data_length)
+int write_chunked_value(BLEDevice *device, uuid_t *char_uuid, uint8_t type, uint8_t handle, const uint8_t *data, size_t data_length)
 {
-
-    size_t remaining = data_length;
-    int count = 0;
-    int header_size = 11;
-    const int mMTU = 23;
-
-    // Iterate through the data, sending it in chunks
-    while (remaining > 0)
+    // Frame every chunk in the device buffer, headers included.
+    int count = chunk_frame(&device->chunked, type, handle, data, data_length);
+    if (count < 0)
     {
-        const int MAX_CHUNKLENGTH = mMTU - 3 - header_size;
-        const size_t copybytes = (remaining < MAX_CHUNKLENGTH) ? remaining : MAX_CHUNKLENGTH;
-        uint8_t chunk[copybytes + header_size];
-
-        int flags = 0;
-
-        // If this is the first chunk, include the total data length and transfer type.
-        if (count == 0)
-        {
-            flags |= 0x01;
-            chunk[5] = data_length & 0xff;
-            chunk[6] = (data_length >> 8) & 0xff;
-            chunk[7] = (data_length >> 16) & 0xff;
-            chunk[8] = (data_length >> 24) & 0xff;
-            chunk[9] = type & 0xff;
-            chunk[10] = (type >> 8) & 0xff;
-        }
+        printf("Chunked value too long: %zu bytes\n", data_length);
+        return -1;
+    }
 
-        // If this is the last chunk, set the end flag.
-        if (remaining <= MAX_CHUNKLENGTH)
+    // Write the chunks in order.
+    for (int i = 0; i < count; i++)
+    {
+        const struct iovec *chunk = &device->chunked.chunks[i];
+        if (gattlib_write_char_by_uuid(device->connection, char_uuid, chunk->iov_base, chunk->iov_len) != GATTLIB_SUCCESS)
         {
-            flags |= 0x06;
+            printf("Failed to write chunk %d\n", i);
+            return -1;
         }
-
-        // Set up the header for the chunk.
-        chunk[0] = 0x03;
-        chunk[1] = flags;
-        chunk[2] = 0;
-        chunk[3] = handle;
-        chunk[4] = count;
-
-        // Copy the data for this chunk.
-        memcpy(chunk + header_size, data + data_length - remaining, copybytes);
-
-        // Write the chunk to the specified characteristic.
-        gattlib_write_char_by_uuid(connection, char_uuid, chunk, copybytes + header_size);
-
-        // Update remaining data and header size.
-        remaining -= copybytes;
-        header_size = 5;
-        count++;
     }
+
+    return 0;
 }
 
 /**
@@ -202,13 +379,12 @@ uint8_t *prepare_pub_key(BLEDevice *device)
     }
 
     // Prepare the final array containing the generated public key and a prefix to identify.
-    uint8_t prefix[] = {0x04, 0x02, 0x00, 0x02};
-    size_t prefix_len = sizeof(prefix) / sizeof(prefix[0]);
+    size_t prefix_len = sizeof(AUTH_PUBLIC_KEY_PREFIX);
 
     size_t total_len = prefix_len + ECC_PUB_KEY_SIZE;
     uint8_t *final_array = (uint8_t *)malloc(total_len * sizeof(uint8_t));
 
-    memcpy(final_array, prefix, prefix_len);
+    memcpy(final_array, AUTH_PUBLIC_KEY_PREFIX, prefix_len);
     memcpy(final_array + prefix_len, device->publicKey, ECC_PUB_KEY_SIZE);
 
     return final_array;
@@ -267,12 +443,6 @@ void encrypt_aes_cbc(const uint8_t *key, const uint8_t *in, uint8_t *out, int le
  */
 void start_hr_measure(BLEDevice *device)
 {
-
-    uint8_t data[] = {0x15, 0x01, 0x01};
-    size_t data_len = sizeof(data) / sizeof(data[0]);
-    uint8_t data2[] = {0x14, 0x00, 0x01};
-    size_t data_len2 = sizeof(data2) / sizeof(data2[0]);
-
     // Start notifications for the heart rate measurement characteristic.
     int ret2 = gattlib_notification_start(device->connection, &device->characteristicHrMeasure.uuid);
 
@@ -281,14 +451,32 @@ void start_hr_measure(BLEDevice *device)
         printf("Failed to start notifications for heart rate: %d\n", ret2);
     }
 
-    // Start counting time.
-    initial_timestamp = time(NULL);
+    // Start notifications for the device events (button presses, wear...).
+    int ret3 = gattlib_notification_start(device->connection, &device->characteristicDeviceEvent.uuid);
 
-    // Start continuous measurement.
-    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, data, data_len);
+    if (ret3 != GATTLIB_SUCCESS)
+    {
+        printf("Failed to start notifications for device events: %d\n", ret3);
+    }
 
-    // Set measurement interval.
-    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, data2, data_len2);
+    // Start counting time. A restart keeps the time base.
+    if (device->startTime == 0)
+    {
+        device->startTime = time(NULL);
+    }
+
+    // Record the measurement session to disk.
+    if (device->session == NULL)
+    {
+        device->session = session_writer_open(SESSION_DIR, device->macAddress, device->startTime);
+    }
+    if (device->columns == NULL && atoi(COLUMNAR_SESSIONS))
+    {
+        device->columns = columnar_writer_open(SESSION_DIR, device->macAddress, device->startTime);
+    }
+
+    // Start continuous measurement, or a single one at the sparser levels.
+    apply_interval(device);
 }
 
 /**
@@ -296,57 +484,383 @@ void start_hr_measure(BLEDevice *device)
  */
 void ping_heart_rate(BLEDevice *device)
 {
-
-    uint8_t data[] = {0x15, 0x01, 0x01};
-    size_t data_len = sizeof(data) / sizeof(data[0]);
-    uint8_t data2[] = {0x14, 0x00, 0x01};
-    size_t data_len2 = sizeof(data2) / sizeof(data2[0]);
+    // Keep the continuous measurement alive at the dense level, or during a duty cycle window.
+    if (!device->dutyCycled && interval_period(device->interval.level) > 1)
+    {
+        return;
+    }
 
     // Start continuous measurement.
-    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, data, data_len);
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, HR_CONTINUOUS_START, sizeof(HR_CONTINUOUS_START));
 
     // Set measurement interval.
-    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, data2, data_len2);
+    const uint8_t interval[] = HR_INTERVAL(interval_band_setting(device->interval.level));
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, interval, sizeof(interval));
 }
 
 /**
- * @brief Plot the heart rate data collected from the device.
+ * @brief Send the measurement of the current interval level to the band.
  */
-void plot_heart_rate(BLEDevice *device)
+void apply_interval(BLEDevice *device)
+{
+    // The duty scheduler starts and stops the measurement of this band.
+    if (device->dutyCycled)
+    {
+        return;
+    }
+
+    IntervalLevel level = device->interval.level;
+
+    // The samples now come once per period of the level, waiting one period is not a gap.
+    gap_list_set_period(&device->hrGaps, interval_period(level));
+
+    // The band's own interval setting, used when the measurement runs from the band.
+    const uint8_t interval[] = HR_INTERVAL(interval_band_setting(level));
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, interval, sizeof(interval));
+
+    if (interval_period(level) <= 1)
+    {
+        // Continuous measurement, kept alive by ping_heart_rate.
+        gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, HR_CONTINUOUS_START, sizeof(HR_CONTINUOUS_START));
+    }
+    else
+    {
+        // Single measurements, requested by the main loop when due.
+        stop_hr_measure(device);
+        probe_heart_rate(device);
+        device->interval.lastProbe = time(NULL);
+    }
+}
+
+/**
+ * @brief Register the function called for every stored heart rate sample.
+ */
+void ble_device_set_sample_callback(BLEDevice *device, SampleCallback callback, void *user_data)
 {
+    device->sampleCallback = callback;
+    device->sampleCallbackData = user_data;
+}
 
-    // Open a pipe to gnuplot
-    FILE *gnuplot_pipe = popen("gnuplot -persistent", "w");
-    if (!gnuplot_pipe)
+/**
+ * @brief Find the first sample of the history below a threshold.
+ */
+int ble_device_find_below(BLEDevice *device, int32_t from, int32_t to, int32_t threshold)
+{
+    return history_find_below(&device->hrIndex, device->hrHist, from, to, threshold);
+}
+
+/**
+ * @brief Aggregate the history over a time range.
+ */
+void ble_device_aggregate(BLEDevice *device, int32_t from, int32_t to, BlockSummary *result)
+{
+    history_aggregate(&device->hrIndex, device->hrHist, from, to, result);
+}
+
+/**
+ * @brief Register the function called when the authentication completes.
+ */
+void ble_device_set_auth_callback(BLEDevice *device, AuthCallback callback, void *user_data)
+{
+    device->authCallback = callback;
+    device->authCallbackData = user_data;
+}
+
+/**
+ * @brief Fetch the activity stored on the band since a given time.
+ */
+int fetch_activity(BLEDevice *device, time_t since, ActivityCallback callback, void *user_data)
+{
+    if (device->activityCallback != NULL)
+    {
+        printf("An activity fetch is already running\n");
+        return -1;
+    }
+
+    // The fetch control and the activity data are both notified.
+    if (!device->fetchNotifying)
+    {
+        int ret = gattlib_notification_start(device->connection, &device->characteristicFetch.uuid);
+        int ret2 = gattlib_notification_start(device->connection, &device->characteristicActivityData.uuid);
+        if (ret != GATTLIB_SUCCESS || ret2 != GATTLIB_SUCCESS)
+        {
+            printf("Failed to start notifications for the activity fetch: %d %d\n", ret, ret2);
+            return -1;
+        }
+        device->fetchNotifying = 1;
+    }
+
+    // Request the activity since the given minute, in the local time of the band.
+    struct tm local;
+    localtime_r(&since, &local);
+    uint8_t data[] = {FETCH_ACTIVITY_SINCE,
+                      (local.tm_year + 1900) & 0xff, ((local.tm_year + 1900) >> 8) & 0xff,
+                      local.tm_mon + 1, local.tm_mday, local.tm_hour, local.tm_min,
+                      (uint8_t)(local.tm_gmtoff / 900)};
+    size_t data_len = sizeof(data) / sizeof(data[0]);
+
+    device->activityCallback = callback;
+    device->activityCallbackData = user_data;
+    device->activityTime = since;
+
+    if (gattlib_write_char_by_uuid(device->connection, &device->characteristicFetch.uuid, data, data_len) != GATTLIB_SUCCESS)
+    {
+        printf("Failed to request the activity data\n");
+        device->activityCallback = NULL;
+        device->activityCallbackData = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Stop the continuous heart rate measurement.
+ */
+void stop_hr_measure(BLEDevice *device)
+{
+    // Stop continuous measurement.
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, HR_CONTINUOUS_STOP, sizeof(HR_CONTINUOUS_STOP));
+}
+
+/**
+ * @brief Request a single heart rate measurement.
+ */
+void probe_heart_rate(BLEDevice *device)
+{
+    // Start manual (one-shot) measurement.
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicHrControl.uuid, HR_MANUAL_START, sizeof(HR_MANUAL_START));
+}
+
+/**
+ * @brief Decode a heart rate measurement notification.
+ */
+int decode_heart_rate_measurement(const uint8_t *value, size_t value_length, HeartRateMeasurement *measurement)
+{
+    memset(measurement, 0, sizeof(*measurement));
+    if (value_length < 2)
+    {
+        return -1;
+    }
+
+    size_t pos = 0;
+    measurement->flags = value[pos++];
+
+    // Heart rate, 8 or 16 bit.
+    if (measurement->flags & HRM_FLAG_UINT16)
+    {
+        if (value_length < 3)
+        {
+            return -1;
+        }
+        measurement->bpm = value[pos] | (value[pos + 1] << 8);
+        pos += 2;
+    }
+    else
+    {
+        measurement->bpm = value[pos++];
+    }
+
+    // Energy expended.
+    if (measurement->flags & HRM_FLAG_ENERGY_EXPENDED)
+    {
+        if (pos + 2 > value_length)
+        {
+            return -1;
+        }
+        measurement->energyExpended = value[pos] | (value[pos + 1] << 8);
+        pos += 2;
+    }
+
+    // RR intervals fill the rest of the value.
+    if (measurement->flags & HRM_FLAG_RR_INTERVALS)
+    {
+        while (pos + 2 <= value_length && measurement->rrCount < HRM_MAX_RR_INTERVALS)
+        {
+            measurement->rrIntervals[measurement->rrCount++] = value[pos] | (value[pos + 1] << 8);
+            pos += 2;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Main loop callback: store the result of a spectral analysis.
+ */
+static gboolean spectral_job_done(gpointer data)
+{
+    SpectralJob *job = (SpectralJob *)data;
+    BLEDevice *device = job->device;
+
+    if (job->status == 0)
+    {
+        device->spectralMetrics = job->metrics;
+        printf("HRV LF: %.1f ms^2, HF: %.1f ms^2, LF/HF: %.2f (%d intervals) \n",
+               job->metrics.lf, job->metrics.hf, job->metrics.ratio, job->metrics.count);
+    }
+    device->spectralJob = NULL;
+    free(job);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Thread pool worker: compute the LF/HF power of the job's intervals.
+ */
+static void spectral_job_run(gpointer data, gpointer user_data)
+{
+    SpectralJob *job = (SpectralJob *)data;
+    job->status = spectral_lf_hf(job->time, job->rr, job->count, job->scratch, &job->metrics);
+
+    // Hand the result back to the main loop, the device is only touched there.
+    // ble_device_destroy removes the idle source if the device goes away first.
+    g_idle_add(spectral_job_done, job);
+}
+
+/**
+ * @brief Queue a spectral analysis of the RR window if one is due.
+ */
+static void schedule_spectral_analysis(BLEDevice *device)
+{
+    if (device->spectralPool == NULL || device->spectralJob || device->hrv.count < SPECTRAL_MIN_INTERVALS ||
+        device->hrv.clock - device->spectralClock < SPECTRAL_UPDATE_MS)
     {
-        fprintf(stderr, "Error: could not open a pipe to gnuplot\n");
         return;
     }
 
-    // Configure the plot
-    fprintf(gnuplot_pipe, "set title 'Heart Rate vs. Time'\n");
-    fprintf(gnuplot_pipe, "set xlabel 'Time (s)'\n");
-    fprintf(gnuplot_pipe, "set ylabel 'Heart Rate (bpm)'\n");
-    fprintf(gnuplot_pipe, "plot '-' with linespoints linetype 1 linecolor 'blue', '' with points pointtype 6 lc rgb 'red'\n");
+    // One allocation for the job, the copy of the window and the scratch buffer.
+    int count = device->hrv.count;
+    SpectralJob *job = malloc(sizeof(SpectralJob) + 2 * count * sizeof(double) + spectral_scratch_size(count));
+    if (job == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return;
+    }
+
+    job->device = device;
+    job->time = (double *)(job + 1);
+    job->rr = job->time + count;
+    job->scratch = job->rr + count;
+    job->count = hrv_copy_intervals(&device->hrv, job->time, job->rr);
+
+    device->spectralClock = device->hrv.clock;
+    device->spectralJob = job;
+    g_thread_pool_push(device->spectralPool, job, NULL);
+}
+
+/**
+ * @brief Suspend or resume the measurement after a change of the wear state.
+ */
+static void apply_wear_state(BLEDevice *device, WearState previous)
+{
+    if (device->wear.state == WEAR_OFF)
+    {
+        printf("Band off the wrist, heart rate measurement suspended \n");
+        stop_hr_measure(device);
+    }
+    else if (device->wear.state == WEAR_ON && previous == WEAR_OFF)
+    {
+        printf("Band back on the wrist after %lld s, heart rate measurement resumed \n",
+               (long long)(time(NULL) - device->wear.offSince));
+        apply_interval(device);
+    }
+}
+
+/**
+ * @brief Device event handler: log every event.
+ */
+static void log_band_event(const BandEvent *event, void *user_data)
+{
+    printf("Band event: %s (0x%02x) \n", event_name(event->type), event->type);
+}
+
+/**
+ * @brief Device event handler: the band reports it is not worn.
+ */
+static void handle_nonwear_event(const BandEvent *event, void *user_data)
+{
+    BLEDevice *device = (BLEDevice *)user_data;
+
+    WearState previous = device->wear.state;
+    if (wear_on_nonwear_event(&device->wear, time(NULL)))
+    {
+        apply_wear_state(device, previous);
+    }
+}
+
+/**
+ * @brief Device event handler: a button press, or rejecting the call notification, acknowledges the alert.
+ */
+static void acknowledge_alert(const BandEvent *event, void *user_data)
+{
+    BLEDevice *device = (BLEDevice *)user_data;
 
-    // Send data points to gnuplot (line)
-    for (int i = 0; i < device->hrCount; i++)
+    if (device->alertSentAt == 0)
     {
-        fprintf(gnuplot_pipe, "%d %d\n", device->hrHist[i][0], device->hrHist[i][1]);
+        return;
     }
 
-    fprintf(gnuplot_pipe, "e\n");
+    printf("Alert acknowledged on the band after %.1f s \n", (event->receivedAt - device->alertSentAt) / 1e6);
+    device->alertSentAt = 0;
+}
 
-    // Send data points to gnuplot (points)
-    for (int i = 0; i < device->hrCount; i++)
+/**
+ * @brief Report the end of the authentication, or start the measurement if nobody waits for it.
+ */
+static void finish_authentication(BLEDevice *device, int status)
+{
+    device->authenticated = status == 0;
+    if (device->authCallback)
     {
-        fprintf(gnuplot_pipe, "%d %d\n", device->hrHist[i][0], device->hrHist[i][1]);
+        device->authCallback(status, device->authCallbackData);
     }
+    else if (status == 0)
+    {
+        start_hr_measure(device);
+    }
+}
 
-    fprintf(gnuplot_pipe, "e\n");
+/**
+ * @brief Report the end of an activity fetch. The callback may start the next one.
+ */
+static void finish_fetch(BLEDevice *device, int status)
+{
+    ActivityCallback callback = device->activityCallback;
+    void *user_data = device->activityCallbackData;
+
+    device->activityCallback = NULL;
+    device->activityCallbackData = NULL;
+
+    if (callback)
+    {
+        callback(NULL, 0, status, user_data);
+    }
+}
 
-    // Finish the plot
-    fflush(gnuplot_pipe);
+/**
+ * @brief Plot the heart rate data collected from the device.
+ */
+void plot_heart_rate(BLEDevice *device)
+{
+    plot_heart_rate_range(device, INT32_MIN, INT32_MAX);
+}
+
+/**
+ * @brief Plot a time range of the heart rate history.
+ */
+void plot_heart_rate_range(BLEDevice *device, int32_t from, int32_t to)
+{
+    // Open a pipe to gnuplot
+    FILE *gnuplot_pipe = gnuplot_open();
+    if (!gnuplot_pipe)
+    {
+        return;
+    }
+
+    // Send the data points once, from the pyramid level that fits the viewport, and plot them.
+    gnuplot_append_viewport(gnuplot_pipe, &device->hrPyramid, device->hrHist, from, to, PLOT_MAX_POINTS, &device->hrGaps);
+    gnuplot_draw(gnuplot_pipe);
 }
 
 /**
@@ -354,13 +868,15 @@ void plot_heart_rate(BLEDevice *device)
  */
 void send_alert(BLEDevice *device)
 {
-
-    uint8_t data[] = {0x03, 0x01, 0x0a, 0x0a, 0x0a};
-    size_t data_len = sizeof(data) / sizeof(data[0]);
+    // Wait for the acknowledgement of the first unacknowledged alert.
+    if (device->alertSentAt == 0)
+    {
+        device->alertSentAt = g_get_monotonic_time();
+    }
 
     // Send call notification alert.
     printf("Sending call notification to the band\n");
-    gattlib_write_char_by_uuid(device->connection, &device->characteristicAlert.uuid, data, data_len);
+    gattlib_write_char_by_uuid(device->connection, &device->characteristicAlert.uuid, ALERT_CALL, sizeof(ALERT_CALL));
 }
 
 /**
@@ -400,7 +916,8 @@ void characteristic_enable_notifications_succeeded(BLEDevice *device, uuid_t uui
     {
         printf("Sending 1st Auth Part \n");
         uint8_t *auth = prepare_pub_key(device);
-        write_chunked_value(device->connection, &uuid, 0x82, device->handle, auth, 52);
+        write_chunked_value(device, &uuid, CHUNK_TYPE_AUTH, device->handle, auth, sizeof(AUTH_PUBLIC_KEY_PREFIX) + ECC_PUB_KEY_SIZE);
+        free(auth);
     }
 }
 
@@ -409,12 +926,25 @@ void characteristic_enable_notifications_succeeded(BLEDevice *device, uuid_t uui
  */
 void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size_t value_length, void *user_data)
 {
+    // Reception time, the event latency is measured from here.
+    int64_t received_at = g_get_monotonic_time();
 
     BLEDevice *device = (BLEDevice *)user_data;
 
     char uuid_str[MAX_LEN_UUID_STR + 1];
     gattlib_uuid_to_string(uuid, uuid_str, sizeof(uuid_str));
 
+    // Handle device events first, they are published straight to the handlers.
+    if (strcmp(uuid_str, CHARACTERISTIC_DEVICEEVENT) == 0)
+    {
+        BandEvent event;
+        if (event_decode(value, value_length, received_at, &event) == 0)
+        {
+            event_bus_publish(&device->events, &event);
+        }
+        return;
+    }
+
     // Handle chunked transfer characteristic value updates.
     if (strcmp(uuid_str, CHARACTERISTIC_CHUNKED_TRANSFER_READ) == 0)
     {
@@ -426,7 +956,7 @@ void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size
             size_t header_size = 0;
 
             if (sequence_number == 0 &&
-                value[9] == 0x82 &&
+                value[9] == CHUNK_TYPE_AUTH &&
                 value[10] == 0x00 &&
                 value[11] == 0x10 &&
                 value[12] == 0x04 &&
@@ -445,14 +975,23 @@ void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size
                 }
                 header_size = 5;
             }
-            else if (value[9] == 0x82 &&
+            else if (value[9] == CHUNK_TYPE_AUTH &&
                      value[10] == 0x00 &&
                      value[11] == 0x10 &&
                      value[12] == 0x05 &&
                      value[13] == 0x01)
             {
                 printf("Successfully authenticated\n");
-                start_hr_measure(device);
+                finish_authentication(device, 0);
+            }
+            else if (value_length > 13 &&
+                     value[9] == CHUNK_TYPE_AUTH &&
+                     value[10] == 0x00 &&
+                     value[11] == 0x10)
+            {
+                printf("Authentication failed (step %d, status %d)\n", value[12], value[13]);
+                finish_authentication(device, -1);
+                return;
             }
             else
             {
@@ -490,77 +1029,238 @@ void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size
                 encrypt_aes_cbc(finalSharedSessionAES, remoteRandom, out2, 16);
 
                 // Format data according to auth logic.
-                command[0] = 0x05;
+                command[0] = AUTH_SEND_ENCRYPTED;
                 memcpy(command + 1, out1, 16);
                 memcpy(command + 17, out2, 16);
 
                 printf("Sending 2nd Auth Part\n");
-                write_chunked_value(device->connection, &device->characteristicChunkedW.uuid, 0x82, device->handle + 1, command, 33);
+                write_chunked_value(device, &device->characteristicChunkedW.uuid, CHUNK_TYPE_AUTH, device->handle + 1, command, sizeof(command));
+            }
+        }
+    }
+
+    // Handle the responses to the activity fetch requests.
+    if (strcmp(uuid_str, CHARACTERISTIC_FETCH) == 0)
+    {
+        if (value_length < 3 || value[0] != 0x10 || device->activityCallback == NULL)
+        {
+            return;
+        }
+
+        // Start of the data: size and time of the first stored minute, then ask for the data.
+        if (value[1] == 0x01)
+        {
+            if (value[2] != 0x01 || value_length < 14)
+            {
+                printf("Activity fetch refused (status %d)\n", value[2]);
+                finish_fetch(device, FETCH_FAILED);
+                return;
             }
+
+            struct tm first = {0};
+            first.tm_year = (value[7] | (value[8] << 8)) - 1900;
+            first.tm_mon = value[9] - 1;
+            first.tm_mday = value[10];
+            first.tm_hour = value[11];
+            first.tm_min = value[12];
+            first.tm_sec = value[13];
+            first.tm_isdst = -1;
+            device->activityTime = mktime(&first);
+
+            uint32_t size = value[3] | (value[4] << 8) | (value[5] << 16) | ((uint32_t)value[6] << 24);
+            printf("Fetching %u bytes of activity data\n", size);
+
+            gattlib_write_char_by_uuid(device->connection, &device->characteristicFetch.uuid, FETCH_START_DATA, sizeof(FETCH_START_DATA));
+        }
+        // End of the data.
+        else if (value[1] == 0x02)
+        {
+            finish_fetch(device, value[2] == 0x01 ? FETCH_DONE : FETCH_FAILED);
+        }
+        return;
+    }
+
+    // Handle the activity data, a packet counter followed by one sample per minute.
+    if (strcmp(uuid_str, CHARACTERISTIC_ACTIVITY_DATA) == 0)
+    {
+        if (value_length < 1 + ACTIVITY_SAMPLE_SIZE || device->activityCallback == NULL)
+        {
+            return;
+        }
+
+        ActivitySample samples[ACTIVITY_MAX_SAMPLES];
+        int count = 0;
+        for (size_t i = 1; i + ACTIVITY_SAMPLE_SIZE <= value_length && count < ACTIVITY_MAX_SAMPLES; i += ACTIVITY_SAMPLE_SIZE)
+        {
+            samples[count].time = device->activityTime;
+            samples[count].kind = value[i];
+            samples[count].intensity = value[i + 1];
+            samples[count].steps = value[i + 2];
+            samples[count].heartRate = value[i + 3];
+            device->activityTime += 60;
+            count++;
         }
+
+        device->activityCallback(samples, count, FETCH_RUNNING, device->activityCallbackData);
+        return;
     }
 
     // Handle heart rate measurement characteristic updates.
     if (strcmp(uuid_str, CHARACTERISTIC_HEART_RATE_MEASURE) == 0)
     {
-        // Increment number of heart rate measures.
-        device->hrCount += 1;
+        // Decode the measurement.
+        HeartRateMeasurement measurement;
+        if (decode_heart_rate_measurement(value, value_length, &measurement) != 0)
+        {
+            printf("Invalid heart rate measurement\n");
+            return;
+        }
+
+        // Update the heart rate variability with the RR intervals, the batch ends at the reception.
+        int64_t batch_ms = 0;
+        for (int i = 0; i < measurement.rrCount; i++)
+        {
+            batch_ms += (int32_t)measurement.rrIntervals[i] * 1000 / 1024;
+        }
+        if (measurement.rrCount > 0)
+        {
+            hrv_sync(&device->hrv, g_get_monotonic_time() / 1000 - batch_ms);
+        }
+        for (int i = 0; i < measurement.rrCount; i++)
+        {
+            hrv_add(&device->hrv, (int32_t)measurement.rrIntervals[i] * 1000 / 1024);
+        }
+        hrv_metrics(&device->hrv, &device->hrvMetrics);
+        schedule_spectral_analysis(device);
+
+        // Time at which the value was received.
+        int32_t timestamp = (int32_t)(time(NULL) - device->startTime);
+
+        // Recorded sessions keep the values as received, so they can be replayed through the filter.
+        if (device->session)
+        {
+            session_writer_append(device->session, timestamp, measurement.bpm);
+        }
+
+        // Reject sensor artifacts before the value is stored or used for the alert.
+        int32_t result;
+        int quality = hampel_filter(&device->hrFilter, measurement.bpm, &result);
+
+        // Follow the wear state, a band off the wrist only sends junk.
+        WearState previous = device->wear.state;
+        int contact = (measurement.flags & HRM_FLAG_CONTACT_SUPPORTED) ? (measurement.flags & HRM_FLAG_CONTACT_DETECTED) != 0 : -1;
+        int valid = quality == SAMPLE_OK || quality == SAMPLE_OUTLIER;
+        if (wear_on_sample(&device->wear, contact, valid, time(NULL)))
+        {
+            apply_wear_state(device, previous);
+        }
+
+        // The columnar file keeps every value as received, with its quality, the wear and the RR intervals.
+        if (device->columns)
+        {
+            uint8_t flags = quality < 0 ? SAMPLE_INVALID | COLUMNAR_FLAG_IGNORED : quality;
+            if (contact == 1)
+            {
+                flags |= COLUMNAR_FLAG_CONTACT;
+            }
+            if (device->wear.state == WEAR_OFF)
+            {
+                flags |= COLUMNAR_FLAG_OFF_WRIST | COLUMNAR_FLAG_IGNORED;
+            }
+            columnar_writer_append(device->columns, timestamp, measurement.bpm, flags, measurement.rrIntervals,
+                                   measurement.rrCount);
+        }
+
+        if (quality < 0 || device->wear.state == WEAR_OFF)
+        {
+            printf("Heart Rate Value: %i (ignored) \n", measurement.bpm);
+            return;
+        }
 
         // Check if the buffer needs to be resized.
         if (device->hrCount == device->histSize)
         {
-            device->histSize *= 2;
-            int **tempArray = realloc(device->hrHist, device->histSize * sizeof(int32_t *));
-            for (int i = (device->histSize / 2); i < device->histSize; ++i)
+            int32_t(*tempArray)[2] = realloc(device->hrHist, 2 * device->histSize * sizeof(*device->hrHist));
+            RawSample *tempRaw = tempArray ? realloc(device->hrRaw, 2 * device->histSize * sizeof(RawSample)) : NULL;
+            if (tempArray)
             {
-                tempArray[i] = malloc(2 * sizeof(int32_t));
+                device->hrHist = tempArray;
             }
-            if (tempArray == NULL)
+            if (tempRaw == NULL)
             {
                 printf("Error while allocating memory! \n");
                 plot_heart_rate(device);
                 device->hrCount = 0;
-                device->histSize = 1000;
-                device->hrHist = realloc(device->hrHist, device->histSize * sizeof(int32_t *));
-                for (int i = 0; i < device->histSize; ++i)
-                {
-                    device->hrHist[i] = malloc(2 * sizeof(int32_t));
-                }
+                history_index_reset(&device->hrIndex);
+                lod_reset(&device->hrPyramid);
+                gap_list_reset(&device->hrGaps);
             }
             else
             {
-                device->hrHist = tempArray;
+                device->hrRaw = tempRaw;
+                device->histSize *= 2;
             }
         }
 
-        // Read the heart rate value.
-        size_t len = 2;
-        int32_t result = 0;
-        for (size_t i = 0; i < len; i++)
+        // Increment number of heart rate measures.
+        device->hrCount += 1;
+
+        if (device->hrvMetrics.count > 1)
         {
-            result = (result << 8) | value[i];
+            printf("Heart Rate Value: %i (RMSSD %.1f ms, SDNN %.1f ms, pNN50 %.1f%%) \n", result,
+                   device->hrvMetrics.rmssd, device->hrvMetrics.sdnn, device->hrvMetrics.pnn50);
+        }
+        else
+        {
+            printf("Heart Rate Value: %i \n", result);
+        }
+        if (quality != SAMPLE_OK)
+        {
+            printf("Replaced %s heart rate value %i \n", quality == SAMPLE_INVALID ? "invalid" : "outlier", measurement.bpm);
         }
-        printf("Heart Rate Value: %i \n", result);
 
-        // Store the value and the time at which it was received.
-        device->hrHist[device->hrCount - 1][0] = (int32_t)(time(NULL) - initial_timestamp);
+        // Store the filtered value, the value as received and its quality.
+        device->hrHist[device->hrCount - 1][0] = timestamp;
         device->hrHist[device->hrCount - 1][1] = result;
+        device->hrRaw[device->hrCount - 1].raw = measurement.bpm;
+        device->hrRaw[device->hrCount - 1].quality = quality;
 
-        // Calculate mean value to send alert in case heart rate is decreasing.
-        double sum = 0;
-        double mean = 0;
-
-        for (int i = 0; i < device->hrCount; i++)
+        // Record a gap if the notifications paused.
+        const Gap *gap = gap_list_add(&device->hrGaps, device->hrHist[device->hrCount - 1][0]);
+        if (gap)
         {
-            sum += device->hrHist[i][1];
+            printf("Gap of %d s in the heart rate measurements \n", gap->end - gap->start);
         }
 
-        mean = sum / device->hrCount;
+        // Update the block summaries and the level-of-detail pyramid.
+        history_index_add(&device->hrIndex, device->hrHist[device->hrCount - 1][0], result);
+        lod_add(&device->hrPyramid, device->hrHist[device->hrCount - 1][0], result);
+
+        if (device->sampleCallback)
+        {
+            device->sampleCallback(timestamp, result, device->hrRaw[device->hrCount - 1], device->sampleCallbackData);
+        }
 
-        // Send alert to the band.
-        if ((device->hrCount > 60) && (result < mean - 10))
+        // Send alert to the band in case heart rate is decreasing.
+        int alert = alert_triggered(device->hrIndex.totalSum, device->hrCount, result);
+        if (alert)
         {
             send_alert(device);
         }
+
+        // An alert nobody acknowledged within ALERT_HOLD_S is given up once its condition cleared.
+        if (!alert && device->alertSentAt != 0 && g_get_monotonic_time() - device->alertSentAt > ALERT_HOLD_S * G_USEC_PER_SEC)
+        {
+            printf("Alert not acknowledged after %d s \n", ALERT_HOLD_S);
+            device->alertSentAt = 0;
+        }
+
+        // Measure densely while the heart rate moves or an alert is pending, sparsely at rest.
+        if (interval_update(&device->interval, timestamp, result, alert || device->alertSentAt != 0) && !device->dutyCycled)
+        {
+            printf("Measurement interval %s (%d s) \n", interval_name(device->interval.level),
+                   interval_period(device->interval.level));
+            apply_interval(device);
+        }
     }
 }
\ No newline at end of file
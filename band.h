@@ -9,7 +9,108 @@
  *
  */
 
+#ifndef BAND_H
+#define BAND_H
+
 #include <gattlib.h>
+#include <glib.h>
+#include "session.h"
+#include "columnar.h"
+#include "history.h"
+#include "lod.h"
+#include "gaps.h"
+#include "hrv.h"
+#include "filter.h"
+#include "wear.h"
+#include "interval.h"
+#include "events.h"
+#include "spectral.h"
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Flags of the heart rate measurement characteristic (0x2a37).
+#define HRM_FLAG_UINT16 0x01
+#define HRM_FLAG_CONTACT_DETECTED 0x02
+#define HRM_FLAG_CONTACT_SUPPORTED 0x04
+#define HRM_FLAG_ENERGY_EXPENDED 0x08
+#define HRM_FLAG_RR_INTERVALS 0x10
+
+// Maximum number of RR intervals in one heart rate measurement notification.
+#define HRM_MAX_RR_INTERVALS 9
+
+// An alert not acknowledged after this stops holding the measurement dense, in seconds.
+#define ALERT_HOLD_S 300
+
+/**
+ * @brief Decoded heart rate measurement notification. RR intervals are in 1/1024 s.
+ */
+typedef struct
+{
+    uint8_t flags;
+    uint16_t bpm;
+    uint16_t energyExpended;
+    uint16_t rrIntervals[HRM_MAX_RR_INTERVALS];
+    int rrCount;
+} HeartRateMeasurement;
+
+/**
+ * @brief Called for every heart rate sample stored in the history.
+ * @param time The sample time, in seconds since the start of the measurement.
+ * @param bpm The filtered heart rate value.
+ * @param raw The value as received and its quality.
+ * @param user_data The user data given to ble_device_set_sample_callback.
+ */
+typedef void (*SampleCallback)(int32_t time, int32_t bpm, RawSample raw, void *user_data);
+
+/**
+ * @brief Called when the authentication completes.
+ * @param status 0 if the band accepted the key, -1 otherwise.
+ * @param user_data The user data given to ble_device_set_auth_callback.
+ */
+typedef void (*AuthCallback)(int status, void *user_data);
+
+/**
+ * @brief Called from the main loop when an asynchronous connection completes.
+ * @param status 0 if the band is connected, -1 otherwise.
+ * @param user_data The user data given with the connection request.
+ */
+typedef void (*ConnectCallback)(int status, void *user_data);
+
+// Size of one activity sample in the activity data notifications.
+#define ACTIVITY_SAMPLE_SIZE 4
+
+// Maximum number of activity samples in one activity data notification.
+#define ACTIVITY_MAX_SAMPLES 64
+
+// Status of an activity fetch, given to the ActivityCallback.
+#define FETCH_RUNNING 0
+#define FETCH_DONE 1
+#define FETCH_FAILED -1
+
+/**
+ * @brief One minute of activity stored on the band.
+ */
+typedef struct
+{
+    int64_t time;
+    uint8_t kind;
+    uint8_t intensity;
+    uint8_t steps;
+    uint8_t heartRate;
+} ActivitySample;
+
+/**
+ * @brief Called for every activity data notification of a fetch, and once when it ends.
+ * @param samples The samples of the notification.
+ * @param count The number of samples, 0 when the fetch ends.
+ * @param status FETCH_RUNNING, then FETCH_DONE or FETCH_FAILED.
+ * @param user_data The user data given to fetch_activity.
+ */
+typedef void (*ActivityCallback)(const ActivitySample *samples, int count, int status, void *user_data);
 
 /**
  * @brief Mi Band structure containing necessary information for BLE communication, services, characteristics and heart rate data.
@@ -28,8 +129,48 @@ typedef struct
     gattlib_characteristic_t characteristicHrControl;
     gattlib_characteristic_t characteristicHrMeasure;
     gattlib_characteristic_t characteristicAlert;
+    gattlib_characteristic_t characteristicDeviceEvent;
+    ChunkedMessage chunked;
+    EventBus events;
+    int64_t alertSentAt;
+    SampleCallback sampleCallback;
+    void *sampleCallbackData;
+    AuthCallback authCallback;
+    void *authCallbackData;
+    ActivityCallback activityCallback;
+    void *activityCallbackData;
+    int64_t activityTime;
+
+    int32_t (*hrHist)[2];
+    RawSample *hrRaw;
+    HampelFilter hrFilter;
+    WearDetector wear;
+    IntervalPolicy interval;
+
+    // Set while a DutyScheduler decides when the band measures, instead of the interval policy.
+    int dutyCycled;
+    HistoryIndex hrIndex;
+    LodPyramid hrPyramid;
+    GapList hrGaps;
+    HrvWindow hrv;
+    HrvMetrics hrvMetrics;
+    GThreadPool *spectralPool;
+    SpectralMetrics spectralMetrics;
+    int64_t spectralClock;
+    // Spectral job queued, running or waiting for the main loop, NULL if none.
+    void *spectralJob;
+    SessionWriter *session;
+    ColumnarWriter *columns;
+    time_t startTime;
+    char macAddress[18];
+    int connected;
 
-    int32_t **hrHist;
+    // Set while an asynchronous connection is pending, and once the band accepted the key on the current connection.
+    int connecting;
+    int authenticated;
+    ConnectCallback connectCallback;
+    void *connectCallbackData;
+    int adapter;
     uint8_t *authKey;
     uint8_t *privateKey;
     uint8_t *publicKey;
@@ -38,6 +179,7 @@ typedef struct
     uint8_t pointer;
     uint8_t expectedBytes;
     uint8_t handle;
+    uint8_t fetchNotifying;
 
     int serviceCount;
     int characteristicCount;
@@ -58,6 +200,39 @@ typedef struct
  */
 BLEDevice *ble_device_create(const char *mac_address, const int band_type);
 
+/**
+ * @brief Create a Mi Band instance (BLEDevice) connected through a given adapter.
+ * @param adapter The adapter opened with gattlib_adapter_open, or NULL for the default one.
+ * @param mac_address The MAC address of the device to connect to.
+ * @param band_type The type of the Mi Band.
+ * @return A pointer to the created BLEDevice instance, or NULL if the connection failed.
+ */
+BLEDevice *ble_device_create_on_adapter(void *adapter, const char *mac_address, const int band_type);
+
+/**
+ * @brief Create a Mi Band instance (BLEDevice) without connecting it.
+ * @param mac_address The MAC address of the device.
+ * @param band_type The type of the Mi Band.
+ * @return A pointer to the created BLEDevice instance, to connect with ble_device_reconnect.
+ */
+BLEDevice *ble_device_new(const char *mac_address, const int band_type);
+
+/**
+ * @brief Connect the band again, after the connection was lost or to move it to another adapter.
+ * @param device The BLEDevice instance.
+ * @param adapter The adapter to connect through, or NULL for the default one.
+ * @param callback The function called from the main loop once the connection completes.
+ * @param user_data The user data passed to the callback.
+ * @return 0 if the connection started, -1 if it could not start or one is already pending.
+ *
+ * The connection is asynchronous, the main loop keeps running meanwhile. The previous
+ * connection is dropped and the band counts as not authenticated until the authentication
+ * is done again with enable_notifications_chunked, the measurement restarts once it
+ * succeeds. The history, its time base and the session are kept. The device must not be
+ * destroyed while connecting.
+ */
+int ble_device_reconnect(BLEDevice *device, void *adapter, ConnectCallback callback, void *user_data);
+
 /**
  * @brief Clean up memory and disconnect with the device.
  * @param device The BLEDevice instance to disconnect and clean up.
@@ -70,19 +245,19 @@ void ble_device_destroy(BLEDevice *device);
 
 /**
  * @brief Split value in different packets (chunks) to write in the chunked transfer characteristic
- * @param connection The GATT connection to use for writing.
+ * @param device The BLEDevice instance, whose chunk buffer is used.
  * @param char_uuid The UUID of the chunked transfer characteristic.
  * @param type The type of chunked transfer.
  * @param handle The handle to use for the transfer.
  * @param data The data to write.
- * @param data_length The length of the data to write.
+ * @param data_length The length of the data to write, at most CHUNK_MAX_MESSAGE.
+ * @return 0 on success, -1 if the data is too long or a write failed.
  * 
- * This function sends the provided data in chunks to the target characteristic
- * of the connected BLE device. The data is split into multiple chunks if its
- * size exceeds the maximum transmission unit (MTU).
+ * This function frames the provided data in the preallocated chunk buffer of the device,
+ * see chunk_frame, and writes the chunks to the target characteristic.
  * 
  */
-void write_chunked_value(gatt_connection_t *connection, uuid_t *char_uuid, uint8_t type, uint8_t handle, uint8_t *data, size_t data_length);
+int write_chunked_value(BLEDevice *device, uuid_t *char_uuid, uint8_t type, uint8_t handle, const uint8_t *data, size_t data_length);
 
 /**
  * @brief Prepare a public-private key pair using ECDH key agreement.
@@ -135,15 +310,114 @@ void start_hr_measure(BLEDevice *device);
  */
 void ping_heart_rate(BLEDevice *device);
 
+/**
+ * @brief Register the function called for every stored heart rate sample.
+ * @param device The BLEDevice instance.
+ * @param callback The callback, or NULL to remove it.
+ * @param user_data The user data passed to the callback.
+ */
+void ble_device_set_sample_callback(BLEDevice *device, SampleCallback callback, void *user_data);
+
+/**
+ * @brief Find the first sample of the history below a threshold, e.g. to check for bradycardia.
+ * @param device The BLEDevice instance.
+ * @param from The start of the time range (inclusive, seconds since device->startTime, as in hrHist).
+ * @param to The end of the time range (exclusive, seconds since device->startTime).
+ * @param threshold The heart rate threshold.
+ * @return The index of the sample in hrHist, or -1 if there is none.
+ *
+ * Only the blocks of the history whose minimum is below the threshold are scanned.
+ */
+int ble_device_find_below(BLEDevice *device, int32_t from, int32_t to, int32_t threshold);
+
+/**
+ * @brief Aggregate the history over a time range.
+ * @param device The BLEDevice instance.
+ * @param from The start of the time range (inclusive, seconds since device->startTime, as in hrHist).
+ * @param to The end of the time range (exclusive, seconds since device->startTime).
+ * @param result The count, min, max and sum of the samples in the range.
+ *
+ * Blocks entirely inside the range are taken from their summaries.
+ */
+void ble_device_aggregate(BLEDevice *device, int32_t from, int32_t to, BlockSummary *result);
+
+/**
+ * @brief Register the function called when the authentication completes.
+ * @param device The BLEDevice instance.
+ * @param callback The callback, or NULL to start the heart rate measurement once authenticated.
+ * @param user_data The user data passed to the callback.
+ *
+ * With a callback registered, the measurement is not started automatically, the
+ * callback decides whether to call start_hr_measure or e.g. fetch_activity.
+ */
+void ble_device_set_auth_callback(BLEDevice *device, AuthCallback callback, void *user_data);
+
+/**
+ * @brief Fetch the activity (steps, heart rate...) stored on the band since a given time.
+ * @param device The authenticated BLEDevice instance.
+ * @param since The local time of the first minute to fetch.
+ * @param callback Called with the samples of every activity data notification.
+ * @param user_data The user data passed to the callback.
+ * @return 0 if the fetch was requested, -1 if a fetch is running or the request failed.
+ *
+ * The band answers with the time of the first stored minute and the size of the data,
+ * then sends ACTIVITY_SAMPLE_SIZE bytes per minute on the activity data characteristic.
+ */
+int fetch_activity(BLEDevice *device, time_t since, ActivityCallback callback, void *user_data);
+
+/**
+ * @brief Stop the continuous heart rate measurement, e.g. while the band is off the wrist.
+ * @param device The BLEDevice instance.
+ */
+void stop_hr_measure(BLEDevice *device);
+
+/**
+ * @brief Request a single heart rate measurement, used to probe for the wrist while the band is off it.
+ * @param device The BLEDevice instance.
+ */
+void probe_heart_rate(BLEDevice *device);
+
+/**
+ * @brief Send the measurement of the current interval level: continuous when dense, single measurements otherwise.
+ * @param device The BLEDevice instance.
+ *
+ * Does nothing while the band is duty cycled, the DutyScheduler starts and stops its measurement.
+ */
+void apply_interval(BLEDevice *device);
+
+/**
+ * @brief Decode a heart rate measurement notification.
+ * @param value The notified value.
+ * @param value_length The length of the notified value.
+ * @param measurement The HeartRateMeasurement to fill.
+ * @return 0 on success, -1 if the value is too short.
+ *
+ * This function reads the flags, the 8 or 16 bit heart rate, the energy expended
+ * and the RR intervals of the heart rate measurement characteristic.
+ */
+int decode_heart_rate_measurement(const uint8_t *value, size_t value_length, HeartRateMeasurement *measurement);
+
 /**
  * @brief Plot the heart rate data collected from the device.
  * @param device The BLEDevice instance.
  * 
  * This function creates a pipe to the gnuplot and plots the heart rate data
- * that has been stored in the BLEDevice instance.
+ * that has been stored in the BLEDevice instance. Long histories are drawn from
+ * the level-of-detail pyramid, see plot_heart_rate_range.
  */
 void plot_heart_rate(BLEDevice *device);
 
+/**
+ * @brief Plot a time range of the heart rate history, e.g. to zoom in.
+ * @param device The BLEDevice instance.
+ * @param from The start of the time range (inclusive).
+ * @param to The end of the time range (exclusive).
+ *
+ * At most PLOT_MAX_POINTS nodes of the level-of-detail pyramid are sent, from the finest
+ * level that fits, so the cost depends on the zoom and not on the length of the history.
+ */
+void plot_heart_rate_range(BLEDevice *device, int32_t from, int32_t to);
+
 /**
  * @brief Send an alert notification to the connected BLE device. (call)
  * 
@@ -182,4 +456,10 @@ void characteristic_enable_notifications_succeeded(BLEDevice *device, const uuid
  * authentication process as well as the heart rate data reception and storage.
  *
  */
-void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size_t value_length, void *user_data);
\ No newline at end of file
+void characteristic_value_updated(const uuid_t *uuid, const uint8_t *value, size_t value_length, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
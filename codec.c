@@ -0,0 +1,361 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file codec.c
+ * @author Daniel Oliveira
+ * @brief Gorilla style block codec for archived heart rate samples.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include "codec.h"
+
+// Largest encoded size of one sample: two 4 bit prefixes and two 64 bit escapes.
+#define CODEC_MAX_SAMPLE_BYTES 17
+
+/**
+ * @brief Bit stream writer, most significant bit first.
+ */
+typedef struct
+{
+    uint8_t *out;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+} BitWriter;
+
+/**
+ * @brief Bit stream reader, most significant bit first.
+ */
+typedef struct
+{
+    const uint8_t *in;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+} BitReader;
+
+/**
+ * @brief Write up to 32 bits.
+ */
+static void bits_write(BitWriter *writer, uint32_t value, int count)
+{
+    writer->acc = (writer->acc << count) | (count == 32 ? value : (value & ((1u << count) - 1)));
+    writer->bits += count;
+
+    while (writer->bits >= 8)
+    {
+        writer->out[writer->pos++] = (uint8_t)(writer->acc >> (writer->bits - 8));
+        writer->bits -= 8;
+    }
+}
+
+/**
+ * @brief Write the remaining bits, padded with zeros to a full byte.
+ */
+static void bits_flush(BitWriter *writer)
+{
+    if (writer->bits > 0)
+    {
+        writer->out[writer->pos++] = (uint8_t)(writer->acc << (8 - writer->bits));
+        writer->bits = 0;
+    }
+}
+
+/**
+ * @brief Read up to 32 bits.
+ * @return 0 on success, -1 if the stream is exhausted.
+ */
+static int bits_read(BitReader *reader, int count, uint32_t *value)
+{
+    while (reader->bits < count)
+    {
+        if (reader->pos >= reader->size)
+        {
+            return -1;
+        }
+        reader->acc = (reader->acc << 8) | reader->in[reader->pos++];
+        reader->bits += 8;
+    }
+
+    reader->bits -= count;
+    uint64_t mask = (count == 32) ? 0xffffffffu : ((1u << count) - 1);
+    *value = (uint32_t)((reader->acc >> reader->bits) & mask);
+
+    return 0;
+}
+
+/**
+ * @brief Map a signed value to an unsigned one so that small magnitudes use few bits.
+ */
+static uint64_t zigzag_encode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+/**
+ * @brief Inverse of zigzag_encode.
+ */
+static int64_t zigzag_decode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * @brief Write a signed value with a Gorilla style prefix code.
+ *
+ * '0' for zero, then '10', '110' and '1110' followed by the given number of bits,
+ * and '1111' followed by 64 bits for anything larger.
+ */
+static void write_prefixed(BitWriter *writer, int64_t value, const int widths[3])
+{
+    if (value == 0)
+    {
+        bits_write(writer, 0x0, 1);
+        return;
+    }
+
+    uint64_t encoded = zigzag_encode(value);
+    for (int i = 0; i < 3; i++)
+    {
+        if (encoded < (1ull << widths[i]))
+        {
+            // Prefix of i + 1 ones followed by a zero.
+            bits_write(writer, ((1u << (i + 1)) - 1) << 1, i + 2);
+            bits_write(writer, (uint32_t)encoded, widths[i]);
+            return;
+        }
+    }
+
+    bits_write(writer, 0xf, 4);
+    bits_write(writer, (uint32_t)(encoded >> 32), 32);
+    bits_write(writer, (uint32_t)encoded, 32);
+}
+
+/**
+ * @brief Read a value written by write_prefixed.
+ * @return 0 on success, -1 if the stream is exhausted.
+ */
+static int read_prefixed(BitReader *reader, const int widths[3], int64_t *value)
+{
+    // Count the leading ones of the prefix.
+    int ones = 0;
+    uint32_t bit = 1;
+    while (ones < 4)
+    {
+        if (bits_read(reader, 1, &bit) != 0)
+        {
+            return -1;
+        }
+        if (bit == 0)
+        {
+            break;
+        }
+        ones++;
+    }
+
+    if (ones == 0)
+    {
+        *value = 0;
+        return 0;
+    }
+
+    uint64_t encoded;
+    if (ones < 4)
+    {
+        uint32_t low;
+        if (bits_read(reader, widths[ones - 1], &low) != 0)
+        {
+            return -1;
+        }
+        encoded = low;
+    }
+    else
+    {
+        uint32_t high, low;
+        if (bits_read(reader, 32, &high) != 0 || bits_read(reader, 32, &low) != 0)
+        {
+            return -1;
+        }
+        encoded = ((uint64_t)high << 32) | low;
+    }
+
+    *value = zigzag_decode(encoded);
+    return 0;
+}
+
+// Payload widths of the prefix codes. Timestamps follow Gorilla, heart rate deltas
+// are small so their buckets are narrower.
+static const int TIME_WIDTHS[3] = {7, 9, 12};
+static const int BPM_WIDTHS[3] = {3, 6, 9};
+
+// CRC-32 lookup table for the reflected polynomial 0xedb88320.
+static const uint32_t CRC32_TABLE[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+/**
+ * @brief Maximum encoded size of a block of samples.
+ */
+size_t codec_block_bound(size_t count)
+{
+    return sizeof(CodecBlockHeader) + count * CODEC_MAX_SAMPLE_BYTES + 1;
+}
+
+/**
+ * @brief Encode a block of time sorted samples.
+ */
+size_t codec_encode_block(const SessionRecord *records, size_t count, uint8_t *out)
+{
+    CodecBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.count = (uint32_t)count;
+    header.firstTime = records[0].time;
+    header.lastTime = records[count - 1].time;
+    header.firstBpm = records[0].bpm;
+    header.minBpm = records[0].bpm;
+    header.maxBpm = records[0].bpm;
+    header.sumBpm = records[0].bpm;
+
+    BitWriter writer = {out + sizeof(CodecBlockHeader), 0, 0, 0};
+    int64_t previous_delta = 0;
+
+    for (size_t i = 1; i < count; i++)
+    {
+        // Timestamp as delta-of-delta.
+        int64_t delta = (int64_t)records[i].time - records[i - 1].time;
+        write_prefixed(&writer, delta - previous_delta, TIME_WIDTHS);
+        previous_delta = delta;
+
+        // Heart rate as delta from the previous sample.
+        write_prefixed(&writer, (int64_t)records[i].bpm - records[i - 1].bpm, BPM_WIDTHS);
+
+        // Block summary.
+        if (records[i].bpm < header.minBpm)
+        {
+            header.minBpm = records[i].bpm;
+        }
+        if (records[i].bpm > header.maxBpm)
+        {
+            header.maxBpm = records[i].bpm;
+        }
+        header.sumBpm += records[i].bpm;
+    }
+    bits_flush(&writer);
+
+    // Checksum the header fields and the payload.
+    header.payloadSize = (uint32_t)writer.pos;
+    header.checksum = codec_crc32(0, (const uint8_t *)&header, offsetof(CodecBlockHeader, checksum));
+    header.checksum = codec_crc32(header.checksum, out + sizeof(CodecBlockHeader), writer.pos);
+    memcpy(out, &header, sizeof(header));
+
+    return sizeof(CodecBlockHeader) + writer.pos;
+}
+
+/**
+ * @brief Decode a block of samples.
+ */
+int codec_decode_block(const uint8_t *in, size_t length, SessionRecord *records, size_t capacity)
+{
+    CodecBlockHeader header;
+    if (length < sizeof(header))
+    {
+        return -1;
+    }
+    memcpy(&header, in, sizeof(header));
+
+    if (header.count == 0 || header.count > capacity || header.payloadSize > length - sizeof(header))
+    {
+        return -1;
+    }
+
+    // Verify the checksum before decoding anything.
+    uint32_t checksum = codec_crc32(0, in, offsetof(CodecBlockHeader, checksum));
+    checksum = codec_crc32(checksum, in + sizeof(header), header.payloadSize);
+    if (checksum != header.checksum)
+    {
+        return -1;
+    }
+
+    BitReader reader = {in + sizeof(header), header.payloadSize, 0, 0, 0};
+    int64_t previous_delta = 0;
+
+    records[0].time = header.firstTime;
+    records[0].bpm = header.firstBpm;
+
+    for (uint32_t i = 1; i < header.count; i++)
+    {
+        int64_t delta_of_delta, bpm_delta;
+        if (read_prefixed(&reader, TIME_WIDTHS, &delta_of_delta) != 0 ||
+            read_prefixed(&reader, BPM_WIDTHS, &bpm_delta) != 0)
+        {
+            return -1;
+        }
+
+        previous_delta += delta_of_delta;
+        records[i].time = (int32_t)(records[i - 1].time + previous_delta);
+        records[i].bpm = (int32_t)(records[i - 1].bpm + bpm_delta);
+    }
+
+    return (int)header.count;
+}
+
+/**
+ * @brief Compute or continue a CRC-32 (IEEE 802.3) checksum.
+ */
+uint32_t codec_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = CRC32_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,78 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile codec.h
+ * @author Daniel Oliveira
+ * @brief Gorilla style block codec for archived heart rate samples.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "session.h"
+
+/**
+ * @brief Header stored in front of every encoded block.
+ *
+ * The checksum is a CRC-32 of the header fields before it followed by the payload,
+ * so a corrupted block is detected before any of its samples is decoded. The bpm
+ * summary lets range and threshold queries skip or aggregate a block without decoding it.
+ */
+typedef struct
+{
+    uint32_t count;
+    int32_t firstTime;
+    int32_t lastTime;
+    int32_t firstBpm;
+    int32_t minBpm;
+    int32_t maxBpm;
+    int64_t sumBpm;
+    uint32_t payloadSize;
+    uint32_t checksum;
+} CodecBlockHeader;
+
+/**
+ * @brief Maximum encoded size of a block of samples.
+ * @param count The number of samples in the block.
+ * @return The size in bytes of the buffer needed by codec_encode_block.
+ */
+size_t codec_block_bound(size_t count);
+
+/**
+ * @brief Encode a block of time sorted samples.
+ * @param records The samples to encode.
+ * @param count The number of samples, at least one.
+ * @param out The output buffer, at least codec_block_bound(count) bytes long.
+ * @return The number of bytes written, header included.
+ *
+ * Timestamps are stored as delta-of-delta and bpm values as deltas from the previous
+ * sample, both with Gorilla's variable length prefix codes: a regular cadence and a
+ * steady heart rate cost a single bit each per sample.
+ */
+size_t codec_encode_block(const SessionRecord *records, size_t count, uint8_t *out);
+
+/**
+ * @brief Decode a block of samples.
+ * @param in The encoded block, header included.
+ * @param length The number of bytes available in the input buffer.
+ * @param records The output buffer for the decoded samples.
+ * @param capacity The number of samples the output buffer can hold.
+ * @return The number of decoded samples, or -1 if the block is truncated, corrupted or too large.
+ */
+int codec_decode_block(const uint8_t *in, size_t length, SessionRecord *records, size_t capacity);
+
+/**
+ * @brief Compute or continue a CRC-32 (IEEE 802.3) checksum.
+ * @param crc The checksum of the preceding data, or 0 to start a new checksum.
+ * @param data The data to checksum.
+ * @param length The length of the data.
+ * @return The updated checksum.
+ */
+uint32_t codec_crc32(uint32_t crc, const uint8_t *data, size_t length);
+
+#endif
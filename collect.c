@@ -0,0 +1,172 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file collect.c
+ * @author Daniel Oliveira
+ * @brief Round-robin collector: fetch the heart rate stored on a roster of bands, a few at a time.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "band.h"
+#include "adapter.h"
+#include "collector.h"
+#include "compactor.h"
+
+// Period of the statistics report, in seconds.
+#define REPORT_INTERVAL_S 600
+
+// Initialize global main loop
+GMainLoop *loop;
+
+/**
+ * @brief Signal handler for keyboard interrupt (Ctrl+C).
+ *
+ * @param sig The signal received.
+ */
+void handle_sigint(int sig)
+{
+    if (sig == SIGINT && loop)
+    {
+        g_main_loop_quit(loop);
+    }
+}
+
+/**
+ * @brief Ends the stalled visits and starts new ones, every second.
+ *
+ * @param data The Collector instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean schedule_visits(gpointer data)
+{
+    collector_schedule((Collector *)data, time(NULL));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Prints the collection statistics.
+ *
+ * @param data The Collector instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean report_visits(gpointer data)
+{
+    collector_report((const Collector *)data, time(NULL));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Collects the completed writes of the session files.
+ *
+ * @param fd The completion eventfd of the queue.
+ * @param condition The condition of the file descriptor.
+ * @param data The StorageQueue instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean collect_writes(gint fd, GIOCondition condition, gpointer data)
+{
+    storage_queue_poll((StorageQueue *)data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts a background compaction pass of the session directory.
+ *
+ * @param data The Compactor instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean compact_sessions(gpointer data)
+{
+    compactor_start((Compactor *)data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Main function.
+ *
+ * Loads the roster given as argument, then visits the bands in turn
+ * until a keyboard interrupt.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s ROSTER\n  ROSTER: file with one band MAC address per line\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, handle_sigint);
+    loop = g_main_loop_new(NULL, FALSE);
+
+    static AdapterPool pool;
+    if (adapter_pool_open(&pool, ADAPTERS, ADAPTER_DEFAULT_CAPACITY) < 0)
+    {
+        printf("Failed to open the adapters.\n");
+        return 1;
+    }
+
+    static Collector collector;
+    collector_init(&collector, &pool, atoi(BAND_TYPE), SESSION_DIR);
+    if (collector_load(&collector, argv[1]) <= 0)
+    {
+        fprintf(stderr, "No band in %s\n", argv[1]);
+        adapter_pool_close(&pool);
+        return 1;
+    }
+    printf("Collecting from %d bands \n", collector.count);
+
+    collector_schedule(&collector, time(NULL));
+    guint schedule_id = g_timeout_add_seconds(1, schedule_visits, &collector);
+    guint report_id = g_timeout_add_seconds(REPORT_INTERVAL_S, report_visits, &collector);
+
+    // Collect the completed writes as they complete, rather than on the next write.
+    StorageQueue *storage = storage_queue_shared();
+    guint storage_id = 0;
+    if (storage && storage_queue_fd(storage) >= 0)
+    {
+        storage_id = g_unix_fd_add(storage_queue_fd(storage), G_IO_IN, collect_writes, storage);
+    }
+
+    // Retention and compaction of the session files, in the background at the lowest priority.
+    static Compactor compactor;
+    compactor_init(&compactor, SESSION_DIR, (int64_t)atoi(RETENTION_DAYS) * 86400, COMPACT_RATE_BYTES);
+    guint compact_id = g_timeout_add_seconds(COMPACT_INTERVAL_S, compact_sessions, &compactor);
+
+    // Starts glib main event loop.
+    g_main_loop_run(loop);
+
+    collector_report(&collector, time(NULL));
+
+    // Clean up.
+    g_source_remove(schedule_id);
+    g_source_remove(report_id);
+    g_source_remove(compact_id);
+    compactor_stop(&compactor);
+    if (compactor.passes > 0)
+    {
+        compactor_report(&compactor);
+    }
+    compactor_free(&compactor);
+    collector_free(&collector);
+    adapter_pool_close(&pool);
+    if (storage_id)
+    {
+        g_source_remove(storage_id);
+    }
+    storage_queue_shutdown();
+    g_main_loop_unref(loop);
+
+    return 0;
+}
@@ -0,0 +1,375 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file collector.c
+ * @author Daniel Oliveira
+ * @brief Round-robin collection: visit a roster of bands in turn to fetch the data they stored.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collector.h"
+
+static void visit_connected(int status, void *user_data);
+static void visit_authenticated(int status, void *user_data);
+static void visit_activity(const ActivitySample *samples, int count, int status, void *user_data);
+
+/**
+ * @brief Initialize an empty collector.
+ */
+void collector_init(Collector *collector, AdapterPool *pool, int band_type, const char *directory)
+{
+    memset(collector, 0, sizeof(*collector));
+    collector->pool = pool;
+    collector->bandType = band_type;
+    collector->directory = directory;
+    collector->startedAt = time(NULL);
+}
+
+/**
+ * @brief Add a band to the roster.
+ */
+int collector_add(Collector *collector, const char *mac_address)
+{
+    if (collector->count == collector->capacity)
+    {
+        int capacity = collector->capacity ? 2 * collector->capacity : 64;
+        RosterEntry *roster = realloc(collector->roster, capacity * sizeof(RosterEntry));
+        if (roster == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            return -1;
+        }
+        collector->roster = roster;
+        collector->capacity = capacity;
+    }
+
+    RosterEntry *entry = &collector->roster[collector->count++];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->macAddress, sizeof(entry->macAddress), "%s", mac_address);
+    entry->collector = collector;
+    return 0;
+}
+
+/**
+ * @brief Load a roster file, one MAC address per line.
+ */
+int collector_load(Collector *collector, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("Error opening the roster file");
+        return -1;
+    }
+
+    char line[64];
+    int added = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        // Skip blank lines and comments.
+        line[strcspn(line, " \t\r\n#")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        if (collector_add(collector, line) == 0)
+        {
+            added++;
+        }
+    }
+
+    fclose(file);
+    return added;
+}
+
+/**
+ * @brief Account for a failed visit, a band out of range should not hog the connections.
+ */
+static void back_off(RosterEntry *entry, time_t now)
+{
+    int shift = entry->failures < 6 ? entry->failures : 6;
+    int backoff = COLLECT_RETRY_S << shift;
+
+    entry->retryAt = now + (backoff < COLLECT_MAX_BACKOFF_S ? backoff : COLLECT_MAX_BACKOFF_S);
+    entry->failures++;
+    entry->collector->failed++;
+}
+
+/**
+ * @brief Disconnect the band of a visit, account for the visit and free the connection.
+ */
+static void release_visit(RosterEntry *entry, time_t now)
+{
+    Collector *collector = entry->collector;
+
+    session_writer_close(entry->session);
+    entry->session = NULL;
+
+    // A pending connection cannot be aborted, the band is destroyed once it completes.
+    if (entry->state == VISIT_CONNECTING)
+    {
+        adapter_pool_cancel(collector->pool, entry->device);
+    }
+    else
+    {
+        adapter_pool_release(collector->pool, entry->device);
+        ble_device_destroy(entry->device);
+    }
+    entry->device = NULL;
+    collector->active--;
+    collector->visitTime += now - entry->visitStart;
+
+    if (entry->succeeded)
+    {
+        entry->lastSync = now;
+        entry->failures = 0;
+        collector->served++;
+    }
+    else
+    {
+        back_off(entry, now);
+    }
+
+    entry->state = VISIT_IDLE;
+}
+
+/**
+ * @brief Release a visit ended from a notification, once the notification handler has returned.
+ */
+static gboolean release_ended_visit(gpointer data)
+{
+    RosterEntry *entry = (RosterEntry *)data;
+    time_t now = time(NULL);
+
+    release_visit(entry, now);
+    collector_schedule(entry->collector, now);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief End a visit from one of its callbacks, the BLEDevice is destroyed from the main loop.
+ */
+static void end_visit(RosterEntry *entry, int succeeded)
+{
+    entry->state = VISIT_ENDED;
+    entry->succeeded = succeeded;
+    g_idle_add(release_ended_visit, entry);
+}
+
+/**
+ * @brief Connection callback: authenticate the band.
+ */
+static void visit_connected(int status, void *user_data)
+{
+    RosterEntry *entry = (RosterEntry *)user_data;
+    if (entry->state != VISIT_CONNECTING)
+    {
+        return;
+    }
+
+    if (status != 0)
+    {
+        end_visit(entry, 0);
+        return;
+    }
+
+    entry->state = VISIT_AUTHENTICATING;
+    ble_device_set_auth_callback(entry->device, visit_authenticated, entry);
+    enable_notifications_chunked(entry->device);
+}
+
+/**
+ * @brief Authentication callback: fetch the activity since the previous visit.
+ */
+static void visit_authenticated(int status, void *user_data)
+{
+    RosterEntry *entry = (RosterEntry *)user_data;
+    if (entry->state != VISIT_AUTHENTICATING)
+    {
+        return;
+    }
+
+    if (status != 0)
+    {
+        end_visit(entry, 0);
+        return;
+    }
+
+    time_t since = entry->fetchedUntil ? entry->fetchedUntil : time(NULL) - COLLECT_INITIAL_HISTORY_S;
+    entry->state = VISIT_FETCHING;
+    if (fetch_activity(entry->device, since, visit_activity, entry) != 0)
+    {
+        end_visit(entry, 0);
+    }
+}
+
+/**
+ * @brief Activity callback: record the heart rate, one session file per visit.
+ */
+static void visit_activity(const ActivitySample *samples, int count, int status, void *user_data)
+{
+    RosterEntry *entry = (RosterEntry *)user_data;
+    if (entry->state != VISIT_FETCHING)
+    {
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        // The band stores 0 or 255 for the minutes without a heart rate measurement.
+        if (samples[i].heartRate > 0 && samples[i].heartRate < 255)
+        {
+            if (entry->session == NULL)
+            {
+                entry->sessionStart = samples[i].time;
+                entry->session = session_writer_open(entry->collector->directory, entry->macAddress, entry->sessionStart);
+            }
+            if (entry->session)
+            {
+                session_writer_append(entry->session, (int32_t)(samples[i].time - entry->sessionStart), samples[i].heartRate);
+            }
+        }
+        entry->fetchedUntil = samples[i].time + 60;
+    }
+    entry->collector->samples += count;
+
+    if (status != FETCH_RUNNING)
+    {
+        end_visit(entry, status == FETCH_DONE);
+    }
+}
+
+/**
+ * @brief The idle band due for a visit that waited the longest since its last sync, or NULL.
+ */
+static RosterEntry *next_due(Collector *collector, time_t now, unsigned char *skipped)
+{
+    RosterEntry *best = NULL;
+    for (int i = 0; i < collector->count; i++)
+    {
+        RosterEntry *entry = &collector->roster[i];
+        if (entry->state != VISIT_IDLE || skipped[i] || now < entry->retryAt ||
+            (entry->lastSync && now - entry->lastSync < COLLECT_MIN_INTERVAL_S))
+        {
+            continue;
+        }
+        if (best == NULL || entry->lastSync < best->lastSync)
+        {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief End the stalled visits and start new ones while the adapters have free connections.
+ */
+int collector_schedule(Collector *collector, time_t now)
+{
+    // End the visits that lost their connection or take too long.
+    for (int i = 0; i < collector->count; i++)
+    {
+        RosterEntry *entry = &collector->roster[i];
+        int stalled = entry->state == VISIT_CONNECTING && entry->device &&
+                      now - entry->visitStart > COLLECT_CONNECT_TIMEOUT_S;
+        if (stalled || ((entry->state == VISIT_AUTHENTICATING || entry->state == VISIT_FETCHING) &&
+                        (!entry->device->connected || now - entry->visitStart > COLLECT_TIMEOUT_S)))
+        {
+            printf("Visit of %s abandoned\n", entry->macAddress);
+            entry->succeeded = 0;
+            release_visit(entry, now);
+        }
+    }
+
+    // Bands that could not be connected during this round.
+    unsigned char *skipped = calloc(collector->count ? collector->count : 1, 1);
+    if (skipped == NULL)
+    {
+        return 0;
+    }
+
+    int started = 0;
+    RosterEntry *entry;
+    while ((entry = next_due(collector, now, skipped)) != NULL)
+    {
+        // Keep the adapters at their connection limit, and no further.
+        if (adapter_pool_select(collector->pool, entry->macAddress, -1) < 0)
+        {
+            break;
+        }
+
+        // The state is set first, the callback may run before the connection request returns.
+        entry->state = VISIT_CONNECTING;
+        entry->succeeded = 0;
+        entry->visitStart = now;
+        collector->active++;
+
+        BLEDevice *device = adapter_pool_connect_async(collector->pool, entry->macAddress, collector->bandType,
+                                                       visit_connected, entry);
+        if (device == NULL)
+        {
+            entry->state = VISIT_IDLE;
+            collector->active--;
+            skipped[entry - collector->roster] = 1;
+            back_off(entry, now);
+            continue;
+        }
+
+        entry->device = device;
+        started++;
+    }
+
+    free(skipped);
+    return started;
+}
+
+/**
+ * @brief Print the number of bands served per hour and the visit statistics.
+ */
+void collector_report(const Collector *collector, time_t now)
+{
+    double hours = (double)(now - collector->startedAt) / 3600.0;
+    int64_t visits = collector->served + collector->failed;
+
+    printf("Served %lld bands of %d in %.2f h: %.1f bands/hour, %lld failed visits, %d in progress \n",
+           (long long)collector->served, collector->count, hours, hours > 0 ? collector->served / hours : 0.0,
+           (long long)collector->failed, collector->active);
+    if (visits > 0)
+    {
+        printf("Mean visit %.1f s, %lld activity minutes fetched \n", (double)collector->visitTime / visits,
+               (long long)collector->samples);
+    }
+}
+
+/**
+ * @brief Free the roster, ending the visits in progress.
+ */
+void collector_free(Collector *collector)
+{
+    time_t now = time(NULL);
+    for (int i = 0; i < collector->count; i++)
+    {
+        RosterEntry *entry = &collector->roster[i];
+        if (entry->device)
+        {
+            // An ended visit is released here rather than from the main loop.
+            if (entry->state == VISIT_ENDED)
+            {
+                g_source_remove_by_user_data(entry);
+            }
+            entry->succeeded = 0;
+            release_visit(entry, now);
+        }
+    }
+
+    free(collector->roster);
+    collector->roster = NULL;
+    collector->count = 0;
+    collector->capacity = 0;
+}
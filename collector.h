@@ -0,0 +1,159 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile collector.h
+ * @author Daniel Oliveira
+ * @brief Round-robin collection: visit a roster of bands in turn to fetch the data they stored.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+#include <stdint.h>
+#include <time.h>
+#include "band.h"
+#include "adapter.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// A visit (connection, authentication and fetch) taking longer than this is abandoned, in seconds.
+#define COLLECT_TIMEOUT_S 60
+
+// A connection still pending after this is given up and the visit fails, in seconds.
+#define COLLECT_CONNECT_TIMEOUT_S 20
+
+// A band synced less than this ago is not visited again, in seconds.
+#define COLLECT_MIN_INTERVAL_S 300
+
+// After a failed visit a band waits COLLECT_RETRY_S, doubled per failure up to COLLECT_MAX_BACKOFF_S.
+#define COLLECT_RETRY_S 60
+#define COLLECT_MAX_BACKOFF_S 3600
+
+// History fetched from a band visited for the first time, in seconds.
+#define COLLECT_INITIAL_HISTORY_S (24 * 3600)
+
+/**
+ * @brief State of the visit of a band.
+ */
+typedef enum
+{
+    VISIT_IDLE = 0,
+    VISIT_CONNECTING,
+    VISIT_AUTHENTICATING,
+    VISIT_FETCHING,
+    VISIT_ENDED
+} VisitState;
+
+typedef struct Collector Collector;
+
+/**
+ * @brief A band of the roster and its synchronization state.
+ */
+typedef struct
+{
+    char macAddress[18];
+
+    // Wall time of the last successful visit, 0 if never synced.
+    time_t lastSync;
+
+    // Time of the next minute to fetch, in the band clock.
+    time_t fetchedUntil;
+
+    // Consecutive failed visits, and the earliest time of the next one.
+    int failures;
+    time_t retryAt;
+
+    // Current visit.
+    VisitState state;
+    int succeeded;
+    time_t visitStart;
+    BLEDevice *device;
+    SessionWriter *session;
+    time_t sessionStart;
+    Collector *collector;
+} RosterEntry;
+
+/**
+ * @brief Roster of bands visited in turn, and the collection statistics.
+ */
+struct Collector
+{
+    AdapterPool *pool;
+    int bandType;
+    const char *directory;
+
+    RosterEntry *roster;
+    int count;
+    int capacity;
+    int active;
+
+    time_t startedAt;
+    int64_t served;
+    int64_t failed;
+    int64_t samples;
+    int64_t visitTime;
+};
+
+/**
+ * @brief Initialize an empty collector.
+ * @param collector The Collector instance.
+ * @param pool The adapters the bands are connected through.
+ * @param band_type The type of the Mi Bands.
+ * @param directory The directory where the fetched heart rate is recorded.
+ */
+void collector_init(Collector *collector, AdapterPool *pool, int band_type, const char *directory);
+
+/**
+ * @brief Free the roster, ending the visits in progress.
+ * @param collector The Collector instance.
+ */
+void collector_free(Collector *collector);
+
+/**
+ * @brief Add a band to the roster, before the first collector_schedule.
+ * @param collector The Collector instance.
+ * @param mac_address The MAC address of the band.
+ * @return 0 on success, -1 if the memory could not be allocated.
+ */
+int collector_add(Collector *collector, const char *mac_address);
+
+/**
+ * @brief Load a roster file, one MAC address per line.
+ * @param collector The Collector instance.
+ * @param path The path of the roster file.
+ * @return The number of bands added, or -1 if the file could not be read.
+ */
+int collector_load(Collector *collector, const char *path);
+
+/**
+ * @brief End the stalled visits and start new ones while the adapters have free connections.
+ * @param collector The Collector instance.
+ * @param now The current time.
+ * @return The number of visits started.
+ *
+ * Called every second from the main loop, and whenever a visit ends. The bands due for
+ * a visit are taken by time since their last sync, the never synced ones first. A band
+ * is connected, authenticated, its activity since the previous visit is fetched and its
+ * heart rate recorded to a session file, then it is disconnected to free the connection.
+ * The connections are asynchronous, so the main loop never waits for a band to answer.
+ */
+int collector_schedule(Collector *collector, time_t now);
+
+/**
+ * @brief Print the number of bands served per hour and the visit statistics.
+ * @param collector The Collector instance.
+ * @param now The current time.
+ */
+void collector_report(const Collector *collector, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,945 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file columnar.c
+ * @author Daniel Oliveira
+ * @brief Columnar session files: one encoded chunk per column and row group, indexed by a footer.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "columnar.h"
+#include "codec.h"
+
+// Largest encoded size of one sample over every column: two 64 bit varints, two runs and the RR intervals.
+#define COLUMNAR_MAX_SAMPLE_BYTES (10 + 10 + 2 + 2 + 3 * COLUMNAR_MAX_RR)
+
+/**
+ * @brief Map a signed value to an unsigned one so that small magnitudes use few bytes.
+ */
+static uint64_t zigzag_encode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+/**
+ * @brief Inverse of zigzag_encode.
+ */
+static int64_t zigzag_decode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * @brief Write a varint, 7 bits per byte, least significant first.
+ * @return The number of bytes written.
+ */
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+/**
+ * @brief Read a varint.
+ * @return 0 on success, -1 if the chunk is exhausted or the varint is too long.
+ */
+static int get_varint(const uint8_t *in, size_t size, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (*pos >= size)
+        {
+            return -1;
+        }
+        uint8_t byte = in[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Encode times as the differences between consecutive deltas: a steady rate encodes as zeros.
+ */
+static size_t encode_times(const int32_t *values, size_t count, uint8_t *out, ColumnarChunk *chunk)
+{
+    size_t size = 0;
+    int64_t previous = 0;
+    int64_t previous_delta = 0;
+
+    chunk->min = values[0];
+    chunk->max = values[0];
+    for (size_t i = 0; i < count; i++)
+    {
+        int64_t delta = values[i] - previous;
+        size += put_varint(out + size, zigzag_encode(delta - previous_delta));
+        previous = values[i];
+        previous_delta = delta;
+
+        chunk->min = values[i] < chunk->min ? values[i] : chunk->min;
+        chunk->max = values[i] > chunk->max ? values[i] : chunk->max;
+        chunk->sum += values[i];
+    }
+
+    chunk->encoding = COLUMNAR_DELTA_OF_DELTA;
+    chunk->values = (uint32_t)count;
+    return size;
+}
+
+/**
+ * @brief Encode values as the differences between consecutive values.
+ */
+static size_t encode_deltas(const int32_t *values, size_t count, uint8_t *out, ColumnarChunk *chunk)
+{
+    size_t size = 0;
+    int64_t previous = 0;
+
+    chunk->min = values[0];
+    chunk->max = values[0];
+    for (size_t i = 0; i < count; i++)
+    {
+        size += put_varint(out + size, zigzag_encode((int64_t)values[i] - previous));
+        previous = values[i];
+
+        chunk->min = values[i] < chunk->min ? values[i] : chunk->min;
+        chunk->max = values[i] > chunk->max ? values[i] : chunk->max;
+        chunk->sum += values[i];
+    }
+
+    chunk->encoding = COLUMNAR_DELTA;
+    chunk->values = (uint32_t)count;
+    return size;
+}
+
+/**
+ * @brief Write runs of equal bytes: the value, then the length of the run.
+ */
+static size_t put_runs(const uint8_t *values, size_t count, uint8_t *out)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count;)
+    {
+        size_t run = 1;
+        while (i + run < count && values[i + run] == values[i])
+        {
+            run++;
+        }
+        out[size++] = values[i];
+        size += put_varint(out + size, run);
+        i += run;
+    }
+    return size;
+}
+
+/**
+ * @brief Read count bytes written by put_runs.
+ * @return 0 on success, -1 if the runs do not add up to count.
+ */
+static int get_runs(const uint8_t *in, size_t size, size_t *pos, uint8_t *values, size_t count)
+{
+    size_t filled = 0;
+    while (filled < count)
+    {
+        uint64_t run;
+        if (*pos >= size)
+        {
+            return -1;
+        }
+        uint8_t value = in[(*pos)++];
+        if (get_varint(in, size, pos, &run) != 0 || run == 0 || run > count - filled)
+        {
+            return -1;
+        }
+        memset(values + filled, value, run);
+        filled += run;
+    }
+    return 0;
+}
+
+/**
+ * @brief Encode the flags as runs: they rarely change from one sample to the next.
+ */
+static size_t encode_flags(const uint8_t *values, size_t count, uint8_t *out, ColumnarChunk *chunk)
+{
+    chunk->min = values[0];
+    chunk->max = values[0];
+    for (size_t i = 0; i < count; i++)
+    {
+        chunk->min &= values[i];
+        chunk->max |= values[i];
+        chunk->sum += values[i] != 0;
+    }
+
+    chunk->encoding = COLUMNAR_RUN_LENGTH;
+    chunk->values = (uint32_t)count;
+    return put_runs(values, count, out);
+}
+
+/**
+ * @brief Encode the RR interval lists: the counts per sample as runs, then the intervals as deltas.
+ */
+static size_t encode_rr(const uint8_t *counts, size_t count, const uint16_t *rr, size_t values, uint8_t *out, ColumnarChunk *chunk)
+{
+    size_t size = put_runs(counts, count, out);
+    int64_t previous = 0;
+
+    chunk->min = values > 0 ? rr[0] : 0;
+    chunk->max = values > 0 ? rr[0] : 0;
+    for (size_t i = 0; i < values; i++)
+    {
+        size += put_varint(out + size, zigzag_encode((int64_t)rr[i] - previous));
+        previous = rr[i];
+
+        chunk->min = rr[i] < chunk->min ? rr[i] : chunk->min;
+        chunk->max = rr[i] > chunk->max ? rr[i] : chunk->max;
+        chunk->sum += rr[i];
+    }
+
+    chunk->encoding = COLUMNAR_RR_LISTS;
+    chunk->values = (uint32_t)values;
+    return size;
+}
+
+/**
+ * @brief Create the columnar file starting at a given time, locked while it is written.
+ */
+static int open_columnar_file(ColumnarWriter *writer, int64_t file_start)
+{
+    size_t path_len = strlen(writer->directory) + strlen(writer->fileMac) + 32;
+    char *path = malloc(path_len);
+    snprintf(path, path_len, "%s/%s_%lld%s", writer->directory, writer->fileMac, (long long)file_start, COLUMNAR_EXTENSION);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not create columnar file %s\n", path);
+        free(path);
+        return -1;
+    }
+
+    // The lock tells the compactor the file is still written, as for the session files.
+    flock(fd, LOCK_EX);
+
+    StorageFile *file = storage_file_open(fd);
+    if (file == NULL)
+    {
+        close(fd);
+        free(path);
+        return -1;
+    }
+
+    free(writer->path);
+    writer->path = path;
+    writer->file = file;
+    writer->fileStart = file_start;
+    writer->fileRecords = 0;
+    writer->offset = 0;
+    writer->blocks = 0;
+    writer->groupCount = 0;
+    return 0;
+}
+
+/**
+ * @brief Free a writer and its buffers.
+ */
+static void free_writer(ColumnarWriter *writer)
+{
+    free(writer->time);
+    free(writer->bpm);
+    free(writer->flags);
+    free(writer->rrCount);
+    free(writer->rr);
+    free(writer->groups);
+    free(writer->scratch);
+    storage_backlog_free(&writer->backlog);
+    free(writer->directory);
+    free(writer->path);
+    free(writer);
+}
+
+/**
+ * @brief Create a new columnar file in the given directory.
+ */
+ColumnarWriter *columnar_writer_open(const char *directory, const char *mac_address, time_t start_time)
+{
+    StorageQueue *queue = storage_queue_shared();
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    ColumnarWriter *writer = calloc(1, sizeof(ColumnarWriter));
+    if (writer == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+
+    writer->directory = strdup(directory);
+    writer->startTime = start_time;
+    writer->queue = queue;
+    writer->rotateBytes = SESSION_ROTATE_BYTES;
+    writer->rotateSeconds = SESSION_ROTATE_S;
+    snprintf(writer->macAddress, sizeof(writer->macAddress), "%s", mac_address);
+
+    // Build the file name from the MAC address, replacing the separators.
+    snprintf(writer->fileMac, sizeof(writer->fileMac), "%s", mac_address);
+    for (char *c = writer->fileMac; *c; c++)
+    {
+        if (*c == ':')
+        {
+            *c = '-';
+        }
+    }
+
+    writer->time = malloc(COLUMNAR_GROUP_SAMPLES * sizeof(int32_t));
+    writer->bpm = malloc(COLUMNAR_GROUP_SAMPLES * sizeof(int32_t));
+    writer->flags = malloc(COLUMNAR_GROUP_SAMPLES);
+    writer->rrCount = malloc(COLUMNAR_GROUP_SAMPLES);
+    writer->rr = malloc(COLUMNAR_GROUP_SAMPLES * COLUMNAR_MAX_RR * sizeof(uint16_t));
+    writer->scratchSize = sizeof(SessionHeader) + sizeof(ColumnarGroupHeader) + COLUMNAR_GROUP_SAMPLES * COLUMNAR_MAX_SAMPLE_BYTES;
+    writer->scratch = malloc(writer->scratchSize);
+
+    if (open_columnar_file(writer, start_time) != 0)
+    {
+        free_writer(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+/**
+ * @brief Change the size and time after which the writer moves on to a new file.
+ */
+void columnar_writer_set_rotation(ColumnarWriter *writer, int64_t max_bytes, int64_t max_seconds)
+{
+    writer->rotateBytes = max_bytes;
+    writer->rotateSeconds = max_seconds;
+}
+
+/**
+ * @brief Hand bytes over to the queue at an offset of the file, all of them or none.
+ * @return 0 on success, -1 if there are not enough free blocks.
+ */
+static int submit_range(ColumnarWriter *writer, const uint8_t *data, size_t size, off_t offset)
+{
+    StorageBuffer *blocks[STORAGE_QUEUE_DEPTH];
+    size_t count = (size + STORAGE_BLOCK_SIZE - 1) / STORAGE_BLOCK_SIZE;
+    if (count > STORAGE_QUEUE_DEPTH)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        blocks[i] = storage_buffer_take(writer->queue);
+        if (blocks[i] == NULL)
+        {
+            while (i > 0)
+            {
+                storage_buffer_release(writer->queue, blocks[--i]);
+            }
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t begin = i * STORAGE_BLOCK_SIZE;
+        size_t length = size - begin < STORAGE_BLOCK_SIZE ? size - begin : STORAGE_BLOCK_SIZE;
+        memcpy(blocks[i]->data, data + begin, length);
+        blocks[i]->length = length;
+
+        writer->blocks++;
+        storage_buffer_submit(writer->queue, blocks[i], writer->file, offset + begin,
+                              writer->blocks % SESSION_SYNC_BLOCKS == 0);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write bytes straight to the page cache, when they cannot wait for free blocks.
+ * @return 0 on success, -1 on error.
+ */
+static int write_direct(ColumnarWriter *writer, const uint8_t *data, size_t size, off_t offset)
+{
+    if (pwrite(writer->file->fd, data, size, offset) != (ssize_t)size)
+    {
+        fprintf(stderr, "Error: could not write to %s\n", writer->path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Encode the current row group column by column and submit it.
+ */
+static void flush_group(ColumnarWriter *writer)
+{
+    if (writer->count == 0)
+    {
+        return;
+    }
+
+    // The header goes at the beginning of the first group of a file.
+    size_t size = 0;
+    if (writer->offset == 0)
+    {
+        SessionHeader *header = (SessionHeader *)writer->scratch;
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, COLUMNAR_MAGIC, sizeof(header->magic));
+        header->version = COLUMNAR_VERSION;
+        header->startTime = writer->fileStart;
+        snprintf(header->macAddress, sizeof(header->macAddress), "%s", writer->macAddress);
+        size = sizeof(SessionHeader);
+    }
+
+    ColumnarGroupHeader group;
+    memset(&group, 0, sizeof(group));
+    memcpy(group.magic, COLUMNAR_GROUP_MAGIC, sizeof(group.magic));
+    group.group.count = (uint32_t)writer->count;
+    size_t group_offset = size;
+    size += sizeof(group);
+
+    for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+    {
+        ColumnarChunk *chunk = &group.group.chunks[column];
+        uint8_t *out = writer->scratch + size;
+        size_t chunk_size = 0;
+
+        switch (column)
+        {
+        case COLUMNAR_TIME:
+            chunk_size = encode_times(writer->time, writer->count, out, chunk);
+            break;
+        case COLUMNAR_BPM:
+            chunk_size = encode_deltas(writer->bpm, writer->count, out, chunk);
+            break;
+        case COLUMNAR_FLAGS:
+            chunk_size = encode_flags(writer->flags, writer->count, out, chunk);
+            break;
+        case COLUMNAR_RR:
+            chunk_size = encode_rr(writer->rrCount, writer->count, writer->rr, writer->rrValues, out, chunk);
+            break;
+        }
+
+        chunk->offset = writer->offset + size;
+        chunk->size = (uint32_t)chunk_size;
+        chunk->checksum = codec_crc32(0, out, chunk_size);
+        size += chunk_size;
+    }
+
+    group.checksum = codec_crc32(0, (const uint8_t *)&group.group, sizeof(group.group));
+    memcpy(writer->scratch + group_offset, &group, sizeof(group));
+
+    if (writer->groupCount == writer->groupCapacity)
+    {
+        size_t capacity = writer->groupCapacity ? 2 * writer->groupCapacity : 64;
+        ColumnarGroup *groups = realloc(writer->groups, capacity * sizeof(ColumnarGroup));
+        if (groups == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            writer->dropped += writer->count;
+            writer->count = 0;
+            writer->rrValues = 0;
+            return;
+        }
+        writer->groups = groups;
+        writer->groupCapacity = capacity;
+    }
+
+    // The groups are written in file order: this one waits if earlier ones are waiting.
+    if (storage_backlog_submit(writer->queue, &writer->backlog, writer->file, &writer->blocks, SESSION_SYNC_BLOCKS) != 0 ||
+        submit_range(writer, writer->scratch, size, writer->offset) != 0)
+    {
+        if (storage_backlog_keep(&writer->backlog, writer->scratch, size, writer->offset) != 0)
+        {
+            // The group is not in the file, the next one takes its place.
+            if (writer->dropped == 0)
+            {
+                fprintf(stderr, "Warning: columnar writes to %s are falling behind, dropping samples\n", writer->path);
+            }
+            writer->dropped += writer->count;
+            writer->count = 0;
+            writer->rrValues = 0;
+            return;
+        }
+        if (writer->delayed++ == 0)
+        {
+            fprintf(stderr, "Warning: columnar writes to %s are falling behind, delaying row groups\n", writer->path);
+        }
+    }
+    writer->groups[writer->groupCount++] = group.group;
+    writer->offset += size;
+
+    writer->count = 0;
+    writer->rrValues = 0;
+}
+
+/**
+ * @brief Write the last row group and the footer, then sync and close the file in the background.
+ *
+ * The groups still waiting for free blocks and the footer go straight to the page cache
+ * with pwrite, as they may not fit in the free blocks. The final sync of the queue makes
+ * them durable with the rest of the file.
+ */
+static void close_columnar_file(ColumnarWriter *writer)
+{
+    flush_group(writer);
+
+    int status = 0;
+    if (storage_backlog_submit(writer->queue, &writer->backlog, writer->file, &writer->blocks, SESSION_SYNC_BLOCKS) != 0)
+    {
+        status |= storage_backlog_write(&writer->backlog, writer->file);
+    }
+
+    if (writer->offset == 0)
+    {
+        SessionHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, COLUMNAR_MAGIC, sizeof(header.magic));
+        header.version = COLUMNAR_VERSION;
+        header.startTime = writer->fileStart;
+        snprintf(header.macAddress, sizeof(header.macAddress), "%s", writer->macAddress);
+        status |= write_direct(writer, (const uint8_t *)&header, sizeof(header), 0);
+        writer->offset = sizeof(SessionHeader);
+    }
+
+    size_t footer_size = writer->groupCount * sizeof(ColumnarGroup);
+    ColumnarTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.footerOffset = writer->offset;
+    trailer.groupCount = (uint32_t)writer->groupCount;
+    trailer.checksum = codec_crc32(0, (const uint8_t *)writer->groups, footer_size);
+    trailer.version = COLUMNAR_VERSION;
+    memcpy(trailer.magic, COLUMNAR_MAGIC, sizeof(trailer.magic));
+
+    if (footer_size > 0)
+    {
+        status |= write_direct(writer, (const uint8_t *)writer->groups, footer_size, writer->offset);
+    }
+    status |= write_direct(writer, (const uint8_t *)&trailer, sizeof(trailer), writer->offset + footer_size);
+    if (status)
+    {
+        fprintf(stderr, "Error: could not write the footer of %s\n", writer->path);
+    }
+
+    storage_file_close(writer->queue, writer->file, 0);
+    writer->file = NULL;
+}
+
+/**
+ * @brief Append one sample.
+ */
+void columnar_writer_append(ColumnarWriter *writer, int32_t time, int32_t bpm, uint8_t flags, const uint16_t *rr, int rr_count)
+{
+    // Retry the groups that found no free block, the disk may have caught up.
+    if (writer->backlog.size > 0)
+    {
+        storage_backlog_submit(writer->queue, &writer->backlog, writer->file, &writer->blocks, SESSION_SYNC_BLOCKS);
+    }
+
+    // Move on to a new file once the current one is large or old enough.
+    int64_t file_time = writer->startTime + time - writer->fileStart;
+    if (writer->file != NULL && writer->fileRecords > 0 &&
+        ((int64_t)writer->offset >= writer->rotateBytes || file_time >= writer->rotateSeconds))
+    {
+        close_columnar_file(writer);
+        writer->rotations++;
+    }
+    if (writer->file == NULL)
+    {
+        if (open_columnar_file(writer, writer->startTime + time) != 0)
+        {
+            writer->dropped++;
+            return;
+        }
+        file_time = 0;
+    }
+
+    if (rr_count > COLUMNAR_MAX_RR)
+    {
+        rr_count = COLUMNAR_MAX_RR;
+    }
+
+    // Times are relative to the start of the file.
+    size_t i = writer->count++;
+    writer->time[i] = (int32_t)file_time;
+    writer->bpm[i] = bpm;
+    writer->flags[i] = flags;
+    writer->rrCount[i] = (uint8_t)(rr_count > 0 ? rr_count : 0);
+    for (int j = 0; j < rr_count; j++)
+    {
+        writer->rr[writer->rrValues++] = rr[j];
+    }
+    writer->recordCount++;
+    writer->fileRecords++;
+
+    if (writer->count == COLUMNAR_GROUP_SAMPLES)
+    {
+        flush_group(writer);
+    }
+}
+
+/**
+ * @brief Write the last row group and the footer, then sync and close the file in the background.
+ */
+void columnar_writer_close(ColumnarWriter *writer)
+{
+    if (writer == NULL)
+    {
+        return;
+    }
+
+    if (writer->file != NULL)
+    {
+        close_columnar_file(writer);
+    }
+
+    if (writer->dropped > 0)
+    {
+        fprintf(stderr, "Warning: %zu samples could not be written to %s\n", writer->dropped, writer->path);
+    }
+
+    free_writer(writer);
+}
+
+/**
+ * @brief Check whether a file is a columnar file.
+ */
+int columnar_is_columnar(const char *path)
+{
+    char magic[4];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    int is_columnar = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, COLUMNAR_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+
+    return is_columnar;
+}
+
+/**
+ * @brief Find the row groups of a file without footer by walking their headers.
+ * @return The number of groups recovered, the walk stops at the first incomplete one.
+ */
+static size_t recover_groups(const uint8_t *map, size_t size, ColumnarGroup **groups)
+{
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t offset = sizeof(SessionHeader);
+    *groups = NULL;
+
+    while (size - offset >= sizeof(ColumnarGroupHeader))
+    {
+        ColumnarGroupHeader header;
+        memcpy(&header, map + offset, sizeof(header));
+        if (memcmp(header.magic, COLUMNAR_GROUP_MAGIC, sizeof(header.magic)) != 0 ||
+            codec_crc32(0, (const uint8_t *)&header.group, sizeof(header.group)) != header.checksum)
+        {
+            break;
+        }
+
+        // The chunks follow the header back to back, a chunk not fully written ends the walk.
+        size_t end = offset + sizeof(header);
+        int column;
+        for (column = 0; column < COLUMNAR_COLUMNS; column++)
+        {
+            const ColumnarChunk *chunk = &header.group.chunks[column];
+            if (chunk->offset != end || chunk->size > size - end || codec_crc32(0, map + end, chunk->size) != chunk->checksum)
+            {
+                break;
+            }
+            end += chunk->size;
+        }
+        if (column < COLUMNAR_COLUMNS)
+        {
+            break;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            ColumnarGroup *grown = realloc(*groups, capacity * sizeof(ColumnarGroup));
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                break;
+            }
+            *groups = grown;
+        }
+        (*groups)[count++] = header.group;
+        offset = end;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Memory-map a columnar file and load its footer.
+ */
+int columnar_file_open(const char *path, ColumnarFile *file)
+{
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not open columnar file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionHeader))
+    {
+        fprintf(stderr, "Error: %s is not a columnar file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: could not map columnar file %s\n", path);
+        return -1;
+    }
+
+    // Only the pages of the chunks read are wanted, no read ahead into the other columns.
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    const SessionHeader *header = (const SessionHeader *)map;
+    if (memcmp(header->magic, COLUMNAR_MAGIC, sizeof(header->magic)) != 0 || header->version != COLUMNAR_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a columnar file\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    ColumnarTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    size_t footer_end = 0;
+    size_t footer_size = 0;
+    if ((size_t)st.st_size >= sizeof(SessionHeader) + sizeof(trailer))
+    {
+        memcpy(&trailer, (const uint8_t *)map + st.st_size - sizeof(trailer), sizeof(trailer));
+        footer_end = (size_t)st.st_size - sizeof(trailer);
+        footer_size = (size_t)trailer.groupCount * sizeof(ColumnarGroup);
+    }
+
+    if (memcmp(trailer.magic, COLUMNAR_MAGIC, sizeof(trailer.magic)) != 0 || trailer.version != COLUMNAR_VERSION ||
+        trailer.footerOffset < sizeof(SessionHeader) || trailer.footerOffset > footer_end ||
+        footer_end - trailer.footerOffset != footer_size ||
+        codec_crc32(0, (const uint8_t *)map + trailer.footerOffset, footer_size) != trailer.checksum)
+    {
+        // Not closed, or still written: read the groups written so far.
+        file->groupCount = recover_groups(map, st.st_size, &file->groups);
+        fprintf(stderr, "Warning: %s has no footer, %zu row groups recovered\n", path, file->groupCount);
+    }
+    else
+    {
+        // The footer is not aligned, copy it out of the mapping.
+        file->groups = malloc(footer_size > 0 ? footer_size : 1);
+        memcpy(file->groups, (const uint8_t *)map + trailer.footerOffset, footer_size);
+        file->groupCount = trailer.groupCount;
+
+        for (size_t i = 0; i < file->groupCount; i++)
+        {
+            for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+            {
+                const ColumnarChunk *chunk = &file->groups[i].chunks[column];
+                if (chunk->offset < sizeof(SessionHeader) || chunk->offset > trailer.footerOffset ||
+                    chunk->size > trailer.footerOffset - chunk->offset)
+                {
+                    fprintf(stderr, "Error: %s has a chunk outside of the file\n", path);
+                    free(file->groups);
+                    munmap(map, st.st_size);
+                    memset(file, 0, sizeof(*file));
+                    return -1;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < file->groupCount; i++)
+    {
+        file->recordCount += file->groups[i].count;
+    }
+
+    file->map = map;
+    file->mapSize = st.st_size;
+    file->header = header;
+
+    return 0;
+}
+
+/**
+ * @brief Unmap a columnar file.
+ */
+void columnar_file_close(ColumnarFile *file)
+{
+    if (file->map != NULL)
+    {
+        munmap((void *)file->map, file->mapSize);
+    }
+    free(file->groups);
+    memset(file, 0, sizeof(*file));
+}
+
+/**
+ * @brief Decode one chunk into its column.
+ * @return 0 on success, -1 if the chunk is corrupted.
+ */
+static int decode_chunk(const ColumnarFile *file, const ColumnarGroup *group, int column, ColumnarColumns *out)
+{
+    const ColumnarChunk *chunk = &group->chunks[column];
+    const uint8_t *in = file->map + chunk->offset;
+    size_t size = chunk->size;
+    size_t pos = 0;
+    uint64_t value;
+
+    if (codec_crc32(0, in, size) != chunk->checksum)
+    {
+        return -1;
+    }
+
+    switch (column)
+    {
+    case COLUMNAR_TIME:
+    {
+        int64_t previous = 0;
+        int64_t previous_delta = 0;
+        for (size_t i = 0; i < group->count; i++)
+        {
+            if (get_varint(in, size, &pos, &value) != 0)
+            {
+                return -1;
+            }
+            previous_delta += zigzag_decode(value);
+            previous += previous_delta;
+            out->time[i] = (int32_t)previous;
+        }
+        break;
+    }
+    case COLUMNAR_BPM:
+    {
+        int64_t previous = 0;
+        for (size_t i = 0; i < group->count; i++)
+        {
+            if (get_varint(in, size, &pos, &value) != 0)
+            {
+                return -1;
+            }
+            previous += zigzag_decode(value);
+            out->bpm[i] = (int32_t)previous;
+        }
+        break;
+    }
+    case COLUMNAR_FLAGS:
+        return get_runs(in, size, &pos, out->flags, group->count);
+    case COLUMNAR_RR:
+    {
+        if (get_runs(in, size, &pos, out->rrCount, group->count) != 0)
+        {
+            return -1;
+        }
+
+        size_t values = 0;
+        for (size_t i = 0; i < group->count; i++)
+        {
+            values += out->rrCount[i];
+        }
+        if (values != chunk->values)
+        {
+            return -1;
+        }
+        if (values > out->rrCapacity)
+        {
+            out->rrCapacity = values;
+            out->rr = realloc(out->rr, values * sizeof(uint16_t));
+        }
+
+        int64_t previous = 0;
+        for (size_t i = 0; i < values; i++)
+        {
+            if (get_varint(in, size, &pos, &value) != 0)
+            {
+                return -1;
+            }
+            previous += zigzag_decode(value);
+            out->rr[i] = (uint16_t)previous;
+        }
+        out->rrValues = values;
+        break;
+    }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decode the selected columns of a row group.
+ */
+int columnar_read_group(const ColumnarFile *file, size_t group, unsigned columns, ColumnarColumns *out)
+{
+    const ColumnarGroup *row_group = &file->groups[group];
+
+    if (row_group->count > out->capacity)
+    {
+        out->capacity = row_group->count;
+        out->time = realloc(out->time, out->capacity * sizeof(int32_t));
+        out->bpm = realloc(out->bpm, out->capacity * sizeof(int32_t));
+        out->flags = realloc(out->flags, out->capacity);
+        out->rrCount = realloc(out->rrCount, out->capacity);
+    }
+    out->count = row_group->count;
+    out->rrValues = 0;
+
+    for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+    {
+        if ((columns & COLUMNAR_SELECT(column)) && decode_chunk(file, row_group, column, out) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Free the arrays of decoded columns.
+ */
+void columnar_columns_free(ColumnarColumns *columns)
+{
+    free(columns->time);
+    free(columns->bpm);
+    free(columns->flags);
+    free(columns->rrCount);
+    free(columns->rr);
+    memset(columns, 0, sizeof(*columns));
+}
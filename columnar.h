@@ -0,0 +1,308 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile columnar.h
+ * @author Daniel Oliveira
+ * @brief Columnar session files: one encoded chunk per column and row group, indexed by a footer.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "session.h"
+#include "storage.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define COLUMNAR_MAGIC "MBHC"
+#define COLUMNAR_GROUP_MAGIC "MBHG"
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_EXTENSION ".hrc"
+
+// Number of samples of a row group, the unit of the chunks, statistics and skipping.
+// Even fully incompressible, a group fits in well under half of the StorageQueue blocks.
+#define COLUMNAR_GROUP_SAMPLES 2048
+
+// Maximum number of RR intervals of one sample, as in a heart rate measurement notification.
+#define COLUMNAR_MAX_RR 9
+
+// Flags of a sample: the quality of the artifact filter (SampleQuality) in the low bits, then the wear.
+#define COLUMNAR_QUALITY_MASK 0x03
+#define COLUMNAR_FLAG_CONTACT 0x04
+#define COLUMNAR_FLAG_OFF_WRIST 0x08
+#define COLUMNAR_FLAG_IGNORED 0x10
+
+/**
+ * @brief Columns of a columnar file.
+ */
+typedef enum
+{
+    COLUMNAR_TIME = 0,
+    COLUMNAR_BPM,
+    COLUMNAR_FLAGS,
+    COLUMNAR_RR,
+    COLUMNAR_COLUMNS
+} ColumnarColumn;
+
+// Bit of a column in a projection.
+#define COLUMNAR_SELECT(column) (1u << (column))
+#define COLUMNAR_SELECT_ALL ((1u << COLUMNAR_COLUMNS) - 1)
+
+/**
+ * @brief Encoding of a column chunk.
+ */
+typedef enum
+{
+    // Zigzag varints of the differences between consecutive deltas (times).
+    COLUMNAR_DELTA_OF_DELTA = 1,
+    // Zigzag varints of the differences between consecutive values (heart rate).
+    COLUMNAR_DELTA = 2,
+    // Runs of equal bytes: value, then the run length as a varint (flags).
+    COLUMNAR_RUN_LENGTH = 3,
+    // Run-length RR interval counts per sample, then the delta encoded intervals.
+    COLUMNAR_RR_LISTS = 4
+} ColumnarEncoding;
+
+/**
+ * @brief Location and statistics of one column chunk, in the footer.
+ *
+ * min, max and sum are those of the values (of the RR intervals, for the RR chunk). For
+ * the flags, min holds the bits set in every sample, max the bits set in any sample and
+ * sum the number of samples with any bit set, so groups without a given flag are skipped.
+ */
+typedef struct
+{
+    uint64_t offset;
+    int64_t sum;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t encoding;
+    uint32_t values;
+    int32_t min;
+    int32_t max;
+} ColumnarChunk;
+
+/**
+ * @brief A row group in the footer: its samples and one chunk per column.
+ */
+typedef struct
+{
+    uint32_t count;
+    uint32_t reserved;
+    ColumnarChunk chunks[COLUMNAR_COLUMNS];
+} ColumnarGroup;
+
+/**
+ * @brief Header written before the chunks of each row group, a copy of its footer entry.
+ *
+ * The chunks of the group follow it back to back, so a file whose footer was never
+ * written can be recovered by walking the group headers.
+ */
+typedef struct
+{
+    char magic[4];
+    uint32_t checksum;
+    ColumnarGroup group;
+} ColumnarGroupHeader;
+
+/**
+ * @brief Trailer at the very end of the file, locating the footer.
+ */
+typedef struct
+{
+    uint64_t footerOffset;
+    uint32_t groupCount;
+    uint32_t checksum;
+    uint32_t version;
+    char magic[4];
+} ColumnarTrailer;
+
+/**
+ * @brief Writer of a columnar session file, fed sample by sample.
+ *
+ * The samples of a row group are kept in columns in memory. When the group is full it is
+ * encoded, column by column, into blocks of the shared StorageQueue written
+ * asynchronously, as for the session files, so appending never waits for the disk. A
+ * group that finds no free block keeps its place in the file and is submitted again on
+ * the next append, or written directly on close. The footer and trailer are written on
+ * close. A file whose writer was not closed (e.g. after a crash) has no footer, its
+ * groups are recovered from their headers when it is opened.
+ *
+ * The files are rotated as the session files, after SESSION_ROTATE_BYTES or
+ * SESSION_ROTATE_S, and locked while written. Times are relative to the start time of
+ * the header of each file, as in session files.
+ */
+typedef struct
+{
+    char *directory;
+    char macAddress[24];
+    char fileMac[24];
+    int64_t startTime;
+
+    // Current file, its start time (epoch seconds) and records.
+    char *path;
+    StorageQueue *queue;
+    StorageFile *file;
+    int64_t fileStart;
+    size_t fileRecords;
+    off_t offset;
+    int64_t blocks;
+
+    int64_t rotateBytes;
+    int64_t rotateSeconds;
+    int rotations;
+
+    // Columns of the current row group.
+    size_t count;
+    int32_t *time;
+    int32_t *bpm;
+    uint8_t *flags;
+    uint8_t *rrCount;
+    uint16_t *rr;
+    size_t rrValues;
+
+    // Footer built so far, and the encoding scratch buffer.
+    ColumnarGroup *groups;
+    size_t groupCount;
+    size_t groupCapacity;
+    uint8_t *scratch;
+    size_t scratchSize;
+
+    // Encoded groups waiting for free blocks, in file order.
+    StorageBacklog backlog;
+
+    size_t recordCount;
+
+    // Row groups that had to wait for free blocks.
+    size_t delayed;
+
+    // Records lost because a file could not be created or the backlog was full.
+    size_t dropped;
+} ColumnarWriter;
+
+/**
+ * @brief A memory-mapped columnar file.
+ */
+typedef struct
+{
+    const SessionHeader *header;
+    ColumnarGroup *groups;
+    size_t groupCount;
+    size_t recordCount;
+    const uint8_t *map;
+    size_t mapSize;
+} ColumnarFile;
+
+/**
+ * @brief Decoded columns of a row group. Only the selected columns are filled.
+ */
+typedef struct
+{
+    size_t count;
+    int32_t *time;
+    int32_t *bpm;
+    uint8_t *flags;
+
+    // RR intervals (1/1024 s) of the group, rrCount[i] of them for sample i, in order.
+    uint8_t *rrCount;
+    uint16_t *rr;
+    size_t rrValues;
+
+    size_t capacity;
+    size_t rrCapacity;
+} ColumnarColumns;
+
+/**
+ * @brief Create a new columnar file in the given directory.
+ * @param directory The directory of the file.
+ * @param mac_address The MAC address of the band.
+ * @param start_time The start of the session (epoch seconds), sample times are relative to it.
+ * @return A pointer to the ColumnarWriter, or NULL if the file could not be created.
+ *
+ * The file is named <MAC>_<start time>.hrc, the next ones after the time of their first sample.
+ */
+ColumnarWriter *columnar_writer_open(const char *directory, const char *mac_address, time_t start_time);
+
+/**
+ * @brief Change the size and time after which the writer moves on to a new file.
+ * @param writer The ColumnarWriter instance.
+ * @param max_bytes The size of a file, in bytes.
+ * @param max_seconds The time covered by a file, in seconds.
+ */
+void columnar_writer_set_rotation(ColumnarWriter *writer, int64_t max_bytes, int64_t max_seconds);
+
+/**
+ * @brief Append one sample.
+ * @param writer The ColumnarWriter instance.
+ * @param time The sample time, in seconds since the start of the session.
+ * @param bpm The heart rate value as received.
+ * @param flags The quality and wear flags (COLUMNAR_QUALITY_MASK and COLUMNAR_FLAG_*).
+ * @param rr The RR intervals received with the value, in 1/1024 s.
+ * @param rr_count The number of RR intervals, up to COLUMNAR_MAX_RR.
+ */
+void columnar_writer_append(ColumnarWriter *writer, int32_t time, int32_t bpm, uint8_t flags, const uint16_t *rr, int rr_count);
+
+/**
+ * @brief Write the last row group and the footer, then sync and close the file in the background.
+ * @param writer The ColumnarWriter instance.
+ */
+void columnar_writer_close(ColumnarWriter *writer);
+
+/**
+ * @brief Check whether a file is a columnar file.
+ * @param path The path of the file.
+ * @return 1 if the file starts with the columnar magic, 0 otherwise.
+ */
+int columnar_is_columnar(const char *path);
+
+/**
+ * @brief Memory-map a columnar file and load its footer.
+ * @param path The path of the file.
+ * @param file The ColumnarFile to fill.
+ * @return 0 on success, -1 if the file could not be mapped or is not a columnar file.
+ *
+ * Only the header and footer are read here. The mapping is advised as random access, so
+ * reading a chunk does not read ahead into the chunks of the other columns. A file
+ * without a valid footer, not closed or still written, is read up to its last complete
+ * row group, found by walking the group headers.
+ */
+int columnar_file_open(const char *path, ColumnarFile *file);
+
+/**
+ * @brief Unmap a columnar file.
+ * @param file The ColumnarFile instance.
+ */
+void columnar_file_close(ColumnarFile *file);
+
+/**
+ * @brief Decode the selected columns of a row group.
+ * @param file The ColumnarFile instance.
+ * @param group The index of the row group.
+ * @param columns The projection, a combination of COLUMNAR_SELECT bits.
+ * @param out The decoded columns, its arrays grown as needed. Zero it before first use.
+ * @return 0 on success, -1 if a selected chunk is corrupted.
+ *
+ * The chunks of the other columns are never touched.
+ */
+int columnar_read_group(const ColumnarFile *file, size_t group, unsigned columns, ColumnarColumns *out);
+
+/**
+ * @brief Free the arrays of decoded columns.
+ * @param columns The ColumnarColumns instance.
+ */
+void columnar_columns_free(ColumnarColumns *columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
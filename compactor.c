@@ -0,0 +1,838 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file compactor.c
+ * @author Daniel Oliveira
+ * @brief Retention and background compaction of the session files of a directory.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "compactor.h"
+#include "archive.h"
+#include "columnar.h"
+#include "rollup.h"
+
+// I/O priority class of the background thread (linux/ioprio.h is not always installed).
+#define COMPACT_IOPRIO_WHO_PROCESS 1
+#define COMPACT_IOPRIO_CLASS_IDLE 3
+#define COMPACT_IOPRIO_CLASS_SHIFT 13
+
+/**
+ * @brief A session, archive or columnar file found by a pass.
+ */
+typedef struct
+{
+    char *path;
+    int archive;
+    int columnar;
+    int64_t size;
+    SessionHeader header;
+    int64_t samples;
+    int64_t endTime;
+} CompactEntry;
+
+/**
+ * @brief Current monotonic time in seconds.
+ */
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Initialize a compactor.
+ */
+void compactor_init(Compactor *compactor, const char *directory, int64_t retention, int64_t rate_bytes)
+{
+    memset(compactor, 0, sizeof(*compactor));
+    compactor->directory = strdup(directory);
+    compactor->retention = retention;
+    compactor->rateBytes = rate_bytes;
+}
+
+/**
+ * @brief Account for the bytes read or written, and sleep as long as the pass is ahead of its budget.
+ * @return 0 to go on, -1 if the pass was asked to stop.
+ */
+static int throttle(Compactor *compactor, size_t bytes)
+{
+    compactor->passBytes += bytes;
+
+    if (compactor->rateBytes > 0)
+    {
+        double due = compactor->passStart + (double)compactor->passBytes / compactor->rateBytes;
+        double wait = due - now_seconds();
+        if (wait > 0)
+        {
+            compactor->throttled += wait;
+        }
+
+        // Sleep in short slices, so that a stop is not held up by a long wait.
+        while (wait > 0 && !compactor->stop)
+        {
+            double slice = wait < 0.1 ? wait : 0.1;
+            struct timespec pause = {0, (long)(slice * 1e9)};
+            nanosleep(&pause, NULL);
+            wait -= slice;
+        }
+    }
+
+    return compactor->stop ? -1 : 0;
+}
+
+/**
+ * @brief Whether a file ends with the given extension.
+ */
+static int has_extension(const char *name, const char *extension)
+{
+    size_t name_len = strlen(name);
+    size_t ext_len = strlen(extension);
+    return name_len > ext_len && strcmp(name + name_len - ext_len, extension) == 0;
+}
+
+/**
+ * @brief Whether a session writer still holds the file.
+ *
+ * The lock is only tested, never held, so the writer can always take it.
+ */
+static int is_locked(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 1;
+    }
+
+    int locked = flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    if (!locked)
+    {
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+
+    return locked;
+}
+
+/**
+ * @brief Read the header of a columnar file, and the number of samples and time of the newest one.
+ * @return 0 on success, -1 if this is not a columnar file.
+ */
+static int scan_columnar(CompactEntry *entry)
+{
+    ColumnarFile file;
+    if (entry->size < (int64_t)sizeof(SessionHeader) || columnar_file_open(entry->path, &file) != 0)
+    {
+        return -1;
+    }
+
+    // The time statistics of the row groups give the newest sample without decoding it.
+    entry->header = *file.header;
+    entry->samples = (int64_t)file.recordCount;
+    entry->endTime = file.header->startTime;
+    for (size_t i = 0; i < file.groupCount; i++)
+    {
+        int64_t end = file.header->startTime + file.groups[i].chunks[COLUMNAR_TIME].max;
+        entry->endTime = end > entry->endTime ? end : entry->endTime;
+    }
+
+    columnar_file_close(&file);
+    return 0;
+}
+
+/**
+ * @brief Read the header of a file, and the number of samples and time of the newest one.
+ * @return 0 on success, -1 if this is not a complete session or archive file.
+ */
+static int scan_entry(CompactEntry *entry)
+{
+    if (entry->columnar)
+    {
+        return scan_columnar(entry);
+    }
+
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int status = -1;
+    if (pread(fd, &entry->header, sizeof(SessionHeader), 0) != sizeof(SessionHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    entry->endTime = entry->header.startTime;
+
+    if (!entry->archive)
+    {
+        if (memcmp(entry->header.magic, SESSION_MAGIC, sizeof(entry->header.magic)) == 0 &&
+            entry->header.version == SESSION_VERSION)
+        {
+            // A partially written trailing record is ignored, as by the reader.
+            entry->samples = (entry->size - (int64_t)sizeof(SessionHeader)) / (int64_t)sizeof(SessionRecord);
+
+            SessionRecord last;
+            off_t offset = sizeof(SessionHeader) + (entry->samples - 1) * sizeof(SessionRecord);
+            if (entry->samples == 0)
+            {
+                status = 0;
+            }
+            else if (pread(fd, &last, sizeof(last), offset) == sizeof(last))
+            {
+                entry->endTime += last.time;
+                status = 0;
+            }
+        }
+    }
+    else if (memcmp(entry->header.magic, ARCHIVE_MAGIC, sizeof(entry->header.magic)) == 0 &&
+             entry->header.version == ARCHIVE_VERSION)
+    {
+        // Walk the block headers only: they hold the sample count and last time of each block.
+        off_t offset = sizeof(SessionHeader);
+        CodecBlockHeader block;
+        status = 0;
+
+        while (offset < entry->size)
+        {
+            if (pread(fd, &block, sizeof(block), offset) != sizeof(block) ||
+                offset + (off_t)sizeof(block) + block.payloadSize > entry->size)
+            {
+                status = -1;
+                break;
+            }
+            entry->samples += block.count;
+            entry->endTime = entry->header.startTime + block.lastTime;
+            offset += sizeof(block) + block.payloadSize;
+        }
+    }
+
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief Read a whole file in throttled chunks.
+ * @return A buffer holding the file, NULL on error or if the pass was asked to stop.
+ */
+static uint8_t *read_file(Compactor *compactor, const CompactEntry *entry)
+{
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not open %s\n", entry->path);
+        return NULL;
+    }
+
+    uint8_t *data = malloc(entry->size > 0 ? entry->size : 1);
+    int64_t done = 0;
+
+    while (done < entry->size)
+    {
+        size_t chunk = entry->size - done < COMPACT_CHUNK_BYTES ? entry->size - done : COMPACT_CHUNK_BYTES;
+        ssize_t n = pread(fd, data + done, chunk, done);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Error: could not read %s\n", entry->path);
+            break;
+        }
+        done += n;
+        compactor->bytesRead += n;
+
+        if (throttle(compactor, n) != 0)
+        {
+            break;
+        }
+    }
+    close(fd);
+
+    if (done < entry->size || compactor->stop)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * @brief Append the samples of a file, with times relative to base.
+ * @return 0 on success, -1 if the file could not be read or a block is corrupt.
+ */
+static int load_records(Compactor *compactor, const CompactEntry *entry, int64_t base, SessionRecord *records, size_t *count, size_t capacity)
+{
+    uint8_t *data = read_file(compactor, entry);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    size_t first = *count;
+    int status = 0;
+
+    if (!entry->archive)
+    {
+        size_t samples = entry->samples;
+        if (*count + samples > capacity)
+        {
+            samples = capacity - *count;
+        }
+        memcpy(records + *count, data + sizeof(SessionHeader), samples * sizeof(SessionRecord));
+        *count += samples;
+    }
+    else
+    {
+        // Walk the blocks in memory, as in a mapped archive.
+        ArchiveFile archive;
+        memset(&archive, 0, sizeof(archive));
+        archive.data = data + sizeof(SessionHeader);
+        archive.dataSize = entry->size - sizeof(SessionHeader);
+
+        size_t offset = 0;
+        CodecBlockHeader header;
+        const uint8_t *block;
+        size_t size;
+        int next;
+
+        while ((next = archive_file_next_block(&archive, &offset, &header, &block, &size)) == 1)
+        {
+            int decoded = codec_decode_block(block, size, records + *count, capacity - *count);
+            if (decoded < 0)
+            {
+                next = -1;
+                break;
+            }
+            *count += decoded;
+        }
+
+        if (next < 0)
+        {
+            fprintf(stderr, "Error: %s has a corrupt block, it is not compacted\n", entry->path);
+            status = -1;
+        }
+    }
+    free(data);
+
+    // Rebase the times from the start of the file to the start of the merged archive.
+    int64_t shift = entry->header.startTime - base;
+    for (size_t i = first; i < *count; i++)
+    {
+        records[i].time = (int32_t)(records[i].time + shift);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Order samples by time, then by heart rate.
+ */
+static int compare_records(const void *a, const void *b)
+{
+    const SessionRecord *ra = a;
+    const SessionRecord *rb = b;
+
+    if (ra->time != rb->time)
+    {
+        return ra->time < rb->time ? -1 : 1;
+    }
+    return (ra->bpm > rb->bpm) - (ra->bpm < rb->bpm);
+}
+
+/**
+ * @brief Order files by band, then by start time.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const CompactEntry *ea = *(const CompactEntry *const *)a;
+    const CompactEntry *eb = *(const CompactEntry *const *)b;
+
+    int mac = strcmp(ea->header.macAddress, eb->header.macAddress);
+    if (mac != 0)
+    {
+        return mac;
+    }
+    return (ea->header.startTime > eb->header.startTime) - (ea->header.startTime < eb->header.startTime);
+}
+
+/**
+ * @brief Delete a session or archive file and its rollup sidecar.
+ * @return 0 if the file was deleted, -1 otherwise.
+ */
+static int remove_file(const char *path)
+{
+    char *sidecar = rollups_sidecar_path(path);
+    unlink(sidecar);
+    free(sidecar);
+    return unlink(path);
+}
+
+/**
+ * @brief Write the rollup sidecar of a merged archive, so downsampling it reads no samples.
+ */
+static void write_rollups(const char *path, int64_t base, const SessionRecord *records, size_t count)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return;
+    }
+
+    Rollups rollups;
+    rollups_init(&rollups, base);
+    for (size_t i = 0; i < count; i++)
+    {
+        rollups_add(&rollups, records[i].time, records[i].bpm);
+    }
+
+    char *sidecar = rollups_sidecar_path(path);
+    rollups_save(&rollups, sidecar, st.st_size);
+    free(sidecar);
+    rollups_free(&rollups);
+}
+
+/**
+ * @brief Encode the samples into a new archive: temporary file, sync, then rename.
+ * @return 0 on success, -1 on error or if the pass was asked to stop.
+ */
+static int write_archive(Compactor *compactor, const char *path, const char *mac_address, int64_t base,
+                         const SessionRecord *records, size_t count)
+{
+    size_t tmp_len = strlen(path) + strlen(COMPACT_TEMP_EXTENSION) + 1;
+    char *tmp_path = malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s" COMPACT_TEMP_EXTENSION, path);
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL || archive_write_header(out, mac_address, base) != 0)
+    {
+        fprintf(stderr, "Error: could not create archive file %s\n", tmp_path);
+        if (out)
+        {
+            fclose(out);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return -1;
+    }
+    compactor->bytesWritten += sizeof(SessionHeader);
+
+    // Each block header carries the time range and heart rate summary of its samples.
+    uint8_t *buffer = malloc(codec_block_bound(ARCHIVE_BLOCK_SAMPLES));
+    int status = 0;
+
+    for (size_t i = 0; i < count && status == 0; i += ARCHIVE_BLOCK_SAMPLES)
+    {
+        size_t samples = count - i < ARCHIVE_BLOCK_SAMPLES ? count - i : ARCHIVE_BLOCK_SAMPLES;
+        size_t size = codec_encode_block(records + i, samples, buffer);
+
+        if (fwrite(buffer, size, 1, out) != 1)
+        {
+            status = -1;
+            break;
+        }
+        compactor->bytesWritten += size;
+        status = throttle(compactor, size);
+    }
+    free(buffer);
+
+    if (status == 0 && (fflush(out) != 0 || fsync(fileno(out)) != 0))
+    {
+        status = -1;
+    }
+    if (fclose(out) != 0)
+    {
+        status = -1;
+    }
+
+    if (status == 0 && rename(tmp_path, path) != 0)
+    {
+        status = -1;
+    }
+    if (status != 0)
+    {
+        if (!compactor->stop)
+        {
+            fprintf(stderr, "Error: could not write archive file %s\n", path);
+        }
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+
+    // Make the rename durable before the inputs are deleted.
+    if (status == 0)
+    {
+        int dir = open(compactor->directory, O_RDONLY | O_DIRECTORY);
+        if (dir >= 0)
+        {
+            fsync(dir);
+            close(dir);
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Name of the merged archive: the band and its first start time, not taken by a file outside the batch.
+ */
+static char *archive_name(const Compactor *compactor, CompactEntry **batch, int count)
+{
+    char mac[sizeof(batch[0]->header.macAddress)];
+    snprintf(mac, sizeof(mac), "%s", batch[0]->header.macAddress);
+    for (char *c = mac; *c; c++)
+    {
+        if (*c == ':')
+        {
+            *c = '-';
+        }
+    }
+
+    size_t path_len = strlen(compactor->directory) + strlen(mac) + 48;
+    char *path = malloc(path_len);
+
+    for (int attempt = 0;; attempt++)
+    {
+        if (attempt == 0)
+        {
+            snprintf(path, path_len, "%s/%s_%lld%s", compactor->directory, mac, (long long)batch[0]->header.startTime,
+                     ARCHIVE_EXTENSION);
+        }
+        else
+        {
+            snprintf(path, path_len, "%s/%s_%lld-%d%s", compactor->directory, mac,
+                     (long long)batch[0]->header.startTime, attempt, ARCHIVE_EXTENSION);
+        }
+
+        int taken = access(path, F_OK) == 0;
+        for (int i = 0; i < count && taken; i++)
+        {
+            if (strcmp(batch[i]->path, path) == 0)
+            {
+                taken = 0;
+            }
+        }
+        if (!taken)
+        {
+            return path;
+        }
+    }
+}
+
+/**
+ * @brief Merge the files of a band into one sorted archive, then delete them.
+ * @return 0 on success, -1 if nothing was changed.
+ */
+static int merge_batch(Compactor *compactor, CompactEntry **batch, int count)
+{
+    size_t capacity = 0;
+    int64_t base = batch[0]->header.startTime;
+    for (int i = 0; i < count; i++)
+    {
+        capacity += batch[i]->samples;
+    }
+
+    SessionRecord *records = malloc((capacity > 0 ? capacity : 1) * sizeof(SessionRecord));
+    if (records == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return -1;
+    }
+
+    size_t loaded = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (load_records(compactor, batch[i], base, records, &loaded, capacity) != 0)
+        {
+            free(records);
+            return -1;
+        }
+    }
+
+    // Overlapping sessions are interleaved, and samples stored twice are kept once.
+    qsort(records, loaded, sizeof(SessionRecord), compare_records);
+    size_t unique = 0;
+    for (size_t i = 0; i < loaded; i++)
+    {
+        if (unique == 0 || compare_records(&records[unique - 1], &records[i]) != 0)
+        {
+            records[unique++] = records[i];
+        }
+    }
+
+    char *path = archive_name(compactor, batch, count);
+    int status = write_archive(compactor, path, batch[0]->header.macAddress, base, records, unique);
+
+    if (status == 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (strcmp(batch[i]->path, path) != 0)
+            {
+                remove_file(batch[i]->path);
+            }
+        }
+        write_rollups(path, base, records, unique);
+        compactor->merged += count;
+        compactor->archives++;
+        compactor->samples += unique;
+        compactor->duplicates += loaded - unique;
+        printf("Compaction: merged %d files of %s into %s (%zu samples) \n", count, batch[0]->header.macAddress, path,
+               unique);
+    }
+    free(records);
+    free(path);
+
+    return status;
+}
+
+/**
+ * @brief Merge the batch if it is worth it: several files, or one session file to compress.
+ */
+static int flush_batch(Compactor *compactor, CompactEntry **batch, int count)
+{
+    if (count > 1 || (count == 1 && !batch[0]->archive))
+    {
+        return merge_batch(compactor, batch, count);
+    }
+    return 0;
+}
+
+/**
+ * @brief Run a pass in the calling thread.
+ */
+int compactor_run(Compactor *compactor, time_t now)
+{
+    DIR *dir = opendir(compactor->directory);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Error: could not open session directory %s\n", compactor->directory);
+        return -1;
+    }
+
+    compactor->passStart = now_seconds();
+    compactor->passBytes = 0;
+
+    CompactEntry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent *dirent;
+
+    while ((dirent = readdir(dir)) != NULL && !compactor->stop)
+    {
+        int archive = has_extension(dirent->d_name, ARCHIVE_EXTENSION);
+        int columnar = has_extension(dirent->d_name, COLUMNAR_EXTENSION);
+        int temporary = has_extension(dirent->d_name, COMPACT_TEMP_EXTENSION);
+        if (dirent->d_name[0] == '.' ||
+            (!archive && !columnar && !temporary && !has_extension(dirent->d_name, SESSION_EXTENSION)))
+        {
+            continue;
+        }
+
+        size_t path_len = strlen(compactor->directory) + strlen(dirent->d_name) + 2;
+        char *path = malloc(path_len);
+        snprintf(path, path_len, "%s/%s", compactor->directory, dirent->d_name);
+
+        // Leave alone the files still written, and the ones written by hand just now.
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime > now - COMPACT_SETTLE_S || is_locked(path))
+        {
+            free(path);
+            continue;
+        }
+
+        // A temporary archive left by a merge interrupted by a crash, its inputs are still there.
+        if (temporary)
+        {
+            if (unlink(path) == 0)
+            {
+                compactor->deleted++;
+                printf("Deleted stale temporary file %s \n", path);
+            }
+            free(path);
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            entries = realloc(entries, capacity * sizeof(CompactEntry));
+        }
+        CompactEntry *entry = &entries[count];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = path;
+        entry->archive = archive;
+        entry->columnar = columnar;
+        entry->size = st.st_size;
+
+        if (scan_entry(entry) != 0)
+        {
+            // A session or columnar file left without its header by a crash holds nothing.
+            if (!archive && st.st_size < (off_t)sizeof(SessionHeader))
+            {
+                unlink(path);
+                compactor->deleted++;
+            }
+            else
+            {
+                fprintf(stderr, "Warning: %s is not a complete session file, it is not compacted\n", path);
+            }
+            free(path);
+            continue;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    // Retention: delete the files whose newest sample is too old.
+    CompactEntry **small = malloc((count > 0 ? count : 1) * sizeof(CompactEntry *));
+    int small_count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        CompactEntry *entry = &entries[i];
+        if (compactor->retention > 0 && entry->endTime < now - compactor->retention)
+        {
+            if (remove_file(entry->path) == 0)
+            {
+                compactor->deleted++;
+                printf("Retention: deleted %s (newest sample %lld days old) \n", entry->path,
+                       (long long)((now - entry->endTime) / 86400));
+            }
+            continue;
+        }
+        // The columnar files are only subject to the retention, they are not merged.
+        if (!entry->columnar && entry->size < COMPACT_SMALL_BYTES && entry->samples < COMPACT_TARGET_SAMPLES)
+        {
+            small[small_count++] = entry;
+        }
+    }
+
+    // Merge the small files of each band, in time order, up to the target size.
+    qsort(small, small_count, sizeof(CompactEntry *), compare_entries);
+
+    int status = 0;
+    int first = 0;
+    int64_t samples = 0;
+
+    for (int i = 0; i <= small_count && !compactor->stop; i++)
+    {
+        if (i < small_count && i > first &&
+            strcmp(small[i]->header.macAddress, small[first]->header.macAddress) == 0 &&
+            samples + small[i]->samples <= COMPACT_TARGET_SAMPLES)
+        {
+            samples += small[i]->samples;
+            continue;
+        }
+
+        if (i > first && flush_batch(compactor, small + first, i - first) != 0 && !compactor->stop)
+        {
+            status = -1;
+        }
+        first = i;
+        samples = i < small_count ? small[i]->samples : 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free(entries[i].path);
+    }
+    free(entries);
+    free(small);
+
+    compactor->passes++;
+    compactor->busy += now_seconds() - compactor->passStart;
+    return status;
+}
+
+/**
+ * @brief Background pass, at the lowest CPU and I/O priority.
+ */
+static void *compactor_thread(void *arg)
+{
+    Compactor *compactor = arg;
+
+    // Both priorities apply to the calling thread only.
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, COMPACT_IOPRIO_WHO_PROCESS, tid, COMPACT_IOPRIO_CLASS_IDLE << COMPACT_IOPRIO_CLASS_SHIFT);
+#endif
+
+    compactor_run(compactor, time(NULL));
+    compactor->done = 1;
+    return NULL;
+}
+
+/**
+ * @brief Run a pass in a background thread at the lowest CPU and I/O priority.
+ */
+int compactor_start(Compactor *compactor)
+{
+    if (compactor->running)
+    {
+        if (!compactor->done)
+        {
+            return 1;
+        }
+        pthread_join(compactor->thread, NULL);
+        compactor->running = 0;
+    }
+
+    compactor->done = 0;
+    compactor->stop = 0;
+    if (pthread_create(&compactor->thread, NULL, compactor_thread, compactor) != 0)
+    {
+        fprintf(stderr, "Error: could not start the compaction thread\n");
+        return -1;
+    }
+    compactor->running = 1;
+    return 0;
+}
+
+/**
+ * @brief Interrupt the background pass, if any, and wait for it.
+ */
+void compactor_stop(Compactor *compactor)
+{
+    if (compactor->running)
+    {
+        compactor->stop = 1;
+        pthread_join(compactor->thread, NULL);
+        compactor->running = 0;
+    }
+}
+
+/**
+ * @brief Stop the background pass, if any, and free the compactor.
+ */
+void compactor_free(Compactor *compactor)
+{
+    compactor_stop(compactor);
+    free(compactor->directory);
+    compactor->directory = NULL;
+}
+
+/**
+ * @brief Print the files deleted and merged, and the I/O of the passes.
+ */
+void compactor_report(const Compactor *compactor)
+{
+    printf("Compaction: %lld passes, %lld files deleted, %lld files merged into %lld archives (%lld samples, %lld duplicates dropped) \n",
+           (long long)compactor->passes, (long long)compactor->deleted, (long long)compactor->merged,
+           (long long)compactor->archives, (long long)compactor->samples, (long long)compactor->duplicates);
+    printf("Compaction: %.1f MiB read, %.1f MiB written in %.1f s, %.1f s throttled \n",
+           compactor->bytesRead / 1048576.0, compactor->bytesWritten / 1048576.0, compactor->busy, compactor->throttled);
+}
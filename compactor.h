@@ -0,0 +1,138 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile compactor.h
+ * @author Daniel Oliveira
+ * @brief Retention and background compaction of the session files of a directory.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Session and archive files smaller than this are merged, in bytes.
+#define COMPACT_SMALL_BYTES (1024 * 1024)
+
+// Samples of a merged archive: small files are merged until this many samples (8 MiB in memory).
+#define COMPACT_TARGET_SAMPLES (1024 * 1024)
+
+// Default I/O budget of a pass, read and written, in bytes per second.
+#define COMPACT_RATE_BYTES (4 * 1024 * 1024)
+
+// Period of the background passes, in seconds.
+#define COMPACT_INTERVAL_S 3600
+
+// Files modified more recently than this are left alone, in seconds.
+#define COMPACT_SETTLE_S 60
+
+// Extension of the merged archive until it is synced and renamed.
+#define COMPACT_TEMP_EXTENSION ".tmp"
+
+// Files are read and written in chunks of this size, between which the pass may sleep.
+#define COMPACT_CHUNK_BYTES (64 * 1024)
+
+/**
+ * @brief Retention and compaction of a directory of session (.hrs) and archive (.hra) files.
+ *
+ * A pass deletes the files whose newest sample is older than the retention, columnar
+ * (.hrc) files included, then merges
+ * the small sealed files of each band, in time order, into archives of up to
+ * COMPACT_TARGET_SAMPLES samples. The samples are sorted, exact duplicates dropped, and
+ * the blocks encoded again, so the block summaries used to skip blocks cover the merged
+ * data. A file still written (locked by its SessionWriter) is left alone.
+ *
+ * The merged archive is written to a temporary file, synced and renamed before the inputs
+ * are deleted, so an interrupted pass loses nothing. The temporary files a crash left
+ * behind are deleted by the next pass, once settled.
+ */
+typedef struct
+{
+    char *directory;
+    int64_t retention;
+    int64_t rateBytes;
+
+    // Background pass.
+    pthread_t thread;
+    int running;
+    volatile int done;
+    volatile int stop;
+
+    // Statistics of the passes so far.
+    int64_t passes;
+    int64_t deleted;
+    int64_t merged;
+    int64_t archives;
+    int64_t samples;
+    int64_t duplicates;
+    int64_t bytesRead;
+    int64_t bytesWritten;
+    double throttled;
+    double busy;
+
+    // I/O budget of the current pass.
+    double passStart;
+    int64_t passBytes;
+} Compactor;
+
+/**
+ * @brief Initialize a compactor.
+ * @param compactor The Compactor instance.
+ * @param directory The directory of the session files.
+ * @param retention The age after which files are deleted, in seconds, 0 to keep them.
+ * @param rate_bytes The I/O budget in bytes per second, 0 for none.
+ */
+void compactor_init(Compactor *compactor, const char *directory, int64_t retention, int64_t rate_bytes);
+
+/**
+ * @brief Interrupt the background pass, if any, and wait for it.
+ * @param compactor The Compactor instance.
+ *
+ * A merge interrupted halfway leaves its inputs untouched and removes its temporary file.
+ */
+void compactor_stop(Compactor *compactor);
+
+/**
+ * @brief Stop the background pass, if any, and free the compactor.
+ * @param compactor The Compactor instance.
+ */
+void compactor_free(Compactor *compactor);
+
+/**
+ * @brief Run a pass in the calling thread.
+ * @param compactor The Compactor instance.
+ * @param now The current time, for the retention.
+ * @return 0 on success, -1 if the directory could not be read or a merge failed.
+ */
+int compactor_run(Compactor *compactor, time_t now);
+
+/**
+ * @brief Run a pass in a background thread at the lowest CPU and I/O priority.
+ * @param compactor The Compactor instance.
+ * @return 0 if the pass started, 1 if the previous one is still running, -1 on error.
+ *
+ * Called from a timer of the main loop, it never waits for the disk.
+ */
+int compactor_start(Compactor *compactor);
+
+/**
+ * @brief Print the files deleted and merged, and the I/O of the passes.
+ * @param compactor The Compactor instance.
+ */
+void compactor_report(const Compactor *compactor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file events.c
+ * @author Daniel Oliveira
+ * @brief Decoding and dispatch of the band's device events (button presses, wear, sleep...).
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "events.h"
+
+/**
+ * @brief Initialize an event bus without handlers.
+ */
+void event_bus_init(EventBus *bus)
+{
+    memset(bus, 0, sizeof(*bus));
+}
+
+/**
+ * @brief Register a handler.
+ */
+int event_bus_subscribe(EventBus *bus, int type, BandEventHandler handler, void *user_data)
+{
+    if (bus->count == EVENT_MAX_HANDLERS)
+    {
+        return -1;
+    }
+
+    EventSubscription *subscription = &bus->subscriptions[bus->count++];
+    subscription->type = type;
+    subscription->handler = handler;
+    subscription->userData = user_data;
+
+    return 0;
+}
+
+/**
+ * @brief Call the handlers of an event and record the latency from its reception.
+ */
+void event_bus_publish(EventBus *bus, const BandEvent *event)
+{
+    for (int i = 0; i < bus->count; i++)
+    {
+        const EventSubscription *subscription = &bus->subscriptions[i];
+        if (subscription->type != EVENT_ANY && subscription->type != event->type)
+        {
+            continue;
+        }
+
+        // Latency from the notification to the handler.
+        int64_t latency = g_get_monotonic_time() - event->receivedAt;
+        bus->dispatched++;
+        bus->latencySum += latency;
+        if (latency > bus->latencyMax)
+        {
+            bus->latencyMax = latency;
+        }
+
+        subscription->handler(event, subscription->userData);
+    }
+}
+
+/**
+ * @brief Decode a device event notification.
+ */
+int event_decode(const uint8_t *value, size_t value_length, int64_t received_at, BandEvent *event)
+{
+    if (value_length < 1)
+    {
+        return -1;
+    }
+
+    size_t payload = value_length - 1;
+    if (payload > EVENT_MAX_PAYLOAD)
+    {
+        payload = EVENT_MAX_PAYLOAD;
+    }
+
+    event->type = value[0];
+    memcpy(event->payload, value + 1, payload);
+    event->payloadLength = (int)payload;
+    event->receivedAt = received_at;
+
+    return 0;
+}
+
+/**
+ * @brief Name of an event type, for logging.
+ */
+const char *event_name(uint8_t type)
+{
+    switch (type)
+    {
+    case EVENT_FELL_ASLEEP:
+        return "fell asleep";
+    case EVENT_WOKE_UP:
+        return "woke up";
+    case EVENT_STEPS_GOAL_REACHED:
+        return "steps goal reached";
+    case EVENT_BUTTON_PRESSED:
+        return "button pressed";
+    case EVENT_START_NONWEAR:
+        return "non-wear";
+    case EVENT_CALL_REJECT:
+        return "call rejected";
+    case EVENT_FIND_PHONE_START:
+        return "find phone start";
+    case EVENT_CALL_IGNORE:
+        return "call ignored";
+    case EVENT_ALARM_TOGGLED:
+        return "alarm toggled";
+    case EVENT_BUTTON_PRESSED_LONG:
+        return "button long press";
+    case EVENT_TICK_30MIN:
+        return "30 minutes tick";
+    case EVENT_FIND_PHONE_STOP:
+        return "find phone stop";
+    case EVENT_MTU_REQUEST:
+        return "MTU request";
+    case EVENT_MUSIC_CONTROL:
+        return "music control";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,141 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile events.h
+ * @author Daniel Oliveira
+ * @brief Decoding and dispatch of the band's device events (button presses, wear, sleep...).
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Maximum number of handlers registered on an event bus.
+#define EVENT_MAX_HANDLERS 16
+
+// Maximum number of payload bytes kept after the event type.
+#define EVENT_MAX_PAYLOAD 8
+
+// Subscribe to every event type.
+#define EVENT_ANY -1
+
+/**
+ * @brief Event types sent on the device event characteristic.
+ */
+typedef enum
+{
+    EVENT_FELL_ASLEEP = 0x01,
+    EVENT_WOKE_UP = 0x02,
+    EVENT_STEPS_GOAL_REACHED = 0x03,
+    EVENT_BUTTON_PRESSED = 0x04,
+    EVENT_START_NONWEAR = 0x06,
+    EVENT_CALL_REJECT = 0x07,
+    EVENT_FIND_PHONE_START = 0x08,
+    EVENT_CALL_IGNORE = 0x09,
+    EVENT_ALARM_TOGGLED = 0x0a,
+    EVENT_BUTTON_PRESSED_LONG = 0x0b,
+    EVENT_TICK_30MIN = 0x0e,
+    EVENT_FIND_PHONE_STOP = 0x0f,
+    EVENT_MTU_REQUEST = 0x16,
+    EVENT_MUSIC_CONTROL = 0xfe
+} BandEventType;
+
+/**
+ * @brief A decoded device event and the monotonic time (us) its notification was received at.
+ */
+typedef struct
+{
+    uint8_t type;
+    uint8_t payload[EVENT_MAX_PAYLOAD];
+    int payloadLength;
+    int64_t receivedAt;
+} BandEvent;
+
+/**
+ * @brief Event handler, called from the notification dispatcher.
+ * @param event The event.
+ * @param user_data The user data given at subscription.
+ */
+typedef void (*BandEventHandler)(const BandEvent *event, void *user_data);
+
+/**
+ * @brief A handler registered for one event type, or for every type.
+ */
+typedef struct
+{
+    int type;
+    BandEventHandler handler;
+    void *userData;
+} EventSubscription;
+
+/**
+ * @brief Handlers of the device events and the dispatch latency statistics.
+ *
+ * Events are delivered synchronously from the notification callback, without queueing
+ * or allocation, so the latency is the time spent decoding and calling the handlers.
+ */
+typedef struct
+{
+    EventSubscription subscriptions[EVENT_MAX_HANDLERS];
+    int count;
+
+    int64_t dispatched;
+    int64_t latencySum;
+    int64_t latencyMax;
+} EventBus;
+
+/**
+ * @brief Initialize an event bus without handlers.
+ * @param bus The EventBus instance.
+ */
+void event_bus_init(EventBus *bus);
+
+/**
+ * @brief Register a handler.
+ * @param bus The EventBus instance.
+ * @param type The BandEventType to handle, or EVENT_ANY.
+ * @param handler The handler.
+ * @param user_data The user data passed to the handler.
+ * @return 0 on success, -1 if the bus is full.
+ */
+int event_bus_subscribe(EventBus *bus, int type, BandEventHandler handler, void *user_data);
+
+/**
+ * @brief Call the handlers of an event and record the latency from its reception.
+ * @param bus The EventBus instance.
+ * @param event The event.
+ */
+void event_bus_publish(EventBus *bus, const BandEvent *event);
+
+/**
+ * @brief Decode a device event notification.
+ * @param value The notified value.
+ * @param value_length The length of the notified value.
+ * @param received_at The monotonic time (us) the notification was received at.
+ * @param event The BandEvent to fill.
+ * @return 0 on success, -1 if the value is empty.
+ */
+int event_decode(const uint8_t *value, size_t value_length, int64_t received_at, BandEvent *event);
+
+/**
+ * @brief Name of an event type, for logging.
+ * @param type The event type.
+ * @return A static string.
+ */
+const char *event_name(uint8_t type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file filter.c
+ * @author Daniel Oliveira
+ * @brief Streaming artifact rejection (Hampel filter) and the low heart rate alert rule.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+/**
+ * @brief Initialize an empty filter.
+ */
+void hampel_init(HampelFilter *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+}
+
+/**
+ * @brief Median of a small array, sorted in place.
+ */
+static int32_t median(int32_t *values, int count)
+{
+    // Insertion sort, the arrays are at most HAMPEL_WINDOW long.
+    for (int i = 1; i < count; i++)
+    {
+        int32_t value = values[i];
+        int j = i - 1;
+        while (j >= 0 && values[j] > value)
+        {
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = value;
+    }
+
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * @brief Filter one sample.
+ */
+int hampel_filter(HampelFilter *filter, int32_t raw, int32_t *filtered)
+{
+    int32_t sorted[HAMPEL_WINDOW];
+    int32_t center = raw;
+    int32_t mad = 0;
+
+    if (filter->count > 0)
+    {
+        memcpy(sorted, filter->window, filter->count * sizeof(int32_t));
+        center = median(sorted, filter->count);
+
+        for (int i = 0; i < filter->count; i++)
+        {
+            sorted[i] = abs(filter->window[i] - center);
+        }
+        mad = median(sorted, filter->count);
+    }
+
+    // Sensor artifacts are replaced by the median and never enter the window.
+    if (raw < HR_MIN_BPM || raw > HR_MAX_BPM)
+    {
+        if (filter->count == 0)
+        {
+            return -1;
+        }
+        *filtered = center;
+        return SAMPLE_INVALID;
+    }
+
+    int quality = SAMPLE_OK;
+    *filtered = raw;
+
+    // 1.4826 * MAD estimates the standard deviation of normally distributed values.
+    if (filter->count >= HAMPEL_MIN_SAMPLES)
+    {
+        double limit = HAMPEL_THRESHOLD * 1.4826 * mad;
+        if (limit < HAMPEL_MIN_DEVIATION)
+        {
+            limit = HAMPEL_MIN_DEVIATION;
+        }
+        if (abs(raw - center) > limit)
+        {
+            *filtered = center;
+            quality = SAMPLE_OUTLIER;
+        }
+    }
+
+    filter->window[filter->head] = raw;
+    filter->head = (filter->head + 1) % HAMPEL_WINDOW;
+    if (filter->count < HAMPEL_WINDOW)
+    {
+        filter->count++;
+    }
+
+    return quality;
+}
+
+/**
+ * @brief Low heart rate alert rule.
+ */
+int alert_triggered(int64_t sum, int count, int32_t bpm)
+{
+    if (count <= ALERT_MIN_SAMPLES)
+    {
+        return 0;
+    }
+
+    double mean = (double)sum / count;
+    return bpm < mean - ALERT_DROP_BPM;
+}
@@ -0,0 +1,103 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile filter.h
+ * @author Daniel Oliveira
+ * @brief Streaming artifact rejection (Hampel filter) and the low heart rate alert rule.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Number of previous samples the median and the MAD are computed over.
+#define HAMPEL_WINDOW 15
+
+// Samples needed in the window before outliers are detected.
+#define HAMPEL_MIN_SAMPLES 5
+
+// A sample further than HAMPEL_THRESHOLD scaled MADs from the median is an outlier.
+#define HAMPEL_THRESHOLD 3.0
+
+// Deviation (bpm) below which a sample is never an outlier, for flat windows where the MAD is 0.
+#define HAMPEL_MIN_DEVIATION 5
+
+// Heart rate values outside of this range are sensor artifacts (e.g. 0 when off-wrist).
+#define HR_MIN_BPM 25
+#define HR_MAX_BPM 230
+
+// The alert fires when the heart rate drops ALERT_DROP_BPM below the mean, after ALERT_MIN_SAMPLES samples.
+#define ALERT_MIN_SAMPLES 60
+#define ALERT_DROP_BPM 10
+
+/**
+ * @brief Quality of a heart rate sample.
+ */
+typedef enum
+{
+    SAMPLE_OK = 0,
+    SAMPLE_OUTLIER = 1,
+    SAMPLE_INVALID = 2
+} SampleQuality;
+
+/**
+ * @brief Value received from the band and quality of a stored sample.
+ */
+typedef struct
+{
+    uint16_t raw;
+    uint8_t quality;
+} RawSample;
+
+/**
+ * @brief Causal Hampel filter over the last HAMPEL_WINDOW valid samples.
+ */
+typedef struct
+{
+    int32_t window[HAMPEL_WINDOW];
+    int head;
+    int count;
+} HampelFilter;
+
+/**
+ * @brief Initialize an empty filter.
+ * @param filter The HampelFilter instance.
+ */
+void hampel_init(HampelFilter *filter);
+
+/**
+ * @brief Filter one sample.
+ * @param filter The HampelFilter instance.
+ * @param raw The heart rate value received from the band.
+ * @param filtered The value to store: raw if it is fine, the median of the window otherwise.
+ * @return The quality of the sample, or -1 if it is invalid and there is no median to replace it with.
+ *
+ * Values outside [HR_MIN_BPM, HR_MAX_BPM] are invalid and never enter the window. Other
+ * values enter the window even when they are outliers, so a real and lasting change of
+ * the heart rate is followed after half a window. The cost is bounded by the window size.
+ */
+int hampel_filter(HampelFilter *filter, int32_t raw, int32_t *filtered);
+
+/**
+ * @brief Low heart rate alert rule.
+ * @param sum The sum of the stored heart rate values, including bpm.
+ * @param count The number of stored values, including bpm.
+ * @param bpm The latest heart rate value.
+ * @return 1 if the alert should be sent, 0 otherwise.
+ */
+int alert_triggered(int64_t sum, int count, int32_t bpm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
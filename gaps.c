@@ -0,0 +1,170 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file gaps.c
+ * @author Daniel Oliveira
+ * @brief Detection and bookkeeping of the gaps in the heart rate history.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gaps.h"
+
+/**
+ * @brief Initialize an empty gap list.
+ */
+void gap_list_init(GapList *list)
+{
+    memset(list, 0, sizeof(*list));
+}
+
+/**
+ * @brief Free the memory used by a gap list.
+ */
+void gap_list_free(GapList *list)
+{
+    free(list->gaps);
+    memset(list, 0, sizeof(*list));
+}
+
+/**
+ * @brief Drop every gap, e.g. after the history has been cleared.
+ */
+void gap_list_reset(GapList *list)
+{
+    list->count = 0;
+    list->sampleCount = 0;
+    list->lastTime = 0;
+    list->cadence = 0.0;
+}
+
+/**
+ * @brief Account for a sample appended to the history.
+ */
+const Gap *gap_list_add(GapList *list, int32_t time)
+{
+    int index = list->sampleCount++;
+    int32_t previous = list->lastTime;
+    list->lastTime = time;
+
+    if (index == 0)
+    {
+        return NULL;
+    }
+
+    int32_t interval = time - previous;
+    double threshold = GAP_CADENCE_FACTOR * (list->cadence > list->period ? list->cadence : list->period);
+    if (threshold < GAP_MIN_SECONDS)
+    {
+        threshold = GAP_MIN_SECONDS;
+    }
+
+    // Regular interval, follow the cadence.
+    if (interval <= threshold)
+    {
+        list->cadence = index == 1 ? interval : list->cadence + (interval - list->cadence) / 8.0;
+        return NULL;
+    }
+
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        Gap *gaps = realloc(list->gaps, capacity * sizeof(Gap));
+        if (gaps == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            return NULL;
+        }
+        list->gaps = gaps;
+        list->capacity = capacity;
+    }
+
+    Gap *gap = &list->gaps[list->count];
+    gap->start = previous;
+    gap->end = time;
+    gap->index = index;
+    gap->cumulative = (list->count > 0 ? list->gaps[list->count - 1].cumulative : 0) + interval;
+    list->count++;
+
+    return gap;
+}
+
+/**
+ * @brief Set the sampling period requested from the band.
+ */
+void gap_list_set_period(GapList *list, int32_t period)
+{
+    list->period = period;
+    list->cadence = period;
+}
+
+/**
+ * @brief Find the first gap ending at or after a sample.
+ */
+int gap_list_find(const GapList *list, int index)
+{
+    int low = 0;
+    int high = list->count;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (list->gaps[mid].index < index)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * @brief Total length of the gaps before a time, counting the part of a gap the time falls in.
+ */
+static int64_t gap_time_before(const GapList *list, int32_t time)
+{
+    // First gap that ends after the time.
+    int low = 0;
+    int high = list->count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (list->gaps[mid].end <= time)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    int64_t total = low > 0 ? list->gaps[low - 1].cumulative : 0;
+    if (low < list->count && list->gaps[low].start < time)
+    {
+        total += time - list->gaps[low].start;
+    }
+
+    return total;
+}
+
+/**
+ * @brief Time of a range covered by samples, i.e. not inside a gap.
+ */
+int64_t gap_list_covered(const GapList *list, int32_t from, int32_t to)
+{
+    if (to <= from)
+    {
+        return 0;
+    }
+
+    return (int64_t)to - from - (gap_time_before(list, to) - gap_time_before(list, from));
+}
@@ -0,0 +1,121 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile gaps.h
+ * @author Daniel Oliveira
+ * @brief Detection and bookkeeping of the gaps in the heart rate history.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef GAPS_H
+#define GAPS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// A pause longer than GAP_CADENCE_FACTOR times the usual cadence, or the expected period, and than GAP_MIN_SECONDS, is a gap.
+#define GAP_CADENCE_FACTOR 4
+#define GAP_MIN_SECONDS 5
+
+/**
+ * @brief A pause in the notifications between two consecutive samples.
+ */
+typedef struct
+{
+    // Time of the last sample before the gap and of the first sample after it.
+    int32_t start;
+    int32_t end;
+
+    // Index of the first sample after the gap.
+    int index;
+
+    // Total length of the gaps up to and including this one, in seconds.
+    int64_t cumulative;
+} Gap;
+
+/**
+ * @brief Gaps of the heart rate history, in time order, and the cadence they are detected against.
+ */
+typedef struct
+{
+    Gap *gaps;
+    int count;
+    int capacity;
+
+    int sampleCount;
+    int32_t lastTime;
+    double cadence;
+
+    // Sampling period requested from the band, in seconds, 0 if unknown.
+    int32_t period;
+} GapList;
+
+/**
+ * @brief Initialize an empty gap list.
+ * @param list The GapList instance.
+ */
+void gap_list_init(GapList *list);
+
+/**
+ * @brief Free the memory used by a gap list.
+ * @param list The GapList instance.
+ */
+void gap_list_free(GapList *list);
+
+/**
+ * @brief Drop every gap, e.g. after the history has been cleared.
+ * @param list The GapList instance.
+ */
+void gap_list_reset(GapList *list);
+
+/**
+ * @brief Account for a sample appended to the history.
+ * @param list The GapList instance.
+ * @param time The sample time.
+ * @return The new Gap if the sample ends one, NULL otherwise.
+ *
+ * The expected cadence is a moving average of the intervals between samples outside
+ * of gaps, so the detection follows the rate the band actually notifies at. O(1).
+ */
+const Gap *gap_list_add(GapList *list, int32_t time);
+
+/**
+ * @brief Set the sampling period requested from the band, e.g. when the interval level changes.
+ * @param list The GapList instance.
+ * @param period The expected interval between samples, in seconds.
+ *
+ * The cadence restarts from the period, so the first samples at a sparser level are not
+ * taken for gaps, and a pause at a denser level is detected without waiting for the average.
+ */
+void gap_list_set_period(GapList *list, int32_t period);
+
+/**
+ * @brief Find the first gap ending at or after a sample.
+ * @param list The GapList instance.
+ * @param index The sample index.
+ * @return The position of the first gap with gap.index >= index, or list->count if there is none.
+ */
+int gap_list_find(const GapList *list, int index);
+
+/**
+ * @brief Time of a range covered by samples, i.e. not inside a gap.
+ * @param list The GapList instance.
+ * @param from The start of the time range (inclusive).
+ * @param to The end of the time range (exclusive).
+ * @return The covered time in seconds.
+ *
+ * Uses the cumulative gap lengths, so the cost is O(log gaps) whatever the range.
+ */
+int64_t gap_list_covered(const GapList *list, int32_t from, int32_t to);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,298 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file history.c
+ * @author Daniel Oliveira
+ * @brief Block summaries of the heart rate history for query pruning.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+/**
+ * @brief Initialize an empty history index.
+ */
+void history_index_init(HistoryIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * @brief Free the memory used by a history index.
+ */
+void history_index_free(HistoryIndex *index)
+{
+    free(index->blocks);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * @brief Drop every summary, e.g. after the history has been cleared, and enable the index again.
+ */
+void history_index_reset(HistoryIndex *index)
+{
+    index->blockCount = 0;
+    index->totalSum = 0;
+    index->count = 0;
+    index->disabled = 0;
+    memset(&index->open, 0, sizeof(index->open));
+}
+
+/**
+ * @brief Initialize a summary with a single sample.
+ */
+void block_summary_init(BlockSummary *summary, int32_t time, int32_t bpm)
+{
+    summary->firstTime = time;
+    summary->lastTime = time;
+    summary->minBpm = bpm;
+    summary->maxBpm = bpm;
+    summary->sumBpm = bpm;
+    summary->count = 1;
+}
+
+/**
+ * @brief Add a sample to a summary.
+ */
+void block_summary_add(BlockSummary *summary, int32_t time, int32_t bpm)
+{
+    if (summary->count == 0)
+    {
+        block_summary_init(summary, time, bpm);
+        return;
+    }
+
+    summary->lastTime = time;
+    if (bpm < summary->minBpm)
+    {
+        summary->minBpm = bpm;
+    }
+    if (bpm > summary->maxBpm)
+    {
+        summary->maxBpm = bpm;
+    }
+    summary->sumBpm += bpm;
+    summary->count++;
+}
+
+/**
+ * @brief Merge a summary into another one.
+ */
+void block_summary_merge(BlockSummary *summary, const BlockSummary *other)
+{
+    if (other->count == 0)
+    {
+        return;
+    }
+    if (summary->count == 0)
+    {
+        *summary = *other;
+        return;
+    }
+
+    if (other->firstTime < summary->firstTime)
+    {
+        summary->firstTime = other->firstTime;
+    }
+    if (other->lastTime > summary->lastTime)
+    {
+        summary->lastTime = other->lastTime;
+    }
+    if (other->minBpm < summary->minBpm)
+    {
+        summary->minBpm = other->minBpm;
+    }
+    if (other->maxBpm > summary->maxBpm)
+    {
+        summary->maxBpm = other->maxBpm;
+    }
+    summary->sumBpm += other->sumBpm;
+    summary->count += other->count;
+}
+
+/**
+ * @brief Account for a sample appended to the history.
+ */
+void history_index_add(HistoryIndex *index, int32_t time, int32_t bpm)
+{
+    index->totalSum += bpm;
+    index->count++;
+    if (index->disabled)
+    {
+        return;
+    }
+
+    block_summary_add(&index->open, time, bpm);
+    if (index->open.count != HISTORY_BLOCK_SAMPLES)
+    {
+        return;
+    }
+
+    // Seal the open block.
+    if (index->blockCount == index->blockCapacity)
+    {
+        int capacity = index->blockCapacity ? index->blockCapacity * 2 : 64;
+        BlockSummary *blocks = realloc(index->blocks, capacity * sizeof(BlockSummary));
+        if (blocks == NULL)
+        {
+            // The open block cannot grow past a block, stop indexing until the next reset.
+            printf("Error while allocating memory! \n");
+            free(index->blocks);
+            index->blocks = NULL;
+            index->blockCount = 0;
+            index->blockCapacity = 0;
+            index->disabled = 1;
+            memset(&index->open, 0, sizeof(index->open));
+            return;
+        }
+        index->blocks = blocks;
+        index->blockCapacity = capacity;
+    }
+
+    index->blocks[index->blockCount++] = index->open;
+    memset(&index->open, 0, sizeof(index->open));
+}
+
+/**
+ * @brief Number of blocks, the open one included.
+ */
+static int block_total(const HistoryIndex *index)
+{
+    return index->blockCount + (index->open.count > 0 ? 1 : 0);
+}
+
+/**
+ * @brief Summary of block k, sealed or open.
+ */
+static const BlockSummary *block_at(const HistoryIndex *index, int k)
+{
+    return k < index->blockCount ? &index->blocks[k] : &index->open;
+}
+
+/**
+ * @brief First block whose last sample is not earlier than the given time.
+ */
+static int first_block_from(const HistoryIndex *index, int32_t from)
+{
+    int low = 0;
+    int high = block_total(index);
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (block_at(index, mid)->lastTime < from)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * @brief Find the first sample below a threshold in a time range.
+ */
+int history_find_below(const HistoryIndex *index, int32_t (*samples)[2], int32_t from, int32_t to, int32_t threshold)
+{
+    // Without summaries, scan every sample.
+    if (index->disabled)
+    {
+        for (int i = 0; i < index->count && samples[i][0] < to; i++)
+        {
+            if (samples[i][0] >= from && samples[i][1] < threshold)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int total = block_total(index);
+
+    for (int k = first_block_from(index, from); k < total; k++)
+    {
+        const BlockSummary *block = block_at(index, k);
+        if (block->firstTime >= to)
+        {
+            break;
+        }
+
+        // Nothing below the threshold in this block.
+        if (block->minBpm >= threshold)
+        {
+            continue;
+        }
+
+        int start = k * HISTORY_BLOCK_SAMPLES;
+        for (int i = start; i < start + (int)block->count; i++)
+        {
+            if (samples[i][0] >= to)
+            {
+                return -1;
+            }
+            if (samples[i][0] >= from && samples[i][1] < threshold)
+            {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Aggregate the samples of a time range.
+ */
+void history_aggregate(const HistoryIndex *index, int32_t (*samples)[2], int32_t from, int32_t to, BlockSummary *result)
+{
+    memset(result, 0, sizeof(*result));
+
+    // Without summaries, scan every sample.
+    if (index->disabled)
+    {
+        for (int i = 0; i < index->count && samples[i][0] < to; i++)
+        {
+            if (samples[i][0] >= from)
+            {
+                block_summary_add(result, samples[i][0], samples[i][1]);
+            }
+        }
+        return;
+    }
+
+    int total = block_total(index);
+
+    for (int k = first_block_from(index, from); k < total; k++)
+    {
+        const BlockSummary *block = block_at(index, k);
+        if (block->firstTime >= to)
+        {
+            break;
+        }
+
+        // Blocks entirely inside the range are not scanned.
+        if (block->firstTime >= from && block->lastTime < to)
+        {
+            block_summary_merge(result, block);
+            continue;
+        }
+
+        int start = k * HISTORY_BLOCK_SAMPLES;
+        for (int i = start; i < start + (int)block->count; i++)
+        {
+            if (samples[i][0] >= from && samples[i][0] < to)
+            {
+                block_summary_add(result, samples[i][0], samples[i][1]);
+            }
+        }
+    }
+}
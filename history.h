@@ -0,0 +1,139 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile history.h
+ * @author Daniel Oliveira
+ * @brief Block summaries of the heart rate history for query pruning.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Number of samples per history block.
+#define HISTORY_BLOCK_SAMPLES 256
+
+/**
+ * @brief Summary of a block of consecutive heart rate samples.
+ */
+typedef struct
+{
+    int32_t firstTime;
+    int32_t lastTime;
+    int32_t minBpm;
+    int32_t maxBpm;
+    int64_t sumBpm;
+    uint32_t count;
+} BlockSummary;
+
+/**
+ * @brief Summaries of the heart rate history, one per block of HISTORY_BLOCK_SAMPLES samples.
+ *
+ * Block k covers samples [k * HISTORY_BLOCK_SAMPLES, (k + 1) * HISTORY_BLOCK_SAMPLES) of the history.
+ * Full blocks are sealed and never change, the last block stays open while samples arrive.
+ * If a block cannot be sealed for lack of memory, the summaries are dropped and the index
+ * is disabled until the next reset: the queries then scan the samples.
+ */
+typedef struct
+{
+    BlockSummary *blocks;
+    int blockCount;
+    int blockCapacity;
+    BlockSummary open;
+    int64_t totalSum;
+    int count;
+    int disabled;
+} HistoryIndex;
+
+/**
+ * @brief Initialize an empty history index.
+ * @param index The HistoryIndex instance.
+ */
+void history_index_init(HistoryIndex *index);
+
+/**
+ * @brief Free the memory used by a history index.
+ * @param index The HistoryIndex instance.
+ */
+void history_index_free(HistoryIndex *index);
+
+/**
+ * @brief Drop every summary, e.g. after the history has been cleared, and enable the index again.
+ * @param index The HistoryIndex instance.
+ */
+void history_index_reset(HistoryIndex *index);
+
+/**
+ * @brief Account for a sample appended to the history.
+ * @param index The HistoryIndex instance.
+ * @param time The sample time.
+ * @param bpm The heart rate value.
+ *
+ * Updates the open block in O(1) and seals it once it holds HISTORY_BLOCK_SAMPLES samples.
+ */
+void history_index_add(HistoryIndex *index, int32_t time, int32_t bpm);
+
+/**
+ * @brief Initialize a summary with a single sample.
+ * @param summary The BlockSummary to initialize.
+ * @param time The sample time.
+ * @param bpm The heart rate value.
+ */
+void block_summary_init(BlockSummary *summary, int32_t time, int32_t bpm);
+
+/**
+ * @brief Add a sample to a summary.
+ * @param summary The BlockSummary to update.
+ * @param time The sample time.
+ * @param bpm The heart rate value.
+ */
+void block_summary_add(BlockSummary *summary, int32_t time, int32_t bpm);
+
+/**
+ * @brief Merge a summary into another one.
+ * @param summary The BlockSummary to update.
+ * @param other The BlockSummary to merge, it may be empty.
+ */
+void block_summary_merge(BlockSummary *summary, const BlockSummary *other);
+
+/**
+ * @brief Find the first sample below a threshold in a time range.
+ * @param index The HistoryIndex of the history.
+ * @param samples The history samples (time, bpm).
+ * @param from The start of the time range (inclusive).
+ * @param to The end of the time range (exclusive).
+ * @param threshold The heart rate threshold.
+ * @return The index of the first sample with bpm < threshold, or -1 if there is none.
+ *
+ * Blocks outside the time range or whose minimum is not below the threshold are skipped
+ * without reading their samples.
+ */
+int history_find_below(const HistoryIndex *index, int32_t (*samples)[2], int32_t from, int32_t to, int32_t threshold);
+
+/**
+ * @brief Aggregate the samples of a time range.
+ * @param index The HistoryIndex of the history.
+ * @param samples The history samples (time, bpm).
+ * @param from The start of the time range (inclusive).
+ * @param to The end of the time range (exclusive).
+ * @param result The summary of the samples in the range (count is 0 if there is none).
+ *
+ * Blocks entirely inside the time range are taken from their summaries, only the blocks
+ * at the edges of the range are scanned.
+ */
+void history_aggregate(const HistoryIndex *index, int32_t (*samples)[2], int32_t from, int32_t to, BlockSummary *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file hrv.c
+ * @author Daniel Oliveira
+ * @brief Streaming time-domain heart rate variability (RMSSD, SDNN, pNN50) from RR intervals.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hrv.h"
+
+/**
+ * @brief Initialize an empty window.
+ */
+void hrv_init(HrvWindow *window)
+{
+    memset(window, 0, sizeof(*window));
+}
+
+/**
+ * @brief Remove the oldest interval from the window.
+ */
+static void hrv_evict(HrvWindow *window)
+{
+    HrvInterval *oldest = &window->intervals[window->head];
+    window->sumRr -= oldest->rr;
+    window->sumRrSquared -= (int64_t)oldest->rr * oldest->rr;
+
+    window->head = (window->head + 1) % HRV_MAX_INTERVALS;
+    window->count--;
+
+    // The next interval loses its predecessor, so its difference leaves the window.
+    if (window->count > 0)
+    {
+        HrvInterval *next = &window->intervals[window->head];
+        if (next->hasDiff)
+        {
+            window->sumDiffSquared -= (int64_t)next->diff * next->diff;
+            window->diffCount--;
+            if (abs(next->diff) > 50)
+            {
+                window->nn50Count--;
+            }
+            next->hasDiff = 0;
+        }
+    }
+    else
+    {
+        window->hasPrevious = 0;
+    }
+}
+
+/**
+ * @brief Drop the intervals older than HRV_WINDOW_MS, keeping the newest one.
+ */
+static void hrv_slide(HrvWindow *window)
+{
+    while (window->count > 1 && window->intervals[window->head].time <= window->clock - HRV_WINDOW_MS)
+    {
+        hrv_evict(window);
+    }
+}
+
+/**
+ * @brief Catch the band clock up with the wall clock before a batch of intervals.
+ */
+void hrv_sync(HrvWindow *window, int64_t now_ms)
+{
+    if (now_ms <= window->clock + HRV_MAX_RR_MS)
+    {
+        return;
+    }
+
+    // Beats were missed, the next interval does not follow the previous one.
+    window->clock = now_ms;
+    window->hasPrevious = 0;
+    hrv_slide(window);
+
+    // A single interval left over from before the pause is stale too.
+    if (window->count == 1 && window->intervals[window->head].time <= window->clock - HRV_WINDOW_MS)
+    {
+        hrv_evict(window);
+    }
+}
+
+/**
+ * @brief Add an RR interval to the window and drop the intervals older than HRV_WINDOW_MS.
+ */
+void hrv_add(HrvWindow *window, int32_t rr_ms)
+{
+    // The band keeps time even when the beat is rejected.
+    window->clock += rr_ms;
+
+    if (rr_ms < HRV_MIN_RR_MS || rr_ms > HRV_MAX_RR_MS)
+    {
+        window->hasPrevious = 0;
+        return;
+    }
+
+    if (window->count == HRV_MAX_INTERVALS)
+    {
+        hrv_evict(window);
+    }
+
+    int tail = (window->head + window->count) % HRV_MAX_INTERVALS;
+    HrvInterval *interval = &window->intervals[tail];
+    interval->time = window->clock;
+    interval->rr = rr_ms;
+    interval->hasDiff = 0;
+
+    // Successive difference with the previous accepted interval.
+    if (window->hasPrevious && window->count > 0)
+    {
+        int previous = (tail + HRV_MAX_INTERVALS - 1) % HRV_MAX_INTERVALS;
+        interval->diff = rr_ms - window->intervals[previous].rr;
+        interval->hasDiff = 1;
+
+        window->sumDiffSquared += (int64_t)interval->diff * interval->diff;
+        window->diffCount++;
+        if (abs(interval->diff) > 50)
+        {
+            window->nn50Count++;
+        }
+    }
+
+    window->sumRr += rr_ms;
+    window->sumRrSquared += (int64_t)rr_ms * rr_ms;
+    window->count++;
+    window->hasPrevious = 1;
+
+    // Slide the window.
+    hrv_slide(window);
+}
+
+/**
+ * @brief Compute the metrics of the window in O(1).
+ */
+void hrv_metrics(const HrvWindow *window, HrvMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    if (window->count < 2)
+    {
+        return;
+    }
+
+    // Sample standard deviation from the exact integer sums.
+    double n = window->count;
+    double variance = (window->sumRrSquared - (double)window->sumRr * window->sumRr / n) / (n - 1);
+    metrics->sdnn = variance > 0 ? sqrt(variance) : 0.0;
+
+    if (window->diffCount > 0)
+    {
+        metrics->rmssd = sqrt((double)window->sumDiffSquared / window->diffCount);
+        metrics->pnn50 = 100.0 * window->nn50Count / window->diffCount;
+    }
+    metrics->count = window->count;
+}
+
+/**
+ * @brief Copy the intervals of the window, oldest first.
+ */
+int hrv_copy_intervals(const HrvWindow *window, double *time, double *rr)
+{
+    for (int i = 0; i < window->count; i++)
+    {
+        const HrvInterval *interval = &window->intervals[(window->head + i) % HRV_MAX_INTERVALS];
+        time[i] = interval->time / 1000.0;
+        rr[i] = interval->rr;
+    }
+    return window->count;
+}
@@ -0,0 +1,125 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile hrv.h
+ * @author Daniel Oliveira
+ * @brief Streaming time-domain heart rate variability (RMSSD, SDNN, pNN50) from RR intervals.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef HRV_H
+#define HRV_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Length of the sliding window in milliseconds.
+#define HRV_WINDOW_MS (5 * 60 * 1000)
+
+// Capacity of the window, enough for 5 minutes above 240 bpm.
+#define HRV_MAX_INTERVALS 2048
+
+// RR intervals outside of this range (ms) are treated as artifacts.
+#define HRV_MIN_RR_MS 250
+#define HRV_MAX_RR_MS 2500
+
+/**
+ * @brief One RR interval of the window.
+ */
+typedef struct
+{
+    int64_t time;
+    int32_t rr;
+    int32_t diff;
+    uint8_t hasDiff;
+} HrvInterval;
+
+/**
+ * @brief Sliding window of RR intervals with incrementally maintained sums.
+ *
+ * Intervals are timed on the band's own clock, i.e. the running sum of RR intervals,
+ * so batched notifications do not distort the window. The clock is moved forward to
+ * the wall clock when beats were missed, so a pause in the notifications ages the
+ * window as well. Sums are exact integers, so removing intervals never accumulates
+ * rounding errors.
+ */
+typedef struct
+{
+    HrvInterval intervals[HRV_MAX_INTERVALS];
+    int head;
+    int count;
+    int64_t clock;
+    int hasPrevious;
+
+    int64_t sumRr;
+    int64_t sumRrSquared;
+    int64_t sumDiffSquared;
+    int diffCount;
+    int nn50Count;
+} HrvWindow;
+
+/**
+ * @brief Time-domain heart rate variability of the window.
+ */
+typedef struct
+{
+    double rmssd;
+    double sdnn;
+    double pnn50;
+    int count;
+} HrvMetrics;
+
+/**
+ * @brief Initialize an empty window.
+ * @param window The HrvWindow instance.
+ */
+void hrv_init(HrvWindow *window);
+
+/**
+ * @brief Add an RR interval to the window and drop the intervals older than HRV_WINDOW_MS.
+ * @param window The HrvWindow instance.
+ * @param rr_ms The RR interval in milliseconds.
+ *
+ * O(1) per interval (amortized over the evicted intervals). Intervals out of the
+ * physiological range are dropped and break the chain of successive differences.
+ */
+void hrv_add(HrvWindow *window, int32_t rr_ms);
+
+/**
+ * @brief Catch the band clock up with the wall clock before a batch of intervals.
+ * @param window The HrvWindow instance.
+ * @param now_ms The wall clock time of the first beat of the batch, in milliseconds.
+ *
+ * If the wall clock is ahead by more than HRV_MAX_RR_MS, beats were missed: the clock
+ * jumps forward, the chain of successive differences is broken and the intervals that
+ * left the window are dropped. The clock never moves back.
+ */
+void hrv_sync(HrvWindow *window, int64_t now_ms);
+
+/**
+ * @brief Compute the metrics of the window in O(1).
+ * @param window The HrvWindow instance.
+ * @param metrics The HrvMetrics to fill, all zero if the window holds less than two intervals.
+ */
+void hrv_metrics(const HrvWindow *window, HrvMetrics *metrics);
+
+/**
+ * @brief Copy the intervals of the window, oldest first.
+ * @param window The HrvWindow instance.
+ * @param time The output beat times in seconds, window->count long.
+ * @param rr The output RR intervals in milliseconds, window->count long.
+ * @return The number of intervals copied.
+ */
+int hrv_copy_intervals(const HrvWindow *window, double *time, double *rr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
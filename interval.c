@@ -0,0 +1,146 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file interval.c
+ * @author Daniel Oliveira
+ * @brief Adaptive measurement interval: dense during exercise or alerts, sparse at rest.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <math.h>
+#include "interval.h"
+
+/**
+ * @brief Sampling period and band interval setting of a level.
+ */
+typedef struct
+{
+    int period;
+    uint8_t bandInterval;
+    const char *name;
+} IntervalSettings;
+
+static const IntervalSettings INTERVAL_SETTINGS[] = {
+    [INTERVAL_DENSE] = {INTERVAL_DENSE_PERIOD_S, 1, "dense"},
+    [INTERVAL_NORMAL] = {INTERVAL_NORMAL_PERIOD_S, 1, "normal"},
+    [INTERVAL_SPARSE] = {INTERVAL_SPARSE_PERIOD_S, 5, "sparse"},
+};
+
+/**
+ * @brief Initialize a policy at the dense level.
+ */
+void interval_init(IntervalPolicy *policy)
+{
+    policy->level = INTERVAL_DENSE;
+    policy->fast = 0;
+    policy->slow = 0;
+    policy->lastTime = 0;
+    policy->samples = 0;
+    policy->sparserSince = -1;
+    policy->lastProbe = 0;
+    policy->changes = 0;
+}
+
+/**
+ * @brief Update the policy with a heart rate sample.
+ */
+int interval_update(IntervalPolicy *policy, int32_t time, int32_t bpm, int alert)
+{
+    // Time-based averages, so the trend does not depend on the sampling period.
+    if (policy->samples == 0)
+    {
+        policy->fast = bpm;
+        policy->slow = bpm;
+    }
+    else
+    {
+        double dt = time > policy->lastTime ? time - policy->lastTime : 0;
+        policy->fast += (1.0 - exp(-dt / INTERVAL_FAST_TAU_S)) * (bpm - policy->fast);
+        policy->slow += (1.0 - exp(-dt / INTERVAL_SLOW_TAU_S)) * (bpm - policy->slow);
+    }
+    policy->lastTime = time;
+    policy->samples++;
+
+    double trend = fabs(policy->fast - policy->slow);
+    double jump = fabs(bpm - policy->slow);
+
+    IntervalLevel wanted = INTERVAL_SPARSE;
+    if (alert || bpm >= INTERVAL_EXERCISE_BPM || trend >= INTERVAL_DENSE_TREND_BPM || jump >= 2 * INTERVAL_DENSE_TREND_BPM)
+    {
+        wanted = INTERVAL_DENSE;
+    }
+    else if (trend >= INTERVAL_NORMAL_TREND_BPM || jump >= 2 * INTERVAL_NORMAL_TREND_BPM)
+    {
+        wanted = INTERVAL_NORMAL;
+    }
+
+    // Denser at once.
+    if (wanted < policy->level)
+    {
+        policy->level = wanted;
+        policy->sparserSince = -1;
+        policy->changes++;
+        return 1;
+    }
+
+    // Sparser one step at a time, once it has been wanted for a while.
+    if (wanted > policy->level)
+    {
+        if (policy->sparserSince < 0)
+        {
+            policy->sparserSince = time;
+        }
+        else if (time - policy->sparserSince >= INTERVAL_SETTLE_S)
+        {
+            policy->level++;
+            policy->sparserSince = policy->level < wanted ? time : -1;
+            policy->changes++;
+            return 1;
+        }
+        return 0;
+    }
+
+    policy->sparserSince = -1;
+    return 0;
+}
+
+/**
+ * @brief Whether a one-shot measurement is due.
+ */
+int interval_probe_due(IntervalPolicy *policy, int64_t now)
+{
+    int period = interval_period(policy->level);
+    if (period <= 1 || now - policy->lastProbe < period)
+    {
+        return 0;
+    }
+
+    policy->lastProbe = now;
+    return 1;
+}
+
+/**
+ * @brief Sampling period of a level.
+ */
+int interval_period(IntervalLevel level)
+{
+    return INTERVAL_SETTINGS[level].period;
+}
+
+/**
+ * @brief Measurement interval setting of the band for a level.
+ */
+uint8_t interval_band_setting(IntervalLevel level)
+{
+    return INTERVAL_SETTINGS[level].bandInterval;
+}
+
+/**
+ * @brief Name of a level.
+ */
+const char *interval_name(IntervalLevel level)
+{
+    return INTERVAL_SETTINGS[level].name;
+}
@@ -0,0 +1,126 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile interval.h
+ * @author Daniel Oliveira
+ * @brief Adaptive measurement interval: dense during exercise or alerts, sparse at rest.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef INTERVAL_H
+#define INTERVAL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Sampling period of each level in seconds. 1 is the continuous measurement, longer periods use one-shot measurements.
+#define INTERVAL_DENSE_PERIOD_S 1
+#define INTERVAL_NORMAL_PERIOD_S 20
+#define INTERVAL_SPARSE_PERIOD_S 60
+
+// Heart rate from which the wearer is considered exercising, in bpm.
+#define INTERVAL_EXERCISE_BPM 100
+
+// Time constants of the fast and slow heart rate averages whose difference is the trend, in seconds.
+#define INTERVAL_FAST_TAU_S 30
+#define INTERVAL_SLOW_TAU_S 600
+
+// Trend (in bpm, either way) from which the measurement is dense, and normal.
+#define INTERVAL_DENSE_TREND_BPM 8
+#define INTERVAL_NORMAL_TREND_BPM 3
+
+// Time a sparser level must be wanted before stepping down to it, in seconds.
+#define INTERVAL_SETTLE_S 300
+
+/**
+ * @brief Measurement levels, from the densest.
+ */
+typedef enum
+{
+    INTERVAL_DENSE = 0,
+    INTERVAL_NORMAL = 1,
+    INTERVAL_SPARSE = 2
+} IntervalLevel;
+
+/**
+ * @brief Interval policy of a band: the heart rate trend and the current level.
+ */
+typedef struct
+{
+    IntervalLevel level;
+    double fast;
+    double slow;
+    int32_t lastTime;
+    int samples;
+
+    // Time since which a sparser level is wanted, or -1.
+    int32_t sparserSince;
+
+    // Time of the last one-shot measurement.
+    int64_t lastProbe;
+
+    // Level changes, i.e. commands sent to the band.
+    int64_t changes;
+} IntervalPolicy;
+
+/**
+ * @brief Initialize a policy at the dense level, until the trend has settled.
+ * @param policy The IntervalPolicy instance.
+ */
+void interval_init(IntervalPolicy *policy);
+
+/**
+ * @brief Update the policy with a heart rate sample.
+ * @param policy The IntervalPolicy instance.
+ * @param time The sample time in seconds.
+ * @param bpm The heart rate value.
+ * @param alert 1 if an alert is triggered or not acknowledged yet, 0 otherwise.
+ * @return 1 if the level changed, 0 otherwise.
+ *
+ * The wanted level is dense on an alert, above INTERVAL_EXERCISE_BPM or when the heart
+ * rate moves quickly, normal when it drifts, and sparse otherwise. Denser levels apply at
+ * once, so no event waits for the next sparse sample. Sparser levels apply one step at a
+ * time after INTERVAL_SETTLE_S, so a short pause during exercise keeps the measurement dense.
+ */
+int interval_update(IntervalPolicy *policy, int32_t time, int32_t bpm, int alert);
+
+/**
+ * @brief Whether a one-shot measurement is due, at a level without continuous measurement.
+ * @param policy The IntervalPolicy instance.
+ * @param now The current time in seconds.
+ * @return 1 if a measurement should be requested now (the probe time is then updated), 0 otherwise.
+ */
+int interval_probe_due(IntervalPolicy *policy, int64_t now);
+
+/**
+ * @brief Sampling period of a level.
+ * @param level The level.
+ * @return The period in seconds, 1 for the continuous measurement.
+ */
+int interval_period(IntervalLevel level);
+
+/**
+ * @brief Measurement interval setting of the band for a level, sent as {0x14, 0x00, interval}.
+ * @param level The level.
+ * @return The interval in minutes.
+ */
+uint8_t interval_band_setting(IntervalLevel level);
+
+/**
+ * @brief Name of a level, for logging.
+ * @param level The level.
+ * @return A static string.
+ */
+const char *interval_name(IntervalLevel level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file lod.c
+ * @author Daniel Oliveira
+ * @brief Level-of-detail pyramid of the heart rate history for zoomable views.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lod.h"
+
+/**
+ * @brief Initialize an empty pyramid.
+ */
+void lod_init(LodPyramid *pyramid)
+{
+    memset(pyramid, 0, sizeof(*pyramid));
+}
+
+/**
+ * @brief Free the memory used by a pyramid.
+ */
+void lod_free(LodPyramid *pyramid)
+{
+    for (int k = 0; k < LOD_MAX_LEVELS; k++)
+    {
+        free(pyramid->levels[k].nodes);
+    }
+    memset(pyramid, 0, sizeof(*pyramid));
+}
+
+/**
+ * @brief Drop every node, e.g. after the history has been cleared.
+ */
+void lod_reset(LodPyramid *pyramid)
+{
+    for (int k = 0; k < LOD_MAX_LEVELS; k++)
+    {
+        pyramid->levels[k].count = 0;
+    }
+    pyramid->sampleCount = 0;
+    pyramid->disabled = 0;
+}
+
+/**
+ * @brief Account for a sample appended to the history.
+ */
+void lod_add(LodPyramid *pyramid, int32_t time, int32_t bpm)
+{
+    int index = pyramid->sampleCount++;
+    if (pyramid->disabled)
+    {
+        return;
+    }
+
+    // Make room for the nodes this sample opens before touching any level.
+    for (int k = 0; k < LOD_MAX_LEVELS; k++)
+    {
+        LodLevel *level = &pyramid->levels[k];
+        if ((index >> (LOD_FANOUT_SHIFT * (k + 1))) < level->count || level->count < level->capacity)
+        {
+            continue;
+        }
+
+        int capacity = level->capacity ? level->capacity * 2 : 64;
+        BlockSummary *nodes = realloc(level->nodes, capacity * sizeof(BlockSummary));
+        if (nodes == NULL)
+        {
+            // The levels would no longer match the history, drop them.
+            printf("Error while allocating memory! \n");
+            for (int j = 0; j < LOD_MAX_LEVELS; j++)
+            {
+                free(pyramid->levels[j].nodes);
+            }
+            memset(pyramid->levels, 0, sizeof(pyramid->levels));
+            pyramid->disabled = 1;
+            return;
+        }
+        level->nodes = nodes;
+        level->capacity = capacity;
+    }
+
+    // Update the last node of every level, or open a new one.
+    for (int k = 0; k < LOD_MAX_LEVELS; k++)
+    {
+        LodLevel *level = &pyramid->levels[k];
+        int node = index >> (LOD_FANOUT_SHIFT * (k + 1));
+
+        if (node < level->count)
+        {
+            block_summary_add(&level->nodes[node], time, bpm);
+        }
+        else
+        {
+            block_summary_init(&level->nodes[level->count++], time, bpm);
+        }
+    }
+}
+
+/**
+ * @brief Index of the first sample not earlier than the given time.
+ */
+static int sample_lower_bound(int32_t (*samples)[2], int count, int32_t time)
+{
+    int low = 0;
+    int high = count;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (samples[mid][0] < time)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * @brief Resolve a viewport to at most max_points nodes from the finest level that fits.
+ */
+int lod_query(const LodPyramid *pyramid, int32_t (*samples)[2], int32_t from, int32_t to, int max_points, BlockSummary *out, int *level)
+{
+    int first = sample_lower_bound(samples, pyramid->sampleCount, from);
+    int last = sample_lower_bound(samples, pyramid->sampleCount, to);
+    *level = 0;
+
+    if (first >= last)
+    {
+        return 0;
+    }
+
+    // Raw samples fit in the budget.
+    if (last - first <= max_points)
+    {
+        for (int i = first; i < last; i++)
+        {
+            block_summary_init(&out[i - first], samples[i][0], samples[i][1]);
+        }
+        return last - first;
+    }
+
+    // Without levels, summarize runs of consecutive samples.
+    if (pyramid->disabled)
+    {
+        int run = (last - first + max_points - 1) / max_points;
+        int written = 0;
+        for (int i = first; i < last; i++)
+        {
+            if ((i - first) % run == 0)
+            {
+                block_summary_init(&out[written++], samples[i][0], samples[i][1]);
+            }
+            else
+            {
+                block_summary_add(&out[written - 1], samples[i][0], samples[i][1]);
+            }
+        }
+        *level = 1;
+        return written;
+    }
+
+    // Finest level whose nodes covering the viewport fit in the budget.
+    int k = 0;
+    int first_node, last_node;
+    do
+    {
+        int shift = LOD_FANOUT_SHIFT * (k + 1);
+        first_node = first >> shift;
+        last_node = (last - 1) >> shift;
+        k++;
+    } while (last_node - first_node + 1 > max_points && k < LOD_MAX_LEVELS);
+
+    const LodLevel *nodes = &pyramid->levels[k - 1];
+    if (last_node >= nodes->count)
+    {
+        last_node = nodes->count - 1;
+    }
+
+    int written = 0;
+    for (int i = first_node; i <= last_node && written < max_points; i++)
+    {
+        out[written++] = nodes->nodes[i];
+    }
+
+    *level = k;
+    return written;
+}
@@ -0,0 +1,105 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile lod.h
+ * @author Daniel Oliveira
+ * @brief Level-of-detail pyramid of the heart rate history for zoomable views.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef LOD_H
+#define LOD_H
+
+#include <stdint.h>
+#include "history.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Number of nodes of a level summarized by one node of the next level.
+#define LOD_FANOUT_SHIFT 2
+#define LOD_FANOUT (1 << LOD_FANOUT_SHIFT)
+
+// Number of stored levels, a node of the coarsest one covers 4^15 samples.
+#define LOD_MAX_LEVELS 15
+
+/**
+ * @brief Nodes of one pyramid level, node i of level k summarizes samples [i * 4^k, (i + 1) * 4^k).
+ */
+typedef struct
+{
+    BlockSummary *nodes;
+    int count;
+    int capacity;
+} LodLevel;
+
+/**
+ * @brief Min/max/mean pyramid over the heart rate history.
+ *
+ * Level 0 is the history itself and is not stored, levels[k] holds level k + 1.
+ * If a level cannot grow for lack of memory, the levels are freed and the pyramid is
+ * disabled until the next reset: the queries then summarize the samples directly.
+ */
+typedef struct
+{
+    LodLevel levels[LOD_MAX_LEVELS];
+    int sampleCount;
+    int disabled;
+} LodPyramid;
+
+/**
+ * @brief Initialize an empty pyramid.
+ * @param pyramid The LodPyramid instance.
+ */
+void lod_init(LodPyramid *pyramid);
+
+/**
+ * @brief Free the memory used by a pyramid.
+ * @param pyramid The LodPyramid instance.
+ */
+void lod_free(LodPyramid *pyramid);
+
+/**
+ * @brief Drop every node, e.g. after the history has been cleared.
+ * @param pyramid The LodPyramid instance.
+ */
+void lod_reset(LodPyramid *pyramid);
+
+/**
+ * @brief Account for a sample appended to the history.
+ * @param pyramid The LodPyramid instance.
+ * @param time The sample time.
+ * @param bpm The heart rate value.
+ *
+ * Updates the last node of every level, O(log n) per sample. The samples are counted
+ * even when the pyramid is disabled, so it keeps the indices of the history.
+ */
+void lod_add(LodPyramid *pyramid, int32_t time, int32_t bpm);
+
+/**
+ * @brief Resolve a viewport to at most max_points nodes from the finest level that fits.
+ * @param pyramid The LodPyramid of the history.
+ * @param samples The history samples (time, bpm).
+ * @param from The start of the viewport (inclusive).
+ * @param to The end of the viewport (exclusive).
+ * @param max_points The maximum number of nodes to return, at least 2.
+ * @param out The output nodes, at least max_points long.
+ * @param level The level the nodes were taken from (0 for raw samples, above 0 for summaries).
+ * @return The number of nodes written.
+ *
+ * The viewport is located with a binary search over the history, then the nodes are
+ * copied from the chosen level, so the cost is O(log n + points returned). Nodes at the
+ * edges of the viewport may include samples just outside of it. A disabled pyramid
+ * summarizes the samples of the viewport instead, in O(samples in the viewport).
+ */
+int lod_query(const LodPyramid *pyramid, int32_t (*samples)[2], int32_t from, int32_t to, int max_points, BlockSummary *out, int *level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,12 +11,35 @@
 
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
 #include <gattlib.h>
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include "ecdh.h"
 #include "band.h"
+#include "plot.h"
+#include "adapter.h"
+#include "scheduler.h"
+#include "compactor.h"
+
+// Maximum number of bands served at once.
+#define MAX_BANDS 64
+
+// Period of the reconnection and rebalancing of the bands over the adapters, in seconds.
+#define REBALANCE_INTERVAL_S 30
+
+/**
+ * @brief The bands served and the adapters they are spread over.
+ */
+typedef struct
+{
+    AdapterPool pool;
+    BLEDevice *devices[MAX_BANDS];
+    int count;
+} Fleet;
 
 // Initialize global main loop
 GMainLoop *loop;
@@ -54,49 +77,273 @@ gboolean notification_query(gpointer data)
 {
 
     BLEDevice *device = (BLEDevice *)data;
+
+    // A dropped band is reconnected by the rebalancing, and measured again once authenticated.
+    if (!device->connected || !device->authenticated)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    // Off the wrist, keepalives are replaced by an occasional one-shot measurement.
+    if (device->wear.state == WEAR_OFF)
+    {
+        if (wear_probe_due(&device->wear, time(NULL)))
+        {
+            probe_heart_rate(device);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    // Duty cycled bands are kept alive by the scheduler during their windows.
+    if (device->dutyCycled)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    // At the sparser interval levels, a one-shot measurement every period instead of the keepalive.
+    if (interval_period(device->interval.level) > 1)
+    {
+        if (interval_probe_due(&device->interval, time(NULL)))
+        {
+            probe_heart_rate(device);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
     ping_heart_rate(device);
 
     return G_SOURCE_CONTINUE;
 }
 
+/**
+ * @brief Periodically reconnects dropped bands and spreads the bands over the adapters.
+ *
+ * @param data The Fleet instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean rebalance_adapters(gpointer data)
+{
+    Fleet *fleet = (Fleet *)data;
+
+    adapter_pool_rebalance(&fleet->pool, fleet->devices, fleet->count);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts and ends the duty cycle windows of the bands.
+ *
+ * @param data The DutyScheduler instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean duty_cycle(gpointer data)
+{
+    DutyScheduler *scheduler = (DutyScheduler *)data;
+
+    duty_scheduler_tick(scheduler, time(NULL));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Collects the completed writes of the session files.
+ *
+ * @param fd The completion eventfd of the queue.
+ * @param condition The condition of the file descriptor.
+ * @param data The StorageQueue instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean collect_writes(gint fd, GIOCondition condition, gpointer data)
+{
+    storage_queue_poll((StorageQueue *)data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts a background compaction pass of the session directory.
+ *
+ * @param data The Compactor instance passed as user data.
+ * @return gboolean Returns G_SOURCE_CONTINUE to keep the event source active.
+ */
+gboolean compact_sessions(gpointer data)
+{
+    compactor_start((Compactor *)data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Print the statistics of a band at exit.
+ *
+ * @param device The BLEDevice instance.
+ */
+void report_device(BLEDevice *device)
+{
+    printf("Band %s: \n", device->macAddress);
+
+    // Report the time actually covered by measurements.
+    if (device->hrCount > 1)
+    {
+        int32_t first = device->hrHist[0][0];
+        int32_t last = device->hrHist[device->hrCount - 1][0];
+        printf("Measured %lld s out of %d s (%d gaps) \n", (long long)gap_list_covered(&device->hrGaps, first, last),
+               last - first, device->hrGaps.count);
+    }
+
+    if (device->events.dispatched > 0)
+    {
+        printf("Dispatched %lld device events, latency mean %.1f us, max %lld us \n", (long long)device->events.dispatched,
+               (double)device->events.latencySum / device->events.dispatched, (long long)device->events.latencyMax);
+    }
+
+    if (device->wear.skippedPings > 0)
+    {
+        printf("Skipped %lld keepalives while the band was off the wrist (%lld probes) \n",
+               (long long)device->wear.skippedPings, (long long)device->wear.probes);
+    }
+}
+
 /**
  * @brief Main function.
  * 
- * Starts the connection with the device, adds main loop callback,
+ * Starts the connection with the devices, adds main loop callbacks,
  * starts the main loop and waits for keyboard interrupts to clean up.
  *  
  */
 int main()
 {
-    const char *mac_address = MAC_ADDRESS;
     const int band_type = atoi(BAND_TYPE);
+    const int live_plot_interval = atoi(LIVE_PLOT);
+    const int max_staleness = atoi(MAX_STALENESS);
 
     signal(SIGINT, handle_sigint);
     loop = g_main_loop_new(NULL, FALSE);
 
-    // Create and connect BLEDevice.
-    BLEDevice *device = ble_device_create(mac_address, band_type);
-    if (!device)
+    // Open the adapters the bands are spread over.
+    static Fleet fleet;
+    if (adapter_pool_open(&fleet.pool, ADAPTERS, ADAPTER_DEFAULT_CAPACITY) < 0)
     {
-        printf("Failed to connect to the device.\n");
+        printf("Failed to open the adapters.\n");
         return 1;
     }
 
-    // Set callback function for the loop.
-    guint timeout_id = g_timeout_add(10000, notification_query, (gpointer)device);
+    // Create and connect a BLEDevice for each of the comma-separated MAC addresses.
+    char mac_addresses[] = MAC_ADDRESS;
+    char *saveptr = NULL;
+    for (char *mac_address = strtok_r(mac_addresses, ",", &saveptr); mac_address && fleet.count < MAX_BANDS;
+         mac_address = strtok_r(NULL, ",", &saveptr))
+    {
+        BLEDevice *device = adapter_pool_connect(&fleet.pool, mac_address, band_type);
+        if (!device)
+        {
+            printf("Failed to connect to the device %s.\n", mac_address);
+            continue;
+        }
+        fleet.devices[fleet.count++] = device;
+    }
 
-    // Enable notifications of chunked tranfer to start authentication.
-    enable_notifications_chunked(device);
+    if (fleet.count == 0)
+    {
+        adapter_pool_close(&fleet.pool);
+        return 1;
+    }
+
+    guint timeout_ids[MAX_BANDS];
+    for (int i = 0; i < fleet.count; i++)
+    {
+        // Set callback function for the loop.
+        timeout_ids[i] = g_timeout_add(10000, notification_query, (gpointer)fleet.devices[i]);
+
+        // Enable notifications of chunked tranfer to start authentication.
+        enable_notifications_chunked(fleet.devices[i]);
+    }
+    guint rebalance_id = g_timeout_add_seconds(REBALANCE_INTERVAL_S, rebalance_adapters, &fleet);
+
+    // Stagger the continuous measurement of the bands, instead of measuring all of them at once.
+    static DutyScheduler scheduler;
+    guint duty_id = 0;
+    if (max_staleness > 0 && duty_scheduler_init(&scheduler, fleet.devices, fleet.count, atoi(AIRTIME_BUDGET), max_staleness, time(NULL)) == 0)
+    {
+        duty_id = g_timeout_add_seconds(1, duty_cycle, &scheduler);
+    }
+
+    // Collect the completed writes as they complete, rather than on the next write.
+    StorageQueue *storage = storage_queue_shared();
+    guint storage_id = 0;
+    if (storage && storage_queue_fd(storage) >= 0)
+    {
+        storage_id = g_unix_fd_add(storage_queue_fd(storage), G_IO_IN, collect_writes, storage);
+    }
+
+    // Retention and compaction of the session files, in the background at the lowest priority.
+    static Compactor compactor;
+    compactor_init(&compactor, SESSION_DIR, (int64_t)atoi(RETENTION_DAYS) * 86400, COMPACT_RATE_BYTES);
+    guint compact_id = g_timeout_add_seconds(COMPACT_INTERVAL_S, compact_sessions, &compactor);
+
+    // Start the live plot of the first band, refreshed from the main loop.
+    LivePlot *live_plot = NULL;
+    if (live_plot_interval > 0)
+    {
+        live_plot = live_plot_start(fleet.devices[0], live_plot_interval);
+    }
 
     // Starts glib main event loop.
     g_main_loop_run(loop);
 
     // Plot recorded heart rate.
-    plot_heart_rate(device);
+    if (live_plot)
+    {
+        live_plot_stop(live_plot);
+    }
+
+    for (int i = 0; i < fleet.count; i++)
+    {
+        if (!live_plot || i > 0)
+        {
+            plot_heart_rate(fleet.devices[i]);
+        }
+        report_device(fleet.devices[i]);
+    }
+
+    if (duty_id)
+    {
+        duty_scheduler_report(&scheduler, time(NULL));
+    }
+
+    if (fleet.pool.moves > 0)
+    {
+        printf("Moved or reconnected bands %lld times \n", (long long)fleet.pool.moves);
+    }
 
     // Clean up.
-    g_source_remove(timeout_id);
-    ble_device_destroy(device);
+    g_source_remove(compact_id);
+    compactor_stop(&compactor);
+    if (compactor.passes > 0)
+    {
+        compactor_report(&compactor);
+    }
+    compactor_free(&compactor);
+    g_source_remove(rebalance_id);
+    if (duty_id)
+    {
+        g_source_remove(duty_id);
+        duty_scheduler_free(&scheduler);
+    }
+    for (int i = 0; i < fleet.count; i++)
+    {
+        g_source_remove(timeout_ids[i]);
+        adapter_pool_release(&fleet.pool, fleet.devices[i]);
+        ble_device_destroy(fleet.devices[i]);
+    }
+    adapter_pool_close(&fleet.pool);
+
+    if (storage_id)
+    {
+        g_source_remove(storage_id);
+    }
+    // The session files are closed, report their writes.
+    storage_queue_shutdown();
 
     return 0;
 }
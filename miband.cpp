@@ -0,0 +1,194 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file miband.cpp
+ * @author Daniel Oliveira
+ * @brief C++17 interface: move-only band handle, zero-copy history views and sample callbacks.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include "miband.hpp"
+
+namespace miband
+{
+
+/**
+ * @brief The samples of a time range, located with a binary search.
+ */
+HistoryView HistoryView::between(std::int32_t from, std::int32_t to) const noexcept
+{
+    auto lower_bound = [this](std::int32_t time) {
+        std::size_t low = 0;
+        std::size_t high = size_;
+        while (low < high)
+        {
+            std::size_t mid = low + (high - low) / 2;
+            if (samples_[mid][0] < time)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return low;
+    };
+
+    std::size_t first = lower_bound(from);
+    std::size_t last = lower_bound(to);
+    if (last < first)
+    {
+        last = first;
+    }
+
+    return HistoryView(samples_ + first, raw_ + first, last - first);
+}
+
+/**
+ * @brief Connect to a band.
+ */
+std::optional<Band> Band::connect(const std::string &mac_address, int band_type)
+{
+    BLEDevice *device = ble_device_create(mac_address.c_str(), band_type);
+    if (device == nullptr)
+    {
+        return std::nullopt;
+    }
+    return std::optional<Band>(std::in_place, device);
+}
+
+Band::Band(Band &&other) noexcept
+    : device_(std::exchange(other.device_, nullptr)), callback_(std::move(other.callback_))
+{
+}
+
+Band &Band::operator=(Band &&other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        device_ = std::exchange(other.device_, nullptr);
+        callback_ = std::move(other.callback_);
+    }
+    return *this;
+}
+
+Band::~Band()
+{
+    reset();
+}
+
+/**
+ * @brief Disconnect and free the owned device, if any.
+ */
+void Band::reset() noexcept
+{
+    if (device_ != nullptr)
+    {
+        ble_device_set_sample_callback(device_, nullptr, nullptr);
+        ble_device_destroy(device_);
+        device_ = nullptr;
+    }
+    callback_.reset();
+}
+
+/**
+ * @brief Start the authentication, the heart rate measurement follows once it succeeds.
+ */
+void Band::start()
+{
+    enable_notifications_chunked(device_);
+}
+
+/**
+ * @brief Keep the continuous measurement alive.
+ */
+void Band::ping()
+{
+    ping_heart_rate(device_);
+}
+
+/**
+ * @brief Plot the history with gnuplot.
+ */
+void Band::plot() const
+{
+    plot_heart_rate(device_);
+}
+
+/**
+ * @brief Plot a time range of the history with gnuplot.
+ */
+void Band::plot(std::int32_t from, std::int32_t to) const
+{
+    plot_heart_rate_range(device_, from, to);
+}
+
+/**
+ * @brief Zero-copy view over the history.
+ */
+HistoryView Band::history() const noexcept
+{
+    return HistoryView(device_->hrHist, device_->hrRaw, static_cast<std::size_t>(device_->hrCount));
+}
+
+/**
+ * @brief The gaps detected in the history.
+ */
+Span<const Gap> Band::gaps() const noexcept
+{
+    return Span<const Gap>(device_->hrGaps.gaps, static_cast<std::size_t>(device_->hrGaps.count));
+}
+
+/**
+ * @brief The first sample of a time range below a threshold.
+ */
+std::optional<Sample> Band::find_below(std::int32_t from, std::int32_t to, std::int32_t threshold) const noexcept
+{
+    int index = ble_device_find_below(device_, from, to, threshold);
+    if (index < 0)
+    {
+        return std::nullopt;
+    }
+    return history()[static_cast<std::size_t>(index)];
+}
+
+/**
+ * @brief The count, min, max and sum of the samples of a time range.
+ */
+BlockSummary Band::aggregate(std::int32_t from, std::int32_t to) const noexcept
+{
+    BlockSummary result;
+    ble_device_aggregate(device_, from, to, &result);
+    return result;
+}
+
+/**
+ * @brief Remove the sample callback.
+ */
+void Band::clear_sample_callback() noexcept
+{
+    if (device_ != nullptr)
+    {
+        ble_device_set_sample_callback(device_, nullptr, nullptr);
+    }
+    callback_.reset();
+}
+
+/**
+ * @brief Give up ownership of the BLEDevice.
+ */
+BLEDevice *Band::release() noexcept
+{
+    if (device_ != nullptr)
+    {
+        ble_device_set_sample_callback(device_, nullptr, nullptr);
+    }
+    callback_.reset();
+    return std::exchange(device_, nullptr);
+}
+
+} // namespace miband
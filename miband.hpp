@@ -0,0 +1,297 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile miband.hpp
+ * @author Daniel Oliveira
+ * @brief C++17 interface: move-only band handle, zero-copy history views and sample callbacks.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef MIBAND_HPP
+#define MIBAND_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "band.h"
+
+namespace miband
+{
+
+/**
+ * @brief Non-owning view over a contiguous array, a subset of C++20 std::span.
+ */
+template <typename T>
+class Span
+{
+public:
+    constexpr Span() noexcept = default;
+    constexpr Span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+
+    constexpr Span subspan(std::size_t offset, std::size_t count) const noexcept
+    {
+        return Span(data_ + offset, count);
+    }
+
+private:
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/**
+ * @brief One heart rate sample: time, filtered value, value as received and quality.
+ */
+struct Sample
+{
+    // Seconds since the start of the session, as every time of the Band interface.
+    std::int32_t time;
+    std::int32_t bpm;
+    std::uint16_t raw;
+    SampleQuality quality;
+};
+
+/**
+ * @brief Zero-copy view over the heart rate history.
+ *
+ * The view reads the arrays of the BLEDevice directly. It is invalidated when the history
+ * grows past its capacity or is cleared, i.e. by any notification handled after it was taken.
+ */
+class HistoryView
+{
+public:
+    /**
+     * @brief Iterator producing the samples by value.
+     */
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Sample;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Sample;
+
+        Iterator(const HistoryView *view, std::size_t index) noexcept : view_(view), index_(index) {}
+
+        Sample operator*() const noexcept { return (*view_)[index_]; }
+        Iterator &operator++() noexcept
+        {
+            ++index_;
+            return *this;
+        }
+        Iterator operator++(int) noexcept
+        {
+            Iterator previous = *this;
+            ++index_;
+            return previous;
+        }
+        bool operator==(const Iterator &other) const noexcept { return index_ == other.index_; }
+        bool operator!=(const Iterator &other) const noexcept { return index_ != other.index_; }
+
+    private:
+        const HistoryView *view_;
+        std::size_t index_;
+    };
+
+    HistoryView() noexcept = default;
+    HistoryView(const std::int32_t (*samples)[2], const RawSample *raw, std::size_t size) noexcept
+        : samples_(samples), raw_(raw), size_(size) {}
+
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    Sample operator[](std::size_t i) const noexcept
+    {
+        return Sample{samples_[i][0], samples_[i][1], raw_[i].raw, static_cast<SampleQuality>(raw_[i].quality)};
+    }
+
+    Iterator begin() const noexcept { return Iterator(this, 0); }
+    Iterator end() const noexcept { return Iterator(this, size_); }
+
+    /**
+     * @brief The (time, bpm) pairs as stored, e.g. to hand them to C functions.
+     */
+    Span<const std::int32_t[2]> samples() const noexcept { return Span<const std::int32_t[2]>(samples_, size_); }
+
+    /**
+     * @brief The values as received and their quality.
+     */
+    Span<const RawSample> raw() const noexcept { return Span<const RawSample>(raw_, size_); }
+
+    /**
+     * @brief The samples of a time range, located with a binary search.
+     * @param from The start of the time range (inclusive).
+     * @param to The end of the time range (exclusive).
+     */
+    HistoryView between(std::int32_t from, std::int32_t to) const noexcept;
+
+private:
+    const std::int32_t (*samples_)[2] = nullptr;
+    const RawSample *raw_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/**
+ * @brief Move-only owner of a connected band.
+ *
+ * The destructor disconnects the band and frees the BLEDevice, a moved-from Band owns nothing.
+ */
+class Band
+{
+public:
+    /**
+     * @brief Connect to a band.
+     * @param mac_address The MAC address of the band.
+     * @param band_type The band model (6 or 7).
+     * @return The connected Band, or std::nullopt if the connection failed.
+     */
+    static std::optional<Band> connect(const std::string &mac_address, int band_type);
+
+    /**
+     * @brief Take ownership of a BLEDevice created with ble_device_create.
+     */
+    explicit Band(BLEDevice *device) noexcept : device_(device) {}
+
+    Band(Band &&other) noexcept;
+    Band &operator=(Band &&other) noexcept;
+    Band(const Band &) = delete;
+    Band &operator=(const Band &) = delete;
+    ~Band();
+
+    /**
+     * @brief Start the authentication, the heart rate measurement follows once it succeeds.
+     */
+    void start();
+
+    /**
+     * @brief Keep the continuous measurement alive, to be called every few seconds from the main loop.
+     */
+    void ping();
+
+    /**
+     * @brief Plot the history with gnuplot.
+     */
+    void plot() const;
+
+    /**
+     * @brief Plot a time range of the history with gnuplot, from the level-of-detail pyramid.
+     * @param from The start of the time range (inclusive).
+     * @param to The end of the time range (exclusive).
+     */
+    void plot(std::int32_t from, std::int32_t to) const;
+
+    /**
+     * @brief Zero-copy view over the history.
+     */
+    HistoryView history() const noexcept;
+
+    /**
+     * @brief The gaps detected in the history.
+     */
+    Span<const Gap> gaps() const noexcept;
+
+    /**
+     * @brief The first sample of a time range below a threshold, e.g. "any HR < 40 last week?".
+     * @param from The start of the time range (inclusive).
+     * @param to The end of the time range (exclusive).
+     * @param threshold The heart rate threshold.
+     */
+    std::optional<Sample> find_below(std::int32_t from, std::int32_t to, std::int32_t threshold) const noexcept;
+
+    /**
+     * @brief The count, min, max and sum of the samples of a time range, from the block summaries.
+     * @param from The start of the time range (inclusive).
+     * @param to The end of the time range (exclusive).
+     */
+    BlockSummary aggregate(std::int32_t from, std::int32_t to) const noexcept;
+
+    /**
+     * @brief The latest time-domain heart rate variability.
+     */
+    const HrvMetrics &hrv() const noexcept { return device_->hrvMetrics; }
+
+    /**
+     * @brief The latest LF/HF powers.
+     */
+    const SpectralMetrics &spectral() const noexcept { return device_->spectralMetrics; }
+
+    /**
+     * @brief The wear state of the band.
+     */
+    WearState wear() const noexcept { return device_->wear.state; }
+
+    /**
+     * @brief Register the functor called for every stored sample, replacing the previous one.
+     * @param callback A functor callable with a const Sample &. It must not throw.
+     *
+     * The functor is moved to the heap once, here. On the sample path it is called through
+     * a function pointer instantiated for its exact type, without std::function or allocation.
+     */
+    template <typename F>
+    void on_sample(F &&callback);
+
+    /**
+     * @brief Remove the sample callback.
+     */
+    void clear_sample_callback() noexcept;
+
+    /**
+     * @brief The underlying BLEDevice, still owned by the Band.
+     */
+    BLEDevice *get() const noexcept { return device_; }
+
+    /**
+     * @brief Give up ownership of the BLEDevice, the caller must destroy it.
+     */
+    BLEDevice *release() noexcept;
+
+    explicit operator bool() const noexcept { return device_ != nullptr; }
+
+private:
+    using CallbackPtr = std::unique_ptr<void, void (*)(void *)>;
+
+    template <typename F>
+    static void sample_trampoline(std::int32_t time, std::int32_t bpm, RawSample raw, void *user_data) noexcept;
+
+    static void no_delete(void *) noexcept {}
+
+    void reset() noexcept;
+
+    BLEDevice *device_ = nullptr;
+    CallbackPtr callback_{nullptr, &Band::no_delete};
+};
+
+template <typename F>
+void Band::on_sample(F &&callback)
+{
+    using Functor = std::decay_t<F>;
+    static_assert(std::is_invocable_v<Functor &, const Sample &>, "the sample callback must be callable with a const Sample &");
+
+    Functor *functor = new Functor(std::forward<F>(callback));
+    ble_device_set_sample_callback(device_, &Band::sample_trampoline<Functor>, functor);
+    callback_ = CallbackPtr(functor, [](void *pointer) { delete static_cast<Functor *>(pointer); });
+}
+
+template <typename F>
+void Band::sample_trampoline(std::int32_t time, std::int32_t bpm, RawSample raw, void *user_data) noexcept
+{
+    (*static_cast<F *>(user_data))(Sample{time, bpm, raw.raw, static_cast<SampleQuality>(raw.quality)});
+}
+
+} // namespace miband
+
+#endif
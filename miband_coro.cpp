@@ -0,0 +1,228 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file miband_coro.cpp
+ * @author Daniel Oliveira
+ * @brief C++20 coroutine interface: awaitable authentication, samples and activity fetch.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include "miband_coro.hpp"
+
+namespace miband
+{
+
+// Capacity of the activity buffers, one day of minutes. They only grow for longer fetches.
+static constexpr std::size_t ActivityCapacity = 1440;
+
+/**
+ * @brief Drive a connected band from coroutines.
+ */
+AsyncBand::AsyncBand(Band band) : band_(std::move(band))
+{
+    // The source is never ready until an awaiter completes, it has no fd and no timeout.
+    static GSourceFuncs source_funcs = {nullptr, nullptr, &AsyncBand::dispatch, nullptr, nullptr, nullptr};
+
+    source_ = reinterpret_cast<Source *>(g_source_new(&source_funcs, sizeof(Source)));
+    source_->band = this;
+    g_source_attach(&source_->source, nullptr);
+
+    activityPending_.reserve(ActivityCapacity);
+    activityBatch_.reserve(ActivityCapacity);
+
+    ble_device_set_auth_callback(band_.get(), &AsyncBand::auth_completed, this);
+    band_.on_sample([this](const Sample &sample) { sample_stored(sample); });
+}
+
+AsyncBand::~AsyncBand()
+{
+    BLEDevice *device = band_.get();
+    if (device != nullptr)
+    {
+        ble_device_set_auth_callback(device, nullptr, nullptr);
+        if (fetchStatus_ == FETCH_RUNNING)
+        {
+            device->activityCallback = nullptr;
+            device->activityCallbackData = nullptr;
+        }
+    }
+    band_.clear_sample_callback();
+
+    g_source_destroy(&source_->source);
+    g_source_unref(&source_->source);
+}
+
+void AsyncBand::AuthAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    handle_ = handle;
+    band_->authWaiter_ = this;
+
+    // The band answers with notifications, handled once the coroutine is suspended.
+    enable_notifications_chunked(band_->band_.get());
+}
+
+void AsyncBand::SampleAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    handle_ = handle;
+    band_->sampleWaiter_ = this;
+}
+
+void AsyncBand::ActivityStream::NextAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    handle_ = handle;
+    band_->activityWaiter_ = this;
+}
+
+/**
+ * @brief Fetch the activity stored on the band since a given time.
+ */
+AsyncBand::ActivityStream AsyncBand::fetch_activity(std::int64_t since)
+{
+    if (fetchStatus_ == FETCH_RUNNING)
+    {
+        return ActivityStream(this);
+    }
+
+    activityPending_.clear();
+    activityBatch_.clear();
+    fetchStatus_ = FETCH_RUNNING;
+
+    if (closed_ || ::fetch_activity(band_.get(), static_cast<time_t>(since), &AsyncBand::activity_received, this) != 0)
+    {
+        fetchStatus_ = FETCH_FAILED;
+    }
+
+    return ActivityStream(this);
+}
+
+/**
+ * @brief Resume every waiting coroutine with a failure, and fail the later awaits.
+ */
+void AsyncBand::close() noexcept
+{
+    closed_ = true;
+
+    if (fetchStatus_ == FETCH_RUNNING)
+    {
+        band_.get()->activityCallback = nullptr;
+        band_.get()->activityCallbackData = nullptr;
+        fetchStatus_ = FETCH_FAILED;
+    }
+
+    if (authWaiter_ != nullptr)
+    {
+        authWaiter_->accepted_ = false;
+        wake(std::exchange(authWaiter_, nullptr)->handle_);
+    }
+    if (sampleWaiter_ != nullptr)
+    {
+        sampleWaiter_->sample_.reset();
+        wake(std::exchange(sampleWaiter_, nullptr)->handle_);
+    }
+    if (activityWaiter_ != nullptr)
+    {
+        wake(std::exchange(activityWaiter_, nullptr)->handle_);
+    }
+}
+
+/**
+ * @brief Authentication callback of the BLEDevice.
+ */
+void AsyncBand::auth_completed(int status, void *user_data) noexcept
+{
+    AsyncBand *band = static_cast<AsyncBand *>(user_data);
+    if (band->authWaiter_ != nullptr)
+    {
+        band->authWaiter_->accepted_ = status == 0;
+        band->wake(std::exchange(band->authWaiter_, nullptr)->handle_);
+    }
+}
+
+/**
+ * @brief Sample callback of the BLEDevice.
+ */
+void AsyncBand::sample_stored(const Sample &sample) noexcept
+{
+    if (sampleWaiter_ != nullptr)
+    {
+        sampleWaiter_->sample_ = sample;
+        wake(std::exchange(sampleWaiter_, nullptr)->handle_);
+    }
+}
+
+/**
+ * @brief Activity callback of the BLEDevice: buffer the samples, the consumer takes them in batches.
+ */
+void AsyncBand::activity_received(const ActivitySample *samples, int count, int status, void *user_data) noexcept
+{
+    AsyncBand *band = static_cast<AsyncBand *>(user_data);
+
+    band->activityPending_.insert(band->activityPending_.end(), samples, samples + count);
+    if (status != FETCH_RUNNING)
+    {
+        band->fetchStatus_ = status;
+    }
+
+    if (band->activityWaiter_ != nullptr && band->activity_ready())
+    {
+        band->wake(std::exchange(band->activityWaiter_, nullptr)->handle_);
+    }
+}
+
+bool AsyncBand::activity_ready() const noexcept
+{
+    return !activityPending_.empty() || fetchStatus_ != FETCH_RUNNING;
+}
+
+/**
+ * @brief Hand the buffered samples to the consumer, swapping the two buffers.
+ */
+std::optional<Span<const ActivitySample>> AsyncBand::take_activity() noexcept
+{
+    if (activityPending_.empty())
+    {
+        return std::nullopt;
+    }
+
+    activityBatch_.swap(activityPending_);
+    activityPending_.clear();
+    return Span<const ActivitySample>(activityBatch_.data(), activityBatch_.size());
+}
+
+/**
+ * @brief Queue a coroutine to be resumed by the next dispatch of the source.
+ */
+void AsyncBand::wake(std::coroutine_handle<> handle) noexcept
+{
+    ready_[readyCount_++] = handle;
+    g_source_set_ready_time(&source_->source, 0);
+}
+
+/**
+ * @brief Resume the queued coroutines, from the main loop.
+ */
+gboolean AsyncBand::dispatch(GSource *source, GSourceFunc, gpointer) noexcept
+{
+    AsyncBand *band = reinterpret_cast<Source *>(source)->band;
+
+    // The coroutines may await again, or destroy the band, while they run.
+    std::coroutine_handle<> ready[MaxReady];
+    int count = band->readyCount_;
+    for (int i = 0; i < count; i++)
+    {
+        ready[i] = band->ready_[i];
+    }
+    band->readyCount_ = 0;
+    g_source_set_ready_time(source, -1);
+
+    for (int i = 0; i < count; i++)
+    {
+        ready[i].resume();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+} // namespace miband
@@ -0,0 +1,388 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile miband_coro.hpp
+ * @author Daniel Oliveira
+ * @brief C++20 coroutine interface: awaitable authentication, samples and activity fetch.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef MIBAND_CORO_HPP
+#define MIBAND_CORO_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "miband.hpp"
+
+namespace miband
+{
+
+template <typename T = void>
+class Task;
+
+namespace detail
+{
+
+/**
+ * @brief Promise state shared by every Task: the awaiting coroutine and the exception, if any.
+ */
+struct TaskPromiseBase
+{
+    /**
+     * @brief Resume the awaiting coroutine, or free the frame of a detached task.
+     */
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            TaskPromiseBase &promise = handle.promise();
+            if (promise.continuation)
+            {
+                return promise.continuation;
+            }
+            if (promise.detached)
+            {
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+
+    void unhandled_exception() noexcept
+    {
+        // Nobody can catch the exception of a detached task, it runs from the main loop.
+        if (detached)
+        {
+            std::terminate();
+        }
+        exception = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    Task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U &&result) noexcept(std::is_nothrow_constructible_v<T, U &&>)
+    {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T take()
+    {
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    Task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void take()
+    {
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Lazily started coroutine, awaited by another Task or detached to run on its own.
+ *
+ * The frame is allocated once when the coroutine is called. Awaiting a Task, or any of the
+ * AsyncBand awaitables, allocates nothing: the awaiters live in the suspended frame.
+ */
+template <typename T>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle_)
+            {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    /**
+     * @brief Run the task until it completes, then resume the awaiting coroutine.
+     */
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume() { return handle.promise().take(); }
+        };
+        return Awaiter{handle_};
+    }
+
+    /**
+     * @brief Start the task, which frees its own frame when it completes.
+     *
+     * Call it from the main loop, e.g. before g_main_loop_run or from a glib callback.
+     */
+    void detach() &&
+    {
+        std::coroutine_handle<promise_type> handle = std::exchange(handle_, nullptr);
+        handle.promise().detached = true;
+        handle.resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail
+{
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/**
+ * @brief Band driven by coroutines resumed from the glib main loop.
+ *
+ * Each awaitable has one slot in the AsyncBand, so one coroutine at a time may await the
+ * authentication, the next sample or the activity data of a given band. The C callbacks
+ * only fill the awaiter and mark a GSource, owned by the AsyncBand, ready: the coroutines
+ * are resumed when the main loop dispatches it, never from inside a notification handler.
+ * Nothing is allocated per await, the activity buffers keep their capacity between fetches.
+ *
+ * The AsyncBand takes over the sample and authentication callbacks of the Band, and does not
+ * start the heart rate measurement when authenticated: call start_measurement for that.
+ * It must not be moved, and must outlive the coroutines awaiting it (see close).
+ */
+class AsyncBand
+{
+public:
+    /**
+     * @brief Awaiter of the authentication, resumes with true if the band accepted the key.
+     */
+    class AuthAwaiter
+    {
+    public:
+        explicit AuthAwaiter(AsyncBand *band) noexcept : band_(band) {}
+
+        bool await_ready() const noexcept { return band_->closed_; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept;
+        bool await_resume() const noexcept { return accepted_; }
+
+    private:
+        friend class AsyncBand;
+
+        AsyncBand *band_;
+        std::coroutine_handle<> handle_;
+        bool accepted_ = false;
+    };
+
+    /**
+     * @brief Awaiter of the next stored sample, resumes with std::nullopt once the band is closed.
+     */
+    class SampleAwaiter
+    {
+    public:
+        explicit SampleAwaiter(AsyncBand *band) noexcept : band_(band) {}
+
+        bool await_ready() const noexcept { return band_->closed_; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept;
+        std::optional<Sample> await_resume() const noexcept { return sample_; }
+
+    private:
+        friend class AsyncBand;
+
+        AsyncBand *band_;
+        std::coroutine_handle<> handle_;
+        std::optional<Sample> sample_;
+    };
+
+    /**
+     * @brief Async generator over the activity data of a fetch.
+     *
+     * co_await next() yields the samples received since the previous call, or std::nullopt
+     * once the fetch has ended. A batch is valid until the next call to next().
+     */
+    class ActivityStream
+    {
+    public:
+        /**
+         * @brief Awaiter of the next batch of activity samples.
+         */
+        class NextAwaiter
+        {
+        public:
+            explicit NextAwaiter(AsyncBand *band) noexcept : band_(band) {}
+
+            bool await_ready() const noexcept { return band_->activity_ready(); }
+            void await_suspend(std::coroutine_handle<> handle) noexcept;
+            std::optional<Span<const ActivitySample>> await_resume() noexcept { return band_->take_activity(); }
+
+        private:
+            friend class AsyncBand;
+
+            AsyncBand *band_;
+            std::coroutine_handle<> handle_;
+        };
+
+        explicit ActivityStream(AsyncBand *band) noexcept : band_(band) {}
+
+        NextAwaiter next() noexcept { return NextAwaiter(band_); }
+
+        /**
+         * @brief Whether the fetch could not be started or was interrupted.
+         */
+        bool failed() const noexcept { return band_->fetchStatus_ == FETCH_FAILED; }
+
+    private:
+        AsyncBand *band_;
+    };
+
+    /**
+     * @brief Drive a connected band from coroutines.
+     * @param band The band, not authenticated yet.
+     */
+    explicit AsyncBand(Band band);
+
+    AsyncBand(const AsyncBand &) = delete;
+    AsyncBand &operator=(const AsyncBand &) = delete;
+    ~AsyncBand();
+
+    /**
+     * @brief Authenticate: co_await band.authenticate() resumes with true on success.
+     */
+    AuthAwaiter authenticate() noexcept { return AuthAwaiter(this); }
+
+    /**
+     * @brief The next stored sample: samples stored while nobody awaits are only in the history.
+     */
+    SampleAwaiter next_sample() noexcept { return SampleAwaiter(this); }
+
+    /**
+     * @brief Fetch the activity stored on the band since a given time.
+     * @param since The local time of the first minute to fetch.
+     * @return The stream of the fetch, or of the fetch already running.
+     */
+    ActivityStream fetch_activity(std::int64_t since);
+
+    /**
+     * @brief Start the continuous heart rate measurement, once authenticated.
+     */
+    void start_measurement() { start_hr_measure(band_.get()); }
+
+    /**
+     * @brief Resume every waiting coroutine with a failure, and fail the later awaits.
+     */
+    void close() noexcept;
+
+    Band &band() noexcept { return band_; }
+    const Band &band() const noexcept { return band_; }
+
+private:
+    // One waiting coroutine per awaitable kind.
+    static constexpr int MaxReady = 3;
+
+    struct Source
+    {
+        GSource source;
+        AsyncBand *band;
+    };
+
+    static void auth_completed(int status, void *user_data) noexcept;
+    static void activity_received(const ActivitySample *samples, int count, int status, void *user_data) noexcept;
+    static gboolean dispatch(GSource *source, GSourceFunc callback, gpointer user_data) noexcept;
+
+    void sample_stored(const Sample &sample) noexcept;
+    void wake(std::coroutine_handle<> handle) noexcept;
+    bool activity_ready() const noexcept;
+    std::optional<Span<const ActivitySample>> take_activity() noexcept;
+
+    Band band_;
+    Source *source_ = nullptr;
+    std::coroutine_handle<> ready_[MaxReady];
+    int readyCount_ = 0;
+    bool closed_ = false;
+
+    AuthAwaiter *authWaiter_ = nullptr;
+    SampleAwaiter *sampleWaiter_ = nullptr;
+    ActivityStream::NextAwaiter *activityWaiter_ = nullptr;
+
+    std::vector<ActivitySample> activityPending_;
+    std::vector<ActivitySample> activityBatch_;
+    int fetchStatus_ = FETCH_DONE;
+};
+
+} // namespace miband
+
+#endif
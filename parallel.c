@@ -0,0 +1,471 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file parallel.c
+ * @author Daniel Oliveira
+ * @brief Parallel scan and aggregation over session, archive and columnar files.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "parallel.h"
+#include "session.h"
+#include "archive.h"
+#include "columnar.h"
+
+// Number of records of a session file per task.
+#define SESSION_TASK_RECORDS (1 << 20)
+
+// Number of blocks of an archive file per task.
+#define ARCHIVE_TASK_BLOCKS 256
+
+// Number of row groups of a columnar file per task.
+#define COLUMNAR_TASK_GROUPS 64
+
+/**
+ * @brief A mapped input file.
+ */
+typedef struct
+{
+    int isArchive;
+    int isColumnar;
+    int isOpen;
+    SessionFile session;
+    ArchiveFile archive;
+    ColumnarFile columnar;
+} ScanFile;
+
+/**
+ * @brief A unit of work: a range of records of a session file, of bytes of an archive file or of row groups of a columnar file.
+ */
+typedef struct
+{
+    ScanFile *file;
+    size_t begin;
+    size_t end;
+} ScanTask;
+
+/**
+ * @brief State shared by the workers of one scan.
+ */
+typedef struct
+{
+    ScanTask *tasks;
+    size_t taskCount;
+    atomic_size_t nextTask;
+    const ScanFilter *filter;
+
+    pthread_mutex_t lock;
+    Aggregate result;
+    int status;
+} ScanJob;
+
+/**
+ * @brief Add a sample to an aggregate.
+ */
+void aggregate_add(Aggregate *aggregate, int32_t bpm)
+{
+    if (aggregate->count == 0 || bpm < aggregate->min)
+    {
+        aggregate->min = bpm;
+    }
+    if (aggregate->count == 0 || bpm > aggregate->max)
+    {
+        aggregate->max = bpm;
+    }
+    aggregate->sum += bpm;
+    aggregate->count++;
+}
+
+/**
+ * @brief Merge an aggregate into another one.
+ */
+void aggregate_merge(Aggregate *aggregate, const Aggregate *other)
+{
+    if (other->count == 0)
+    {
+        return;
+    }
+
+    if (aggregate->count == 0 || other->min < aggregate->min)
+    {
+        aggregate->min = other->min;
+    }
+    if (aggregate->count == 0 || other->max > aggregate->max)
+    {
+        aggregate->max = other->max;
+    }
+    aggregate->sum += other->sum;
+    aggregate->count += other->count;
+}
+
+/**
+ * @brief Merge the summary of an encoded block into an aggregate.
+ */
+void aggregate_merge_block(Aggregate *aggregate, const CodecBlockHeader *header)
+{
+    Aggregate block = {header->count, header->sumBpm, header->minBpm, header->maxBpm};
+    aggregate_merge(aggregate, &block);
+}
+
+/**
+ * @brief Aggregate a range of records of a session file.
+ */
+static int scan_session(const ScanFilter *filter, const ScanTask *task, Aggregate *partial)
+{
+    const SessionFile *file = &task->file->session;
+    const SessionRecord *records = file->records + task->begin;
+    size_t count = task->end - task->begin;
+
+    size_t first = session_lower_bound(records, count, session_relative_time(file->header, filter->from));
+    size_t last = session_lower_bound(records, count, session_relative_time(file->header, filter->to));
+
+    for (size_t i = first; i < last; i++)
+    {
+        if (records[i].bpm < filter->below && records[i].bpm > filter->above)
+        {
+            aggregate_add(partial, records[i].bpm);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Aggregate a range of blocks of an archive file.
+ */
+static int scan_archive(const ScanFilter *filter, const ScanTask *task, Aggregate *partial, SessionRecord **records, size_t *capacity)
+{
+    const ArchiveFile *archive = &task->file->archive;
+    int64_t from = session_relative_time(archive->header, filter->from);
+    int64_t to = session_relative_time(archive->header, filter->to);
+
+    size_t offset = task->begin;
+    CodecBlockHeader header;
+    const uint8_t *block;
+    size_t size;
+
+    while (offset < task->end && archive_file_next_block(archive, &offset, &header, &block, &size) == 1)
+    {
+        // Skip blocks outside of the time range or of the bpm filter without decoding them.
+        if (header.lastTime < from || header.firstTime >= to ||
+            header.minBpm >= filter->below || header.maxBpm <= filter->above)
+        {
+            continue;
+        }
+
+        // Aggregate blocks entirely inside the filter from their summary.
+        if (header.firstTime >= from && header.lastTime < to &&
+            header.maxBpm < filter->below && header.minBpm > filter->above)
+        {
+            aggregate_merge_block(partial, &header);
+            continue;
+        }
+
+        if (header.count > *capacity)
+        {
+            SessionRecord *grown = realloc(*records, header.count * sizeof(SessionRecord));
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                return -1;
+            }
+            *records = grown;
+            *capacity = header.count;
+        }
+
+        int count = codec_decode_block(block, size, *records, *capacity);
+        if (count < 0)
+        {
+            fprintf(stderr, "Error: corrupted block in archive\n");
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const SessionRecord *record = &(*records)[i];
+            if (record->time >= from && record->time < to &&
+                record->bpm < filter->below && record->bpm > filter->above)
+            {
+                aggregate_add(partial, record->bpm);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Aggregate a range of row groups of a columnar file, reading only the time and heart rate columns.
+ */
+static int scan_columnar(const ScanFilter *filter, const ScanTask *task, Aggregate *partial, ColumnarColumns *columns)
+{
+    const ColumnarFile *file = &task->file->columnar;
+    int64_t from = session_relative_time(file->header, filter->from);
+    int64_t to = session_relative_time(file->header, filter->to);
+
+    for (size_t g = task->begin; g < task->end; g++)
+    {
+        const ColumnarGroup *group = &file->groups[g];
+        const ColumnarChunk *time = &group->chunks[COLUMNAR_TIME];
+        const ColumnarChunk *bpm = &group->chunks[COLUMNAR_BPM];
+
+        // Skip groups outside of the time range or of the bpm filter without reading them.
+        if (time->max < from || time->min >= to || bpm->min >= filter->below || bpm->max <= filter->above)
+        {
+            continue;
+        }
+
+        // Aggregate groups entirely inside the filter from the statistics of the footer.
+        if (time->min >= from && time->max < to && bpm->max < filter->below && bpm->min > filter->above)
+        {
+            Aggregate summary = {group->count, bpm->sum, bpm->min, bpm->max};
+            aggregate_merge(partial, &summary);
+            continue;
+        }
+
+        if (columnar_read_group(file, g, COLUMNAR_SELECT(COLUMNAR_TIME) | COLUMNAR_SELECT(COLUMNAR_BPM), columns) != 0)
+        {
+            fprintf(stderr, "Error: corrupted chunk in columnar file\n");
+            return -1;
+        }
+
+        for (size_t i = 0; i < columns->count; i++)
+        {
+            if (columns->time[i] >= from && columns->time[i] < to &&
+                columns->bpm[i] < filter->below && columns->bpm[i] > filter->above)
+            {
+                aggregate_add(partial, columns->bpm[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Worker thread: run tasks from the shared queue, then merge the partial aggregate.
+ */
+static void *scan_worker(void *arg)
+{
+    ScanJob *job = (ScanJob *)arg;
+    Aggregate partial;
+    memset(&partial, 0, sizeof(partial));
+    SessionRecord *records = NULL;
+    size_t capacity = 0;
+    ColumnarColumns columns;
+    memset(&columns, 0, sizeof(columns));
+    int status = 0;
+
+    for (;;)
+    {
+        size_t index = atomic_fetch_add(&job->nextTask, 1);
+        if (index >= job->taskCount)
+        {
+            break;
+        }
+
+        const ScanTask *task = &job->tasks[index];
+        if (task->file->isArchive)
+        {
+            status |= scan_archive(job->filter, task, &partial, &records, &capacity);
+        }
+        else if (task->file->isColumnar)
+        {
+            status |= scan_columnar(job->filter, task, &partial, &columns);
+        }
+        else
+        {
+            status |= scan_session(job->filter, task, &partial);
+        }
+    }
+
+    free(records);
+    columnar_columns_free(&columns);
+
+    pthread_mutex_lock(&job->lock);
+    aggregate_merge(&job->result, &partial);
+    if (status != 0)
+    {
+        job->status = -1;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Append a task, growing the task array if needed. The job fails if the memory runs out.
+ */
+static void add_task(ScanJob *job, size_t *capacity, ScanFile *file, size_t begin, size_t end)
+{
+    if (job->taskCount == *capacity)
+    {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        ScanTask *grown = realloc(job->tasks, grown_capacity * sizeof(ScanTask));
+        if (grown == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            job->status = -1;
+            return;
+        }
+        job->tasks = grown;
+        *capacity = grown_capacity;
+    }
+
+    ScanTask *task = &job->tasks[job->taskCount++];
+    task->file = file;
+    task->begin = begin;
+    task->end = end;
+}
+
+/**
+ * @brief Aggregate the samples of session, archive and columnar files on a pool of threads.
+ */
+int parallel_aggregate(char **paths, int path_count, const ScanFilter *filter, int threads, Aggregate *result)
+{
+    ScanJob job;
+    memset(&job, 0, sizeof(job));
+    job.filter = filter;
+    atomic_init(&job.nextTask, 0);
+    pthread_mutex_init(&job.lock, NULL);
+
+    ScanFile *files = calloc(path_count, sizeof(ScanFile));
+    size_t task_capacity = 0;
+
+    // Map every file and split it into tasks.
+    for (int i = 0; i < path_count; i++)
+    {
+        ScanFile *file = &files[i];
+        file->isArchive = archive_is_archive(paths[i]);
+        file->isColumnar = !file->isArchive && columnar_is_columnar(paths[i]);
+
+        if (file->isColumnar)
+        {
+            if (columnar_file_open(paths[i], &file->columnar) != 0)
+            {
+                job.status = -1;
+                continue;
+            }
+
+            // The footer gives the row groups, cut every COLUMNAR_TASK_GROUPS groups.
+            for (size_t begin = 0; begin < file->columnar.groupCount; begin += COLUMNAR_TASK_GROUPS)
+            {
+                size_t end = begin + COLUMNAR_TASK_GROUPS;
+                add_task(&job, &task_capacity, file, begin, end < file->columnar.groupCount ? end : file->columnar.groupCount);
+            }
+        }
+        else if (file->isArchive)
+        {
+            if (archive_file_open(paths[i], &file->archive) != 0)
+            {
+                job.status = -1;
+                continue;
+            }
+
+            // Walk the block headers to cut the archive every ARCHIVE_TASK_BLOCKS blocks.
+            size_t offset = 0;
+            size_t begin = 0;
+            int blocks = 0;
+            CodecBlockHeader header;
+            const uint8_t *block;
+            size_t size;
+            int ret;
+
+            while ((ret = archive_file_next_block(&file->archive, &offset, &header, &block, &size)) == 1)
+            {
+                if (++blocks == ARCHIVE_TASK_BLOCKS)
+                {
+                    add_task(&job, &task_capacity, file, begin, offset);
+                    begin = offset;
+                    blocks = 0;
+                }
+            }
+            if (blocks > 0)
+            {
+                add_task(&job, &task_capacity, file, begin, offset);
+            }
+            if (ret < 0)
+            {
+                fprintf(stderr, "Error: truncated archive %s\n", paths[i]);
+                job.status = -1;
+            }
+        }
+        else
+        {
+            if (session_file_open(paths[i], &file->session) != 0)
+            {
+                job.status = -1;
+                continue;
+            }
+
+            for (size_t begin = 0; begin < file->session.recordCount; begin += SESSION_TASK_RECORDS)
+            {
+                size_t end = begin + SESSION_TASK_RECORDS;
+                add_task(&job, &task_capacity, file, begin, end < file->session.recordCount ? end : file->session.recordCount);
+            }
+        }
+        file->isOpen = 1;
+    }
+
+    // Run the workers, the calling thread being one of them.
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if ((size_t)threads > job.taskCount)
+    {
+        threads = job.taskCount > 0 ? (int)job.taskCount : 1;
+    }
+
+    pthread_t *workers = malloc((threads - 1) * sizeof(pthread_t) + 1);
+    int started = 0;
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&workers[started], NULL, scan_worker, &job) != 0)
+        {
+            break;
+        }
+    }
+
+    scan_worker(&job);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // Clean up.
+    for (int i = 0; i < path_count; i++)
+    {
+        if (!files[i].isOpen)
+        {
+            continue;
+        }
+        if (files[i].isArchive)
+        {
+            archive_file_close(&files[i].archive);
+        }
+        else if (files[i].isColumnar)
+        {
+            columnar_file_close(&files[i].columnar);
+        }
+        else
+        {
+            session_file_close(&files[i].session);
+        }
+    }
+    free(files);
+    free(job.tasks);
+    pthread_mutex_destroy(&job.lock);
+
+    *result = job.result;
+    return job.status;
+}
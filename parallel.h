@@ -0,0 +1,77 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile parallel.h
+ * @author Daniel Oliveira
+ * @brief Parallel scan and aggregation over session and archive files.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+#include "codec.h"
+
+/**
+ * @brief Running aggregate over a set of samples.
+ */
+typedef struct
+{
+    int64_t count;
+    int64_t sum;
+    int32_t min;
+    int32_t max;
+} Aggregate;
+
+/**
+ * @brief Samples selected by a scan: from <= time < to (epoch seconds) and above < bpm < below.
+ */
+typedef struct
+{
+    int64_t from;
+    int64_t to;
+    int64_t below;
+    int64_t above;
+} ScanFilter;
+
+/**
+ * @brief Add a sample to an aggregate.
+ * @param aggregate The Aggregate to update.
+ * @param bpm The heart rate value.
+ */
+void aggregate_add(Aggregate *aggregate, int32_t bpm);
+
+/**
+ * @brief Merge an aggregate into another one.
+ * @param aggregate The Aggregate to update.
+ * @param other The Aggregate to merge, it may be empty.
+ */
+void aggregate_merge(Aggregate *aggregate, const Aggregate *other);
+
+/**
+ * @brief Merge the summary of an encoded block into an aggregate.
+ * @param aggregate The Aggregate to update.
+ * @param header The header of the block.
+ */
+void aggregate_merge_block(Aggregate *aggregate, const CodecBlockHeader *header);
+
+/**
+ * @brief Aggregate the samples of session, archive and columnar files on a pool of threads.
+ * @param paths The session (.hrs), archive (.hra) and columnar (.hrc) files to scan.
+ * @param path_count The number of files.
+ * @param filter The samples to aggregate.
+ * @param threads The number of worker threads.
+ * @param result The aggregate of every selected sample.
+ * @return 0 on success, -1 if a file could not be read or is corrupted (the other files are still aggregated).
+ *
+ * Files are split into tasks (ranges of records or of blocks) that the workers pick
+ * from a shared queue, each worker aggregates into its own partial result and the
+ * partial results are merged at the end. Archive blocks and columnar row groups are
+ * pruned and aggregated from their summaries whenever possible, as in the sequential queries.
+ */
+int parallel_aggregate(char **paths, int path_count, const ScanFilter *filter, int threads, Aggregate *result);
+
+#endif
@@ -0,0 +1,239 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file plot.c
+ * @author Daniel Oliveira
+ * @brief Gnuplot helpers and live heart rate plot.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <glib.h>
+#include "plot.h"
+
+// Size of the gnuplot pipe buffer.
+#define PLOT_PIPE_BUFFER (1024 * 1024)
+
+/**
+ * @brief Open a pipe to gnuplot and configure the heart rate plot.
+ */
+FILE *gnuplot_open()
+{
+    // Open a pipe to gnuplot
+    FILE *gnuplot_pipe = popen("gnuplot -persistent", "w");
+    if (!gnuplot_pipe)
+    {
+        fprintf(stderr, "Error: could not open a pipe to gnuplot\n");
+        return NULL;
+    }
+
+    // Data is written in large blocks.
+    setvbuf(gnuplot_pipe, NULL, _IOFBF, PLOT_PIPE_BUFFER);
+
+    // Configure the plot
+    fprintf(gnuplot_pipe, "set title 'Heart Rate vs. Time'\n");
+    fprintf(gnuplot_pipe, "set xlabel 'Time (s)'\n");
+    fprintf(gnuplot_pipe, "set ylabel 'Heart Rate (bpm)'\n");
+
+    // Empty datablock the points are appended to.
+    fprintf(gnuplot_pipe, "$HR << EOD\nEOD\n");
+
+    return gnuplot_pipe;
+}
+
+/**
+ * @brief Append points to the $HR datablock.
+ */
+void gnuplot_append_points(FILE *pipe, int32_t (*points)[2], int count)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+
+    fprintf(pipe, "set table $HR append\n");
+    fprintf(pipe, "plot '-' binary record=%d format=\"%%int32%%int32\" using 1:2 with table\n", count);
+    fwrite(points, sizeof(*points), count, pipe);
+    fprintf(pipe, "unset table\n");
+}
+
+/**
+ * @brief Append a line break to the $HR datablock.
+ */
+void gnuplot_append_break(FILE *pipe)
+{
+    // A blank line in a datablock breaks the line without starting a new data set.
+    fprintf(pipe, "set print $HR append\nprint \"\"\nunset print\n");
+}
+
+/**
+ * @brief Append a range of the history to the $HR datablock, breaking the line at every gap.
+ */
+void gnuplot_append_history(FILE *pipe, int32_t (*points)[2], int first, int last, const GapList *gaps)
+{
+    int start = first;
+
+    for (int g = gap_list_find(gaps, first); g < gaps->count && gaps->gaps[g].index < last; g++)
+    {
+        int index = gaps->gaps[g].index;
+        gnuplot_append_points(pipe, points + start, index - start);
+        gnuplot_append_break(pipe);
+        start = index;
+    }
+
+    gnuplot_append_points(pipe, points + start, last - start);
+}
+
+/**
+ * @brief Append a viewport of the history to the $HR datablock, with at most 2 * max_points points.
+ */
+int gnuplot_append_viewport(FILE *pipe, const LodPyramid *pyramid, int32_t (*points)[2], int32_t from, int32_t to,
+                            int max_points, const GapList *gaps)
+{
+    BlockSummary *nodes = malloc(max_points * sizeof(BlockSummary));
+    int32_t(*line)[2] = malloc(2 * max_points * sizeof(*line));
+    if (nodes == NULL || line == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        free(nodes);
+        free(line);
+        return 0;
+    }
+
+    int level;
+    int count = lod_query(pyramid, points, from, to, max_points, nodes, &level);
+    int written = 0;
+    int start = 0;
+    int g = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Break the line at a gap lying between the previous node and this one.
+        int gap = 0;
+        while (i > 0 && g < gaps->count && gaps->gaps[g].end <= nodes[i].firstTime)
+        {
+            gap |= gaps->gaps[g].start >= nodes[i - 1].lastTime;
+            g++;
+        }
+        if (gap)
+        {
+            gnuplot_append_points(pipe, line + start, written - start);
+            gnuplot_append_break(pipe);
+            start = written;
+        }
+
+        line[written][0] = nodes[i].firstTime;
+        line[written][1] = nodes[i].minBpm;
+        written++;
+        if (level > 0)
+        {
+            line[written][0] = nodes[i].lastTime;
+            line[written][1] = nodes[i].maxBpm;
+            written++;
+        }
+    }
+    gnuplot_append_points(pipe, line + start, written - start);
+
+    free(nodes);
+    free(line);
+    return written;
+}
+
+/**
+ * @brief Draw the $HR datablock and flush the pipe.
+ */
+void gnuplot_draw(FILE *pipe)
+{
+    fprintf(pipe, "plot $HR with linespoints linetype 1 linecolor 'blue', $HR with points pointtype 6 lc rgb 'red'\n");
+    fflush(pipe);
+}
+
+/**
+ * @brief Timer callback: send the new samples and redraw.
+ */
+static gboolean live_plot_refresh(gpointer data)
+{
+    LivePlot *plot = (LivePlot *)data;
+    BLEDevice *device = plot->device;
+
+    // The history was cleared, start the datablock over.
+    if (device->hrCount < plot->sentCount)
+    {
+        fprintf(plot->pipe, "$HR << EOD\nEOD\n");
+        plot->sentCount = 0;
+        plot->datablockPoints = 0;
+    }
+
+    // Nothing new, skip the redraw.
+    if (device->hrCount == plot->sentCount)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    // Rebuild a datablock grown too large from the pyramid, otherwise append the new samples.
+    int new_points = device->hrCount - plot->sentCount;
+    if (plot->datablockPoints + new_points > 2 * PLOT_MAX_POINTS)
+    {
+        fprintf(plot->pipe, "$HR << EOD\nEOD\n");
+        plot->datablockPoints = gnuplot_append_viewport(plot->pipe, &device->hrPyramid, device->hrHist, INT32_MIN,
+                                                        INT32_MAX, PLOT_MAX_POINTS / 2, &device->hrGaps);
+    }
+    else
+    {
+        gnuplot_append_history(plot->pipe, device->hrHist, plot->sentCount, device->hrCount, &device->hrGaps);
+        plot->datablockPoints += new_points;
+    }
+    plot->sentCount = device->hrCount;
+    gnuplot_draw(plot->pipe);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Start a live plot of the heart rate history, refreshed from the glib main loop.
+ */
+LivePlot *live_plot_start(BLEDevice *device, guint interval_ms)
+{
+    FILE *pipe = gnuplot_open();
+    if (pipe == NULL)
+    {
+        return NULL;
+    }
+
+    LivePlot *plot = malloc(sizeof(LivePlot));
+    plot->pipe = pipe;
+    plot->device = device;
+    plot->sentCount = 0;
+    plot->datablockPoints = 0;
+
+    // Cap the refresh rate.
+    if (interval_ms < LIVE_PLOT_MIN_INTERVAL_MS)
+    {
+        interval_ms = LIVE_PLOT_MIN_INTERVAL_MS;
+    }
+    plot->timeoutId = g_timeout_add(interval_ms, live_plot_refresh, (gpointer)plot);
+
+    return plot;
+}
+
+/**
+ * @brief Stop the live plot and close the gnuplot pipe. The plot window stays open.
+ */
+void live_plot_stop(LivePlot *plot)
+{
+    if (plot == NULL)
+    {
+        return;
+    }
+
+    g_source_remove(plot->timeoutId);
+
+    // Draw the last samples before closing.
+    live_plot_refresh(plot);
+    pclose(plot->pipe);
+    free(plot);
+}
@@ -0,0 +1,118 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile plot.h
+ * @author Daniel Oliveira
+ * @brief Gnuplot helpers and live heart rate plot.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef PLOT_H
+#define PLOT_H
+
+#include <stdio.h>
+#include <glib.h>
+#include "band.h"
+
+// Minimum time between two refreshes of the live plot.
+#define LIVE_PLOT_MIN_INTERVAL_MS 250
+
+// Points drawn for a viewport, longer ranges are drawn from the level-of-detail pyramid.
+#define PLOT_MAX_POINTS 2048
+
+/**
+ * @brief Live plot state: one gnuplot pipe kept open for the whole session.
+ */
+typedef struct
+{
+    FILE *pipe;
+    BLEDevice *device;
+    int sentCount;
+    int datablockPoints;
+    guint timeoutId;
+} LivePlot;
+
+/**
+ * @brief Open a pipe to gnuplot and configure the heart rate plot.
+ * @return The gnuplot pipe, or NULL if gnuplot could not be started.
+ *
+ * The pipe is fully buffered with a large buffer and an empty $HR datablock is defined.
+ */
+FILE *gnuplot_open();
+
+/**
+ * @brief Append points to the $HR datablock.
+ * @param pipe The gnuplot pipe.
+ * @param points The (time, bpm) points to append.
+ * @param count The number of points.
+ *
+ * The points are sent as gnuplot binary inline data (int32 pairs) in a single write
+ * straight from the history array.
+ */
+void gnuplot_append_points(FILE *pipe, int32_t (*points)[2], int count);
+
+/**
+ * @brief Append a line break to the $HR datablock, the points before and after it are not joined.
+ * @param pipe The gnuplot pipe.
+ */
+void gnuplot_append_break(FILE *pipe);
+
+/**
+ * @brief Append a range of the history to the $HR datablock, breaking the line at every gap.
+ * @param pipe The gnuplot pipe.
+ * @param points The history (time, bpm) points.
+ * @param first The index of the first point to append.
+ * @param last The index after the last point to append.
+ * @param gaps The gaps of the history.
+ *
+ * The gaps in the range are found with a binary search, each run of points between two
+ * gaps is sent in a single write.
+ */
+void gnuplot_append_history(FILE *pipe, int32_t (*points)[2], int first, int last, const GapList *gaps);
+
+/**
+ * @brief Append a viewport of the history to the $HR datablock, with at most 2 * max_points points.
+ * @param pipe The gnuplot pipe.
+ * @param pyramid The LodPyramid of the history.
+ * @param points The history (time, bpm) points.
+ * @param from The start of the viewport (inclusive).
+ * @param to The end of the viewport (exclusive).
+ * @param max_points The number of pyramid nodes to draw, at least 2.
+ * @param gaps The gaps of the history.
+ * @return The number of points appended.
+ *
+ * The viewport is resolved with lod_query. When it holds more than max_points samples,
+ * each node is drawn as its minimum and maximum, so spikes stay visible at any zoom level.
+ * The line is broken at the gaps lying between two nodes.
+ */
+int gnuplot_append_viewport(FILE *pipe, const LodPyramid *pyramid, int32_t (*points)[2], int32_t from, int32_t to,
+                            int max_points, const GapList *gaps);
+
+/**
+ * @brief Draw the $HR datablock and flush the pipe.
+ * @param pipe The gnuplot pipe.
+ */
+void gnuplot_draw(FILE *pipe);
+
+/**
+ * @brief Start a live plot of the heart rate history, refreshed from the glib main loop.
+ * @param device The BLEDevice instance whose history is plotted.
+ * @param interval_ms The refresh interval, raised to LIVE_PLOT_MIN_INTERVAL_MS if lower.
+ * @return A pointer to the LivePlot instance, or NULL if gnuplot could not be started.
+ *
+ * Each refresh only sends the samples received since the previous one, so its cost
+ * grows with the number of new samples and not with the length of the session. Once the
+ * datablock holds more than 2 * PLOT_MAX_POINTS points, it is rebuilt from the
+ * level-of-detail pyramid, so gnuplot never redraws more than a few thousand points.
+ */
+LivePlot *live_plot_start(BLEDevice *device, guint interval_ms);
+
+/**
+ * @brief Stop the live plot and close the gnuplot pipe. The plot window stays open.
+ * @param plot The LivePlot instance.
+ */
+void live_plot_stop(LivePlot *plot);
+
+#endif
@@ -0,0 +1,136 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file plot_bench.c
+ * @author Daniel Oliveira
+ * @brief Benchmark of the hand-off of the history to gnuplot: two ASCII passes against one binary write.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "plot.h"
+
+// Size of the pipe buffer, as for the gnuplot pipe.
+#define BENCH_PIPE_BUFFER (1024 * 1024)
+
+/**
+ * @brief Current monotonic time in seconds.
+ */
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Open the pipe the points are handed to.
+ */
+static FILE *open_pipe(const char *command)
+{
+    FILE *pipe = popen(command, "w");
+    if (pipe == NULL)
+    {
+        fprintf(stderr, "Error: could not open a pipe to %s\n", command);
+        return NULL;
+    }
+    setvbuf(pipe, NULL, _IOFBF, BENCH_PIPE_BUFFER);
+    return pipe;
+}
+
+/**
+ * @brief Hand the points over as before: formatted with fprintf, once for the line and once for the points.
+ * @return The time taken, including draining the pipe, in seconds, or -1 on error.
+ */
+static double hand_off_ascii(const char *command, int32_t (*points)[2], int count)
+{
+    double start = now_seconds();
+    FILE *pipe = open_pipe(command);
+    if (pipe == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(pipe, "plot '-' with lines, '-' with points\n");
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            fprintf(pipe, "%d %d\n", points[i][0], points[i][1]);
+        }
+        fprintf(pipe, "e\n");
+    }
+
+    pclose(pipe);
+    return now_seconds() - start;
+}
+
+/**
+ * @brief Hand the points over as plot_heart_rate does: one binary write to the $HR datablock.
+ * @return The time taken, including draining the pipe, in seconds, or -1 on error.
+ */
+static double hand_off_binary(const char *command, int32_t (*points)[2], int count)
+{
+    double start = now_seconds();
+    FILE *pipe = open_pipe(command);
+    if (pipe == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(pipe, "$HR << EOD\nEOD\n");
+    gnuplot_append_points(pipe, points, count);
+    gnuplot_draw(pipe);
+
+    pclose(pipe);
+    return now_seconds() - start;
+}
+
+/**
+ * @brief Main function.
+ *
+ * Usage: miband_plot_bench [POINTS] [COMMAND]. The points (default 1000000) are handed
+ * to COMMAND (default "cat > /dev/null", "gnuplot" to include the parsing) both ways.
+ *
+ * @return int Returns 0 on success, 1 on error.
+ */
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *command = argc > 2 ? argv[2] : "cat > /dev/null";
+    if (count <= 0)
+    {
+        fprintf(stderr, "Usage: %s [POINTS] [COMMAND]\n", argv[0]);
+        return 1;
+    }
+
+    // A heart rate history at 1 Hz.
+    int32_t(*points)[2] = malloc(count * sizeof(*points));
+    if (points == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        points[i][0] = i;
+        points[i][1] = 60 + (i / 30) % 40;
+    }
+
+    double ascii = hand_off_ascii(command, points, count);
+    double binary = hand_off_binary(command, points, count);
+    free(points);
+    if (ascii < 0 || binary < 0)
+    {
+        return 1;
+    }
+
+    printf("Hand-off of %d points to '%s': ASCII twice %.1f ms, binary once %.1f ms \n", count, command, ascii * 1e3,
+           binary * 1e3);
+    return 0;
+}
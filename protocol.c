@@ -0,0 +1,67 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file protocol.c
+ * @author Daniel Oliveira
+ * @brief Command tables of the band protocol and framing of the chunked transfers.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <string.h>
+#include "protocol.h"
+
+_Static_assert(CHUNK_COUNT(CHUNK_FIRST_PAYLOAD) == 1, "a message fitting the first chunk takes one chunk");
+_Static_assert(CHUNK_COUNT(CHUNK_MAX_MESSAGE) == 4, "the 1st authentication part takes four chunks");
+
+/**
+ * @brief Frame a message for the chunked transfer characteristic.
+ */
+int chunk_frame(ChunkedMessage *message, uint8_t type, uint8_t handle, const uint8_t *data, size_t data_length)
+{
+    if (data_length > CHUNK_MAX_MESSAGE)
+    {
+        return -1;
+    }
+
+    uint8_t *chunk = message->buffer;
+    size_t remaining = data_length;
+    int count = 0;
+
+    while (remaining > 0)
+    {
+        int first = count == 0;
+        size_t header_size = first ? CHUNK_FIRST_HEADER_SIZE : CHUNK_HEADER_SIZE;
+        size_t capacity = first ? CHUNK_FIRST_PAYLOAD : CHUNK_PAYLOAD;
+        size_t copybytes = remaining < capacity ? remaining : capacity;
+
+        // Header: the first chunk also carries the total length and the transfer type.
+        chunk[0] = 0x03;
+        chunk[1] = (first ? CHUNK_FLAG_FIRST : 0) | (remaining <= capacity ? CHUNK_FLAG_LAST : 0);
+        chunk[2] = 0;
+        chunk[3] = handle;
+        chunk[4] = count;
+        if (first)
+        {
+            chunk[5] = data_length & 0xff;
+            chunk[6] = (data_length >> 8) & 0xff;
+            chunk[7] = (data_length >> 16) & 0xff;
+            chunk[8] = (data_length >> 24) & 0xff;
+            chunk[9] = type;
+            chunk[10] = 0;
+        }
+
+        memcpy(chunk + header_size, data + data_length - remaining, copybytes);
+
+        message->chunks[count].iov_base = chunk;
+        message->chunks[count].iov_len = header_size + copybytes;
+
+        chunk += header_size + copybytes;
+        remaining -= copybytes;
+        count++;
+    }
+
+    message->count = count;
+    return count;
+}
@@ -0,0 +1,92 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile protocol.h
+ * @author Daniel Oliveira
+ * @brief Command tables of the band protocol and framing of the chunked transfers.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Heart rate control point (0x2a39) commands.
+static const uint8_t HR_CONTINUOUS_START[] = {0x15, 0x01, 0x01};
+static const uint8_t HR_CONTINUOUS_STOP[] = {0x15, 0x01, 0x00};
+static const uint8_t HR_MANUAL_START[] = {0x15, 0x02, 0x01};
+
+// Measurement interval setting, in minutes, for a band measuring on its own.
+#define HR_INTERVAL(minutes) {0x14, 0x00, (minutes)}
+
+// Alert (0x2a46) command: incoming call.
+static const uint8_t ALERT_CALL[] = {0x03, 0x01, 0x0a, 0x0a, 0x0a};
+
+// Activity fetch commands, the data request follows the metadata of the band.
+#define FETCH_ACTIVITY_SINCE 0x01, 0x01
+static const uint8_t FETCH_START_DATA[] = {0x02};
+
+// Prefix of the public key in the 1st authentication part, and the 2nd part command.
+static const uint8_t AUTH_PUBLIC_KEY_PREFIX[] = {0x04, 0x02, 0x00, 0x02};
+#define AUTH_SEND_ENCRYPTED 0x05
+
+// Chunked transfer type of the authentication.
+#define CHUNK_TYPE_AUTH 0x82
+
+// Chunked transfers are written without the long write procedure, in packets of the default MTU.
+#define CHUNK_MTU 23
+#define CHUNK_FIRST_HEADER_SIZE 11
+#define CHUNK_HEADER_SIZE 5
+#define CHUNK_FIRST_PAYLOAD (CHUNK_MTU - 3 - CHUNK_FIRST_HEADER_SIZE)
+#define CHUNK_PAYLOAD (CHUNK_MTU - 3 - CHUNK_HEADER_SIZE)
+
+// Flags of the chunk header.
+#define CHUNK_FLAG_FIRST 0x01
+#define CHUNK_FLAG_LAST 0x06
+
+// Number of chunks and of framed bytes of a message of n bytes.
+#define CHUNK_COUNT(n) ((n) <= CHUNK_FIRST_PAYLOAD ? 1 : 1 + ((n) - CHUNK_FIRST_PAYLOAD + CHUNK_PAYLOAD - 1) / CHUNK_PAYLOAD)
+#define CHUNK_FRAMED_SIZE(n) ((n) + CHUNK_FIRST_HEADER_SIZE + (CHUNK_COUNT(n) - 1) * CHUNK_HEADER_SIZE)
+
+// Largest chunked message, the 1st authentication part.
+#define CHUNK_MAX_MESSAGE 52
+
+/**
+ * @brief A chunked message framed in one buffer, one iovec per packet to write.
+ */
+typedef struct
+{
+    uint8_t buffer[CHUNK_FRAMED_SIZE(CHUNK_MAX_MESSAGE)];
+    struct iovec chunks[CHUNK_COUNT(CHUNK_MAX_MESSAGE)];
+    int count;
+} ChunkedMessage;
+
+/**
+ * @brief Frame a message for the chunked transfer characteristic.
+ * @param message The ChunkedMessage to fill, its buffer is reused for every message.
+ * @param type The type of chunked transfer.
+ * @param handle The handle to use for the transfer.
+ * @param data The data to frame.
+ * @param data_length The length of the data, at most CHUNK_MAX_MESSAGE.
+ * @return The number of chunks, or -1 if the data is too long.
+ *
+ * Headers and payloads are written in place, so each chunk is contiguous in the buffer
+ * and can be written as is. Nothing is allocated.
+ */
+int chunk_frame(ChunkedMessage *message, uint8_t type, uint8_t handle, const uint8_t *data, size_t data_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1912 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file query.c
+ * @author Daniel Oliveira
+ * @brief Command-line tool to query recorded heart rate session files.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "session.h"
+#include "archive.h"
+#include "codec.h"
+#include "parallel.h"
+#include "resample.h"
+#include "filter.h"
+#include "interval.h"
+#include "compactor.h"
+#include "columnar.h"
+#include "rollup.h"
+
+// Names of the columns of a columnar file, in --select and in the output of columns.
+static const char *const COLUMN_NAMES[COLUMNAR_COLUMNS] = {"time", "bpm", "flags", "rr"};
+
+// Size of the stdout buffer, output is streamed in large blocks.
+#define QUERY_OUTPUT_BUFFER (1024 * 1024)
+
+// Size of the writes of the disk pressure thread of ingest, synced one by one.
+#define PRESSURE_CHUNK (1024 * 1024)
+
+/**
+ * @brief Output formats supported by the query tool.
+ */
+typedef enum
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+} OutputFormat;
+
+/**
+ * @brief Query commands supported by the query tool.
+ */
+typedef enum
+{
+    COMMAND_RANGE,
+    COMMAND_AGGREGATE,
+    COMMAND_DOWNSAMPLE,
+    COMMAND_EXPORT,
+    COMMAND_PACK,
+    COMMAND_RESAMPLE,
+    COMMAND_FILTER,
+    COMMAND_INTERVAL,
+    COMMAND_INGEST,
+    COMMAND_COMPACT,
+    COMMAND_COLUMNS
+} QueryCommand;
+
+/**
+ * @brief Episodes (alerts or exercise) of a trace and how late the interval policy sees them.
+ */
+typedef struct
+{
+    int64_t count;
+    int64_t missed;
+    int64_t delaySum;
+    int64_t delayMax;
+
+    // Start of the current episode in the full trace, and whether the policy saw it yet.
+    int64_t start;
+    int active;
+    int seen;
+} IntervalEvents;
+
+/**
+ * @brief Query parameters and streaming state.
+ */
+typedef struct
+{
+    QueryCommand command;
+    OutputFormat format;
+    int64_t from;
+    int64_t to;
+    int64_t bucket;
+
+    // Samples are kept if above < bpm < below.
+    int64_t below;
+    int64_t above;
+
+    // Worker threads for aggregate, and whether to report the scan time.
+    int threads;
+    int timing;
+
+    // Output directory, pace (samples/s, 0 for full speed), disk pressure (MB) and file rotation (s) of ingest.
+    const char *outDir;
+    int64_t pace;
+    int64_t pressure;
+    int64_t rotate;
+    int columnar;
+
+    // Columns printed by columns (COLUMNAR_SELECT bits), and the chunks read from columnar files.
+    unsigned select;
+    int64_t groupsRead;
+    int64_t groupsTotal;
+    int64_t chunkBytes;
+    int64_t fileBytes;
+
+    // Files downsampled from their rollup sidecars, and the buckets read from them.
+    int64_t rollupFiles;
+    int64_t rollupBuckets;
+
+    // Retention (days, 0 to keep everything) and I/O budget (MB/s, 0 for none) of compact.
+    int64_t retentionDays;
+    int64_t ioRate;
+
+    // Number of rows written so far (used for JSON separators).
+    int64_t rows;
+
+    // Band and last sample time (epoch seconds) of the current series. Consecutive files of
+    // a band that follow in time are one series, so rotated files read as a single session.
+    int inSeries;
+    char seriesMac[24];
+    int64_t seriesEnd;
+
+    // Aggregate of the whole query, or of the current bucket when downsampling.
+    Aggregate total;
+    int64_t bucketStart;
+
+    // Resampling grid and the session being resampled.
+    int rate;
+    ResampleMethod method;
+    int64_t maxGap;
+    Resampler *resampler;
+    int resampling;
+    int64_t resampleStart;
+    char resampleMac[24];
+    int64_t resampledSamples;
+
+    // Replay of the current file through the artifact filter.
+    HampelFilter filter;
+    char filterMac[24];
+    int64_t filterCounts[3];
+    int64_t rawSum;
+    int rawCount;
+    int64_t filteredSum;
+    int filteredCount;
+    int64_t rawAlerts;
+    int64_t filteredAlerts;
+    int64_t rawArtifactAlerts;
+    int64_t filteredArtifactAlerts;
+
+    // Replay of the current file through the interval policy.
+    IntervalPolicy interval;
+    char intervalMac[24];
+    int64_t intervalStart;
+    int64_t intervalSamples;
+    int64_t intervalTaken;
+    int64_t nextProbe;
+    int64_t lastTime;
+    int64_t levelTime[3];
+    int64_t fullSum;
+    int fullCount;
+    int64_t takenSum;
+    int takenCount;
+    IntervalEvents events[2];
+} Query;
+
+/**
+ * @brief Print usage information.
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s <command> [options] FILE...\n"
+            "\n"
+            "FILE is a session file (.hrs), an archive file (.hra) or a columnar file (.hrc),\n"
+            "DIR a directory of session and archive files (compact). Consecutive files of a band that\n"
+            "follow in time are queried as one session, as if it had not been rotated.\n"
+            "\n"
+            "Commands:\n"
+            "  range       Print the samples in the time range\n"
+            "  aggregate   Print count, min, max and mean bpm of the time range\n"
+            "  downsample  Print min, max and mean bpm per time bucket (requires --bucket), from the rollup\n"
+            "              sidecars (.hru) when the buckets are whole minutes and no bpm filter is given\n"
+            "  export      Export the samples in the time range (requires --format csv|json)\n"
+            "  pack        Compress session files into archive files, with their rollups, and report the compression\n"
+            "  resample    Interpolate the samples to a uniform time grid, gaps are marked invalid\n"
+            "  filter      Replay the samples through the artifact filter and count the alerts with and without it\n"
+            "  interval    Replay the samples through the adaptive interval policy and report the samples taken and events missed\n"
+            "  ingest      Write session files again through the session writer (requires --out) and report\n"
+            "              the write throughput and the latency of each append\n"
+            "  columns     Print the selected columns of columnar files (.hrc), reading only their chunks\n"
+            "  compact     Delete the files of DIR older than the retention and merge its small files into archives\n"
+            "\n"
+            "Options:\n"
+            "  --from T        Start of the time range (epoch seconds, inclusive)\n"
+            "  --to T          End of the time range (epoch seconds, exclusive)\n"
+            "  --bucket S      Bucket size in seconds for downsample\n"
+            "  --below BPM     Only keep samples with bpm below BPM\n"
+            "  --above BPM     Only keep samples with bpm above BPM\n"
+            "  --threads N     Number of threads used by aggregate\n"
+            "  --rate HZ       Grid rate of resample in Hz (default 1)\n"
+            "  --method M      Interpolation of resample: linear or cubic (default linear)\n"
+            "  --max-gap S     Samples further apart than S seconds delimit a gap (default 10)\n"
+            "  --out DIR       Directory of the files written by ingest, other than the one of the inputs\n"
+            "  --pace N        Samples per second appended by ingest (default 0, as fast as possible)\n"
+            "  --pressure MB   Keep the disk busy during ingest with synced writes to a scratch file of MB megabytes\n"
+            "  --rotate S      Start a new file every S seconds of samples during ingest (default 86400)\n"
+            "  --columnar      Also write a columnar file per session during ingest, with the quality flags of the filter\n"
+            "  --select LIST   Columns printed by columns: time,bpm,flags,rr (default all, rr in ms)\n"
+            "  --retention-days N  Delete the files whose newest sample is older than N days during compact (default 0, keep)\n"
+            "  --io-rate MB    Read and write at most MB megabytes per second during compact (default 4, 0 for no limit)\n"
+            "  --timing        Report the scan time and throughput of aggregate and resample, the chunks read\n"
+            "                  by columns and the rollups read by downsample, on stderr\n"
+            "  --format F      Output format: text, csv or json\n",
+            program);
+}
+
+/**
+ * @brief Write the opening of the output document.
+ */
+static void output_begin(Query *query)
+{
+    if (query->format == FORMAT_JSON)
+    {
+        fputs("[", stdout);
+    }
+    else if (query->format == FORMAT_CSV)
+    {
+        if (query->command == COMMAND_RANGE || query->command == COMMAND_EXPORT)
+        {
+            fputs("mac,time,bpm\n", stdout);
+        }
+        else if (query->command == COMMAND_DOWNSAMPLE)
+        {
+            fputs("time,count,min,max,mean\n", stdout);
+        }
+        else if (query->command == COMMAND_RESAMPLE)
+        {
+            fputs("mac,time,bpm,valid\n", stdout);
+        }
+        else if (query->command == COMMAND_FILTER)
+        {
+            fputs("mac,samples,outliers,invalid,alerts_raw,alerts_filtered,artifact_alerts_raw,artifact_alerts_filtered\n", stdout);
+        }
+        else if (query->command == COMMAND_COLUMNS)
+        {
+            fputs("mac", stdout);
+            for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+            {
+                if (query->select & COLUMNAR_SELECT(column))
+                {
+                    printf(",%s", COLUMN_NAMES[column]);
+                }
+            }
+            fputs("\n", stdout);
+        }
+        else if (query->command == COMMAND_INTERVAL)
+        {
+            fputs("mac,samples,taken,changes,dense_s,normal_s,sparse_s,alerts,alerts_missed,alert_delay_max,"
+                  "exercise,exercise_missed,exercise_delay_max\n", stdout);
+        }
+        else
+        {
+            fputs("count,min,max,mean\n", stdout);
+        }
+    }
+}
+
+/**
+ * @brief Write the closing of the output document.
+ */
+static void output_end(Query *query)
+{
+    if (query->format == FORMAT_JSON)
+    {
+        fputs(query->rows > 0 ? "\n]\n" : "]\n", stdout);
+    }
+}
+
+/**
+ * @brief Write the separator that precedes a row.
+ */
+static void output_row_separator(Query *query)
+{
+    if (query->format == FORMAT_JSON)
+    {
+        fputs(query->rows > 0 ? ",\n" : "\n", stdout);
+    }
+    query->rows++;
+}
+
+/**
+ * @brief Write one sample.
+ */
+static void output_sample(Query *query, const char *mac, int64_t time, int32_t bpm)
+{
+    output_row_separator(query);
+
+    switch (query->format)
+    {
+    case FORMAT_CSV:
+        printf("%s,%lld,%d\n", mac, (long long)time, bpm);
+        break;
+    case FORMAT_JSON:
+        printf("{\"mac\":\"%s\",\"time\":%lld,\"bpm\":%d}", mac, (long long)time, bpm);
+        break;
+    default:
+        printf("%lld %d\n", (long long)time, bpm);
+        break;
+    }
+}
+
+/**
+ * @brief Write one aggregate, optionally tagged with the start of its bucket.
+ */
+static void output_aggregate(Query *query, const Aggregate *aggregate, int has_time, int64_t time)
+{
+    double mean = aggregate->count > 0 ? (double)aggregate->sum / aggregate->count : 0.0;
+
+    output_row_separator(query);
+
+    switch (query->format)
+    {
+    case FORMAT_CSV:
+        if (has_time)
+        {
+            printf("%lld,", (long long)time);
+        }
+        printf("%lld,%d,%d,%.2f\n", (long long)aggregate->count, aggregate->min, aggregate->max, mean);
+        break;
+    case FORMAT_JSON:
+        fputs("{", stdout);
+        if (has_time)
+        {
+            printf("\"time\":%lld,", (long long)time);
+        }
+        printf("\"count\":%lld,\"min\":%d,\"max\":%d,\"mean\":%.2f}", (long long)aggregate->count, aggregate->min, aggregate->max, mean);
+        break;
+    default:
+        if (has_time)
+        {
+            printf("%lld ", (long long)time);
+        }
+        printf("count %lld min %d max %d mean %.2f\n", (long long)aggregate->count, aggregate->min, aggregate->max, mean);
+        break;
+    }
+}
+
+/**
+ * @brief Resampler output: write one block of grid points.
+ */
+static void output_grid(const float *values, const uint8_t *valid, int64_t first, int count, void *user_data)
+{
+    Query *query = (Query *)user_data;
+
+    for (int i = 0; i < count; i++)
+    {
+        double time = query->resampleStart + query->resampler->origin + (double)(first + i) / query->rate;
+
+        output_row_separator(query);
+
+        switch (query->format)
+        {
+        case FORMAT_CSV:
+            if (valid[i])
+            {
+                printf("%s,%.3f,%.2f,1\n", query->resampleMac, time, values[i]);
+            }
+            else
+            {
+                printf("%s,%.3f,,0\n", query->resampleMac, time);
+            }
+            break;
+        case FORMAT_JSON:
+            if (valid[i])
+            {
+                printf("{\"mac\":\"%s\",\"time\":%.3f,\"bpm\":%.2f}", query->resampleMac, time, values[i]);
+            }
+            else
+            {
+                printf("{\"mac\":\"%s\",\"time\":%.3f,\"bpm\":null}", query->resampleMac, time);
+            }
+            break;
+        default:
+            if (valid[i])
+            {
+                printf("%.3f %.2f\n", time, values[i]);
+            }
+            else
+            {
+                printf("%.3f -\n", time);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Feed a slice of records to the resampler, starting the series at the first slice of a file.
+ */
+static void resample_records(Query *query, const SessionHeader *header, const SessionRecord *records, size_t count)
+{
+    if (!query->resampling)
+    {
+        int64_t origin = query->from == INT64_MIN ? INT64_MIN : session_relative_time(header, query->from);
+        resampler_start(query->resampler, origin);
+        query->resampleStart = header->startTime;
+        snprintf(query->resampleMac, sizeof(query->resampleMac), "%s", header->macAddress);
+        query->resampling = 1;
+    }
+
+    // The times of the later files of the series are rebased on the first one.
+    int64_t shift = header->startTime - query->resampleStart;
+    if (shift == 0)
+    {
+        resampler_push(query->resampler, records, count, output_grid, query);
+    }
+    else
+    {
+        SessionRecord *rebased = malloc(count * sizeof(SessionRecord));
+        if (rebased == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            return;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            rebased[i].time = (int32_t)(records[i].time + shift);
+            rebased[i].bpm = records[i].bpm;
+        }
+        resampler_push(query->resampler, rebased, count, output_grid, query);
+        free(rebased);
+    }
+    query->resampledSamples += count;
+}
+
+/**
+ * @brief Replay a slice of records through the artifact filter and the alert rule.
+ */
+static void filter_records(Query *query, const SessionHeader *header, const SessionRecord *records, size_t count)
+{
+    snprintf(query->filterMac, sizeof(query->filterMac), "%s", header->macAddress);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        int32_t bpm = records[i].bpm;
+
+        // Without the filter every value is stored.
+        query->rawSum += bpm;
+        query->rawCount++;
+        int raw_alert = alert_triggered(query->rawSum, query->rawCount, bpm);
+        query->rawAlerts += raw_alert;
+
+        int32_t filtered;
+        int quality = hampel_filter(&query->filter, bpm, &filtered);
+        if (quality < 0)
+        {
+            query->filterCounts[SAMPLE_INVALID]++;
+            query->rawArtifactAlerts += raw_alert;
+            continue;
+        }
+        query->filterCounts[quality]++;
+
+        query->filteredSum += filtered;
+        query->filteredCount++;
+        int filtered_alert = alert_triggered(query->filteredSum, query->filteredCount, filtered);
+        query->filteredAlerts += filtered_alert;
+
+        // Alerts fired on a sample the filter rejected.
+        if (quality != SAMPLE_OK)
+        {
+            query->rawArtifactAlerts += raw_alert;
+            query->filteredArtifactAlerts += filtered_alert;
+        }
+    }
+}
+
+/**
+ * @brief Write the filter replay report of the current file and reset it.
+ */
+static void flush_filter(Query *query)
+{
+    if (query->rawCount > 0)
+    {
+        output_row_separator(query);
+
+        int64_t samples = query->rawCount;
+        int64_t outliers = query->filterCounts[SAMPLE_OUTLIER];
+        int64_t invalid = query->filterCounts[SAMPLE_INVALID];
+
+        switch (query->format)
+        {
+        case FORMAT_CSV:
+            printf("%s,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", query->filterMac, (long long)samples, (long long)outliers,
+                   (long long)invalid, (long long)query->rawAlerts, (long long)query->filteredAlerts,
+                   (long long)query->rawArtifactAlerts, (long long)query->filteredArtifactAlerts);
+            break;
+        case FORMAT_JSON:
+            printf("{\"mac\":\"%s\",\"samples\":%lld,\"outliers\":%lld,\"invalid\":%lld,\"alerts_raw\":%lld,"
+                   "\"alerts_filtered\":%lld,\"artifact_alerts_raw\":%lld,\"artifact_alerts_filtered\":%lld}",
+                   query->filterMac, (long long)samples, (long long)outliers, (long long)invalid,
+                   (long long)query->rawAlerts, (long long)query->filteredAlerts,
+                   (long long)query->rawArtifactAlerts, (long long)query->filteredArtifactAlerts);
+            break;
+        default:
+            printf("%s samples %lld outliers %lld invalid %lld alerts raw %lld filtered %lld on artifacts raw %lld filtered %lld\n",
+                   query->filterMac, (long long)samples, (long long)outliers, (long long)invalid,
+                   (long long)query->rawAlerts, (long long)query->filteredAlerts,
+                   (long long)query->rawArtifactAlerts, (long long)query->filteredArtifactAlerts);
+            break;
+        }
+    }
+
+    hampel_init(&query->filter);
+    memset(query->filterCounts, 0, sizeof(query->filterCounts));
+    query->rawSum = 0;
+    query->rawCount = 0;
+    query->filteredSum = 0;
+    query->filteredCount = 0;
+    query->rawAlerts = 0;
+    query->filteredAlerts = 0;
+    query->rawArtifactAlerts = 0;
+    query->filteredArtifactAlerts = 0;
+}
+
+/**
+ * @brief Follow the episodes of one kind: started in the full trace, seen or not in the samples taken.
+ */
+static void track_events(IntervalEvents *events, int64_t time, int in_full, int taken, int in_taken)
+{
+    if (in_full && !events->active)
+    {
+        events->active = 1;
+        events->seen = 0;
+        events->start = time;
+        events->count++;
+    }
+
+    if (events->active && !events->seen && taken && in_taken)
+    {
+        int64_t delay = time - events->start;
+        events->seen = 1;
+        events->delaySum += delay;
+        if (delay > events->delayMax)
+        {
+            events->delayMax = delay;
+        }
+    }
+
+    if (!in_full && events->active)
+    {
+        events->active = 0;
+        events->missed += !events->seen;
+    }
+}
+
+/**
+ * @brief Replay a slice of records through the interval policy.
+ *
+ * Every record is taken at the continuous (dense) level. At the other levels only the
+ * first record after each period is, as a one-shot measurement would return it. Alerts
+ * and exercise (bpm >= INTERVAL_EXERCISE_BPM) are found in the full trace, and each
+ * episode is missed if it ends before a taken sample shows it.
+ */
+static void interval_records(Query *query, const SessionHeader *header, const SessionRecord *records, size_t count)
+{
+    snprintf(query->intervalMac, sizeof(query->intervalMac), "%s", header->macAddress);
+    if (query->intervalSamples == 0)
+    {
+        query->intervalStart = header->startTime;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // Times relative to the first file of the series.
+        int64_t time = header->startTime - query->intervalStart + records[i].time;
+        int32_t bpm = records[i].bpm;
+
+        if (query->intervalSamples > 0)
+        {
+            query->levelTime[query->interval.level] += time - query->lastTime;
+        }
+        query->lastTime = time;
+        query->intervalSamples++;
+
+        query->fullSum += bpm;
+        query->fullCount++;
+        int full_alert = alert_triggered(query->fullSum, query->fullCount, bpm);
+
+        int taken = interval_period(query->interval.level) <= 1 || time >= query->nextProbe;
+        int taken_alert = 0;
+        if (taken)
+        {
+            query->intervalTaken++;
+            query->takenSum += bpm;
+            query->takenCount++;
+            taken_alert = alert_triggered(query->takenSum, query->takenCount, bpm);
+
+            interval_update(&query->interval, (int32_t)time, bpm, taken_alert);
+            query->nextProbe = time + interval_period(query->interval.level);
+        }
+
+        track_events(&query->events[0], time, full_alert, taken, taken_alert);
+        track_events(&query->events[1], time, bpm >= INTERVAL_EXERCISE_BPM, taken, bpm >= INTERVAL_EXERCISE_BPM);
+    }
+}
+
+/**
+ * @brief Write the interval replay report of the current file and reset it.
+ */
+static void flush_interval(Query *query)
+{
+    if (query->intervalSamples > 0)
+    {
+        output_row_separator(query);
+
+        const IntervalEvents *alerts = &query->events[0];
+        const IntervalEvents *exercise = &query->events[1];
+
+        // An episode still running at the end of the trace counts as missed if it was not seen.
+        int64_t alerts_missed = alerts->missed + (alerts->active && !alerts->seen);
+        int64_t exercise_missed = exercise->missed + (exercise->active && !exercise->seen);
+
+        switch (query->format)
+        {
+        case FORMAT_CSV:
+            printf("%s,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", query->intervalMac,
+                   (long long)query->intervalSamples, (long long)query->intervalTaken, (long long)query->interval.changes,
+                   (long long)query->levelTime[INTERVAL_DENSE], (long long)query->levelTime[INTERVAL_NORMAL],
+                   (long long)query->levelTime[INTERVAL_SPARSE], (long long)alerts->count, (long long)alerts_missed,
+                   (long long)alerts->delayMax, (long long)exercise->count, (long long)exercise_missed,
+                   (long long)exercise->delayMax);
+            break;
+        case FORMAT_JSON:
+            printf("{\"mac\":\"%s\",\"samples\":%lld,\"taken\":%lld,\"changes\":%lld,\"dense_s\":%lld,\"normal_s\":%lld,"
+                   "\"sparse_s\":%lld,\"alerts\":%lld,\"alerts_missed\":%lld,\"alert_delay_max\":%lld,\"exercise\":%lld,"
+                   "\"exercise_missed\":%lld,\"exercise_delay_max\":%lld}",
+                   query->intervalMac, (long long)query->intervalSamples, (long long)query->intervalTaken,
+                   (long long)query->interval.changes, (long long)query->levelTime[INTERVAL_DENSE],
+                   (long long)query->levelTime[INTERVAL_NORMAL], (long long)query->levelTime[INTERVAL_SPARSE],
+                   (long long)alerts->count, (long long)alerts_missed, (long long)alerts->delayMax,
+                   (long long)exercise->count, (long long)exercise_missed, (long long)exercise->delayMax);
+            break;
+        default:
+        {
+            int64_t total = query->levelTime[0] + query->levelTime[1] + query->levelTime[2];
+            double scale = total > 0 ? 100.0 / total : 0.0;
+            printf("%s samples %lld taken %lld (%.1f%%) level changes %lld time dense %.1f%% normal %.1f%% sparse %.1f%%\n",
+                   query->intervalMac, (long long)query->intervalSamples, (long long)query->intervalTaken,
+                   100.0 * query->intervalTaken / query->intervalSamples, (long long)query->interval.changes,
+                   query->levelTime[INTERVAL_DENSE] * scale, query->levelTime[INTERVAL_NORMAL] * scale,
+                   query->levelTime[INTERVAL_SPARSE] * scale);
+            printf("%s alerts %lld missed %lld max delay %lld s, exercise %lld missed %lld max delay %lld s\n",
+                   query->intervalMac, (long long)alerts->count, (long long)alerts_missed, (long long)alerts->delayMax,
+                   (long long)exercise->count, (long long)exercise_missed, (long long)exercise->delayMax);
+            break;
+        }
+        }
+    }
+
+    interval_init(&query->interval);
+    query->intervalSamples = 0;
+    query->intervalTaken = 0;
+    query->nextProbe = 0;
+    query->lastTime = 0;
+    memset(query->levelTime, 0, sizeof(query->levelTime));
+    query->fullSum = 0;
+    query->fullCount = 0;
+    query->takenSum = 0;
+    query->takenCount = 0;
+    memset(query->events, 0, sizeof(query->events));
+}
+
+/**
+ * @brief Emit the current downsample bucket, if any, and reset it.
+ */
+static void flush_bucket(Query *query)
+{
+    if (query->total.count > 0)
+    {
+        output_aggregate(query, &query->total, 1, query->bucketStart);
+    }
+    memset(&query->total, 0, sizeof(query->total));
+}
+
+/**
+ * @brief End the current series: emit its last bucket, the end of its grid, or its replay report.
+ */
+static void flush_series(Query *query)
+{
+    if (query->command == COMMAND_DOWNSAMPLE)
+    {
+        flush_bucket(query);
+    }
+    else if (query->command == COMMAND_RESAMPLE && query->resampling)
+    {
+        resampler_finish(query->resampler, output_grid, query);
+        query->resampling = 0;
+    }
+    else if (query->command == COMMAND_FILTER)
+    {
+        flush_filter(query);
+    }
+    else if (query->command == COMMAND_INTERVAL)
+    {
+        flush_interval(query);
+    }
+    query->inSeries = 0;
+}
+
+/**
+ * @brief Continue the current series with samples of a band, or end it if they belong to another one.
+ * @param first The time of the first sample (epoch seconds).
+ * @param last The time of the last sample (epoch seconds).
+ *
+ * The series ends when the band changes or the samples do not follow the previous ones in time.
+ */
+static void follow_series(Query *query, const char *mac, int64_t first, int64_t last)
+{
+    if (query->inSeries && (strcmp(mac, query->seriesMac) != 0 || first < query->seriesEnd))
+    {
+        flush_series(query);
+    }
+    snprintf(query->seriesMac, sizeof(query->seriesMac), "%s", mac);
+    query->seriesEnd = last;
+    query->inSeries = 1;
+}
+
+/**
+ * @brief Run the query over a contiguous, time sorted slice of records.
+ */
+static void process_records(Query *query, const SessionHeader *header, const SessionRecord *records, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    follow_series(query, header->macAddress, header->startTime + records[0].time, header->startTime + records[count - 1].time);
+
+    // Resampling and the filter replay work on the whole slice, the bpm filters do not apply.
+    if (query->command == COMMAND_RESAMPLE)
+    {
+        resample_records(query, header, records, count);
+        return;
+    }
+    if (query->command == COMMAND_FILTER)
+    {
+        filter_records(query, header, records, count);
+        return;
+    }
+    if (query->command == COMMAND_INTERVAL)
+    {
+        interval_records(query, header, records, count);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        int64_t time = header->startTime + records[i].time;
+
+        if (records[i].bpm >= query->below || records[i].bpm <= query->above)
+        {
+            continue;
+        }
+
+        switch (query->command)
+        {
+        case COMMAND_RANGE:
+        case COMMAND_EXPORT:
+            output_sample(query, header->macAddress, time, records[i].bpm);
+            break;
+        case COMMAND_DOWNSAMPLE:
+        {
+            int64_t bucket_start = time - (((time % query->bucket) + query->bucket) % query->bucket);
+            if (query->total.count > 0 && bucket_start != query->bucketStart)
+            {
+                flush_bucket(query);
+            }
+            query->bucketStart = bucket_start;
+            aggregate_add(&query->total, records[i].bpm);
+            break;
+        }
+        case COMMAND_AGGREGATE:
+        case COMMAND_PACK:
+        case COMMAND_RESAMPLE:
+        case COMMAND_FILTER:
+        case COMMAND_INTERVAL:
+        case COMMAND_INGEST:
+        case COMMAND_COMPACT:
+        case COMMAND_COLUMNS:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Run the query over one session file.
+ */
+static int process_session(Query *query, const char *path)
+{
+    SessionFile file;
+    if (session_file_open(path, &file) != 0)
+    {
+        return -1;
+    }
+
+    // Locate the time range with a binary search over the sorted records.
+    size_t first = session_file_lower_bound(&file, session_relative_time(file.header, query->from));
+    size_t last = session_file_lower_bound(&file, session_relative_time(file.header, query->to));
+
+    if (first < last)
+    {
+        // Only the selected slice is read, and it is read once from start to end.
+        const uint8_t *slice = (const uint8_t *)(file.records + first);
+        uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        const uint8_t *page = (const uint8_t *)((uintptr_t)slice & ~page_mask);
+        madvise((void *)page, (last - first) * sizeof(SessionRecord) + (slice - page), MADV_SEQUENTIAL);
+
+        process_records(query, file.header, file.records + first, last - first);
+    }
+
+    session_file_close(&file);
+    return 0;
+}
+
+/**
+ * @brief Run the query over one archive file, decoding only the blocks that overlap the time range.
+ */
+static int process_archive(Query *query, const char *path)
+{
+    ArchiveFile archive;
+    if (archive_file_open(path, &archive) != 0)
+    {
+        return -1;
+    }
+
+    int64_t from = session_relative_time(archive.header, query->from);
+    int64_t to = session_relative_time(archive.header, query->to);
+
+    SessionRecord *records = NULL;
+    size_t capacity = 0;
+    size_t offset = 0;
+    CodecBlockHeader header;
+    const uint8_t *block;
+    size_t size;
+    int status = 0;
+    int ret;
+
+    while ((ret = archive_file_next_block(&archive, &offset, &header, &block, &size)) == 1)
+    {
+        // Skip blocks outside of the time range or of the bpm filter without decoding them.
+        if (header.lastTime < from || header.firstTime >= to ||
+            header.minBpm >= query->below || header.maxBpm <= query->above)
+        {
+            continue;
+        }
+
+        if (header.count > capacity)
+        {
+            SessionRecord *grown = realloc(records, header.count * sizeof(SessionRecord));
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                status = -1;
+                break;
+            }
+            records = grown;
+            capacity = header.count;
+        }
+
+        int count = codec_decode_block(block, size, records, capacity);
+        if (count < 0)
+        {
+            fprintf(stderr, "Error: corrupted block in %s\n", path);
+            status = -1;
+            continue;
+        }
+
+        size_t first = session_lower_bound(records, count, from);
+        size_t last = session_lower_bound(records, count, to);
+        process_records(query, archive.header, records + first, last - first);
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error: truncated archive %s\n", path);
+        status = -1;
+    }
+
+    free(records);
+    archive_file_close(&archive);
+    return status;
+}
+
+/**
+ * @brief Downsample one file from its rollup sidecar instead of its samples.
+ * @return 0 if the file was downsampled, 1 if the sidecar is missing or stale or cannot answer the query.
+ *
+ * The rollups cannot apply the bpm filters, and their buckets may only be cut at the range
+ * bounds if these fall on output bucket boundaries (or outside of the file).
+ */
+static int process_rollups(Query *query, const char *path)
+{
+    struct stat st;
+    if (query->bucket % 60 != 0 || query->below != INT64_MAX || query->above != INT64_MIN || stat(path, &st) != 0)
+    {
+        return 1;
+    }
+
+    Rollups rollups;
+    char *sidecar = rollups_sidecar_path(path);
+    int status = rollups_load(&rollups, sidecar, st.st_size);
+    free(sidecar);
+    if (status != 0)
+    {
+        return 1;
+    }
+
+    const RollupSeries *days = &rollups.levels[ROLLUP_DAY];
+    const RollupSeries *minutes = &rollups.levels[ROLLUP_MINUTE];
+    if (days->count == 0)
+    {
+        rollups_free(&rollups);
+        return 0;
+    }
+
+    int64_t first = rollups.origin + days->buckets[0].summary.firstTime;
+    int64_t last = rollups.origin + days->buckets[days->count - 1].summary.lastTime;
+    if ((query->from > first && query->from % query->bucket != 0) || (query->to <= last && query->to % query->bucket != 0))
+    {
+        rollups_free(&rollups);
+        return 1;
+    }
+
+    // The band of the file, to continue its series.
+    SessionHeader header;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        rollups_free(&rollups);
+        return 1;
+    }
+    close(fd);
+    header.macAddress[sizeof(header.macAddress) - 1] = '\0';
+
+    // The range in the relative time of the rollups, clamped to the file.
+    int64_t from = query->from > first ? query->from - rollups.origin : days->buckets[0].summary.firstTime;
+    int64_t to = query->to <= last ? query->to - rollups.origin : days->buckets[days->count - 1].summary.lastTime + 1;
+
+    RollupBucket *buckets = malloc((minutes->count > 0 ? minutes->count : 1) * sizeof(RollupBucket));
+    int count = from < to ? rollups_query(&rollups, (int32_t)query->bucket, (int32_t)from, (int32_t)to, buckets, minutes->count) : 0;
+    if (count > 0)
+    {
+        follow_series(query, header.macAddress, rollups.origin + buckets[0].summary.firstTime,
+                      rollups.origin + buckets[count - 1].summary.lastTime);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const BlockSummary *summary = &buckets[i].summary;
+        Aggregate aggregate = {summary->count, summary->sumBpm, summary->minBpm, summary->maxBpm};
+        int64_t bucket_start = rollups.origin + buckets[i].start;
+
+        if (query->total.count > 0 && bucket_start != query->bucketStart)
+        {
+            flush_bucket(query);
+        }
+        query->bucketStart = bucket_start;
+        aggregate_merge(&query->total, &aggregate);
+    }
+
+    query->rollupFiles++;
+    query->rollupBuckets += count;
+    free(buckets);
+    rollups_free(&rollups);
+    return 0;
+}
+
+/**
+ * @brief Write the selected columns of one sample of a columnar file, RR intervals in ms.
+ */
+static void output_columns(Query *query, const char *mac, int64_t start, const ColumnarColumns *columns, size_t i, size_t rr)
+{
+    output_row_separator(query);
+
+    const char *separator = query->format == FORMAT_TEXT ? "" : ",";
+    if (query->format == FORMAT_CSV)
+    {
+        fputs(mac, stdout);
+    }
+    else if (query->format == FORMAT_JSON)
+    {
+        printf("{\"mac\":\"%s\"", mac);
+    }
+
+    for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+    {
+        if (!(query->select & COLUMNAR_SELECT(column)))
+        {
+            continue;
+        }
+
+        if (query->format == FORMAT_JSON)
+        {
+            printf(",\"%s\":", COLUMN_NAMES[column]);
+        }
+        else
+        {
+            fputs(separator, stdout);
+        }
+        separator = query->format == FORMAT_TEXT ? " " : ",";
+
+        switch (column)
+        {
+        case COLUMNAR_TIME:
+            printf("%lld", (long long)(start + columns->time[i]));
+            break;
+        case COLUMNAR_BPM:
+            printf("%d", columns->bpm[i]);
+            break;
+        case COLUMNAR_FLAGS:
+            printf("%u", columns->flags[i]);
+            break;
+        case COLUMNAR_RR:
+            fputs(query->format == FORMAT_JSON ? "[" : "", stdout);
+            for (int j = 0; j < columns->rrCount[i]; j++)
+            {
+                printf(j == 0 ? "%d" : (query->format == FORMAT_JSON ? ",%d" : ";%d"), columns->rr[rr + j] * 1000 / 1024);
+            }
+            fputs(query->format == FORMAT_JSON ? "]" : (columns->rrCount[i] == 0 && query->format == FORMAT_TEXT ? "-" : ""),
+                  stdout);
+            break;
+        }
+    }
+    fputs(query->format == FORMAT_JSON ? "}" : "\n", stdout);
+}
+
+/**
+ * @brief Run the query over one columnar file, decoding only the needed columns of the groups that overlap the filters.
+ *
+ * Queries read the time and heart rate columns. columns reads the selected ones, plus
+ * the time and heart rate when they are filtered on.
+ */
+static int process_columnar(Query *query, const char *path)
+{
+    ColumnarFile file;
+    if (columnar_file_open(path, &file) != 0)
+    {
+        return -1;
+    }
+
+    int64_t from = session_relative_time(file.header, query->from);
+    int64_t to = session_relative_time(file.header, query->to);
+    int time_filter = query->from != INT64_MIN || query->to != INT64_MAX;
+    int bpm_filter = query->below != INT64_MAX || query->above != INT64_MIN;
+
+    unsigned needed = COLUMNAR_SELECT(COLUMNAR_TIME) | COLUMNAR_SELECT(COLUMNAR_BPM);
+    if (query->command == COMMAND_COLUMNS)
+    {
+        needed = query->select | (time_filter ? COLUMNAR_SELECT(COLUMNAR_TIME) : 0) |
+                 (bpm_filter ? COLUMNAR_SELECT(COLUMNAR_BPM) : 0);
+    }
+
+    ColumnarColumns columns;
+    memset(&columns, 0, sizeof(columns));
+    SessionRecord *records = NULL;
+    size_t capacity = 0;
+    int status = 0;
+
+    query->groupsTotal += file.groupCount;
+    query->fileBytes += file.mapSize;
+
+    for (size_t g = 0; g < file.groupCount; g++)
+    {
+        // Skip groups outside of the time range or of the bpm filter from the footer statistics.
+        const ColumnarGroup *group = &file.groups[g];
+        const ColumnarChunk *time = &group->chunks[COLUMNAR_TIME];
+        const ColumnarChunk *bpm = &group->chunks[COLUMNAR_BPM];
+        if (time->max < from || time->min >= to || bpm->min >= query->below || bpm->max <= query->above)
+        {
+            continue;
+        }
+
+        if (columnar_read_group(&file, g, needed, &columns) != 0)
+        {
+            fprintf(stderr, "Error: corrupted chunk in %s\n", path);
+            status = -1;
+            continue;
+        }
+        query->groupsRead++;
+        for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+        {
+            query->chunkBytes += (needed & COLUMNAR_SELECT(column)) ? group->chunks[column].size : 0;
+        }
+
+        if (query->command == COMMAND_COLUMNS)
+        {
+            size_t rr = 0;
+            for (size_t i = 0; i < columns.count; i++)
+            {
+                int keep = (!time_filter || (columns.time[i] >= from && columns.time[i] < to)) &&
+                           (!bpm_filter || (columns.bpm[i] < query->below && columns.bpm[i] > query->above));
+                if (keep)
+                {
+                    output_columns(query, file.header->macAddress, file.header->startTime, &columns, i, rr);
+                }
+                rr += (needed & COLUMNAR_SELECT(COLUMNAR_RR)) ? columns.rrCount[i] : 0;
+            }
+            continue;
+        }
+
+        // Other queries see the group as session records.
+        if (columns.count > capacity)
+        {
+            SessionRecord *grown = realloc(records, columns.count * sizeof(SessionRecord));
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                status = -1;
+                break;
+            }
+            records = grown;
+            capacity = columns.count;
+        }
+        for (size_t i = 0; i < columns.count; i++)
+        {
+            records[i].time = columns.time[i];
+            records[i].bpm = columns.bpm[i];
+        }
+
+        size_t first = session_lower_bound(records, columns.count, from);
+        size_t last = session_lower_bound(records, columns.count, to);
+        process_records(query, file.header, records + first, last - first);
+    }
+
+    free(records);
+    columnar_columns_free(&columns);
+    columnar_file_close(&file);
+    return status;
+}
+
+/**
+ * @brief Run the query over one session, archive or columnar file.
+ */
+static int process_file(Query *query, const char *path)
+{
+    int status;
+    if (query->command == COMMAND_DOWNSAMPLE && !columnar_is_columnar(path) && process_rollups(query, path) == 0)
+    {
+        status = 0;
+    }
+    else if (archive_is_archive(path))
+    {
+        status = process_archive(query, path);
+    }
+    else if (columnar_is_columnar(path))
+    {
+        status = process_columnar(query, path);
+    }
+    else if (query->command == COMMAND_COLUMNS)
+    {
+        fprintf(stderr, "Error: %s is not a columnar file\n", path);
+        status = -1;
+    }
+    else
+    {
+        status = process_session(query, path);
+    }
+
+    // Buckets, grids and replays continue in the next file if it follows this one.
+    return status;
+}
+
+/**
+ * @brief Current monotonic time in seconds.
+ */
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Compress a session file into an archive file and report ratio and codec throughput.
+ *
+ * The archive is written next to the session file and decoded back to verify it.
+ */
+static int pack_file(const char *path)
+{
+    SessionFile file;
+    if (session_file_open(path, &file) != 0)
+    {
+        return -1;
+    }
+
+    // Replace the session extension with the archive one.
+    size_t path_len = strlen(path);
+    size_t ext_len = strlen(SESSION_EXTENSION);
+    if (path_len >= ext_len && strcmp(path + path_len - ext_len, SESSION_EXTENSION) == 0)
+    {
+        path_len -= ext_len;
+    }
+    char *archive_path = malloc(path_len + strlen(ARCHIVE_EXTENSION) + 1);
+    memcpy(archive_path, path, path_len);
+    strcpy(archive_path + path_len, ARCHIVE_EXTENSION);
+
+    FILE *out = fopen(archive_path, "wb");
+    if (out == NULL || archive_write_header(out, file.header->macAddress, file.header->startTime) != 0)
+    {
+        fprintf(stderr, "Error: could not create archive file %s\n", archive_path);
+        if (out)
+        {
+            fclose(out);
+        }
+        free(archive_path);
+        session_file_close(&file);
+        return -1;
+    }
+
+    // Encode the session block by block.
+    uint8_t *buffer = malloc(codec_block_bound(ARCHIVE_BLOCK_SAMPLES));
+    double encode_time = 0;
+    size_t archive_size = sizeof(SessionHeader);
+
+    for (size_t i = 0; i < file.recordCount; i += ARCHIVE_BLOCK_SAMPLES)
+    {
+        size_t count = file.recordCount - i < ARCHIVE_BLOCK_SAMPLES ? file.recordCount - i : ARCHIVE_BLOCK_SAMPLES;
+
+        double start = now_seconds();
+        size_t size = codec_encode_block(file.records + i, count, buffer);
+        encode_time += now_seconds() - start;
+
+        fwrite(buffer, size, 1, out);
+        archive_size += size;
+    }
+    free(buffer);
+
+    int status = fclose(out) == 0 ? 0 : -1;
+
+    // Decode the archive back and verify it against the session file.
+    ArchiveFile archive;
+    SessionRecord *decoded = malloc(ARCHIVE_BLOCK_SAMPLES * sizeof(SessionRecord));
+    double decode_time = 0;
+    size_t decoded_count = 0;
+
+    if (status == 0 && archive_file_open(archive_path, &archive) == 0)
+    {
+        size_t offset = 0;
+        CodecBlockHeader header;
+        const uint8_t *block;
+        size_t size;
+
+        while (archive_file_next_block(&archive, &offset, &header, &block, &size) == 1)
+        {
+            double start = now_seconds();
+            int count = codec_decode_block(block, size, decoded, ARCHIVE_BLOCK_SAMPLES);
+            decode_time += now_seconds() - start;
+
+            if (count < 0 || decoded_count + count > file.recordCount ||
+                memcmp(decoded, file.records + decoded_count, count * sizeof(SessionRecord)) != 0)
+            {
+                break;
+            }
+            decoded_count += count;
+        }
+        archive_file_close(&archive);
+    }
+    free(decoded);
+
+    if (status != 0 || decoded_count != file.recordCount)
+    {
+        fprintf(stderr, "Error: archive %s does not match %s\n", archive_path, path);
+        status = -1;
+    }
+    else
+    {
+        // The archive gets the rollups of its samples, so downsampling it decodes no block.
+        Rollups rollups;
+        rollups_init(&rollups, file.header->startTime);
+        for (size_t i = 0; i < file.recordCount; i++)
+        {
+            rollups_add(&rollups, file.records[i].time, file.records[i].bpm);
+        }
+        char *sidecar = rollups_sidecar_path(archive_path);
+        rollups_save(&rollups, sidecar, archive_size);
+        free(sidecar);
+        rollups_free(&rollups);
+
+        // Report the compression and the codec throughput on the raw sample size.
+        double raw_bytes = (double)file.recordCount * sizeof(SessionRecord);
+        double payload_bytes = (double)(archive_size - sizeof(SessionHeader));
+        printf("%s: %zu samples, %zu -> %zu bytes, ratio %.2f, %.2f bits/sample, encode %.1f MB/s, decode %.1f MB/s\n",
+               archive_path, file.recordCount, file.mapSize, archive_size,
+               payload_bytes > 0 ? raw_bytes / payload_bytes : 0.0,
+               file.recordCount > 0 ? payload_bytes * 8 / file.recordCount : 0.0,
+               encode_time > 0 ? raw_bytes / encode_time / 1e6 : 0.0,
+               decode_time > 0 ? raw_bytes / decode_time / 1e6 : 0.0);
+    }
+
+    free(archive_path);
+    session_file_close(&file);
+    return status;
+}
+
+/**
+ * @brief Disk pressure of ingest: a thread rewriting a scratch file with synced writes.
+ */
+typedef struct
+{
+    char *path;
+    int64_t size;
+    volatile int stop;
+    int64_t written;
+} DiskPressure;
+
+/**
+ * @brief Thread of the disk pressure: write and sync chunks in a loop until stopped.
+ */
+static void *pressure_worker(void *data)
+{
+    DiskPressure *pressure = (DiskPressure *)data;
+
+    int fd = open(pressure->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not create %s\n", pressure->path);
+        return NULL;
+    }
+
+    char *chunk = malloc(PRESSURE_CHUNK);
+    memset(chunk, 0xA5, PRESSURE_CHUNK);
+    off_t offset = 0;
+    while (!pressure->stop)
+    {
+        if (pwrite(fd, chunk, PRESSURE_CHUNK, offset) != PRESSURE_CHUNK || fsync(fd) != 0)
+        {
+            break;
+        }
+        pressure->written += PRESSURE_CHUNK;
+        offset = (offset + PRESSURE_CHUNK) % (pressure->size * PRESSURE_CHUNK);
+    }
+
+    free(chunk);
+    close(fd);
+    unlink(pressure->path);
+    return NULL;
+}
+
+/**
+ * @brief Compare two latencies, for qsort.
+ */
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Write session files again through the session writer and report its throughput and append latency.
+ *
+ * Every append is timed, as it would run in the notification callback. With a pressure, a
+ * thread keeps the disk busy with synced writes meanwhile.
+ */
+static int ingest_files(const Query *query, char **paths, int count)
+{
+    // The inputs are memory-mapped, writing to their directory would truncate them.
+    struct stat out_stat;
+    if (stat(query->outDir, &out_stat) != 0 || !S_ISDIR(out_stat.st_mode))
+    {
+        fprintf(stderr, "Error: %s is not a directory\n", query->outDir);
+        return -1;
+    }
+
+    DiskPressure pressure = {NULL, query->pressure, 0, 0};
+    pthread_t pressure_thread;
+    int pressure_started = 0;
+    if (query->pressure > 0)
+    {
+        size_t path_len = strlen(query->outDir) + 32;
+        pressure.path = malloc(path_len);
+        snprintf(pressure.path, path_len, "%s/.miband_pressure", query->outDir);
+        pressure_started = pthread_create(&pressure_thread, NULL, pressure_worker, &pressure) == 0;
+    }
+
+    int64_t *latencies = NULL;
+    size_t samples = 0;
+    size_t capacity = 0;
+    size_t dropped = 0;
+    int status = 0;
+    double start = now_seconds();
+
+    for (int i = 0; i < count; i++)
+    {
+        SessionFile file;
+        if (session_file_open(paths[i], &file) != 0)
+        {
+            status = -1;
+            continue;
+        }
+
+        char *slash = strrchr(paths[i], '/');
+        struct stat in_stat;
+        char *in_dir = slash ? strndup(paths[i], slash - paths[i] + 1) : strdup(".");
+        int same_dir = stat(in_dir, &in_stat) == 0 && in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino;
+        free(in_dir);
+        if (same_dir)
+        {
+            fprintf(stderr, "Error: %s is in the output directory\n", paths[i]);
+            session_file_close(&file);
+            status = -1;
+            continue;
+        }
+
+        SessionWriter *writer = session_writer_open(query->outDir, file.header->macAddress, file.header->startTime);
+        if (writer == NULL)
+        {
+            session_file_close(&file);
+            status = -1;
+            continue;
+        }
+        if (query->rotate > 0)
+        {
+            session_writer_set_rotation(writer, SESSION_ROTATE_BYTES, query->rotate);
+        }
+
+        // The columnar file gets the quality flags of the artifact filter, the RR intervals are not in session files.
+        ColumnarWriter *columns = NULL;
+        HampelFilter filter;
+        hampel_init(&filter);
+        if (query->columnar)
+        {
+            columns = columnar_writer_open(query->outDir, file.header->macAddress, file.header->startTime);
+        }
+        if (columns && query->rotate > 0)
+        {
+            columnar_writer_set_rotation(columns, SESSION_ROTATE_BYTES, query->rotate);
+        }
+
+        if (samples + file.recordCount > capacity)
+        {
+            int64_t *grown = realloc(latencies, (samples + file.recordCount) * sizeof(int64_t));
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                session_writer_close(writer);
+                columnar_writer_close(columns);
+                session_file_close(&file);
+                status = -1;
+                break;
+            }
+            latencies = grown;
+            capacity = samples + file.recordCount;
+        }
+
+        for (size_t j = 0; j < file.recordCount; j++)
+        {
+            double before = now_seconds();
+            session_writer_append(writer, file.records[j].time, file.records[j].bpm);
+            if (columns)
+            {
+                int32_t filtered;
+                int quality = hampel_filter(&filter, file.records[j].bpm, &filtered);
+                uint8_t flags = quality < 0 ? SAMPLE_INVALID | COLUMNAR_FLAG_IGNORED : quality;
+                columnar_writer_append(columns, file.records[j].time, file.records[j].bpm, flags, NULL, 0);
+            }
+            double after = now_seconds();
+            latencies[samples++] = (int64_t)((after - before) * 1e9);
+
+            // Wait for the time of the next sample, at the given pace.
+            if (query->pace > 0)
+            {
+                double due = start + (double)samples / query->pace;
+                while (now_seconds() < due)
+                {
+                    struct timespec pause = {0, 100000};
+                    nanosleep(&pause, NULL);
+                }
+            }
+        }
+
+        dropped += writer->dropped;
+        session_writer_close(writer);
+        if (columns)
+        {
+            dropped += columns->dropped;
+            columnar_writer_close(columns);
+        }
+        session_file_close(&file);
+    }
+    double elapsed = now_seconds() - start;
+
+    if (pressure_started)
+    {
+        pressure.stop = 1;
+        pthread_join(pressure_thread, NULL);
+    }
+
+    if (samples > 0)
+    {
+        qsort(latencies, samples, sizeof(int64_t), compare_int64);
+        double bytes = (double)(samples - dropped) * sizeof(SessionRecord);
+        printf("Ingested %zu samples (%zu dropped) in %.3f s: %.2f MB/s, %.2f Msamples/s \n", samples, dropped, elapsed,
+               bytes / elapsed / 1e6, (samples - dropped) / elapsed / 1e6);
+        printf("Append latency: p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us \n", latencies[samples / 2] / 1e3,
+               latencies[samples * 99 / 100] / 1e3, latencies[samples * 999 / 1000] / 1e3, latencies[samples - 1] / 1e3);
+    }
+    if (pressure_started)
+    {
+        printf("Disk pressure: %.1f MB written and synced meanwhile (%.1f MB/s) \n", pressure.written / 1e6,
+               pressure.written / elapsed / 1e6);
+    }
+    storage_queue_shutdown();
+
+    free(latencies);
+    free(pressure.path);
+    return status;
+}
+
+/**
+ * @brief Parse a time or size argument.
+ */
+static int parse_int64(const char *text, int64_t *value)
+{
+    char *end;
+    long long parsed = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0')
+    {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/**
+ * @brief Parse a comma-separated list of column names.
+ */
+static int parse_columns(const char *text, unsigned *select)
+{
+    *select = 0;
+    while (*text)
+    {
+        size_t length = strcspn(text, ",");
+        int found = 0;
+        for (int column = 0; column < COLUMNAR_COLUMNS; column++)
+        {
+            if (strlen(COLUMN_NAMES[column]) == length && strncmp(text, COLUMN_NAMES[column], length) == 0)
+            {
+                *select |= COLUMNAR_SELECT(column);
+                found = 1;
+            }
+        }
+        if (!found)
+        {
+            return -1;
+        }
+        text += length + (text[length] == ',');
+    }
+    return *select ? 0 : -1;
+}
+
+/**
+ * @brief Main function.
+ *
+ * Parses the command line, runs the query over every given session file
+ * and streams the result to the standard output.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Query query;
+    memset(&query, 0, sizeof(query));
+    query.format = FORMAT_TEXT;
+    query.from = INT64_MIN;
+    query.to = INT64_MAX;
+    query.below = INT64_MAX;
+    query.above = INT64_MIN;
+    query.threads = 1;
+    query.rate = 1;
+    query.method = RESAMPLE_LINEAR;
+    query.maxGap = 10;
+
+    if (strcmp(argv[1], "range") == 0)
+    {
+        query.command = COMMAND_RANGE;
+    }
+    else if (strcmp(argv[1], "aggregate") == 0)
+    {
+        query.command = COMMAND_AGGREGATE;
+    }
+    else if (strcmp(argv[1], "downsample") == 0)
+    {
+        query.command = COMMAND_DOWNSAMPLE;
+    }
+    else if (strcmp(argv[1], "export") == 0)
+    {
+        query.command = COMMAND_EXPORT;
+        query.format = FORMAT_CSV;
+    }
+    else if (strcmp(argv[1], "pack") == 0)
+    {
+        query.command = COMMAND_PACK;
+    }
+    else if (strcmp(argv[1], "resample") == 0)
+    {
+        query.command = COMMAND_RESAMPLE;
+    }
+    else if (strcmp(argv[1], "filter") == 0)
+    {
+        query.command = COMMAND_FILTER;
+    }
+    else if (strcmp(argv[1], "interval") == 0)
+    {
+        query.command = COMMAND_INTERVAL;
+        interval_init(&query.interval);
+    }
+    else if (strcmp(argv[1], "ingest") == 0)
+    {
+        query.command = COMMAND_INGEST;
+    }
+    else if (strcmp(argv[1], "columns") == 0)
+    {
+        query.command = COMMAND_COLUMNS;
+        query.select = COLUMNAR_SELECT_ALL;
+    }
+    else if (strcmp(argv[1], "compact") == 0)
+    {
+        query.command = COMMAND_COMPACT;
+        query.ioRate = COMPACT_RATE_BYTES / (1024 * 1024);
+    }
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Parse the options.
+    int i = 2;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        // Options without a value.
+        if (strcmp(argv[i], "--timing") == 0)
+        {
+            query.timing = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--columnar") == 0)
+        {
+            query.columnar = 1;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        const char *option = argv[i];
+        const char *value = argv[++i];
+        int error = 0;
+
+        if (strcmp(option, "--from") == 0)
+        {
+            error = parse_int64(value, &query.from);
+        }
+        else if (strcmp(option, "--to") == 0)
+        {
+            error = parse_int64(value, &query.to);
+        }
+        else if (strcmp(option, "--below") == 0)
+        {
+            error = parse_int64(value, &query.below);
+        }
+        else if (strcmp(option, "--above") == 0)
+        {
+            error = parse_int64(value, &query.above);
+        }
+        else if (strcmp(option, "--threads") == 0)
+        {
+            int64_t threads;
+            error = parse_int64(value, &threads) || threads < 1 || threads > 1024;
+            query.threads = (int)threads;
+        }
+        else if (strcmp(option, "--bucket") == 0)
+        {
+            error = parse_int64(value, &query.bucket) || query.bucket <= 0;
+        }
+        else if (strcmp(option, "--rate") == 0)
+        {
+            int64_t rate;
+            error = parse_int64(value, &rate) || rate < 1 || rate > 1000;
+            query.rate = (int)rate;
+        }
+        else if (strcmp(option, "--method") == 0)
+        {
+            if (strcmp(value, "linear") == 0)
+            {
+                query.method = RESAMPLE_LINEAR;
+            }
+            else if (strcmp(value, "cubic") == 0)
+            {
+                query.method = RESAMPLE_CUBIC;
+            }
+            else
+            {
+                error = 1;
+            }
+        }
+        else if (strcmp(option, "--out") == 0)
+        {
+            query.outDir = value;
+        }
+        else if (strcmp(option, "--pace") == 0)
+        {
+            error = parse_int64(value, &query.pace) || query.pace < 0;
+        }
+        else if (strcmp(option, "--pressure") == 0)
+        {
+            error = parse_int64(value, &query.pressure) || query.pressure < 0;
+        }
+        else if (strcmp(option, "--select") == 0)
+        {
+            error = parse_columns(value, &query.select);
+        }
+        else if (strcmp(option, "--rotate") == 0)
+        {
+            error = parse_int64(value, &query.rotate) || query.rotate <= 0;
+        }
+        else if (strcmp(option, "--retention-days") == 0)
+        {
+            error = parse_int64(value, &query.retentionDays) || query.retentionDays < 0;
+        }
+        else if (strcmp(option, "--io-rate") == 0)
+        {
+            error = parse_int64(value, &query.ioRate) || query.ioRate < 0;
+        }
+        else if (strcmp(option, "--max-gap") == 0)
+        {
+            error = parse_int64(value, &query.maxGap) || query.maxGap < 0;
+        }
+        else if (strcmp(option, "--format") == 0)
+        {
+            if (strcmp(value, "text") == 0)
+            {
+                query.format = FORMAT_TEXT;
+            }
+            else if (strcmp(value, "csv") == 0)
+            {
+                query.format = FORMAT_CSV;
+            }
+            else if (strcmp(value, "json") == 0)
+            {
+                query.format = FORMAT_JSON;
+            }
+            else
+            {
+                error = 1;
+            }
+        }
+        else
+        {
+            error = 1;
+        }
+
+        if (error)
+        {
+            fprintf(stderr, "Error: invalid option %s %s\n", option, value);
+            return 1;
+        }
+    }
+
+    if (i >= argc || (query.command == COMMAND_DOWNSAMPLE && query.bucket == 0) ||
+        (query.command == COMMAND_EXPORT && query.format == FORMAT_TEXT) ||
+        (query.command == COMMAND_INGEST && query.outDir == NULL))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Pack does not run a query.
+    if (query.command == COMMAND_PACK)
+    {
+        int status = 0;
+        for (; i < argc; i++)
+        {
+            if (pack_file(argv[i]) != 0)
+            {
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    // Ingest writes files instead of running a query.
+    if (query.command == COMMAND_INGEST)
+    {
+        return ingest_files(&query, argv + i, argc - i) == 0 ? 0 : 1;
+    }
+
+    // Compact runs one pass over every given directory.
+    if (query.command == COMMAND_COMPACT)
+    {
+        int status = 0;
+        for (; i < argc; i++)
+        {
+            Compactor compactor;
+            compactor_init(&compactor, argv[i], query.retentionDays * 86400, query.ioRate * 1024 * 1024);
+            if (compactor_run(&compactor, time(NULL)) != 0)
+            {
+                status = 1;
+            }
+            compactor_report(&compactor);
+            compactor_free(&compactor);
+        }
+        return status;
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, QUERY_OUTPUT_BUFFER);
+
+    // Run the query over every file, streaming the output.
+    int status = 0;
+    output_begin(&query);
+    if (query.command == COMMAND_AGGREGATE)
+    {
+        // Aggregates are computed on a pool of threads.
+        ScanFilter filter = {query.from, query.to, query.below, query.above};
+        double start = now_seconds();
+        if (parallel_aggregate(argv + i, argc - i, &filter, query.threads, &query.total) != 0)
+        {
+            status = 1;
+        }
+        double elapsed = now_seconds() - start;
+
+        if (query.timing)
+        {
+            fprintf(stderr, "Aggregated %lld samples in %.3f s with %d threads (%.1f Msamples/s)\n",
+                    (long long)query.total.count, elapsed, query.threads,
+                    elapsed > 0 ? query.total.count / elapsed / 1e6 : 0.0);
+        }
+        output_aggregate(&query, &query.total, 0, 0);
+    }
+    else
+    {
+        if (query.command == COMMAND_RESAMPLE)
+        {
+            query.resampler = resampler_create(query.rate, query.method, query.maxGap);
+            if (query.resampler == NULL)
+            {
+                return 1;
+            }
+        }
+
+        int first_file = i;
+        double start = now_seconds();
+        for (; i < argc; i++)
+        {
+            if (process_file(&query, argv[i]) != 0)
+            {
+                status = 1;
+            }
+        }
+        flush_series(&query);
+        double elapsed = now_seconds() - start;
+
+        if (query.timing && query.command == COMMAND_RESAMPLE)
+        {
+            fprintf(stderr, "Resampled %lld samples to %lld grid points in %.3f s (%.1f Mpoints/s)\n",
+                    (long long)query.resampledSamples, (long long)query.rows, elapsed,
+                    elapsed > 0 ? query.rows / elapsed / 1e6 : 0.0);
+        }
+        if (query.timing && query.command == COMMAND_DOWNSAMPLE)
+        {
+            fprintf(stderr, "Downsampled %lld of %d files from %lld rollup buckets in %.3f s\n",
+                    (long long)query.rollupFiles, argc - first_file, (long long)query.rollupBuckets, elapsed);
+        }
+        if (query.timing && query.command == COMMAND_COLUMNS)
+        {
+            fprintf(stderr, "Read %lld of %lld row groups, %.1f KiB of chunks out of %.1f KiB of files, in %.3f s\n",
+                    (long long)query.groupsRead, (long long)query.groupsTotal, query.chunkBytes / 1024.0,
+                    query.fileBytes / 1024.0, elapsed);
+        }
+        resampler_destroy(query.resampler);
+    }
+    output_end(&query);
+
+    fflush(stdout);
+    return status;
+}
@@ -0,0 +1,229 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file resample.c
+ * @author Daniel Oliveira
+ * @brief Streaming resampling of the heart rate series to a uniform time grid.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+
+/**
+ * @brief Create a resampler.
+ */
+Resampler *resampler_create(int rate, ResampleMethod method, int64_t max_gap)
+{
+    if (rate <= 0 || max_gap < 0)
+    {
+        return NULL;
+    }
+
+    // Vector types need their natural alignment.
+    void *memory = NULL;
+    if (posix_memalign(&memory, sizeof(ResampleVector), sizeof(Resampler)) != 0)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+
+    Resampler *resampler = (Resampler *)memory;
+    memset(resampler, 0, sizeof(Resampler));
+    resampler->rate = rate;
+    resampler->method = method;
+    resampler->maxGap = max_gap;
+    resampler->origin = INT64_MIN;
+
+    return resampler;
+}
+
+/**
+ * @brief Free a resampler.
+ */
+void resampler_destroy(Resampler *resampler)
+{
+    free(resampler);
+}
+
+/**
+ * @brief Start a new series.
+ */
+void resampler_start(Resampler *resampler, int64_t origin)
+{
+    resampler->origin = origin;
+    resampler->started = 0;
+    resampler->next = 0;
+    resampler->windowCount = 0;
+    resampler->pendingCount = 0;
+}
+
+/**
+ * @brief Time of a sample in grid units.
+ */
+static inline int64_t grid_time(const Resampler *resampler, const SessionRecord *record)
+{
+    return (record->time - resampler->origin) * resampler->rate;
+}
+
+/**
+ * @brief Interpolate the pending grid points and hand them to the output.
+ */
+static void resampler_flush(Resampler *resampler, ResampleOutput output, void *user_data)
+{
+    if (resampler->pendingCount == 0)
+    {
+        return;
+    }
+
+    // Padding lanes are computed too, their values are never read.
+    int vectors = (resampler->pendingCount + RESAMPLE_LANES - 1) / RESAMPLE_LANES;
+
+    if (resampler->method == RESAMPLE_CUBIC)
+    {
+        // Catmull-Rom spline through p1 and p2, in Horner form.
+        for (int v = 0; v < vectors; v++)
+        {
+            ResampleVector p0 = resampler->p0[v], p1 = resampler->p1[v], p2 = resampler->p2[v], p3 = resampler->p3[v];
+            ResampleVector u = resampler->u[v];
+
+            ResampleVector a = -0.5f * p0 + 1.5f * p1 - 1.5f * p2 + 0.5f * p3;
+            ResampleVector b = p0 - 2.5f * p1 + 2.0f * p2 - 0.5f * p3;
+            ResampleVector c = 0.5f * (p2 - p0);
+            resampler->values[v] = ((a * u + b) * u + c) * u + p1;
+        }
+    }
+    else
+    {
+        for (int v = 0; v < vectors; v++)
+        {
+            resampler->values[v] = resampler->p1[v] + resampler->u[v] * (resampler->p2[v] - resampler->p1[v]);
+        }
+    }
+
+    output((const float *)resampler->values, resampler->valid, resampler->pendingFirst, resampler->pendingCount, user_data);
+    resampler->pendingCount = 0;
+}
+
+/**
+ * @brief Gather the kernel inputs of the grid points before limit (grid units, exclusive).
+ */
+static void resampler_gather(Resampler *resampler, int64_t limit, ResampleOutput output, void *user_data)
+{
+    const SessionRecord *window = resampler->window;
+    const int n = resampler->windowCount;
+    const int64_t max_span = resampler->maxGap * resampler->rate;
+    int i = 0;
+
+    while (resampler->next < limit)
+    {
+        // Samples i and i + 1 surround the grid point.
+        while (i + 2 < n && grid_time(resampler, &window[i + 1]) <= resampler->next)
+        {
+            i++;
+        }
+
+        int64_t t1 = grid_time(resampler, &window[i]);
+        int64_t t2 = grid_time(resampler, &window[i + 1]);
+        int64_t span = t2 - t1;
+
+        if (resampler->pendingCount == 0)
+        {
+            resampler->pendingFirst = resampler->next;
+        }
+        int slot = resampler->pendingCount++;
+        int v = slot / RESAMPLE_LANES;
+        int lane = slot % RESAMPLE_LANES;
+
+        if (span > max_span || resampler->next < t1)
+        {
+            // Gap: all inputs zero, so the interpolated value is zero.
+            resampler->p0[v][lane] = 0.0f;
+            resampler->p1[v][lane] = 0.0f;
+            resampler->p2[v][lane] = 0.0f;
+            resampler->p3[v][lane] = 0.0f;
+            resampler->u[v][lane] = 0.0f;
+            resampler->valid[slot] = 0;
+        }
+        else
+        {
+            // Outer samples across a gap are replaced by the inner ones.
+            int has_before = i > 0 && t1 - grid_time(resampler, &window[i - 1]) <= max_span;
+            int has_after = i + 2 < n && grid_time(resampler, &window[i + 2]) - t2 <= max_span;
+
+            resampler->p1[v][lane] = window[i].bpm;
+            resampler->p2[v][lane] = window[i + 1].bpm;
+            resampler->p0[v][lane] = has_before ? window[i - 1].bpm : window[i].bpm;
+            resampler->p3[v][lane] = has_after ? window[i + 2].bpm : window[i + 1].bpm;
+            resampler->u[v][lane] = span > 0 ? (float)(resampler->next - t1) / span : 0.0f;
+            resampler->valid[slot] = 1;
+        }
+
+        resampler->next++;
+        if (resampler->pendingCount == RESAMPLE_BLOCK)
+        {
+            resampler_flush(resampler, output, user_data);
+        }
+    }
+}
+
+/**
+ * @brief Append time sorted samples to the series.
+ */
+void resampler_push(Resampler *resampler, const SessionRecord *records, size_t count, ResampleOutput output, void *user_data)
+{
+    // The cubic kernel needs the sample after the pair surrounding the grid point.
+    const int lookahead = resampler->method == RESAMPLE_CUBIC ? 2 : 1;
+
+    while (count > 0)
+    {
+        size_t take = count < RESAMPLE_BLOCK ? count : RESAMPLE_BLOCK;
+        memcpy(resampler->window + resampler->windowCount, records, take * sizeof(SessionRecord));
+        resampler->windowCount += take;
+        records += take;
+        count -= take;
+
+        // The grid starts at the origin, or at the first sample.
+        if (!resampler->started)
+        {
+            if (resampler->origin == INT64_MIN)
+            {
+                resampler->origin = resampler->window[0].time;
+            }
+            int64_t first = grid_time(resampler, &resampler->window[0]);
+            resampler->next = first > 0 ? first : 0;
+            resampler->started = 1;
+        }
+
+        int n = resampler->windowCount;
+        if (n > lookahead)
+        {
+            resampler_gather(resampler, grid_time(resampler, &resampler->window[n - lookahead]), output, user_data);
+        }
+
+        // Keep the last samples for the grid points not interpolated yet.
+        int keep = n < RESAMPLE_CARRY ? n : RESAMPLE_CARRY;
+        memmove(resampler->window, resampler->window + n - keep, keep * sizeof(SessionRecord));
+        resampler->windowCount = keep;
+    }
+}
+
+/**
+ * @brief End the series and emit the remaining grid points, up to the last sample.
+ */
+void resampler_finish(Resampler *resampler, ResampleOutput output, void *user_data)
+{
+    int n = resampler->windowCount;
+    if (n >= 2)
+    {
+        resampler_gather(resampler, grid_time(resampler, &resampler->window[n - 1]) + 1, output, user_data);
+    }
+    resampler_flush(resampler, output, user_data);
+
+    resampler->started = 0;
+    resampler->windowCount = 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile resample.h
+ * @author Daniel Oliveira
+ * @brief Streaming resampling of the heart rate series to a uniform time grid.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+#include "session.h"
+
+// Number of grid points interpolated and emitted at once.
+#define RESAMPLE_BLOCK 4096
+
+// Number of values interpolated by one vector operation.
+#define RESAMPLE_LANES 8
+
+// Samples kept from one pushed chunk to the next (the cubic kernel reads 4 samples).
+#define RESAMPLE_CARRY 3
+
+typedef float ResampleVector __attribute__((vector_size(RESAMPLE_LANES * sizeof(float))));
+
+/**
+ * @brief Interpolation methods.
+ */
+typedef enum
+{
+    RESAMPLE_LINEAR,
+    RESAMPLE_CUBIC
+} ResampleMethod;
+
+/**
+ * @brief Receives a block of grid points.
+ * @param values The interpolated bpm values, 0 where the point is not valid.
+ * @param valid 1 if the point is valid, 0 if it falls in a gap.
+ * @param first The grid index of the first point, its time is origin + first / rate.
+ * @param count The number of points.
+ * @param user_data The user data given to resampler_push or resampler_finish.
+ */
+typedef void (*ResampleOutput)(const float *values, const uint8_t *valid, int64_t first, int count, void *user_data);
+
+/**
+ * @brief Resampler state: the last samples of the series and the pending block of grid points.
+ */
+typedef struct
+{
+    int rate;
+    ResampleMethod method;
+    int64_t maxGap;
+    int64_t origin;
+    int started;
+
+    // Next grid index to interpolate.
+    int64_t next;
+
+    // Samples of the current chunk, preceded by the last samples of the previous one.
+    SessionRecord window[RESAMPLE_CARRY + RESAMPLE_BLOCK];
+    int windowCount;
+
+    // Kernel inputs of the pending grid points, gathered before the vector pass.
+    ResampleVector p0[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    ResampleVector p1[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    ResampleVector p2[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    ResampleVector p3[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    ResampleVector u[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    ResampleVector values[RESAMPLE_BLOCK / RESAMPLE_LANES];
+    uint8_t valid[RESAMPLE_BLOCK];
+    int64_t pendingFirst;
+    int pendingCount;
+} Resampler;
+
+/**
+ * @brief Create a resampler.
+ * @param rate The grid rate in Hz.
+ * @param method The interpolation method.
+ * @param max_gap Samples further apart than this (seconds) delimit a gap.
+ * @return A pointer to the Resampler, or NULL on error.
+ */
+Resampler *resampler_create(int rate, ResampleMethod method, int64_t max_gap);
+
+/**
+ * @brief Free a resampler.
+ * @param resampler The Resampler instance, may be NULL.
+ */
+void resampler_destroy(Resampler *resampler);
+
+/**
+ * @brief Start a new series.
+ * @param resampler The Resampler instance.
+ * @param origin The time of grid index 0, or INT64_MIN to start at the first sample.
+ */
+void resampler_start(Resampler *resampler, int64_t origin);
+
+/**
+ * @brief Append time sorted samples to the series.
+ * @param resampler The Resampler instance.
+ * @param records The samples.
+ * @param count The number of samples.
+ * @param output The callback receiving the complete blocks of grid points.
+ * @param user_data The user data passed to the callback.
+ *
+ * Grid points are emitted as soon as the samples around them are known, so the
+ * memory used does not depend on the length of the series.
+ */
+void resampler_push(Resampler *resampler, const SessionRecord *records, size_t count, ResampleOutput output, void *user_data);
+
+/**
+ * @brief End the series and emit the remaining grid points, up to the last sample.
+ * @param resampler The Resampler instance.
+ * @param output The callback receiving the blocks of grid points.
+ * @param user_data The user data passed to the callback.
+ */
+void resampler_finish(Resampler *resampler, ResampleOutput output, void *user_data);
+
+#endif
@@ -0,0 +1,300 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file rollup.c
+ * @author Daniel Oliveira
+ * @brief Multi-resolution heart rate rollups (1 minute, 1 hour, 1 day).
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rollup.h"
+#include "codec.h"
+
+// Bucket size of every level in seconds.
+static const int32_t LEVEL_SECONDS[ROLLUP_LEVELS] = {60, 3600, 86400};
+
+/**
+ * @brief Start of the wall clock aligned bucket containing a time, relative to the origin.
+ */
+static int32_t bucket_start(int64_t origin, int32_t time, int32_t seconds)
+{
+    int64_t absolute = origin + time;
+    int64_t aligned = absolute - (((absolute % seconds) + seconds) % seconds);
+    return (int32_t)(aligned - origin);
+}
+
+/**
+ * @brief Initialize empty rollups.
+ */
+void rollups_init(Rollups *rollups, int64_t origin)
+{
+    memset(rollups, 0, sizeof(*rollups));
+    rollups->origin = origin;
+}
+
+/**
+ * @brief Free the memory used by rollups.
+ */
+void rollups_free(Rollups *rollups)
+{
+    for (int level = 0; level < ROLLUP_LEVELS; level++)
+    {
+        free(rollups->levels[level].buckets);
+    }
+    memset(rollups, 0, sizeof(*rollups));
+}
+
+/**
+ * @brief Drop every bucket, keeping the allocated memory.
+ */
+void rollups_reset(Rollups *rollups)
+{
+    for (int level = 0; level < ROLLUP_LEVELS; level++)
+    {
+        rollups->levels[level].count = 0;
+    }
+}
+
+/**
+ * @brief Account for a new sample at every resolution.
+ */
+void rollups_add(Rollups *rollups, int32_t time, int32_t bpm)
+{
+    for (int level = 0; level < ROLLUP_LEVELS; level++)
+    {
+        RollupSeries *series = &rollups->levels[level];
+        int32_t start = bucket_start(rollups->origin, time, LEVEL_SECONDS[level]);
+
+        // Same bucket as the previous sample.
+        if (series->count > 0 && series->buckets[series->count - 1].start == start)
+        {
+            block_summary_add(&series->buckets[series->count - 1].summary, time, bpm);
+            continue;
+        }
+
+        // Open a new bucket.
+        if (series->count == series->capacity)
+        {
+            int capacity = series->capacity ? series->capacity * 2 : 64;
+            RollupBucket *buckets = realloc(series->buckets, capacity * sizeof(RollupBucket));
+            if (buckets == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                continue;
+            }
+            series->buckets = buckets;
+            series->capacity = capacity;
+        }
+
+        RollupBucket *bucket = &series->buckets[series->count++];
+        bucket->start = start;
+        block_summary_init(&bucket->summary, time, bpm);
+    }
+}
+
+/**
+ * @brief Resolution of a rollup level in seconds.
+ */
+int32_t rollup_level_seconds(RollupLevel level)
+{
+    return LEVEL_SECONDS[level];
+}
+
+/**
+ * @brief Aggregate a time range in buckets of the given size, from the rollups only.
+ */
+int rollups_query(const Rollups *rollups, int32_t bucket_seconds, int32_t from, int32_t to, RollupBucket *out, int capacity)
+{
+    // Pick the coarsest level that evenly divides the requested bucket size.
+    int level = -1;
+    for (int i = ROLLUP_LEVELS - 1; i >= 0; i--)
+    {
+        if (bucket_seconds >= LEVEL_SECONDS[i] && bucket_seconds % LEVEL_SECONDS[i] == 0)
+        {
+            level = i;
+            break;
+        }
+    }
+    if (level < 0)
+    {
+        return -1;
+    }
+
+    const RollupSeries *series = &rollups->levels[level];
+
+    // Binary search the first level bucket that may overlap the range.
+    int low = 0;
+    int high = series->count;
+    int32_t first_start = bucket_start(rollups->origin, from, LEVEL_SECONDS[level]);
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (series->buckets[mid].start < first_start)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    // Merge the level buckets into the output buckets.
+    int written = 0;
+    for (int i = low; i < series->count && series->buckets[i].start < to; i++)
+    {
+        int32_t start = bucket_start(rollups->origin, series->buckets[i].start, bucket_seconds);
+
+        if (written == 0 || out[written - 1].start != start)
+        {
+            if (written == capacity)
+            {
+                break;
+            }
+            out[written].start = start;
+            memset(&out[written].summary, 0, sizeof(BlockSummary));
+            written++;
+        }
+        block_summary_merge(&out[written - 1].summary, &series->buckets[i].summary);
+    }
+
+    return written;
+}
+
+/**
+ * @brief Path of the rollup sidecar of a file.
+ */
+char *rollups_sidecar_path(const char *path)
+{
+    size_t path_len = strlen(path) + strlen(ROLLUP_EXTENSION) + 1;
+    char *sidecar = malloc(path_len);
+    snprintf(sidecar, path_len, "%s%s", path, ROLLUP_EXTENSION);
+    return sidecar;
+}
+
+/**
+ * @brief Serialize rollups as a sidecar.
+ */
+uint8_t *rollups_encode(const Rollups *rollups, uint64_t source_size, size_t *size)
+{
+    RollupFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ROLLUP_MAGIC, sizeof(header.magic));
+    header.version = ROLLUP_VERSION;
+    header.origin = rollups->origin;
+    header.sourceSize = source_size;
+
+    size_t length = sizeof(header);
+    for (int level = 0; level < ROLLUP_LEVELS; level++)
+    {
+        header.counts[level] = rollups->levels[level].count;
+        length += rollups->levels[level].count * sizeof(RollupBucket);
+    }
+
+    uint8_t *data = malloc(length);
+    if (data == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+
+    size_t offset = sizeof(header);
+    for (int level = 0; level < ROLLUP_LEVELS; level++)
+    {
+        size_t bytes = rollups->levels[level].count * sizeof(RollupBucket);
+        if (bytes > 0)
+        {
+            memcpy(data + offset, rollups->levels[level].buckets, bytes);
+            offset += bytes;
+        }
+    }
+    header.checksum = codec_crc32(0, data + sizeof(header), length - sizeof(header));
+    memcpy(data, &header, sizeof(header));
+
+    *size = length;
+    return data;
+}
+
+/**
+ * @brief Write rollups to a sidecar file.
+ */
+int rollups_save(const Rollups *rollups, const char *path, uint64_t source_size)
+{
+    size_t size;
+    uint8_t *data = rollups_encode(rollups, source_size, &size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    FILE *out = fopen(path, "wb");
+    int status = out != NULL && fwrite(data, size, 1, out) == 1 ? 0 : -1;
+    if (out != NULL && fclose(out) != 0)
+    {
+        status = -1;
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "Error: could not write rollup file %s\n", path);
+        unlink(path);
+    }
+
+    free(data);
+    return status;
+}
+
+/**
+ * @brief Read rollups from a sidecar file.
+ */
+int rollups_load(Rollups *rollups, const char *path, uint64_t source_size)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        return -1;
+    }
+
+    RollupFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, ROLLUP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ROLLUP_VERSION || header.sourceSize != source_size)
+    {
+        fclose(in);
+        return -1;
+    }
+
+    rollups_init(rollups, header.origin);
+    uint32_t crc = 0;
+    int status = 0;
+
+    for (int level = 0; level < ROLLUP_LEVELS && status == 0; level++)
+    {
+        RollupSeries *series = &rollups->levels[level];
+        if (header.counts[level] == 0)
+        {
+            continue;
+        }
+
+        series->buckets = malloc(header.counts[level] * sizeof(RollupBucket));
+        if (series->buckets == NULL || fread(series->buckets, sizeof(RollupBucket), header.counts[level], in) != header.counts[level])
+        {
+            status = -1;
+            break;
+        }
+        series->count = series->capacity = header.counts[level];
+        crc = codec_crc32(crc, (const uint8_t *)series->buckets, header.counts[level] * sizeof(RollupBucket));
+    }
+    fclose(in);
+
+    if (status != 0 || crc != header.checksum)
+    {
+        rollups_free(rollups);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile rollup.h
+ * @author Daniel Oliveira
+ * @brief Multi-resolution heart rate rollups (1 minute, 1 hour, 1 day).
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "history.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define ROLLUP_MAGIC "MBHU"
+#define ROLLUP_VERSION 1
+
+// Extension appended to the path of a session or archive file to name its rollup sidecar.
+#define ROLLUP_EXTENSION ".hru"
+
+/**
+ * @brief Resolutions at which rollups are maintained.
+ */
+typedef enum
+{
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_LEVELS
+} RollupLevel;
+
+/**
+ * @brief Aggregate of the samples of one time bucket.
+ *
+ * start is the bucket start in seconds relative to the session start.
+ */
+typedef struct
+{
+    int32_t start;
+    BlockSummary summary;
+} RollupBucket;
+
+/**
+ * @brief Buckets of one resolution, in time order.
+ */
+typedef struct
+{
+    RollupBucket *buckets;
+    int count;
+    int capacity;
+} RollupSeries;
+
+/**
+ * @brief Rollups of the heart rate history at every resolution.
+ *
+ * Buckets are aligned on wall clock time: origin is the absolute time (epoch seconds)
+ * of relative time 0.
+ */
+typedef struct
+{
+    RollupSeries levels[ROLLUP_LEVELS];
+    int64_t origin;
+} Rollups;
+
+/**
+ * @brief Header of a rollup sidecar, followed by the buckets of every level in order.
+ *
+ * sourceSize is the size of the file the rollups were computed from: a sidecar whose
+ * file has since changed size is stale and ignored. The checksum covers the buckets.
+ */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    int64_t origin;
+    uint64_t sourceSize;
+    uint32_t counts[ROLLUP_LEVELS];
+    uint32_t checksum;
+} RollupFileHeader;
+
+/**
+ * @brief Initialize empty rollups.
+ * @param rollups The Rollups instance.
+ * @param origin The absolute time (epoch seconds) sample times are relative to.
+ */
+void rollups_init(Rollups *rollups, int64_t origin);
+
+/**
+ * @brief Free the memory used by rollups.
+ * @param rollups The Rollups instance.
+ */
+void rollups_free(Rollups *rollups);
+
+/**
+ * @brief Drop every bucket, keeping the allocated memory.
+ * @param rollups The Rollups instance.
+ */
+void rollups_reset(Rollups *rollups);
+
+/**
+ * @brief Account for a new sample at every resolution.
+ * @param rollups The Rollups instance.
+ * @param time The sample time, not earlier than the previous one.
+ * @param bpm The heart rate value.
+ *
+ * Each level only updates or appends its last bucket, so the cost is O(1) per sample.
+ */
+void rollups_add(Rollups *rollups, int32_t time, int32_t bpm);
+
+/**
+ * @brief Resolution of a rollup level in seconds.
+ * @param level The rollup level.
+ * @return The bucket size in seconds.
+ */
+int32_t rollup_level_seconds(RollupLevel level);
+
+/**
+ * @brief Aggregate a time range in buckets of the given size, from the rollups only.
+ * @param rollups The Rollups instance.
+ * @param bucket_seconds The output bucket size, a multiple of 60 seconds.
+ * @param from The start of the time range (inclusive).
+ * @param to The end of the time range (exclusive).
+ * @param out The output buckets.
+ * @param capacity The number of buckets the output can hold.
+ * @return The number of non-empty buckets written, or -1 if bucket_seconds is finer than the rollups.
+ *
+ * The coarsest level that evenly divides bucket_seconds is read, so e.g. daily buckets
+ * over a month read about 30 day buckets rather than every sample. Level buckets
+ * partially overlapping the range are included whole.
+ */
+int rollups_query(const Rollups *rollups, int32_t bucket_seconds, int32_t from, int32_t to, RollupBucket *out, int capacity);
+
+/**
+ * @brief Path of the rollup sidecar of a file.
+ * @param path The path of the session or archive file.
+ * @return The path with ROLLUP_EXTENSION appended, to be freed by the caller.
+ */
+char *rollups_sidecar_path(const char *path);
+
+/**
+ * @brief Serialize rollups as a sidecar.
+ * @param rollups The Rollups instance.
+ * @param source_size The size of the file the rollups were computed from.
+ * @param size The size of the serialized sidecar.
+ * @return The sidecar, to be freed by the caller, or NULL if it could not be allocated.
+ */
+uint8_t *rollups_encode(const Rollups *rollups, uint64_t source_size, size_t *size);
+
+/**
+ * @brief Write rollups to a sidecar file.
+ * @param rollups The Rollups instance.
+ * @param path The path of the sidecar.
+ * @param source_size The size of the file the rollups were computed from.
+ * @return 0 on success, -1 on error.
+ *
+ * The sidecar is not synced: it can always be computed again from its file.
+ */
+int rollups_save(const Rollups *rollups, const char *path, uint64_t source_size);
+
+/**
+ * @brief Read rollups from a sidecar file.
+ * @param rollups The Rollups to fill, free them with rollups_free.
+ * @param path The path of the sidecar.
+ * @param source_size The current size of the file the rollups were computed from.
+ * @return 0 on success, -1 if the sidecar is missing, corrupted or stale.
+ */
+int rollups_load(Rollups *rollups, const char *path, uint64_t source_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file scheduler.c
+ * @author Daniel Oliveira
+ * @brief Duty cycling: staggered continuous measurement windows under an airtime budget.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scheduler.h"
+
+/**
+ * @brief Take over the measurement of the bands and stagger their first windows.
+ */
+int duty_scheduler_init(DutyScheduler *scheduler, BLEDevice **devices, int count, int budget, int max_staleness, time_t now)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->bands = calloc(count > 0 ? count : 1, sizeof(DutyBand));
+    if (scheduler->bands == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return -1;
+    }
+    scheduler->count = count;
+    scheduler->budget = budget > 0 ? budget : 1;
+    scheduler->maxStaleness = max_staleness;
+    scheduler->startedAt = now;
+
+    // The bands measure budget at a time: each group of bands gets an equal share of the period.
+    int groups = (count + scheduler->budget - 1) / scheduler->budget;
+    int period = max_staleness - DUTY_MARGIN_S;
+    int share = groups > 0 ? period / groups : period;
+
+    scheduler->window = share < DUTY_WINDOW_S ? share : DUTY_WINDOW_S;
+    if (scheduler->window < DUTY_MIN_WINDOW_S)
+    {
+        scheduler->window = DUTY_MIN_WINDOW_S;
+        share = DUTY_MIN_WINDOW_S;
+        printf("A staleness of %d s cannot be guaranteed for %d bands measuring %d at a time (%d at a time needed) \n",
+               max_staleness, count, scheduler->budget,
+               (count * DUTY_MIN_WINDOW_S + period - 1) / (period > 0 ? period : 1));
+    }
+
+    // Stagger the first deadlines one share apart per group.
+    for (int i = 0; i < count; i++)
+    {
+        DutyBand *band = &scheduler->bands[i];
+        band->device = devices[i];
+        band->deadline = now + scheduler->window + DUTY_MARGIN_S + (i / scheduler->budget) * share;
+        devices[i]->dutyCycled = 1;
+    }
+
+    printf("Duty cycling %d bands: windows of %d s, %d at a time, staleness up to %d s \n", count, scheduler->window,
+           scheduler->budget, max_staleness);
+    return 0;
+}
+
+/**
+ * @brief Give the measurement back to the bands and free the scheduler.
+ */
+void duty_scheduler_free(DutyScheduler *scheduler)
+{
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        scheduler->bands[i].device->dutyCycled = 0;
+    }
+    free(scheduler->bands);
+    scheduler->bands = NULL;
+    scheduler->count = 0;
+}
+
+/**
+ * @brief Follow the newest stored sample of a band, and its deadline.
+ */
+static void update_freshness(DutyScheduler *scheduler, DutyBand *band, time_t now)
+{
+    BLEDevice *device = band->device;
+
+    if (device->hrCount > 0)
+    {
+        time_t newest = device->startTime + device->hrHist[device->hrCount - 1][0];
+        if (newest > band->lastSample)
+        {
+            time_t previous = band->lastSample ? band->lastSample : scheduler->startedAt;
+            if (newest - previous > scheduler->worstStaleness)
+            {
+                scheduler->worstStaleness = newest - previous;
+            }
+            band->lastSample = newest;
+            band->deadline = newest + scheduler->maxStaleness;
+            band->late = 0;
+        }
+    }
+
+    // Count each missed deadline once, the late band is first in line for the next free slot.
+    if (now > band->deadline && !band->late)
+    {
+        band->late = 1;
+        scheduler->missed++;
+    }
+}
+
+/**
+ * @brief Whether a band can measure: connected, authenticated on this connection, measuring and worn.
+ */
+static int can_measure(const BLEDevice *device)
+{
+    return device->connected && device->authenticated && device->startTime != 0 && device->wear.state != WEAR_OFF;
+}
+
+/**
+ * @brief End the window of a band.
+ */
+static void end_window(DutyScheduler *scheduler, DutyBand *band, time_t now)
+{
+    if (band->device->connected)
+    {
+        stop_hr_measure(band->device);
+    }
+    band->measuring = 0;
+    scheduler->active--;
+    scheduler->airtime += now - band->windowStart;
+
+    // A window without any value (no sensor lock) waits a full period, so the band does not hold a slot forever.
+    if (band->lastSample < band->windowStart)
+    {
+        band->deadline = now + scheduler->maxStaleness;
+        band->late = 0;
+    }
+}
+
+/**
+ * @brief End the windows that are over and start the ones that are due.
+ */
+int duty_scheduler_tick(DutyScheduler *scheduler, time_t now)
+{
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        DutyBand *band = &scheduler->bands[i];
+        update_freshness(scheduler, band, now);
+
+        if (!band->measuring)
+        {
+            continue;
+        }
+
+        if (now >= band->windowEnd || !can_measure(band->device))
+        {
+            end_window(scheduler, band, now);
+        }
+        else if (now - band->lastPing >= DUTY_PING_S)
+        {
+            ping_heart_rate(band->device);
+            band->lastPing = now;
+        }
+    }
+
+    // Earliest deadline first, among the bands whose window is due.
+    int started = 0;
+    while (scheduler->active < scheduler->budget)
+    {
+        DutyBand *next = NULL;
+        for (int i = 0; i < scheduler->count; i++)
+        {
+            DutyBand *band = &scheduler->bands[i];
+            if (band->measuring || !can_measure(band->device))
+            {
+                continue;
+            }
+            if (now < band->deadline - scheduler->window - DUTY_MARGIN_S)
+            {
+                continue;
+            }
+            if (next == NULL || band->deadline < next->deadline)
+            {
+                next = band;
+            }
+        }
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        ping_heart_rate(next->device);
+        next->measuring = 1;
+        next->windowStart = now;
+        next->windowEnd = now + scheduler->window;
+        next->lastPing = now;
+        scheduler->active++;
+        scheduler->windows++;
+        started++;
+    }
+
+    return started;
+}
+
+/**
+ * @brief Print the windows, the airtime used and the missed deadlines.
+ */
+void duty_scheduler_report(const DutyScheduler *scheduler, time_t now)
+{
+    int64_t airtime = scheduler->airtime;
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        if (scheduler->bands[i].measuring)
+        {
+            airtime += now - scheduler->bands[i].windowStart;
+        }
+    }
+
+    double elapsed = (double)(now - scheduler->startedAt);
+    printf("Duty cycling: %lld windows, measuring %.1f%% of the time per band (%.1f bands at once on average) \n",
+           (long long)scheduler->windows, elapsed > 0 ? 100.0 * airtime / (elapsed * scheduler->count) : 0.0,
+           elapsed > 0 ? airtime / elapsed : 0.0);
+    printf("Duty cycling: %lld missed deadlines, longest time without a sample %lld s (limit %d s) \n",
+           (long long)scheduler->missed, (long long)scheduler->worstStaleness, scheduler->maxStaleness);
+}
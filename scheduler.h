@@ -0,0 +1,121 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile scheduler.h
+ * @author Daniel Oliveira
+ * @brief Duty cycling: staggered continuous measurement windows under an airtime budget.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <time.h>
+#include "band.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Length of a continuous measurement window, shortened when the budget requires it, in seconds.
+#define DUTY_WINDOW_S 60
+
+// Shortest window worth starting: the band needs a few seconds before the first value, in seconds.
+#define DUTY_MIN_WINDOW_S 20
+
+// A window starts this long before it is strictly needed to meet the staleness, in seconds.
+#define DUTY_MARGIN_S 10
+
+// Period of the keepalives during a window, in seconds.
+#define DUTY_PING_S 10
+
+/**
+ * @brief Duty cycle state of a band.
+ */
+typedef struct
+{
+    BLEDevice *device;
+
+    // Current window, if measuring.
+    int measuring;
+    time_t windowStart;
+    time_t windowEnd;
+    time_t lastPing;
+
+    // Wall time of the newest stored sample, and the time by which the next one is due.
+    time_t lastSample;
+    time_t deadline;
+    int late;
+} DutyBand;
+
+/**
+ * @brief Fleet scheduler: at most budget bands measure at once, each within the maximum staleness.
+ */
+typedef struct
+{
+    DutyBand *bands;
+    int count;
+    int budget;
+    int maxStaleness;
+    int window;
+    int active;
+
+    time_t startedAt;
+    int64_t windows;
+    int64_t missed;
+    int64_t airtime;
+    int64_t worstStaleness;
+} DutyScheduler;
+
+/**
+ * @brief Take over the measurement of the bands and stagger their first windows.
+ * @param scheduler The DutyScheduler instance.
+ * @param devices The bands, not authenticated yet.
+ * @param count The number of bands.
+ * @param budget The number of bands measuring continuously at once.
+ * @param max_staleness The longest time a band may go without a stored sample, in seconds.
+ * @param now The current time.
+ * @return 0 on success, -1 if the memory could not be allocated.
+ *
+ * A band needs one window per max_staleness. The window is shortened so that the bands,
+ * budget at a time, fit in that period. If even DUTY_MIN_WINDOW_S does not fit, the
+ * staleness cannot be guaranteed: this is reported, and the deadlines are missed evenly.
+ */
+int duty_scheduler_init(DutyScheduler *scheduler, BLEDevice **devices, int count, int budget, int max_staleness, time_t now);
+
+/**
+ * @brief Give the measurement back to the bands and free the scheduler.
+ * @param scheduler The DutyScheduler instance.
+ */
+void duty_scheduler_free(DutyScheduler *scheduler);
+
+/**
+ * @brief End the windows that are over and start the ones that are due.
+ * @param scheduler The DutyScheduler instance.
+ * @param now The current time.
+ * @return The number of windows started.
+ *
+ * Called every second from the main loop. The bands whose next sample is due soonest
+ * are started first (earliest deadline first), while fewer than budget bands measure.
+ * A band is not started before its deadline minus the window and DUTY_MARGIN_S, so the
+ * windows stay spread over the staleness period instead of running back to back.
+ * Bands dropped, not authenticated yet or off the wrist are skipped.
+ */
+int duty_scheduler_tick(DutyScheduler *scheduler, time_t now);
+
+/**
+ * @brief Print the windows, the airtime used and the missed deadlines.
+ * @param scheduler The DutyScheduler instance.
+ * @param now The current time.
+ */
+void duty_scheduler_report(const DutyScheduler *scheduler, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
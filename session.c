@@ -0,0 +1,458 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file session.c
+ * @author Daniel Oliveira
+ * @brief Recorded heart rate session files: writer and memory-mapped reader.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "session.h"
+
+/**
+ * @brief Create the session file starting at a given time, locked while it is written.
+ */
+static int open_session_file(SessionWriter *writer, int64_t file_start)
+{
+    size_t path_len = strlen(writer->directory) + strlen(writer->fileMac) + 32;
+    char *path = malloc(path_len);
+    snprintf(path, path_len, "%s/%s_%lld%s", writer->directory, writer->fileMac, (long long)file_start, SESSION_EXTENSION);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not create session file %s\n", path);
+        free(path);
+        return -1;
+    }
+
+    // The lock tells the compactor the file is still written, it goes away with the descriptor.
+    // The compactor only tests it for an instant, so waiting for it is bounded.
+    flock(fd, LOCK_EX);
+
+    StorageFile *file = storage_file_open(fd);
+    if (file == NULL)
+    {
+        close(fd);
+        free(path);
+        return -1;
+    }
+
+    free(writer->path);
+    writer->path = path;
+    writer->file = file;
+    writer->fileStart = file_start;
+    writer->fileRecords = 0;
+    rollups_reset(&writer->rollups);
+    writer->rollups.origin = file_start;
+    writer->blockOffset = 0;
+    writer->blocks = 0;
+    return 0;
+}
+
+/**
+ * @brief Create a new session file in the given directory.
+ */
+SessionWriter *session_writer_open(const char *directory, const char *mac_address, time_t start_time)
+{
+    StorageQueue *queue = storage_queue_shared();
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    SessionWriter *writer = calloc(1, sizeof(SessionWriter));
+    writer->queue = queue;
+    writer->directory = strdup(directory);
+    writer->startTime = start_time;
+    writer->rotateBytes = SESSION_ROTATE_BYTES;
+    writer->rotateSeconds = SESSION_ROTATE_S;
+    rollups_init(&writer->rollups, start_time);
+    snprintf(writer->macAddress, sizeof(writer->macAddress), "%s", mac_address);
+
+    // Build the file name from the MAC address, replacing the separators.
+    snprintf(writer->fileMac, sizeof(writer->fileMac), "%s", mac_address);
+    for (char *c = writer->fileMac; *c; c++)
+    {
+        if (*c == ':')
+        {
+            *c = '-';
+        }
+    }
+
+    if (open_session_file(writer, start_time) != 0)
+    {
+        rollups_free(&writer->rollups);
+        free(writer->directory);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+/**
+ * @brief Change the size and time after which the writer moves on to a new file.
+ */
+void session_writer_set_rotation(SessionWriter *writer, int64_t max_bytes, int64_t max_seconds)
+{
+    writer->rotateBytes = max_bytes;
+    writer->rotateSeconds = max_seconds;
+}
+
+/**
+ * @brief Fill the header of the current file.
+ */
+static void fill_header(const SessionWriter *writer, SessionHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SESSION_MAGIC, sizeof(header->magic));
+    header->version = SESSION_VERSION;
+    header->startTime = writer->fileStart;
+    snprintf(header->macAddress, sizeof(header->macAddress), "%s", writer->macAddress);
+}
+
+/**
+ * @brief Keep a record that found no free buffer, after the ones already waiting.
+ * @return 0 on success, -1 if the backlog is full.
+ */
+static int keep_record(SessionWriter *writer, const SessionRecord *record)
+{
+    // The header goes first if nothing of the file was written yet.
+    if (writer->blockOffset == 0)
+    {
+        SessionHeader header;
+        fill_header(writer, &header);
+        if (storage_backlog_keep(&writer->backlog, &header, sizeof(header), 0) != 0)
+        {
+            return -1;
+        }
+        writer->blockOffset = sizeof(header);
+    }
+
+    if (storage_backlog_keep(&writer->backlog, record, sizeof(*record), writer->blockOffset) != 0)
+    {
+        return -1;
+    }
+    writer->blockOffset += sizeof(*record);
+    return 0;
+}
+
+/**
+ * @brief Submit the open block, and start the next one at the following offset.
+ */
+static void seal_block(SessionWriter *writer)
+{
+    StorageBuffer *block = writer->block;
+    writer->block = NULL;
+
+    writer->blocks++;
+    off_t offset = writer->blockOffset;
+    writer->blockOffset += block->length;
+    storage_buffer_submit(writer->queue, block, writer->file, offset, writer->blocks % SESSION_SYNC_BLOCKS == 0);
+}
+
+/**
+ * @brief Write the rollups of the current file to its sidecar, through the storage queue.
+ *
+ * The sidecar only saves queries from reading the samples: if the buffers it needs are
+ * not all free, it is not written rather than holding up the records.
+ */
+static void write_rollups(SessionWriter *writer)
+{
+    if (writer->fileRecords == 0)
+    {
+        return;
+    }
+
+    uint64_t source_size = sizeof(SessionHeader) + writer->fileRecords * sizeof(SessionRecord);
+    size_t size;
+    uint8_t *data = rollups_encode(&writer->rollups, source_size, &size);
+    if (data == NULL)
+    {
+        return;
+    }
+
+    size_t count = (size + STORAGE_BLOCK_SIZE - 1) / STORAGE_BLOCK_SIZE;
+    StorageBuffer *buffers[STORAGE_QUEUE_DEPTH];
+    size_t taken = 0;
+    while (taken < count && count <= STORAGE_QUEUE_DEPTH / 2 && (buffers[taken] = storage_buffer_take(writer->queue)) != NULL)
+    {
+        taken++;
+    }
+
+    char *path = rollups_sidecar_path(writer->path);
+    int fd = taken == count ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    StorageFile *file = fd >= 0 ? storage_file_open(fd) : NULL;
+    if (file == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        for (size_t i = 0; i < taken; i++)
+        {
+            storage_buffer_release(writer->queue, buffers[i]);
+        }
+        fprintf(stderr, "Warning: rollups of %s not written, queries will read its samples\n", writer->path);
+        free(path);
+        free(data);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t offset = i * STORAGE_BLOCK_SIZE;
+        buffers[i]->length = size - offset < STORAGE_BLOCK_SIZE ? size - offset : STORAGE_BLOCK_SIZE;
+        memcpy(buffers[i]->data, data + offset, buffers[i]->length);
+        storage_buffer_submit(writer->queue, buffers[i], file, offset, 0);
+    }
+    storage_file_close(writer->queue, file, 0);
+
+    free(path);
+    free(data);
+}
+
+/**
+ * @brief Submit the open block, and write the records still waiting for a buffer before the file is closed.
+ */
+static void flush_blocks(SessionWriter *writer)
+{
+    if (writer->block)
+    {
+        seal_block(writer);
+    }
+    if (storage_backlog_submit(writer->queue, &writer->backlog, writer->file, &writer->blocks, SESSION_SYNC_BLOCKS) != 0)
+    {
+        storage_backlog_write(&writer->backlog, writer->file);
+    }
+}
+
+/**
+ * @brief Close the current file in the background and start a new one at the given time.
+ */
+static int rotate(SessionWriter *writer, int32_t time)
+{
+    flush_blocks(writer);
+    write_rollups(writer);
+    storage_file_close(writer->queue, writer->file, 0);
+    writer->file = NULL;
+    writer->rotations++;
+
+    return open_session_file(writer, writer->startTime + time);
+}
+
+/**
+ * @brief Append one heart rate sample to the session file.
+ */
+void session_writer_append(SessionWriter *writer, int32_t time, int32_t bpm)
+{
+    // Move on to a new file once the current one is large or old enough.
+    int64_t file_time = writer->startTime + time - writer->fileStart;
+    if (writer->fileRecords > 0 &&
+        ((int64_t)(writer->fileRecords * sizeof(SessionRecord)) >= writer->rotateBytes || file_time >= writer->rotateSeconds))
+    {
+        if (rotate(writer, time) != 0)
+        {
+            writer->dropped++;
+            return;
+        }
+        file_time = 0;
+    }
+    if (writer->file == NULL && open_session_file(writer, writer->startTime + time) != 0)
+    {
+        writer->dropped++;
+        return;
+    }
+
+    // Retry the records that found no free buffer, the disk may have caught up.
+    if (writer->backlog.size > 0)
+    {
+        storage_backlog_submit(writer->queue, &writer->backlog, writer->file, &writer->blocks, SESSION_SYNC_BLOCKS);
+    }
+
+    // A new block only starts once no record is waiting, so the records stay in file order.
+    if (writer->block == NULL && writer->backlog.size == 0)
+    {
+        writer->block = storage_buffer_take(writer->queue);
+
+        // The header goes at the beginning of the first block of a file.
+        if (writer->block != NULL && writer->blockOffset == 0)
+        {
+            fill_header(writer, (SessionHeader *)writer->block->data);
+            writer->block->length = sizeof(SessionHeader);
+        }
+    }
+
+    // Record times are relative to the start of the file.
+    SessionRecord record = {(int32_t)file_time, bpm};
+    if (writer->block == NULL)
+    {
+        if (keep_record(writer, &record) != 0)
+        {
+            if (writer->dropped++ == 0)
+            {
+                fprintf(stderr, "Warning: session writes to %s are falling behind, dropping samples\n", writer->path);
+            }
+            return;
+        }
+    }
+    else
+    {
+        memcpy(writer->block->data + writer->block->length, &record, sizeof(record));
+        writer->block->length += sizeof(record);
+    }
+    writer->recordCount++;
+    writer->fileRecords++;
+    rollups_add(&writer->rollups, (int32_t)file_time, bpm);
+
+    if (writer->block != NULL && writer->block->length + sizeof(record) > STORAGE_BLOCK_SIZE)
+    {
+        seal_block(writer);
+    }
+}
+
+/**
+ * @brief Write the open block, then sync and close the session file in the background.
+ */
+void session_writer_close(SessionWriter *writer)
+{
+    if (writer == NULL)
+    {
+        return;
+    }
+
+    if (writer->file)
+    {
+        flush_blocks(writer);
+        write_rollups(writer);
+        storage_file_close(writer->queue, writer->file, 0);
+    }
+
+    if (writer->dropped > 0)
+    {
+        fprintf(stderr, "Warning: %zu samples could not be written to %s\n", writer->dropped, writer->path);
+    }
+
+    rollups_free(&writer->rollups);
+    storage_backlog_free(&writer->backlog);
+    free(writer->directory);
+    free(writer->path);
+    free(writer);
+}
+
+/**
+ * @brief Memory-map a session file for reading.
+ */
+int session_file_open(const char *path, SessionFile *file)
+{
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: could not open session file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionHeader))
+    {
+        fprintf(stderr, "Error: %s is not a session file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: could not map session file %s\n", path);
+        return -1;
+    }
+
+    const SessionHeader *header = (const SessionHeader *)map;
+    if (memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0 || header->version != SESSION_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a session file\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    file->map = map;
+    file->mapSize = st.st_size;
+    file->header = header;
+    file->records = (const SessionRecord *)((const uint8_t *)map + sizeof(SessionHeader));
+
+    // A partially written trailing record (e.g. after a crash) is ignored.
+    file->recordCount = (file->mapSize - sizeof(SessionHeader)) / sizeof(SessionRecord);
+
+    return 0;
+}
+
+/**
+ * @brief Unmap a session file.
+ */
+void session_file_close(SessionFile *file)
+{
+    if (file->map != NULL)
+    {
+        munmap(file->map, file->mapSize);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+/**
+ * @brief Find the first record with a time greater or equal to the given time.
+ */
+size_t session_file_lower_bound(const SessionFile *file, int64_t time)
+{
+    return session_lower_bound(file->records, file->recordCount, time);
+}
+
+/**
+ * @brief Find the first record with a time greater or equal to the given time in a sorted array.
+ */
+size_t session_lower_bound(const SessionRecord *records, size_t count, int64_t time)
+{
+    size_t low = 0;
+    size_t high = count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (records[mid].time < time)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * @brief Convert an absolute time (epoch seconds) to a time relative to the session start.
+ */
+int64_t session_relative_time(const SessionHeader *header, int64_t time)
+{
+    if (time == INT64_MIN || time == INT64_MAX)
+    {
+        return time;
+    }
+    return time - header->startTime;
+}
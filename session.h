@@ -0,0 +1,203 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile session.h
+ * @author Daniel Oliveira
+ * @brief Recorded heart rate session files: on-disk layout, writer and memory-mapped reader.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "storage.h"
+#include "rollup.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SESSION_MAGIC "MBHS"
+#define SESSION_VERSION 1
+#define SESSION_EXTENSION ".hrs"
+
+/**
+ * @brief Header stored at the beginning of every session file.
+ *
+ * Record times are stored in seconds relative to startTime, exactly as they are kept in the
+ * in-memory heart rate history, so absolute time is startTime + record time.
+ */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    int64_t startTime;
+    char macAddress[24];
+} SessionHeader;
+
+/**
+ * @brief One heart rate sample as stored in a session file. Records are sorted by time.
+ */
+typedef struct
+{
+    int32_t time;
+    int32_t bpm;
+} SessionRecord;
+
+// The file data is synced after every SESSION_SYNC_BLOCKS blocks, and on close.
+#define SESSION_SYNC_BLOCKS 8
+
+// A writer moves on to a new file after SESSION_ROTATE_BYTES of records or SESSION_ROTATE_S seconds.
+#define SESSION_ROTATE_BYTES (64 * 1024 * 1024)
+#define SESSION_ROTATE_S (24 * 3600)
+
+/**
+ * @brief Append-only writer for a session, rotated over several files.
+ *
+ * Records are copied to a preallocated block of the shared StorageQueue. A sealed (full)
+ * block is written asynchronously, so the notification path never waits for the disk.
+ * When a file reaches the rotation size or age, it is closed in the background and the
+ * next records go to a new file named after the time of its first record.
+ *
+ * The 1 minute, 1 hour and 1 day rollups of each file are kept as records are appended,
+ * and written to its sidecar (ROLLUP_EXTENSION) when the file is closed.
+ */
+typedef struct
+{
+    char *directory;
+    char macAddress[24];
+    char fileMac[24];
+    int64_t startTime;
+    size_t recordCount;
+
+    // Current file, its start time (epoch seconds) and records.
+    StorageFile *file;
+    char *path;
+    int64_t fileStart;
+    size_t fileRecords;
+    Rollups rollups;
+
+    StorageQueue *queue;
+    StorageBuffer *block;
+    off_t blockOffset;
+    int64_t blocks;
+
+    // Records waiting for a free buffer, in file order.
+    StorageBacklog backlog;
+
+    int64_t rotateBytes;
+    int64_t rotateSeconds;
+    int rotations;
+
+    // Records lost while the backlog was full.
+    size_t dropped;
+} SessionWriter;
+
+/**
+ * @brief Read-only, memory-mapped view of a session file.
+ */
+typedef struct
+{
+    const SessionHeader *header;
+    const SessionRecord *records;
+    size_t recordCount;
+    void *map;
+    size_t mapSize;
+} SessionFile;
+
+/**
+ * @brief Create a new session file in the given directory.
+ * @param directory The directory where the session file is created.
+ * @param mac_address The MAC address of the recorded device.
+ * @param start_time The absolute time (epoch seconds) record times are relative to.
+ * @return A pointer to the created SessionWriter, or NULL if the file could not be created.
+ *
+ * The file is named after the MAC address and the start time, so every measurement
+ * session produces its own file. The header is written with the first block.
+ */
+SessionWriter *session_writer_open(const char *directory, const char *mac_address, time_t start_time);
+
+/**
+ * @brief Append one heart rate sample to the session file.
+ * @param writer The SessionWriter instance.
+ * @param time The sample time in seconds relative to the session start.
+ * @param bpm The heart rate value.
+ *
+ * In the file, the time is stored relative to the start of that file.
+ * The record is copied to the open block, a sealed block is submitted to the storage queue.
+ * Nothing blocks: if every buffer is in flight because the disk is slow, the record waits
+ * in the backlog of the writer, and is dropped and counted once the backlog is full.
+ */
+void session_writer_append(SessionWriter *writer, int32_t time, int32_t bpm);
+
+/**
+ * @brief Write the open block, then sync and close the session file in the background.
+ * @param writer The SessionWriter instance.
+ *
+ * The file is closed by the storage queue once its blocks are written, storage_queue_shutdown
+ * waits for it.
+ */
+void session_writer_close(SessionWriter *writer);
+
+/**
+ * @brief Change the size and time after which the writer moves on to a new file.
+ * @param writer The SessionWriter instance.
+ * @param max_bytes The size of the records of a file, in bytes.
+ * @param max_seconds The time covered by a file, in seconds.
+ */
+void session_writer_set_rotation(SessionWriter *writer, int64_t max_bytes, int64_t max_seconds);
+
+/**
+ * @brief Memory-map a session file for reading.
+ * @param path The path of the session file.
+ * @param file The SessionFile structure to fill.
+ * @return 0 on success, -1 if the file could not be opened or is not a valid session file.
+ */
+int session_file_open(const char *path, SessionFile *file);
+
+/**
+ * @brief Unmap a session file.
+ * @param file The SessionFile instance.
+ */
+void session_file_close(SessionFile *file);
+
+/**
+ * @brief Find the first record with a time greater or equal to the given time.
+ * @param file The SessionFile instance.
+ * @param time The time in seconds relative to the session start.
+ * @return The index of the record, or recordCount if every record is earlier.
+ *
+ * Records are sorted by time, so this is a binary search and only touches
+ * O(log n) pages of the mapping.
+ */
+size_t session_file_lower_bound(const SessionFile *file, int64_t time);
+
+/**
+ * @brief Find the first record with a time greater or equal to the given time in a sorted array.
+ * @param records The time sorted records.
+ * @param count The number of records.
+ * @param time The time in seconds relative to the session start.
+ * @return The index of the record, or count if every record is earlier.
+ */
+size_t session_lower_bound(const SessionRecord *records, size_t count, int64_t time);
+
+/**
+ * @brief Convert an absolute time (epoch seconds) to a time relative to the session start.
+ * @param header The header of the session.
+ * @param time The absolute time, INT64_MIN and INT64_MAX stand for unbounded and are kept as is.
+ * @return The relative time.
+ */
+int64_t session_relative_time(const SessionHeader *header, int64_t time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
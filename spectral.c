@@ -0,0 +1,196 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file spectral.c
+ * @author Daniel Oliveira
+ * @brief Frequency-domain heart rate variability (LF/HF) with a Lomb-Scargle periodogram.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "spectral.h"
+
+// Number of samples processed by one vector operation.
+#define SPECTRAL_LANES 4
+
+typedef double SpectralVector __attribute__((vector_size(SPECTRAL_LANES * sizeof(double))));
+
+/**
+ * @brief Per-sample state of the periodogram, one lane per sample.
+ */
+typedef struct
+{
+    SpectralVector value;
+    SpectralVector cos;
+    SpectralVector sin;
+    SpectralVector stepCos;
+    SpectralVector stepSin;
+} SpectralLanes;
+
+/**
+ * @brief Size of the scratch buffer needed to analyze count intervals.
+ */
+size_t spectral_scratch_size(int count)
+{
+    int groups = (count + SPECTRAL_LANES - 1) / SPECTRAL_LANES;
+    return groups * sizeof(SpectralLanes) + sizeof(SpectralVector);
+}
+
+/**
+ * @brief Sum the lanes of a vector.
+ */
+static double spectral_sum(const SpectralVector *v)
+{
+    double sum = 0.0;
+    for (int i = 0; i < SPECTRAL_LANES; i++)
+    {
+        sum += (*v)[i];
+    }
+    return sum;
+}
+
+/**
+ * @brief Compute the Lomb-Scargle periodogram of an unevenly sampled series.
+ */
+int spectral_periodogram(const double *time, const double *value, int count, void *scratch, double *power)
+{
+    if (count < 3)
+    {
+        return -1;
+    }
+
+    // Vector types need their natural alignment.
+    uintptr_t address = ((uintptr_t)scratch + sizeof(SpectralVector) - 1) & ~(uintptr_t)(sizeof(SpectralVector) - 1);
+    SpectralLanes *lanes = (SpectralLanes *)address;
+    int groups = (count + SPECTRAL_LANES - 1) / SPECTRAL_LANES;
+
+    double mean = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        mean += value[i];
+    }
+    mean /= count;
+
+    // Start every sample at the lowest frequency. Padding lanes have a zero phasor,
+    // so they add nothing to any sum.
+    const double origin = time[0];
+    const double omega0 = 2.0 * M_PI * SPECTRAL_LF_MIN;
+    const double step = 2.0 * M_PI * SPECTRAL_FREQUENCY_STEP;
+    for (int g = 0; g < groups; g++)
+    {
+        for (int l = 0; l < SPECTRAL_LANES; l++)
+        {
+            int i = g * SPECTRAL_LANES + l;
+            if (i < count)
+            {
+                double t = time[i] - origin;
+                lanes[g].value[l] = value[i] - mean;
+                lanes[g].cos[l] = cos(omega0 * t);
+                lanes[g].sin[l] = sin(omega0 * t);
+                lanes[g].stepCos[l] = cos(step * t);
+                lanes[g].stepSin[l] = sin(step * t);
+            }
+            else
+            {
+                lanes[g].value[l] = 0.0;
+                lanes[g].cos[l] = 0.0;
+                lanes[g].sin[l] = 0.0;
+                lanes[g].stepCos[l] = 1.0;
+                lanes[g].stepSin[l] = 0.0;
+            }
+        }
+    }
+
+    for (int k = 0; k < SPECTRAL_FREQUENCIES; k++)
+    {
+        SpectralVector yc = {0}, ys = {0}, c2 = {0}, s2 = {0};
+
+        for (int g = 0; g < groups; g++)
+        {
+            SpectralVector c = lanes[g].cos;
+            SpectralVector s = lanes[g].sin;
+
+            yc += lanes[g].value * c;
+            ys += lanes[g].value * s;
+            c2 += c * c - s * s;
+            s2 += 2.0 * c * s;
+
+            // Rotate to the next frequency.
+            lanes[g].cos = c * lanes[g].stepCos - s * lanes[g].stepSin;
+            lanes[g].sin = s * lanes[g].stepCos + c * lanes[g].stepSin;
+        }
+
+        // Shift the time origin by tau so the sine and cosine terms are orthogonal.
+        double sum_yc = spectral_sum(&yc);
+        double sum_ys = spectral_sum(&ys);
+        double sum_c2 = spectral_sum(&c2);
+        double sum_s2 = spectral_sum(&s2);
+        double two_tau = atan2(sum_s2, sum_c2);
+        double cos_tau = cos(two_tau / 2.0);
+        double sin_tau = sin(two_tau / 2.0);
+
+        double yc_tau = sum_yc * cos_tau + sum_ys * sin_tau;
+        double ys_tau = sum_ys * cos_tau - sum_yc * sin_tau;
+        double cc_tau = (count + sum_c2 * cos(two_tau) + sum_s2 * sin(two_tau)) / 2.0;
+        double ss_tau = count - cc_tau;
+
+        double p = 0.0;
+        if (cc_tau > 1e-9)
+        {
+            p += yc_tau * yc_tau / cc_tau;
+        }
+        if (ss_tau > 1e-9)
+        {
+            p += ys_tau * ys_tau / ss_tau;
+        }
+
+        // Scale so that a sinusoid's peak equals its variance.
+        power[k] = p / count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Compute the LF and HF power of a series of RR intervals.
+ */
+int spectral_lf_hf(const double *time, const double *rr, int count, void *scratch, SpectralMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    if (count < SPECTRAL_MIN_INTERVALS)
+    {
+        return -1;
+    }
+
+    double power[SPECTRAL_FREQUENCIES];
+    if (spectral_periodogram(time, rr, count, scratch, power) != 0)
+    {
+        return -1;
+    }
+
+    // A peak is 1 / duration wide, so scale the sum of the bins to the power of the band.
+    double duration = time[count - 1] - time[0];
+    double scale = SPECTRAL_FREQUENCY_STEP * duration;
+
+    for (int k = 0; k < SPECTRAL_FREQUENCIES; k++)
+    {
+        double frequency = SPECTRAL_LF_MIN + k * SPECTRAL_FREQUENCY_STEP;
+        if (frequency < SPECTRAL_LF_MAX)
+        {
+            metrics->lf += power[k] * scale;
+        }
+        else
+        {
+            metrics->hf += power[k] * scale;
+        }
+    }
+
+    metrics->ratio = metrics->hf > 0 ? metrics->lf / metrics->hf : 0.0;
+    metrics->count = count;
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile spectral.h
+ * @author Daniel Oliveira
+ * @brief Frequency-domain heart rate variability (LF/HF) with a Lomb-Scargle periodogram.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef SPECTRAL_H
+#define SPECTRAL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Frequency bands in Hz.
+#define SPECTRAL_LF_MIN 0.04
+#define SPECTRAL_LF_MAX 0.15
+#define SPECTRAL_HF_MAX 0.40
+
+// Step of the frequency grid in Hz, the grid covers [SPECTRAL_LF_MIN, SPECTRAL_HF_MAX].
+#define SPECTRAL_FREQUENCY_STEP 0.0025
+#define SPECTRAL_FREQUENCIES 145
+
+// Interval between two analyses of the RR window, on the band's clock (ms).
+#define SPECTRAL_UPDATE_MS 30000
+
+// Minimum number of intervals for a meaningful spectrum (about one minute).
+#define SPECTRAL_MIN_INTERVALS 64
+
+/**
+ * @brief Power of the LF and HF bands in ms^2.
+ */
+typedef struct
+{
+    double lf;
+    double hf;
+    double ratio;
+    int count;
+} SpectralMetrics;
+
+/**
+ * @brief Size of the scratch buffer needed to analyze count intervals.
+ * @param count The number of intervals.
+ * @return The size in bytes.
+ */
+size_t spectral_scratch_size(int count);
+
+/**
+ * @brief Compute the Lomb-Scargle periodogram of an unevenly sampled series.
+ * @param time The sample times in seconds, ascending.
+ * @param value The sample values.
+ * @param count The number of samples.
+ * @param scratch A buffer of spectral_scratch_size(count) bytes.
+ * @param power The output spectrum, SPECTRAL_FREQUENCIES values in value units squared.
+ * @return 0 on success, -1 if there are not enough samples.
+ *
+ * The sines and cosines of every sample are advanced from one frequency to the next with
+ * a rotation, so the trigonometric functions are evaluated once per sample instead of
+ * once per sample and frequency. The loop over the samples is written with vector types
+ * and compiles to SIMD instructions on every target GCC and Clang support.
+ */
+int spectral_periodogram(const double *time, const double *value, int count, void *scratch, double *power);
+
+/**
+ * @brief Compute the LF and HF power of a series of RR intervals.
+ * @param time The beat times in seconds, ascending.
+ * @param rr The RR intervals in milliseconds.
+ * @param count The number of intervals.
+ * @param scratch A buffer of spectral_scratch_size(count) bytes.
+ * @param metrics The SpectralMetrics to fill.
+ * @return 0 on success, -1 if there are less than SPECTRAL_MIN_INTERVALS intervals.
+ */
+int spectral_lf_hf(const double *time, const double *rr, int count, void *scratch, SpectralMetrics *metrics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,740 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file storage.c
+ * @author Daniel Oliveira
+ * @brief Asynchronous block writes: io_uring, or a pool of pwrite threads.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#endif
+#include "storage.h"
+
+// Queue shared by the session writers.
+static StorageQueue *shared_queue = NULL;
+
+static void *storage_worker(void *data);
+static void drain(StorageQueue *queue);
+
+/**
+ * @brief Current monotonic time in nanoseconds.
+ */
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Allocate the buffers and start the io_uring instance or the pwrite threads.
+ */
+StorageQueue *storage_queue_create(void)
+{
+    StorageQueue *queue = calloc(1, sizeof(StorageQueue));
+    if (queue == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+
+    // One allocation for every buffer, aligned on pages.
+    if (posix_memalign((void **)&queue->memory, STORAGE_BLOCK_SIZE, (size_t)STORAGE_QUEUE_DEPTH * STORAGE_BLOCK_SIZE) != 0)
+    {
+        printf("Error while allocating memory! \n");
+        free(queue);
+        return NULL;
+    }
+    // Touch every page now, so the notification path never takes a page fault on a buffer.
+    memset(queue->memory, 0, (size_t)STORAGE_QUEUE_DEPTH * STORAGE_BLOCK_SIZE);
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++)
+    {
+        queue->buffers[i].data = queue->memory + (size_t)i * STORAGE_BLOCK_SIZE;
+        queue->freeList[i] = STORAGE_QUEUE_DEPTH - 1 - i;
+    }
+    queue->freeCount = STORAGE_QUEUE_DEPTH;
+    queue->eventFd = -1;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+    pthread_cond_init(&queue->submitted, NULL);
+
+#ifdef HAVE_LIBURING
+    // Room for a write and a linked fdatasync per buffer.
+    if (io_uring_queue_init(2 * STORAGE_QUEUE_DEPTH, &queue->ring, 0) == 0)
+    {
+        queue->uring = 1;
+
+        // Wake the main loop on completions, so they are collected even when nothing is written.
+        queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (queue->eventFd >= 0 && io_uring_register_eventfd(&queue->ring, queue->eventFd) != 0)
+        {
+            close(queue->eventFd);
+            queue->eventFd = -1;
+        }
+        if (queue->eventFd < 0)
+        {
+            fprintf(stderr, "Warning: no completion eventfd, writes are collected on the next one\n");
+        }
+        return queue;
+    }
+    fprintf(stderr, "Warning: io_uring is not available, using write threads\n");
+#endif
+
+    for (int i = 0; i < STORAGE_THREADS; i++)
+    {
+        if (pthread_create(&queue->threads[queue->threadCount], NULL, storage_worker, queue) == 0)
+        {
+            queue->threadCount++;
+        }
+    }
+    if (queue->threadCount == 0)
+    {
+        fprintf(stderr, "Error: could not start the write threads\n");
+        storage_queue_destroy(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+/**
+ * @brief Wait for the writes in flight, stop the threads and free the queue.
+ */
+void storage_queue_destroy(StorageQueue *queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+
+    drain(queue);
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        io_uring_queue_exit(&queue->ring);
+    }
+    if (queue->eventFd >= 0)
+    {
+        close(queue->eventFd);
+    }
+#endif
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    for (int i = 0; i < queue->threadCount; i++)
+    {
+        pthread_join(queue->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&queue->submitted);
+    pthread_cond_destroy(&queue->completed);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->memory);
+    free(queue);
+}
+
+/**
+ * @brief The queue shared by the session writers of the process.
+ */
+StorageQueue *storage_queue_shared(void)
+{
+    if (shared_queue == NULL)
+    {
+        shared_queue = storage_queue_create();
+    }
+    return shared_queue;
+}
+
+/**
+ * @brief Report and destroy the shared queue.
+ */
+void storage_queue_shutdown(void)
+{
+    if (shared_queue == NULL)
+    {
+        return;
+    }
+
+    // Files closed without waiting may still be written.
+    drain(shared_queue);
+    if (shared_queue->writes + shared_queue->errors > 0)
+    {
+        storage_queue_report(shared_queue);
+    }
+    storage_queue_destroy(shared_queue);
+    shared_queue = NULL;
+}
+
+/**
+ * @brief Write a file through the queue.
+ */
+StorageFile *storage_file_open(int fd)
+{
+    StorageFile *file = calloc(1, sizeof(StorageFile));
+    if (file == NULL)
+    {
+        printf("Error while allocating memory! \n");
+        return NULL;
+    }
+    file->fd = fd;
+    return file;
+}
+
+/**
+ * @brief Sync and close a file whose blocks are all written, with the lock held.
+ */
+static void start_final_sync(StorageQueue *queue, StorageFile *file)
+{
+    file->state = STORAGE_FILE_SYNCING;
+
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&queue->ring);
+        io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+        io_uring_sqe_set_data(sqe, (void *)((uintptr_t)file | 1));
+        file->pending++;
+        io_uring_submit(&queue->ring);
+        return;
+    }
+#endif
+
+    file->next = queue->closeList;
+    queue->closeList = file;
+    pthread_cond_signal(&queue->submitted);
+}
+
+/**
+ * @brief Close a file after its final sync, with the lock held.
+ */
+static void finish_close(StorageQueue *queue, StorageFile *file)
+{
+    if (close(file->fd) != 0)
+    {
+        file->errors++;
+    }
+    file->state = STORAGE_FILE_CLOSED;
+    queue->closing--;
+    queue->closed++;
+    pthread_cond_broadcast(&queue->completed);
+
+    if (file->detached)
+    {
+        free(file);
+    }
+}
+
+/**
+ * @brief Account for the end of a write or sync of a file, with the lock held.
+ */
+static void file_settled(StorageQueue *queue, StorageFile *file)
+{
+    file->pending--;
+    if (file->pending > 0)
+    {
+        return;
+    }
+
+    if (file->state == STORAGE_FILE_CLOSING)
+    {
+        start_final_sync(queue, file);
+    }
+    else if (file->state == STORAGE_FILE_SYNCING)
+    {
+        finish_close(queue, file);
+    }
+}
+
+/**
+ * @brief Sync and close a file once its blocks are written.
+ */
+int storage_file_close(StorageQueue *queue, StorageFile *file, int wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    file->state = STORAGE_FILE_CLOSING;
+    file->detached = !wait;
+    queue->closing++;
+    if (file->pending == 0)
+    {
+        start_final_sync(queue, file);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!wait)
+    {
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        storage_queue_poll(queue);
+        while (file->state != STORAGE_FILE_CLOSED)
+        {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&queue->ring, &cqe) != 0)
+            {
+                break;
+            }
+            storage_queue_poll(queue);
+        }
+    }
+    else
+#endif
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (file->state != STORAGE_FILE_CLOSED)
+        {
+            pthread_cond_wait(&queue->completed, &queue->lock);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    int status = file->errors == 0 ? 0 : -1;
+    free(file);
+    return status;
+}
+
+/**
+ * @brief Wait until no block is in flight and no file is closing.
+ */
+static void drain(StorageQueue *queue)
+{
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        storage_queue_poll(queue);
+        while (queue->inFlight > 0 || queue->closing > 0)
+        {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&queue->ring, &cqe) != 0)
+            {
+                break;
+            }
+            storage_queue_poll(queue);
+        }
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->threadCount > 0 && (queue->inFlight > 0 || queue->closing > 0))
+    {
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Account for a completed write, with the lock held.
+ * @param result The number of bytes written, or a negative errno.
+ */
+static void complete_write(StorageQueue *queue, StorageBuffer *buffer, ssize_t result)
+{
+    if (result < 0 || (size_t)result != buffer->length)
+    {
+        queue->errors++;
+        buffer->file->errors++;
+        fprintf(stderr, "Error: block write failed: %s\n", result < 0 ? strerror((int)-result) : "short write");
+    }
+    else
+    {
+        queue->writes++;
+        queue->bytes += result;
+    }
+
+    int64_t latency = monotonic_ns() - buffer->submittedAt;
+    queue->latencySum += latency;
+    if (latency > queue->latencyMax)
+    {
+        queue->latencyMax = latency;
+    }
+
+    buffer->writing = 0;
+    queue->freeList[queue->freeCount++] = (int)(buffer - queue->buffers);
+    queue->inFlight--;
+    file_settled(queue, buffer->file);
+    pthread_cond_broadcast(&queue->completed);
+}
+
+/**
+ * @brief Account for a completed sync, with the lock held.
+ * @param result 0, or a negative errno.
+ */
+static void complete_sync(StorageQueue *queue, StorageFile *file, int result)
+{
+    if (result < 0)
+    {
+        queue->errors++;
+        file->errors++;
+        fprintf(stderr, "Error: sync failed: %s\n", strerror(-result));
+    }
+    else
+    {
+        queue->syncs++;
+    }
+}
+
+/**
+ * @brief Take a free buffer, without blocking.
+ */
+StorageBuffer *storage_buffer_take(StorageQueue *queue)
+{
+    // Collect the completed writes first, they give their buffers back.
+    storage_queue_poll(queue);
+
+    pthread_mutex_lock(&queue->lock);
+    StorageBuffer *buffer = NULL;
+    if (queue->freeCount > 0)
+    {
+        buffer = &queue->buffers[queue->freeList[--queue->freeCount]];
+        buffer->length = 0;
+    }
+    else
+    {
+        queue->exhausted++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return buffer;
+}
+
+/**
+ * @brief Give back a buffer that was taken but not submitted.
+ */
+void storage_buffer_release(StorageQueue *queue, StorageBuffer *buffer)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->freeList[queue->freeCount++] = (int)(buffer - queue->buffers);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Keep bytes that found no free buffer, after the ones already waiting.
+ */
+int storage_backlog_keep(StorageBacklog *backlog, const void *data, size_t size, off_t offset)
+{
+    if (backlog->size + size > STORAGE_MAX_BACKLOG)
+    {
+        return -1;
+    }
+
+    if (backlog->size + size > backlog->capacity)
+    {
+        size_t capacity = backlog->capacity ? 2 * backlog->capacity : STORAGE_BLOCK_SIZE;
+        while (capacity < backlog->size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t *bytes = realloc(backlog->data, capacity);
+        if (bytes == NULL)
+        {
+            printf("Error while allocating memory! \n");
+            return -1;
+        }
+        backlog->data = bytes;
+        backlog->capacity = capacity;
+    }
+
+    if (backlog->size == 0)
+    {
+        backlog->offset = offset;
+    }
+    memcpy(backlog->data + backlog->size, data, size);
+    backlog->size += size;
+    return 0;
+}
+
+/**
+ * @brief Submit the waiting bytes block by block, as far as buffers are free, without blocking.
+ */
+int storage_backlog_submit(StorageQueue *queue, StorageBacklog *backlog, StorageFile *file, int64_t *blocks, int sync_blocks)
+{
+    size_t done = 0;
+    while (done < backlog->size)
+    {
+        StorageBuffer *buffer = storage_buffer_take(queue);
+        if (buffer == NULL)
+        {
+            break;
+        }
+
+        buffer->length = backlog->size - done < STORAGE_BLOCK_SIZE ? backlog->size - done : STORAGE_BLOCK_SIZE;
+        memcpy(buffer->data, backlog->data + done, buffer->length);
+        (*blocks)++;
+        storage_buffer_submit(queue, buffer, file, backlog->offset + done, *blocks % sync_blocks == 0);
+        done += buffer->length;
+    }
+
+    memmove(backlog->data, backlog->data + done, backlog->size - done);
+    backlog->size -= done;
+    backlog->offset += done;
+    return backlog->size > 0 ? -1 : 0;
+}
+
+/**
+ * @brief Write the waiting bytes straight to the page cache with pwrite, before the file is closed.
+ */
+int storage_backlog_write(StorageBacklog *backlog, StorageFile *file)
+{
+    int status = 0;
+    if (backlog->size > 0 && pwrite(file->fd, backlog->data, backlog->size, backlog->offset) != (ssize_t)backlog->size)
+    {
+        fprintf(stderr, "Error: could not write %zu waiting bytes\n", backlog->size);
+        status = -1;
+    }
+    backlog->size = 0;
+    return status;
+}
+
+/**
+ * @brief Free the memory of a backlog.
+ */
+void storage_backlog_free(StorageBacklog *backlog)
+{
+    free(backlog->data);
+    memset(backlog, 0, sizeof(*backlog));
+}
+
+/**
+ * @brief Hand a filled buffer over to be written, without blocking.
+ */
+void storage_buffer_submit(StorageQueue *queue, StorageBuffer *buffer, StorageFile *file, off_t offset, int sync)
+{
+    buffer->file = file;
+    buffer->offset = offset;
+    buffer->sync = sync;
+    buffer->submittedAt = monotonic_ns();
+
+    pthread_mutex_lock(&queue->lock);
+    file->pending++;
+    queue->inFlight++;
+    if (queue->inFlight > queue->maxInFlight)
+    {
+        queue->maxInFlight = queue->inFlight;
+    }
+
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        // There is always room: a buffer has at most a write and a sync in the ring.
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&queue->ring);
+        io_uring_prep_write(sqe, file->fd, buffer->data, (unsigned)buffer->length, offset);
+        io_uring_sqe_set_data(sqe, buffer);
+
+        if (sync)
+        {
+            // The sync runs once this write is done, it is tagged with the file. Draining would stall every file.
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe = io_uring_get_sqe(&queue->ring);
+            io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+            io_uring_sqe_set_data(sqe, (void *)((uintptr_t)file | 1));
+            file->pending++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        io_uring_submit(&queue->ring);
+        return;
+    }
+#endif
+
+    queue->queued[(queue->queueHead + queue->queueCount) % STORAGE_QUEUE_DEPTH] = (int)(buffer - queue->buffers);
+    queue->queueCount++;
+    pthread_cond_signal(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Collect the completed writes, without blocking.
+ */
+int storage_queue_poll(StorageQueue *queue)
+{
+    int collected = 0;
+
+#ifdef HAVE_LIBURING
+    if (queue->uring)
+    {
+        // Reset the eventfd before collecting, a completion arriving meanwhile signals it again.
+        uint64_t count;
+        if (queue->eventFd >= 0 && read(queue->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        {
+            fprintf(stderr, "Warning: could not read the completion eventfd: %s\n", strerror(errno));
+        }
+
+        struct io_uring_cqe *cqe;
+        pthread_mutex_lock(&queue->lock);
+        while (io_uring_peek_cqe(&queue->ring, &cqe) == 0)
+        {
+            uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+            int result = cqe->res;
+            io_uring_cqe_seen(&queue->ring, cqe);
+
+            if (data & 1)
+            {
+                // A sync, tagged with its file.
+                StorageFile *file = (StorageFile *)(data & ~(uintptr_t)1);
+                complete_sync(queue, file, result);
+                file_settled(queue, file);
+            }
+            else
+            {
+                complete_write(queue, (StorageBuffer *)data, result);
+            }
+            collected++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+#else
+    (void)queue;
+#endif
+
+    // The threads give the buffers back themselves.
+    return collected;
+}
+
+/**
+ * @brief File descriptor readable when writes completed.
+ */
+int storage_queue_fd(const StorageQueue *queue)
+{
+    return queue->eventFd;
+}
+
+/**
+ * @brief Write a block with pwrite.
+ * @return The number of bytes written, or a negative errno.
+ */
+static ssize_t write_block(const StorageBuffer *buffer)
+{
+    size_t written = 0;
+    while (written < buffer->length)
+    {
+        ssize_t result = pwrite(buffer->file->fd, buffer->data + written, buffer->length - written, buffer->offset + written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return result < 0 ? -errno : (ssize_t)written;
+        }
+        written += result;
+    }
+    return (ssize_t)written;
+}
+
+/**
+ * @brief Whether a block of the same file taken before this one is still being written, with the lock held.
+ */
+static int earlier_write_pending(const StorageQueue *queue, const StorageBuffer *buffer)
+{
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++)
+    {
+        const StorageBuffer *other = &queue->buffers[i];
+        if (other->writing && other->file == buffer->file && other->sequence < buffer->sequence)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Thread of the fallback: write the submitted blocks in order, and close the files.
+ */
+static void *storage_worker(void *data)
+{
+    StorageQueue *queue = (StorageQueue *)data;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1)
+    {
+        while (queue->queueCount == 0 && queue->closeList == NULL && !queue->stopping)
+        {
+            pthread_cond_wait(&queue->submitted, &queue->lock);
+        }
+
+        // The final sync of a file whose blocks are all written.
+        if (queue->closeList)
+        {
+            StorageFile *file = queue->closeList;
+            queue->closeList = file->next;
+            pthread_mutex_unlock(&queue->lock);
+
+            int result = fdatasync(file->fd) == 0 ? 0 : -errno;
+
+            pthread_mutex_lock(&queue->lock);
+            complete_sync(queue, file, result);
+            finish_close(queue, file);
+            continue;
+        }
+
+        if (queue->queueCount == 0)
+        {
+            break;
+        }
+
+        StorageBuffer *buffer = &queue->buffers[queue->queued[queue->queueHead]];
+        queue->queueHead = (queue->queueHead + 1) % STORAGE_QUEUE_DEPTH;
+        queue->queueCount--;
+        buffer->sequence = queue->taken++;
+        buffer->writing = 1;
+        pthread_mutex_unlock(&queue->lock);
+
+        ssize_t result = write_block(buffer);
+        int synced = 1;
+        if (result >= 0 && buffer->sync)
+        {
+            // The blocks are taken in order, the sync must cover the earlier ones another thread is still writing.
+            pthread_mutex_lock(&queue->lock);
+            while (earlier_write_pending(queue, buffer))
+            {
+                pthread_cond_wait(&queue->completed, &queue->lock);
+            }
+            pthread_mutex_unlock(&queue->lock);
+
+            synced = fdatasync(buffer->file->fd) == 0 ? 0 : -errno;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (synced <= 0)
+        {
+            complete_sync(queue, buffer->file, synced);
+        }
+        complete_write(queue, buffer, result);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Print the backend, the writes and syncs, and the write latency.
+ */
+void storage_queue_report(const StorageQueue *queue)
+{
+    printf("Storage (%s): %lld blocks, %.1f MB written, %lld syncs, %lld files closed, %lld errors, up to %d blocks in flight \n",
+           queue->uring ? "io_uring" : "write threads", (long long)queue->writes, queue->bytes / 1e6,
+           (long long)queue->syncs, (long long)queue->closed, (long long)queue->errors, queue->maxInFlight);
+
+    int64_t completed = queue->writes + queue->errors;
+    if (completed > 0)
+    {
+        printf("Storage: block write latency mean %.2f ms, max %.2f ms, %lld times no free buffer \n",
+               queue->latencySum / 1e6 / completed, queue->latencyMax / 1e6, (long long)queue->exhausted);
+    }
+}
@@ -0,0 +1,292 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile storage.h
+ * @author Daniel Oliveira
+ * @brief Asynchronous block writes: io_uring, or a pool of pwrite threads.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Size of a block buffer, in bytes.
+#define STORAGE_BLOCK_SIZE 4096
+
+// Number of block buffers: blocks being filled plus blocks in flight never exceed it.
+#define STORAGE_QUEUE_DEPTH 64
+
+// Number of pwrite threads of the fallback.
+#define STORAGE_THREADS 2
+
+// Bytes a writer keeps in memory while no buffer is free, after which its samples are dropped.
+#define STORAGE_MAX_BACKLOG (1024 * 1024)
+
+/**
+ * @brief State of a file written through the queue.
+ */
+typedef enum
+{
+    STORAGE_FILE_OPEN = 0,
+    STORAGE_FILE_CLOSING,
+    STORAGE_FILE_SYNCING,
+    STORAGE_FILE_CLOSED
+} StorageFileState;
+
+/**
+ * @brief A file written through the queue, closed asynchronously.
+ *
+ * Once closing, the file waits for its blocks in flight, is synced and closed by the
+ * queue. A detached file is then freed by the queue, otherwise by its owner.
+ */
+typedef struct StorageFile
+{
+    int fd;
+    StorageFileState state;
+    int detached;
+
+    // Blocks and syncs in flight, and the ones that failed.
+    int pending;
+    int errors;
+
+    // Next file waiting for its final sync (write threads only).
+    struct StorageFile *next;
+} StorageFile;
+
+/**
+ * @brief A preallocated block buffer, filled by its owner then written at an offset of a file.
+ */
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    StorageFile *file;
+    off_t offset;
+
+    // Whether the file data is synced (fdatasync) once the block is written.
+    int sync;
+
+    // Order in which the write threads took the block, and whether it is being written.
+    int64_t sequence;
+    int writing;
+
+    int64_t submittedAt;
+} StorageBuffer;
+
+/**
+ * @brief Bytes of a file waiting for free buffers, in file order from an offset.
+ *
+ * This is the back-pressure policy of every writer of the queue: when no buffer is free,
+ * the bytes wait in memory, up to STORAGE_MAX_BACKLOG, and are submitted as buffers come
+ * back. Beyond that the writer drops its samples and counts them, so neither the memory
+ * nor the notification callback depends on the disk keeping up.
+ */
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    off_t offset;
+} StorageBacklog;
+
+/**
+ * @brief Pool of block buffers and the asynchronous writes of the filled ones.
+ *
+ * Taking a buffer and submitting it never blocks: the buffers are allocated once, and a
+ * submitted block is written and synced by io_uring (with HAVE_LIBURING) or by a pool
+ * of threads calling pwrite and fdatasync. At most STORAGE_QUEUE_DEPTH blocks are in
+ * flight, after which storage_buffer_take fails until a write completes.
+ *
+ * A sync covers its own block and the blocks of the file already written, other files
+ * are not held up. The final sync of storage_file_close waits for every block of the
+ * file, so a closed file is complete on the disk. The io_uring
+ * completions are collected by storage_queue_poll, which the main loop calls when
+ * storage_queue_fd becomes readable.
+ */
+typedef struct
+{
+    StorageBuffer buffers[STORAGE_QUEUE_DEPTH];
+    uint8_t *memory;
+
+    // Free buffers, the submitted ones and the files to close waiting for a thread (fallback only).
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+    int freeList[STORAGE_QUEUE_DEPTH];
+    int freeCount;
+    int inFlight;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    int uring;
+
+    // Signalled when io_uring completes a write or sync, -1 with the write threads.
+    int eventFd;
+
+    pthread_cond_t submitted;
+    int queued[STORAGE_QUEUE_DEPTH];
+    int queueHead;
+    int queueCount;
+    int64_t taken;
+    StorageFile *closeList;
+    pthread_t threads[STORAGE_THREADS];
+    int threadCount;
+    int stopping;
+
+    // Statistics.
+    int64_t writes;
+    int64_t bytes;
+    int64_t syncs;
+    int64_t errors;
+    int64_t exhausted;
+    int maxInFlight;
+    int closing;
+    int64_t closed;
+    int64_t latencySum;
+    int64_t latencyMax;
+} StorageQueue;
+
+/**
+ * @brief Allocate the buffers and start the io_uring instance or the pwrite threads.
+ * @return A pointer to the StorageQueue, or NULL if the memory could not be allocated.
+ */
+StorageQueue *storage_queue_create(void);
+
+/**
+ * @brief Wait for the writes in flight, stop the threads and free the queue.
+ * @param queue The StorageQueue instance.
+ */
+void storage_queue_destroy(StorageQueue *queue);
+
+/**
+ * @brief The queue shared by the session writers of the process, created on first use.
+ * @return A pointer to the shared StorageQueue, or NULL if it could not be created.
+ */
+StorageQueue *storage_queue_shared(void);
+
+/**
+ * @brief Report and destroy the shared queue, if it was created.
+ */
+void storage_queue_shutdown(void);
+
+/**
+ * @brief Write a file through the queue.
+ * @param fd The file descriptor, open for writing. The queue closes it.
+ * @return A pointer to the StorageFile, or NULL if the memory could not be allocated.
+ */
+StorageFile *storage_file_open(int fd);
+
+/**
+ * @brief Sync and close a file once its blocks are written.
+ * @param queue The StorageQueue instance.
+ * @param file The StorageFile, no block may be submitted to it any more.
+ * @param wait 1 to block until the file is closed, then free it. 0 to return at once,
+ *             the queue frees the file once closed.
+ * @return 0 on success, -1 if a write or the final sync failed (wait only).
+ */
+int storage_file_close(StorageQueue *queue, StorageFile *file, int wait);
+
+/**
+ * @brief Take a free buffer, without blocking.
+ * @param queue The StorageQueue instance.
+ * @return An empty buffer, or NULL if every buffer is being filled or written.
+ */
+StorageBuffer *storage_buffer_take(StorageQueue *queue);
+
+/**
+ * @brief Hand a filled buffer over to be written, without blocking.
+ * @param queue The StorageQueue instance.
+ * @param buffer The buffer, taken with storage_buffer_take, holding length bytes.
+ * @param file The file written to.
+ * @param offset The offset of the block in the file.
+ * @param sync 1 to sync the file data once the block is written, 0 otherwise.
+ *
+ * The buffer goes back to the free list once written, it must not be touched after this call.
+ */
+void storage_buffer_submit(StorageQueue *queue, StorageBuffer *buffer, StorageFile *file, off_t offset, int sync);
+
+/**
+ * @brief Give back a buffer that was taken but not submitted.
+ * @param queue The StorageQueue instance.
+ * @param buffer The buffer.
+ */
+void storage_buffer_release(StorageQueue *queue, StorageBuffer *buffer);
+
+/**
+ * @brief Keep bytes that found no free buffer, after the ones already waiting.
+ * @param backlog The StorageBacklog instance, zeroed before the first use.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @param offset The offset of the bytes in the file, following the waiting ones if any.
+ * @return 0 on success, -1 if the backlog would exceed STORAGE_MAX_BACKLOG or the memory could not be allocated.
+ */
+int storage_backlog_keep(StorageBacklog *backlog, const void *data, size_t size, off_t offset);
+
+/**
+ * @brief Submit the waiting bytes block by block, as far as buffers are free, without blocking.
+ * @param queue The StorageQueue instance.
+ * @param backlog The StorageBacklog instance.
+ * @param file The file the bytes belong to.
+ * @param blocks The number of blocks submitted to the file, incremented per block.
+ * @param sync_blocks The file data is synced after every sync_blocks blocks.
+ * @return 0 if nothing is left waiting, -1 otherwise.
+ */
+int storage_backlog_submit(StorageQueue *queue, StorageBacklog *backlog, StorageFile *file, int64_t *blocks, int sync_blocks);
+
+/**
+ * @brief Write the waiting bytes straight to the page cache with pwrite, before the file is closed.
+ * @param backlog The StorageBacklog instance, empty afterwards.
+ * @param file The file the bytes belong to.
+ * @return 0 on success, -1 on error.
+ *
+ * The final sync of storage_file_close makes them durable with the rest of the file.
+ */
+int storage_backlog_write(StorageBacklog *backlog, StorageFile *file);
+
+/**
+ * @brief Free the memory of a backlog.
+ * @param backlog The StorageBacklog instance.
+ */
+void storage_backlog_free(StorageBacklog *backlog);
+
+/**
+ * @brief Collect the completed writes, without blocking.
+ * @param queue The StorageQueue instance.
+ * @return The number of writes collected.
+ */
+int storage_queue_poll(StorageQueue *queue);
+
+/**
+ * @brief File descriptor readable when writes completed, to watch from the main loop.
+ * @param queue The StorageQueue instance.
+ * @return The eventfd of the io_uring completions, or -1 with the write threads, which need no polling.
+ */
+int storage_queue_fd(const StorageQueue *queue);
+
+/**
+ * @brief Print the backend, the writes and syncs, and the write latency.
+ * @param queue The StorageQueue instance.
+ */
+void storage_queue_report(const StorageQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
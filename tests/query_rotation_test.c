@@ -0,0 +1,154 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file query_rotation_test.c
+ * @author Daniel Oliveira
+ * @brief Test: the queries give the same results over a rotated session as over the same session in one file.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "session.h"
+
+// Session start and length, and the rotation of the rotated copy, in seconds.
+#define TEST_START 1680000000
+#define TEST_LENGTH (6 * 3600)
+#define TEST_ROTATE 1800
+
+// Queries compared over both copies.
+static const char *const QUERIES[] = {
+    "downsample --bucket 7",  "downsample --bucket 300", "downsample --bucket 600 --from 1680000900 --to 1680020000",
+    "resample --rate 2",      "filter",                  "interval",
+    "range --from 1680001790 --to 1680001810",
+};
+
+/**
+ * @brief Record the synthetic session: rest, a workout, artifacts and a pause in the notifications.
+ */
+static int write_session(const char *directory, int64_t rotate)
+{
+    SessionWriter *writer = session_writer_open(directory, "AA:BB:CC:DD:EE:FF", TEST_START);
+    if (writer == NULL)
+    {
+        return -1;
+    }
+    session_writer_set_rotation(writer, SESSION_ROTATE_BYTES, rotate);
+
+    for (int32_t time = 0; time < TEST_LENGTH; time++)
+    {
+        // No notification for 2 minutes, across a rotation.
+        if (time >= 3 * TEST_ROTATE - 60 && time < 3 * TEST_ROTATE + 60)
+        {
+            continue;
+        }
+
+        int32_t bpm = 60 + (int32_t)(8 * sin(time / 300.0));
+        if (time >= 2 * 3600 && time < 3 * 3600)
+        {
+            bpm += 70;
+        }
+        if (time % 997 == 0)
+        {
+            bpm = 0;
+        }
+        session_writer_append(writer, time, bpm);
+    }
+
+    session_writer_close(writer);
+    return 0;
+}
+
+/**
+ * @brief Run a query over the session files of a directory and return its output.
+ */
+static char *run_query(const char *query_tool, const char *query, const char *directory)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %s %s/*.hrs", query_tool, query, directory);
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL)
+    {
+        fprintf(stderr, "Error: could not run %s\n", command);
+        return NULL;
+    }
+
+    size_t size = 0;
+    size_t capacity = 1 << 20;
+    char *output = malloc(capacity);
+    size_t read;
+    while (output != NULL && (read = fread(output + size, 1, capacity - size - 1, pipe)) > 0)
+    {
+        size += read;
+        if (size + 1 == capacity)
+        {
+            char *grown = realloc(output, 2 * capacity);
+            if (grown == NULL)
+            {
+                printf("Error while allocating memory! \n");
+                free(output);
+            }
+            output = grown;
+            capacity *= 2;
+        }
+    }
+    if (pclose(pipe) != 0 || output == NULL)
+    {
+        fprintf(stderr, "Error: %s failed\n", command);
+        free(output);
+        return NULL;
+    }
+
+    output[size] = '\0';
+    return output;
+}
+
+/**
+ * @brief Main function.
+ *
+ * Usage: query_rotation_test QUERY_TOOL DIRECTORY. The session is recorded in one file
+ * under DIRECTORY/whole and rotated every TEST_ROTATE seconds under DIRECTORY/rotated.
+ *
+ * @return int Returns 0 if every query gives the same output, 1 otherwise.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s QUERY_TOOL DIRECTORY\n", argv[0]);
+        return 1;
+    }
+
+    char whole[512];
+    char rotated[512];
+    snprintf(whole, sizeof(whole), "%s/whole", argv[2]);
+    snprintf(rotated, sizeof(rotated), "%s/rotated", argv[2]);
+
+    char command[2200];
+    snprintf(command, sizeof(command), "rm -rf '%s' '%s' && mkdir -p '%s' '%s'", whole, rotated, whole, rotated);
+    if (system(command) != 0 || write_session(whole, SESSION_ROTATE_S) != 0 || write_session(rotated, TEST_ROTATE) != 0)
+    {
+        fprintf(stderr, "Error: could not record the sessions in %s\n", argv[2]);
+        return 1;
+    }
+    storage_queue_shutdown();
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(QUERIES) / sizeof(QUERIES[0]); i++)
+    {
+        char *expected = run_query(argv[1], QUERIES[i], whole);
+        char *actual = run_query(argv[1], QUERIES[i], rotated);
+        int same = expected != NULL && actual != NULL && expected[0] != '\0' && strcmp(expected, actual) == 0;
+
+        printf("%s: %s\n", QUERIES[i], same ? "same output" : "DIFFERENT output");
+        failures += !same;
+        free(expected);
+        free(actual);
+    }
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @file wear.c
+ * @author Daniel Oliveira
+ * @brief Detection of the band being taken off and put back on the wrist.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#include <string.h>
+#include "wear.h"
+
+/**
+ * @brief Initialize a detector in the unknown state.
+ */
+void wear_init(WearDetector *detector)
+{
+    memset(detector, 0, sizeof(*detector));
+    detector->state = WEAR_UNKNOWN;
+}
+
+/**
+ * @brief Move the detector to a state.
+ */
+static int wear_set_state(WearDetector *detector, WearState state, int64_t now)
+{
+    if (detector->state == state)
+    {
+        return 0;
+    }
+
+    detector->state = state;
+    if (state == WEAR_OFF)
+    {
+        detector->offSince = now;
+        detector->lastProbe = now;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Update the detector with a heart rate measurement.
+ */
+int wear_on_sample(WearDetector *detector, int contact, int valid, int64_t now)
+{
+    // The band reports whether the sensor touches the skin.
+    if (contact >= 0)
+    {
+        detector->invalidRun = contact && valid ? 0 : detector->invalidRun + 1;
+        return wear_set_state(detector, contact ? WEAR_ON : WEAR_OFF, now);
+    }
+
+    if (valid)
+    {
+        detector->invalidRun = 0;
+        return wear_set_state(detector, WEAR_ON, now);
+    }
+
+    detector->invalidRun++;
+    if (detector->invalidRun >= WEAR_OFF_INVALID_SAMPLES)
+    {
+        return wear_set_state(detector, WEAR_OFF, now);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Update the detector with a non-wear event sent by the band.
+ */
+int wear_on_nonwear_event(WearDetector *detector, int64_t now)
+{
+    return wear_set_state(detector, WEAR_OFF, now);
+}
+
+/**
+ * @brief Check whether a keepalive should be replaced by a probe while the band is off the wrist.
+ */
+int wear_probe_due(WearDetector *detector, int64_t now)
+{
+    if (now - detector->lastProbe < WEAR_PROBE_INTERVAL_S)
+    {
+        detector->skippedPings++;
+        return 0;
+    }
+
+    detector->lastProbe = now;
+    detector->probes++;
+    return 1;
+}
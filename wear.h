@@ -0,0 +1,93 @@
+/**
+ * @name Heart Rate Monitor for Mi Band 6 and 7
+ * @headerfile wear.h
+ * @author Daniel Oliveira
+ * @brief Detection of the band being taken off and put back on the wrist.
+ * @date 2023-04-04
+ *
+ * @copyright Copyright (c) 2023 Daniel Oliveira
+ *
+ */
+
+#ifndef WEAR_H
+#define WEAR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Consecutive invalid heart rate values after which the band is considered off the wrist.
+#define WEAR_OFF_INVALID_SAMPLES 5
+
+// Interval between two one-shot measurements probing for the wrist while the band is off it.
+#define WEAR_PROBE_INTERVAL_S 60
+
+/**
+ * @brief Wear state of the band.
+ */
+typedef enum
+{
+    WEAR_UNKNOWN,
+    WEAR_ON,
+    WEAR_OFF
+} WearState;
+
+/**
+ * @brief Wear detector state.
+ */
+typedef struct
+{
+    WearState state;
+    int invalidRun;
+    int64_t offSince;
+    int64_t lastProbe;
+
+    // Keepalives not sent and probes sent while the band was off the wrist.
+    int64_t skippedPings;
+    int64_t probes;
+} WearDetector;
+
+/**
+ * @brief Initialize a detector in the unknown state.
+ * @param detector The WearDetector instance.
+ */
+void wear_init(WearDetector *detector);
+
+/**
+ * @brief Update the detector with a heart rate measurement.
+ * @param detector The WearDetector instance.
+ * @param contact 1 if the band reports sensor contact, 0 if it reports no contact, -1 if it does not report it.
+ * @param valid 1 if the heart rate value is in the physiological range, 0 otherwise.
+ * @param now The current time in seconds.
+ * @return 1 if the state changed, 0 otherwise.
+ *
+ * If the band reports sensor contact the contact flag decides, otherwise a run of
+ * WEAR_OFF_INVALID_SAMPLES invalid values (the band sends 0 when off the wrist) does.
+ * Any valid value with contact means the band is worn.
+ */
+int wear_on_sample(WearDetector *detector, int contact, int valid, int64_t now);
+
+/**
+ * @brief Update the detector with a non-wear event sent by the band.
+ * @param detector The WearDetector instance.
+ * @param now The current time in seconds.
+ * @return 1 if the state changed, 0 otherwise.
+ */
+int wear_on_nonwear_event(WearDetector *detector, int64_t now);
+
+/**
+ * @brief Check whether a keepalive should be replaced by a probe while the band is off the wrist.
+ * @param detector The WearDetector instance.
+ * @param now The current time in seconds.
+ * @return 1 if a one-shot measurement should be requested now, 0 if the keepalive is skipped.
+ */
+int wear_probe_due(WearDetector *detector, int64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif